@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_BATCH_H
+#define ATTENTIVE_AT_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <attentive/at.h>
+
+/*
+ * Command batches.
+ *
+ * V.250 lets one line carry several commands ("AT+CMEE=2;+CREG?;+CSQ"),
+ * answered in order and closed with a single final result, so a list of
+ * commands can go out in a round trip or two rather than one each. The
+ * modem stops at the first command that fails and reports just the error;
+ * the batch then goes over that line's commands one at a time to tell
+ * which it was, running the ones before it again. So only commands that
+ * may run twice share a line: queries ("AT+CREG?"), and those marked
+ * repeat. Others go on lines of their own.
+ *
+ * Answer lines are handed to the command whose name they start with
+ * ("+CREG: 0,1" to "AT+CREG?"); other lines go to the command answered
+ * last, or the line's first one. Commands with bare answers, like AT+CGSN,
+ * belong at the start of a line or on one of their own. All answers on a
+ * line share the channel's response buffer.
+ */
+
+#define AT_BATCH_LINE   560     /**< Longest line built, "AT" included. */
+
+/** One command of a batch. */
+struct at_batch_command {
+    const char *command;        /**< Command, "AT" included, e.g. "AT+CMEE=2". */
+    bool alone;                 /**< Send on a line of its own, e.g. because the
+                                     answer doesn't end the way V.250 says. */
+    bool repeat;                /**< Safe to run twice, e.g. a setting or a
+                                     query without '?'; may share a line. */
+
+    /* Filled in by at_batch(). */
+    int result;                 /**< Zero if the command succeeded, -1 if it
+                                     failed or wasn't sent. */
+    const char *text;           /**< Answer lines joined by "\n", "" if none, or
+                                     the error line; NULL if not answered. */
+    struct at_buf *response;    /**< Holds text; see at_batch_release(). */
+};
+
+/**
+ * Send commands, concatenated into as few lines as fit the modem's line
+ * length. Lines go out in order and the batch stops at the first failure.
+ *
+ * @param at AT channel instance.
+ * @param opts Options for each line, or NULL for defaults.
+ * @param commands Commands; results are filled in.
+ * @param count Number of commands.
+ * @param line_max Longest line the modem takes, "AT" included; at most
+ *                 AT_BATCH_LINE.
+ * @returns Zero if all commands succeeded, -1 and sets errno on failure
+ *          (EIO if a command got an error answer).
+ */
+int at_batch(struct at *at, const struct at_command_options *opts,
+             struct at_batch_command *commands, size_t count, size_t line_max);
+
+/**
+ * Release the answers of a batch.
+ *
+ * @param commands Commands passed to at_batch().
+ * @param count Number of commands.
+ */
+void at_batch_release(struct at_batch_command *commands, size_t count);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
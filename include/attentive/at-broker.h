@@ -0,0 +1,113 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_BROKER_H
+#define ATTENTIVE_AT_BROKER_H
+
+#include <stddef.h>
+
+#include <attentive/cellular.h>
+
+/*
+ * Modem broker.
+ *
+ * One process owns the port and the cellular modem instance and serves it
+ * to others over a UNIX socket (see attentived). Clients get a struct
+ * cellular whose ops run on the broker's modem, so code written against
+ * cellular_ops works unchanged whether it owns the modem or not.
+ *
+ * The socket carries small fixed-size requests and replies only. Payloads
+ * travel through a shared memory area set up per client: a ring for data
+ * going to the broker and one for data coming back. The broker hands the
+ * modem pointers straight into them, so socket and FTP data are copied
+ * once on each side at most; cellular_broker_buffer() saves the sending
+ * side's copy as well.
+ *
+ * Each client is served by a thread of its own, so one client's slow op
+ * doesn't hold up accepting others. Status queries (imei, iccid, creg and
+ * so on) run alongside other ops when the modem has a control port; all
+ * other ops take turns on the modem. Connection ids belong to the client
+ * that connected them; others get EBUSY. A client that goes away has its
+ * connections and FTP session closed. The broker owns attaching: attach
+ * and detach are no-ops for clients, and pdp_close fails with EBUSY while
+ * other clients have connections open. While no requests come in, the
+ * broker keeps the modem's cached status fresh (see
+ * cellular_refresh_status()).
+ */
+
+#define AT_BROKER_RING_SIZE     16384   /**< Per direction and client; power of two. */
+#define AT_BROKER_CLIENTS       8
+#define AT_BROKER_SOCKETS       8       /**< Connection ids 0..AT_BROKER_SOCKETS-1. */
+#define AT_BROKER_REFRESH_MS    1000    /**< Idle time before refreshing cached status. */
+
+struct at_broker;
+
+/**
+ * Create a broker for a modem, listening on a UNIX socket. Any stale
+ * socket file at the path is replaced.
+ *
+ * @param path Socket path.
+ * @param modem Attached cellular modem instance. Not owned.
+ * @returns Broker instance on success, NULL and sets errno on failure.
+ */
+struct at_broker *at_broker_alloc(const char *path, struct cellular *modem);
+
+/**
+ * Serve clients until at_broker_stop().
+ *
+ * @param broker Broker instance.
+ * @returns Zero after a stop, -1 and sets errno on failure.
+ */
+int at_broker_run(struct at_broker *broker);
+
+/**
+ * Make at_broker_run() return. Callable from any thread, and from signal
+ * handlers.
+ *
+ * @param broker Broker instance.
+ */
+void at_broker_stop(struct at_broker *broker);
+
+/**
+ * Disconnect all clients, remove the socket file and free the broker.
+ *
+ * @param broker Broker instance; not running.
+ */
+void at_broker_free(struct at_broker *broker);
+
+/**
+ * Connect to a broker. Ops the broker's modem doesn't have are NULL, as
+ * they would be on the modem itself. Ops may be called from several
+ * threads; they take turns.
+ *
+ * @param path Socket path.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct cellular *cellular_broker_alloc(const char *path);
+
+/**
+ * Disconnect from the broker.
+ *
+ * @param modem Instance from cellular_broker_alloc().
+ */
+void cellular_broker_free(struct cellular *modem);
+
+/**
+ * Get room in the shared ring to build data to send in place. Pass the
+ * pointer (or one into the same area) to socket_send and the data isn't
+ * copied again on this side. Valid until the next op on the instance.
+ *
+ * @param modem Instance from cellular_broker_alloc().
+ * @param size Set to the number of bytes available.
+ * @returns Start of the area.
+ */
+void *cellular_broker_buffer(struct cellular *modem, size_t *size);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,97 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_BUF_H
+#define ATTENTIVE_AT_BUF_H
+
+#include <stddef.h>
+
+/*
+ * Pooled, reference-counted response buffers.
+ *
+ * The parser collects each response in a buffer taken from its pool and,
+ * once the response is complete, hands that buffer over and carries on in a
+ * fresh one. Holders release their reference when done; the last release
+ * returns the buffer to the pool, from any thread, without a lock. The pool
+ * grows when it runs dry instead of making the parser wait.
+ *
+ * Buffers are only taken out of the pool by one thread at a time (the one
+ * feeding the parser), which keeps the lock-free free list safe from ABA.
+ * A pool stays alive until its owner and all outstanding buffers are gone.
+ */
+
+struct at_buf_pool;
+
+struct at_buf {
+    struct at_buf *next;        /**< @internal Free list link. */
+    struct at_buf_pool *pool;   /**< @internal */
+    unsigned refs;              /**< @internal Atomic. */
+    size_t len;                 /**< Data length, without the NUL. */
+    char data[];                /**< NUL-terminated contents. */
+};
+
+/**
+ * Allocate a buffer pool.
+ *
+ * @param size Buffer size in bytes, including the terminating NUL.
+ * @param count Number of buffers to preallocate.
+ * @returns Pool instance, or NULL on allocation failure.
+ */
+struct at_buf_pool *at_buf_pool_alloc(size_t size, size_t count);
+
+/**
+ * Take a buffer out of the pool, allocating one if the pool is empty. The
+ * buffer comes with one reference and zero length. Not thread safe against
+ * other calls to this function on the same pool.
+ *
+ * @param pool Pool instance.
+ * @returns Buffer, or NULL on allocation failure.
+ */
+struct at_buf *at_buf_acquire(struct at_buf_pool *pool);
+
+/**
+ * Buffer size, including the terminating NUL.
+ *
+ * @param pool Pool instance.
+ */
+size_t at_buf_pool_size(struct at_buf_pool *pool);
+
+/**
+ * Number of buffers allocated so far, whether pooled or in use.
+ *
+ * @param pool Pool instance.
+ */
+size_t at_buf_pool_count(struct at_buf_pool *pool);
+
+/**
+ * Drop the owner's reference. Memory is released once all buffers taken
+ * from the pool have been released too.
+ *
+ * @param pool Pool instance.
+ */
+void at_buf_pool_free(struct at_buf_pool *pool);
+
+/**
+ * Add a reference to a buffer. Thread safe.
+ *
+ * @param buf Buffer.
+ * @returns The buffer, for convenience.
+ */
+struct at_buf *at_buf_ref(struct at_buf *buf);
+
+/**
+ * Drop a reference to a buffer; the last one returns it to its pool. Thread
+ * safe.
+ *
+ * @param buf Buffer, or NULL (ignored).
+ */
+void at_buf_release(struct at_buf *buf);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,139 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_CAPTURE_H
+#define ATTENTIVE_AT_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Capture file format. All integers are little-endian.
+ *
+ * File header (16 bytes):
+ *   char     magic[6]     "ATCAP\0"
+ *   uint16_t version      AT_CAPTURE_VERSION
+ *   uint64_t start        CLOCK_REALTIME when the capture was opened, in
+ *                         nanoseconds.
+ *
+ * Followed by any number of records, each with an 8-byte header:
+ *   uint32_t delta        Microseconds since the previous record; for the
+ *                         first one, since start.
+ *   uint16_t length       Payload length in bytes.
+ *   uint8_t  direction    AT_CAPTURE_RX or AT_CAPTURE_TX.
+ *   uint8_t  reserved     Zero.
+ *   uint8_t  payload[length]
+ *
+ * Consecutive bytes flowing in the same direction within a millisecond are
+ * merged into a single record, so a typical session costs a few bytes of
+ * overhead per line rather than per character.
+ */
+
+#define AT_CAPTURE_VERSION 1
+
+enum at_capture_direction {
+    AT_CAPTURE_RX = 0,      /**< Modem to host. */
+    AT_CAPTURE_TX = 1,      /**< Host to modem. */
+};
+
+/**
+ * Create a capture file for writing. Truncates an existing file.
+ *
+ * @param path File path; one file per modem.
+ * @returns Capture instance on success, NULL and sets errno on failure.
+ */
+struct at_capture *at_capture_open(const char *path);
+
+/**
+ * Append bytes to a capture. Thread-safe; timestamps are taken from the
+ * monotonic clock at the time of the call.
+ *
+ * @param cap Capture instance.
+ * @param direction AT_CAPTURE_RX or AT_CAPTURE_TX.
+ * @param data Bytes to record.
+ * @param len Number of bytes.
+ */
+void at_capture_write(struct at_capture *cap, enum at_capture_direction direction,
+                      const void *data, size_t len);
+
+/**
+ * Write out buffered records.
+ *
+ * @param cap Capture instance.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_capture_flush(struct at_capture *cap);
+
+/**
+ * Flush and close a capture file.
+ *
+ * @param cap Capture instance.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_capture_close(struct at_capture *cap);
+
+
+enum at_replay_mode {
+    AT_REPLAY_REALTIME,     /**< Reproduce the original inter-record timing. */
+    AT_REPLAY_FAST,         /**< Feed responses as soon as the TX side matches. */
+};
+
+struct at_replay_stats {
+    size_t records;         /**< Records processed so far. */
+    size_t rx_bytes;        /**< Bytes fed to the stack. */
+    size_t tx_bytes;        /**< Bytes received from the stack. */
+    size_t divergences;     /**< TX records that didn't match the capture. */
+    size_t first_divergence;/**< File offset of the first diverging record. */
+};
+
+/**
+ * Open a capture for replay. The file is mapped into memory; a pseudo-terminal
+ * is created which impersonates the modem.
+ *
+ * @param path Capture file path.
+ * @param mode Replay timing mode.
+ * @returns Replay instance on success, NULL and sets errno on failure.
+ */
+struct at_replay *at_replay_open(const char *path, enum at_replay_mode mode);
+
+/**
+ * Get the device path to hand over to at_alloc_unix().
+ *
+ * @param replay Replay instance.
+ * @returns Pseudo-terminal slave path.
+ */
+const char *at_replay_devpath(struct at_replay *replay);
+
+/**
+ * Start feeding the capture. Call after the channel has been opened.
+ *
+ * @param replay Replay instance.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_replay_start(struct at_replay *replay);
+
+/**
+ * Wait for the replay to reach the end of the capture.
+ *
+ * @param replay Replay instance.
+ * @param stats If not NULL, filled with final statistics.
+ * @returns Zero if the stack behaved exactly as captured, -1 otherwise.
+ */
+int at_replay_wait(struct at_replay *replay, struct at_replay_stats *stats);
+
+/**
+ * Stop the replay and release resources.
+ *
+ * @param replay Replay instance.
+ */
+void at_replay_close(struct at_replay *replay);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_CLOCK_H
+#define ATTENTIVE_AT_CLOCK_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Clocks for POSIX channels.
+ *
+ * Channels time command timeouts, at_delay() sleeps, deadlines, shared
+ * answers and URC policy windows against a clock: the monotonic system
+ * clock (a NULL clock), or a virtual one given with at_unix_set_clock().
+ * Drivers only ever wait through their channel, so a virtual clock takes
+ * them along: timeouts and retry loops of minutes run in as long as the
+ * modem takes to answer.
+ *
+ * Virtual time starts at zero and only moves forward when told to, by
+ * at_clock_advance(), or by itself when the channels using it have nothing
+ * to do: once every waiter has heard nothing for idle_ms of real time, the
+ * clock jumps to the earliest time one of them waits for. The other end of
+ * the line must answer within idle_ms, or its answers come "late"; pick it
+ * well above the real round trip.
+ *
+ * Response latencies in at-stats.h stay in real time.
+ */
+
+struct at_clock;
+
+/**
+ * Allocate a virtual clock.
+ *
+ * @param idle_ms Real time without progress before the clock jumps ahead
+ *                by itself, or zero to move only with at_clock_advance().
+ * @returns Clock instance on success, NULL and sets errno on failure.
+ */
+struct at_clock *at_clock_alloc_virtual(int idle_ms);
+
+/**
+ * Free a virtual clock. Detach it from all channels first.
+ *
+ * @param clock Clock instance.
+ */
+void at_clock_free(struct at_clock *clock);
+
+/**
+ * Read a clock.
+ *
+ * @param clock Clock instance, or NULL for the system clock.
+ * @returns Current time, nanoseconds.
+ */
+uint64_t at_clock_now(struct at_clock *clock);
+
+/**
+ * Move a virtual clock forward. Waits that come due end within a
+ * millisecond of real time.
+ *
+ * @param clock Clock instance.
+ * @param ns Nanoseconds to add.
+ */
+void at_clock_advance(struct at_clock *clock, uint64_t ns);
+
+/**
+ * Wait on a condition variable until the given clock time, for ports.
+ * Called with the mutex held; may return early, so check what you're
+ * waiting for and call again.
+ *
+ * @param clock Clock instance, or NULL for the system clock.
+ * @param cond Condition variable.
+ * @param mutex Mutex held by the caller.
+ * @param until at_clock_now() time, or UINT64_MAX to wait for good.
+ * @returns Zero after a wakeup, ETIMEDOUT once the time has come.
+ */
+int at_clock_wait(struct at_clock *clock, pthread_cond_t *cond, pthread_mutex_t *mutex,
+                  uint64_t until);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,585 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_CORO_HPP
+#define ATTENTIVE_AT_CORO_HPP
+
+/*
+ * C++20 coroutine binding (POSIX only; header only).
+ *
+ * Commands and cellular ops become co_await-able. Each port gets a strand
+ * on an at-executor.h thread pool; an awaited operation is posted to the
+ * strand, runs there, and resumes its coroutine when done. Coroutines that
+ * wait hold no thread, so any number of them can share a channel; the
+ * workers are only busy while a command is actually on the wire, one per
+ * port at most. Size the pool by the number of ports, not of coroutines.
+ *
+ * Operations on one port run one at a time, in order of posting, which
+ * keeps drivers' sticky channel settings safe. The channel must therefore
+ * only be used through its attentive::channel (and the modem built on it)
+ * while that exists.
+ *
+ * A coroutine resumes on a worker, within the strand of the operation it
+ * awaited: keep the work between two co_awaits short and don't block in
+ * it, or the port waits. Don't destroy a channel from within its own
+ * strand.
+ *
+ * Errors are reported as by the C API: -1, NULL or an empty handle, with
+ * errno set on the resuming thread. A std::stop_token given to an
+ * operation cancels it through an at_cancel token (see at_cancel()), also
+ * while it is waiting for its turn on the strand.
+ *
+ * Buffers are passed as std::span and used in place: send data is written
+ * from the caller's memory and received data lands straight in it, so
+ * they must stay valid until the co_await returns, as they naturally do
+ * in the awaiting frame. Responses keep their at_buf.
+ */
+
+#include <sys/types.h>
+
+extern "C" {
+#include <attentive/at.h>
+#include <attentive/at-executor.h>
+#include <attentive/cellular.h>
+}
+
+#include <cerrno>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace attentive {
+
+/*
+ * Coroutine task. Lazy: starts when awaited, or with spawn() or
+ * sync_wait(). Exceptions propagate to the awaiter.
+ */
+template<typename T = void>
+class task;
+
+namespace detail {
+
+template<typename T>
+struct promise_base {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            return h.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template<typename T>
+struct promise : promise_base<T> {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+    template<typename U>
+    void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+    T result()
+    {
+        if (this->error)
+            std::rethrow_exception(this->error);
+        return std::move(*value);
+    }
+};
+
+template<>
+struct promise<void> : promise_base<void> {
+    task<void> get_return_object();
+    void return_void() {}
+    void result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+/* Fire-and-forget frame; cleans up after itself. */
+struct detached {
+    struct promise_type {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+} // namespace detail
+
+template<typename T>
+class task {
+public:
+    using promise_type = detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    task(task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+task<T> detail::promise<T>::get_return_object()
+{
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::promise<void>::get_return_object()
+{
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/**
+ * Start a task and let it run to completion on its own. An exception
+ * escaping it terminates the program.
+ */
+inline void spawn(task<void> t)
+{
+    [](task<void> t) -> detail::detached { co_await t; }(std::move(t));
+}
+
+/**
+ * Run a task and block the calling thread until it's done. Not from a
+ * worker.
+ */
+template<typename T>
+T sync_wait(task<T> t)
+{
+    struct state {
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool done = false;
+        std::conditional_t<std::is_void_v<T>, bool, std::optional<T>> value{};
+        std::exception_ptr error;
+    } state;
+
+    /* The frame outlives the lambda object; pass, don't capture. */
+    [](task<T> &t, struct state &state) -> detail::detached {
+        try {
+            if constexpr (std::is_void_v<T>)
+                co_await t;
+            else
+                state.value.emplace(co_await t);
+        } catch (...) {
+            state.error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.done = true;
+        state.cond.notify_one();
+    }(t, state);
+
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.cond.wait(lock, [&] { return state.done; });
+    if (state.error)
+        std::rethrow_exception(state.error);
+    if constexpr (!std::is_void_v<T>)
+        return std::move(*state.value);
+}
+
+namespace detail {
+
+struct canceller {
+    struct at_cancel *token;
+    void operator()() const noexcept { at_cancel(token); }
+};
+
+/*
+ * Awaitable running fn(at_cancel *) on a strand. The function returns the
+ * C API's result and leaves errno set on failure.
+ */
+template<typename F>
+class operation {
+public:
+    using result_type = std::invoke_result_t<F &, struct at_cancel *>;
+
+    operation(at_strand *strand, std::stop_token stop, result_type failed, F fn)
+        : strand(strand), stop(std::move(stop)), value(std::move(failed)), fn(std::move(fn)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        waiter = h;
+        if (stop.stop_possible())
+            on_stop.emplace(stop, canceller{&cancel});
+        if (at_strand_post(strand, run, this, nullptr) != 0) {
+            error = errno;
+            return false;
+        }
+        /* May already be running, or done; hands off. */
+        return true;
+    }
+
+    result_type await_resume()
+    {
+        on_stop.reset();
+        errno = error;
+        return std::move(value);
+    }
+
+private:
+    static void run(void *arg, at_buf *buf)
+    {
+        (void) buf;
+        operation *op = static_cast<operation *>(arg);
+        errno = 0;
+        op->value = op->fn(&op->cancel);
+        op->error = errno;
+        op->waiter.resume();
+    }
+
+    at_strand *strand;
+    std::stop_token stop;
+    std::optional<std::stop_callback<canceller>> on_stop;
+    struct at_cancel cancel{};
+    std::coroutine_handle<> waiter;
+    result_type value;
+    int error = 0;
+    F fn;
+};
+
+template<typename F>
+operation<F> make_operation(at_strand *strand, std::stop_token stop,
+                            std::invoke_result_t<F &, struct at_cancel *> failed, F fn)
+{
+    return operation<F>(strand, std::move(stop), std::move(failed), std::move(fn));
+}
+
+} // namespace detail
+
+/**
+ * Command response; owns its at_buf. Empty if the command failed.
+ */
+class response {
+public:
+    response() = default;
+    explicit response(at_buf *buf) : buf(buf) {}
+    response(response &&other) noexcept : buf(std::exchange(other.buf, nullptr)) {}
+    response &operator=(response &&other) noexcept
+    {
+        std::swap(buf, other.buf);
+        return *this;
+    }
+    ~response()
+    {
+        if (buf)
+            at_buf_release(buf);
+    }
+
+    explicit operator bool() const { return buf != nullptr; }
+    std::string_view text() const { return buf ? std::string_view(buf->data, buf->len) : std::string_view(); }
+
+private:
+    at_buf *buf = nullptr;
+};
+
+/**
+ * AT channel with a strand of its own. The channel stays owned by the
+ * caller and must be open.
+ */
+class channel {
+public:
+    channel(at_executor *executor, struct at *at) : port(at), strand(at_strand_alloc(executor))
+    {
+        if (!strand)
+            throw std::system_error(errno, std::generic_category(), "at_strand_alloc");
+    }
+    channel(const channel &) = delete;
+    channel &operator=(const channel &) = delete;
+
+    /** Waits for queued operations to finish. */
+    ~channel() { at_strand_free(strand); }
+
+    struct at *get() const { return port; }
+    at_strand *get_strand() const { return strand; }
+
+    /**
+     * Send a command; see at_command_opts(). Yields a response.
+     */
+    auto command(std::string line, at_command_options opts = {}, std::stop_token stop = {})
+    {
+        struct at *at = port;
+        return detail::make_operation(strand, std::move(stop), response(),
+            [at, line = std::move(line), opts](struct at_cancel *cancel) mutable {
+                opts.cancel = cancel;
+                return response(at_command_opts(at, &opts, "%s", line.c_str()));
+            });
+    }
+
+    /**
+     * Send raw data; see at_command_raw_opts(). Yields a response.
+     */
+    auto command_raw(std::span<const std::byte> data, at_command_options opts = {}, std::stop_token stop = {})
+    {
+        struct at *at = port;
+        return detail::make_operation(strand, std::move(stop), response(),
+            [at, data, opts](struct at_cancel *cancel) mutable {
+                opts.cancel = cancel;
+                return response(at_command_raw_opts(at, &opts, data.data(), data.size()));
+            });
+    }
+
+    /**
+     * Sleep; see at_delay_opts(). Holds the strand meanwhile, like a
+     * driver's poll loop would. Yields zero, or -1 once cancelled.
+     */
+    auto delay(int ms, std::stop_token stop = {})
+    {
+        struct at *at = port;
+        return detail::make_operation(strand, std::move(stop), -1,
+            [at, ms](struct at_cancel *cancel) {
+                at_command_options opts{};
+                opts.cancel = cancel;
+                return at_delay_opts(at, &opts, ms);
+            });
+    }
+
+private:
+    struct at *port;
+    at_strand *strand;
+};
+
+class socket;
+class ftp;
+
+/**
+ * Attached cellular modem. Runs on the strand of its (data) channel, the
+ * one it was attached with. Ops the modem doesn't have fail with ENOTSUP.
+ */
+class modem {
+public:
+    modem(channel &ch, cellular *dev) : dev(dev), strand(ch.get_strand()) {}
+    modem(const modem &) = delete;
+    modem &operator=(const modem &) = delete;
+
+    cellular *get() const { return dev; }
+
+    /* Run op(dev, args...) with the token as its budget. */
+    template<typename R, typename Op, typename... Args>
+    auto call(std::stop_token stop, R failed, Op cellular_ops::*op, Args... args)
+    {
+        cellular *device = dev;
+        return detail::make_operation(strand, std::move(stop), failed,
+            [device, failed, op, args...](struct at_cancel *cancel) -> R {
+                if (!(device->ops->*op)) {
+                    errno = ENOTSUP;
+                    return failed;
+                }
+                struct cellular_budget budget = { 0, cancel };
+                cellular_budget_begin(&budget);
+                R result = (device->ops->*op)(device, args...);
+                cellular_budget_end();
+                return result;
+            });
+    }
+
+    auto pdp_open(const char *apn, std::stop_token stop = {}) { return call(std::move(stop), -1, &cellular_ops::pdp_open, apn); }
+    auto pdp_close(std::stop_token stop = {}) { return call(std::move(stop), -1, &cellular_ops::pdp_close); }
+    auto creg(std::stop_token stop = {}) { return call(std::move(stop), -1, &cellular_ops::creg); }
+    auto rssi(std::stop_token stop = {}) { return call(std::move(stop), -1, &cellular_ops::rssi); }
+    auto imei(std::span<char> buf, std::stop_token stop = {}) { return call(std::move(stop), -1, &cellular_ops::imei, buf.data(), buf.size()); }
+    auto iccid(std::span<char> buf, std::stop_token stop = {}) { return call(std::move(stop), -1, &cellular_ops::iccid, buf.data(), buf.size()); }
+
+    /**
+     * Connect a socket. Yields a handle that closes the connection when
+     * it goes; empty on failure.
+     */
+    task<socket> connect(int connid, std::string host, uint16_t port, std::stop_token stop = {});
+
+    /**
+     * Open an FTP session. Yields a handle that closes it when it goes;
+     * empty on failure.
+     */
+    task<ftp> ftp_open(std::string host, uint16_t port, std::string username, std::string password,
+                       bool passive, std::stop_token stop = {});
+
+    /* Run an op without waiting for it, e.g. from a destructor. */
+    template<typename Op, typename... Args>
+    void post(Op cellular_ops::*op, Args... args)
+    {
+        struct work {
+            cellular *device;
+            Op cellular_ops::*op;
+            std::tuple<Args...> args;
+        };
+        work *w = new work{dev, op, std::tuple<Args...>(args...)};
+        auto run = [](void *arg, at_buf *buf) {
+            (void) buf;
+            work *w = static_cast<work *>(arg);
+            std::apply([w](Args... a) { (w->device->ops->*(w->op))(w->device, a...); }, w->args);
+            delete w;
+        };
+        if (at_strand_post(strand, run, w, nullptr) != 0)
+            delete w;
+    }
+
+private:
+    cellular *dev;
+    at_strand *strand;
+};
+
+/**
+ * Connected socket. Closed when the handle goes, without waiting.
+ */
+class socket {
+public:
+    socket() = default;
+    socket(modem *owner, int connid) : owner(owner), connid(connid) {}
+    socket(socket &&other) noexcept : owner(std::exchange(other.owner, nullptr)), connid(other.connid) {}
+    socket &operator=(socket &&other) noexcept
+    {
+        std::swap(owner, other.owner);
+        std::swap(connid, other.connid);
+        return *this;
+    }
+    ~socket()
+    {
+        if (owner)
+            owner->post(&cellular_ops::socket_close, connid);
+    }
+
+    explicit operator bool() const { return owner != nullptr; }
+    int id() const { return connid; }
+
+    /** Yields the number of bytes taken, or -1. */
+    auto send(std::span<const std::byte> data, int flags = 0, std::stop_token stop = {})
+    {
+        return owner->call(std::move(stop), (ssize_t) -1, &cellular_ops::socket_send, connid,
+                           (const void *) data.data(), data.size(), flags);
+    }
+
+    /** Yields the number of bytes received, possibly zero, or -1. */
+    auto recv(std::span<std::byte> data, int flags = 0, std::stop_token stop = {})
+    {
+        return owner->call(std::move(stop), (ssize_t) -1, &cellular_ops::socket_recv, connid,
+                           (void *) data.data(), data.size(), flags);
+    }
+
+    auto waitack(std::stop_token stop = {})
+    {
+        return owner->call(std::move(stop), -1, &cellular_ops::socket_waitack, connid);
+    }
+
+    /** Close now and wait for it. */
+    auto close(std::stop_token stop = {})
+    {
+        modem *m = std::exchange(owner, nullptr);
+        return m->call(std::move(stop), -1, &cellular_ops::socket_close, connid);
+    }
+
+private:
+    modem *owner = nullptr;
+    int connid = -1;
+};
+
+/**
+ * FTP session. Closed when the handle goes, without waiting.
+ */
+class ftp {
+public:
+    ftp() = default;
+    explicit ftp(modem *owner) : owner(owner) {}
+    ftp(ftp &&other) noexcept : owner(std::exchange(other.owner, nullptr)) {}
+    ftp &operator=(ftp &&other) noexcept
+    {
+        std::swap(owner, other.owner);
+        return *this;
+    }
+    ~ftp()
+    {
+        if (owner)
+            owner->post(&cellular_ops::ftp_close);
+    }
+
+    explicit operator bool() const { return owner != nullptr; }
+
+    auto get(const char *filename, std::stop_token stop = {})
+    {
+        return owner->call(std::move(stop), -1, &cellular_ops::ftp_get, filename);
+    }
+
+    /** Yields the number of bytes read, zero at the end, or -1. */
+    auto getdata(std::span<char> data, std::stop_token stop = {})
+    {
+        return owner->call(std::move(stop), -1, &cellular_ops::ftp_getdata, data.data(), data.size());
+    }
+
+    /** Close now and wait for it. */
+    auto close(std::stop_token stop = {})
+    {
+        modem *m = std::exchange(owner, nullptr);
+        return m->call(std::move(stop), -1, &cellular_ops::ftp_close);
+    }
+
+private:
+    modem *owner = nullptr;
+};
+
+inline task<socket> modem::connect(int connid, std::string host, uint16_t port, std::stop_token stop)
+{
+    int result = co_await call(std::move(stop), -1, &cellular_ops::socket_connect, connid,
+                               (const char *) host.c_str(), port);
+    if (result != 0)
+        co_return socket();
+    co_return socket(this, connid);
+}
+
+inline task<ftp> modem::ftp_open(std::string host, uint16_t port, std::string username, std::string password,
+                                 bool passive, std::stop_token stop)
+{
+    int result = co_await call(std::move(stop), -1, &cellular_ops::ftp_open, (const char *) host.c_str(),
+                               port, (const char *) username.c_str(), (const char *) password.c_str(), passive);
+    if (result != 0)
+        co_return ftp();
+    co_return ftp(this);
+}
+
+} // namespace attentive
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,95 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_EXECUTOR_H
+#define ATTENTIVE_AT_EXECUTOR_H
+
+#include <attentive/at-buf.h>
+
+/*
+ * Work-stealing thread pool for URC handlers and deferred driver work
+ * (POSIX only).
+ *
+ * Work is posted to strands. Work on one strand runs in posting order, one
+ * item at a time; different strands run in parallel. Each channel gets a
+ * strand (see at_unix_set_executor()), so URCs keep their order per channel
+ * while a slow handler on one channel doesn't hold up the others, nor the
+ * channel's own parser.
+ *
+ * A strand with work queued sits in one worker's deque. Workers take their
+ * own newest strands first and steal the oldest from other workers when
+ * they run dry. A strand runs a batch of items at a time and then goes to
+ * the back of the line.
+ */
+
+struct at_executor;
+struct at_strand;
+
+/** Deferred work. The buffer, if any, is released after the call. */
+typedef void (*at_work_fn)(void *arg, struct at_buf *buf);
+
+struct at_executor_stats {
+    unsigned long posted;       /**< Work items posted. */
+    unsigned long executed;     /**< Work items run. */
+    unsigned long steals;       /**< Strands taken from another worker. */
+};
+
+/**
+ * Start a pool of worker threads.
+ *
+ * @param threads Number of workers.
+ * @returns Executor instance, or NULL and sets errno on failure.
+ */
+struct at_executor *at_executor_alloc(int threads);
+
+/**
+ * Stop the workers once all queued work has run and free the executor. All
+ * strands must have been freed.
+ *
+ * @param executor Executor instance.
+ */
+void at_executor_free(struct at_executor *executor);
+
+/**
+ * Get executor counters.
+ *
+ * @param executor Executor instance.
+ * @param stats Filled in with current values.
+ */
+void at_executor_get_stats(struct at_executor *executor, struct at_executor_stats *stats);
+
+/**
+ * Create a strand.
+ *
+ * @param executor Executor instance.
+ * @returns Strand instance, or NULL and sets errno on failure.
+ */
+struct at_strand *at_strand_alloc(struct at_executor *executor);
+
+/**
+ * Wait for queued work to finish, then free a strand. Must not be called
+ * from work running on the same strand.
+ *
+ * @param strand Strand instance.
+ */
+void at_strand_free(struct at_strand *strand);
+
+/**
+ * Queue work on a strand. Callable from any thread, including workers.
+ *
+ * @param strand Strand instance.
+ * @param fn Function to call on a worker thread.
+ * @param arg Argument for fn.
+ * @param buf Buffer for fn, or NULL. On success the reference is taken over.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_strand_post(struct at_strand *strand, at_work_fn fn, void *arg, struct at_buf *buf);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -6,17 +6,18 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
-#ifndef ATTENTIVE_AT_UNIX_H
-#define ATTENTIVE_AT_UNIX_H
+#ifndef ATTENTIVE_AT_FREERTOS_H
+#define ATTENTIVE_AT_FREERTOS_H
 
 #include <attentive/at.h>
 
 /**
- * Create an AT channel instance.
+ * Create an AT channel instance on the board GSM UART (boardGSM_SIM800_UART).
  *
- * @param devpath Device path.
- * @param baudrate If non-zero, sets device baudrate (see termios.h).
- * @returns Instance pointer on success, NULL and sets errno on failure.
+ * Commands block the calling task on its direct-to-task notification value,
+ * so tasks issuing commands must not use notifications for anything else.
+ *
+ * @returns Instance pointer on success, NULL on failure.
  */
 struct at *at_alloc_freertos(void);
 
@@ -0,0 +1,68 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_PROBES_H
+#define ATTENTIVE_AT_PROBES_H
+
+/*
+ * USDT static tracepoints.
+ *
+ * Where <sys/sdt.h> is available, these compile to a single nop plus a
+ * note in the ELF file; a tracer attached at run time patches the nop, so
+ * they cost nothing until then and need no special build. Arguments are
+ * values already at hand; no probe reads a clock or copies data.
+ * Elsewhere, or with AT_NO_PROBES defined, they compile to nothing.
+ *
+ * Provider "attentive"; "at" is the channel and "parser" the parser
+ * instance, for telling channels apart. Times are CLOCK_MONOTONIC
+ * nanoseconds, the same clock as bpftrace's nsecs.
+ *
+ *   parser_feed_entry(parser, data, len)
+ *   parser_feed_return(parser, len)
+ *   line(parser, type, line, len)          Line classified; enum at_response_type.
+ *   rawdata_start(parser, len)             Raw or hex data follows the line.
+ *   rawdata_end(parser, len)               All of it arrived.
+ *   command(at, data, len)                 Command or raw data written to the
+ *                                          port, with its line ending.
+ *   response(at, response, len, sent)      Command completed; sent is when
+ *                                          the command was written.
+ *   urc(at, line, len)                     URC handed to the callbacks.
+ *   timeout(at, timeout)                   Command timed out; seconds.
+ *
+ * For example, command latency per channel:
+ *
+ *   bpftrace -e 'usdt:./prog:attentive:response {
+ *       @us[arg0] = hist((nsecs - arg3) / 1000); }'
+ */
+
+#if !defined(AT_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AT_PROBES 1
+#endif
+#endif
+
+#ifdef AT_PROBES
+#define AT_PROBE1(name, a) \
+    DTRACE_PROBE1(attentive, name, a)
+#define AT_PROBE2(name, a, b) \
+    DTRACE_PROBE2(attentive, name, a, b)
+#define AT_PROBE3(name, a, b, c) \
+    DTRACE_PROBE3(attentive, name, a, b, c)
+#define AT_PROBE4(name, a, b, c, d) \
+    DTRACE_PROBE4(attentive, name, a, b, c, d)
+#else
+#define AT_PROBE1(name, a) ((void) 0)
+#define AT_PROBE2(name, a, b) ((void) 0)
+#define AT_PROBE3(name, a, b, c) ((void) 0)
+#define AT_PROBE4(name, a, b, c, d) ((void) 0)
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
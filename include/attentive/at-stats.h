@@ -0,0 +1,154 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_STATS_H
+#define ATTENTIVE_AT_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-channel performance counters.
+ *
+ * Counters are native words updated with relaxed atomics, so they are
+ * lock-free on every port and cheap on the hot path; on 32-bit targets
+ * they wrap around, so scrapers should work with differences. A snapshot
+ * taken from another thread is consistent per counter, not across them.
+ *
+ * Command latency is kept per verb (the command up to the first '=', '?'
+ * or ';', e.g. "AT+CIPSEND") in log2 buckets: bucket 0 counts responses
+ * faster than 1 µs, bucket n those in [2^(n-1), 2^n) µs, and the last
+ * bucket everything slower. Verbs and URC classes (the line up to the
+ * first ':') take table slots in order of appearance; once the table is
+ * full, the rest are counted in a final "*" slot.
+ */
+
+#define AT_STATS_NAME       16      /**< Verb/class name length, with NUL. */
+#define AT_STATS_BUCKETS    28      /**< The last one starts at ~67 s. */
+#define AT_STATS_VERBS      16
+#define AT_STATS_URCS       16
+
+/** Name of the verb slot used by at_command_raw(). */
+#define AT_STATS_VERB_RAW   "<raw>"
+
+struct at_stats_verb {
+    char name[AT_STATS_NAME];
+    unsigned long responses;        /**< Responses received. */
+    unsigned long timeouts;
+    unsigned long total_us;         /**< Sum of response latencies. */
+    unsigned long max_us;
+    unsigned long buckets[AT_STATS_BUCKETS];
+};
+
+struct at_stats_urc {
+    char name[AT_STATS_NAME];
+    unsigned long count;
+    unsigned long suppressed;       /**< Of which held back by a URC policy. */
+};
+
+struct at_stats {
+    unsigned long rx_bytes;         /**< Read from the port. */
+    unsigned long tx_bytes;         /**< Written to the port. */
+    unsigned long lines;            /**< Non-empty lines parsed. */
+    unsigned long urcs;             /**< Lines classified as URCs. */
+    unsigned long urcs_coalesced;   /**< URCs replaced by a later one (AT_URC_COALESCE). */
+    unsigned long urcs_limited;     /**< URCs over a rate limit (AT_URC_RATE_LIMIT). */
+    unsigned long urcs_dropped;     /**< URCs dropped (AT_URC_DROP). */
+    unsigned long unexpected;       /**< Other lines received with no command pending. */
+    unsigned long commands;         /**< Commands issued (at_command/at_command_raw). */
+    unsigned long queued;           /**< Commands that waited for another thread's. */
+    unsigned long shared;           /**< Queries answered by an identical one, not sent. */
+    unsigned long timeouts;         /**< Commands that got no response. */
+    unsigned long cancelled;        /**< Commands cut short by at_cancel(). */
+    unsigned long resyncs;          /**< Sentinel round trips after a timeout. */
+    unsigned long resync_failures;  /**< Of which failed themselves. */
+    unsigned long stale_lines;      /**< Late lines discarded while resyncing. */
+
+    unsigned long parser_size;      /**< Parser buffer size. */
+    unsigned long parser_high_water; /**< Most parser buffer bytes ever used. */
+    unsigned long parser_dropped;   /**< Bytes lost to a full parser buffer. */
+
+    unsigned long scan_line_calls;  /**< User scan_line callback invocations. */
+    unsigned long scan_line_ns;     /**< CPU time spent in them. */
+    unsigned long handle_urc_calls; /**< User handle_urc callback invocations. */
+    unsigned long handle_urc_ns;    /**< CPU time spent in them. */
+
+    unsigned verbs_used;            /**< Valid entries in verbs[]. */
+    struct at_stats_verb verbs[AT_STATS_VERBS];
+    unsigned urcs_used;             /**< Valid entries in urc_classes[]. */
+    struct at_stats_urc urc_classes[AT_STATS_URCS];
+};
+
+/** Bump a counter. Relaxed; callable from any thread. */
+#define AT_STATS_ADD(counter, n) \
+    ((void) __atomic_fetch_add(&(counter), (unsigned long) (n), __ATOMIC_RELAXED))
+
+/**
+ * Look up the verb slot for a command, taking a new one if needed. Callers
+ * must be serialized (ports call it with the command lock held).
+ *
+ * @param stats Live counters.
+ * @param command Command line, or NULL for raw data.
+ * @param len Command length.
+ * @returns Slot index.
+ */
+int at_stats_verb(struct at_stats *stats, const char *command, size_t len);
+
+/**
+ * Record a response to a command.
+ *
+ * @param stats Live counters.
+ * @param verb Slot from at_stats_verb().
+ * @param ns Time between sending the command and receiving the response.
+ */
+void at_stats_response(struct at_stats *stats, int verb, uint64_t ns);
+
+/**
+ * Record a command timeout.
+ *
+ * @param stats Live counters.
+ * @param verb Slot from at_stats_verb().
+ */
+void at_stats_timeout(struct at_stats *stats, int verb);
+
+/**
+ * Count a URC by class. Callers must be serialized (the parser context).
+ *
+ * @param stats Live counters.
+ * @param line URC line.
+ * @param len Line length.
+ * @returns Class slot index.
+ */
+int at_stats_urc(struct at_stats *stats, const char *line, size_t len);
+
+/**
+ * Copy live counters, e.g. from another thread.
+ *
+ * @param stats Live counters.
+ * @param copy Filled in with current values.
+ */
+void at_stats_snapshot(const struct at_stats *stats, struct at_stats *copy);
+
+/**
+ * Find the bucket a latency belongs in.
+ *
+ * @param us Latency in microseconds.
+ * @returns Bucket index.
+ */
+int at_stats_bucket(uint64_t us);
+
+/** Monotonic clock, nanoseconds. Override with AT_STATS_CLOCK_NS. */
+uint64_t at_stats_clock_ns(void);
+
+/** Calling thread CPU time, nanoseconds. Override with AT_STATS_CPU_NS. */
+uint64_t at_stats_cpu_ns(void);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,171 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_TRACE_H
+#define ATTENTIVE_AT_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Binary event trace.
+ *
+ * A flight recorder: a fixed-size ring of fixed-size events, one per AT
+ * channel. Any thread may record an event without taking a lock; when the
+ * ring is full the oldest events are overwritten. Recording costs a clock
+ * read, an atomic increment and a short copy, so tracing can stay enabled
+ * in production builds where printf() is compiled out.
+ *
+ * Snapshots are dumped to a file and converted to Chrome trace / Perfetto
+ * JSON with at-trace-dump, or with at_trace_export_chrome() directly.
+ *
+ * Dump file format. All integers are in host byte order.
+ *
+ * Header (48 bytes):
+ *   char     magic[6]     "ATTRC\0"
+ *   uint16_t version      AT_TRACE_VERSION
+ *   uint16_t event_size   sizeof(struct at_trace_event)
+ *   uint16_t reserved     Zero.
+ *   uint32_t count        Number of events that follow.
+ *   char     name[32]     Channel name, NUL-padded.
+ *
+ * Followed by count events, oldest first.
+ */
+
+#define AT_TRACE_VERSION    1
+#define AT_TRACE_TEXT       44      /**< Text bytes kept per event. */
+#define AT_TRACE_NAME       32
+
+enum at_trace_type {
+    AT_TRACE_COMMAND = 1,   /**< Command sent; text: command line, arg: length. */
+    AT_TRACE_COMMAND_RAW,   /**< Raw data sent as a command; arg: length. */
+    AT_TRACE_SEND,          /**< Data sent without waiting for a response; arg: length. */
+    AT_TRACE_RX,            /**< First bytes received after a command; arg: length. */
+    AT_TRACE_LINE,          /**< Line received; arg: enum at_response_type. */
+    AT_TRACE_URC,           /**< URC delivered; text: line. */
+    AT_TRACE_RESPONSE,      /**< Command completed; text: response, arg: length. */
+    AT_TRACE_TIMEOUT,       /**< Command timed out. */
+    AT_TRACE_STATE,         /**< State change; text: what, arg: new value. */
+    AT_TRACE_BEGIN,         /**< Start of an operation; text: name. */
+    AT_TRACE_END,           /**< End of an operation; text: name, arg: result. */
+};
+
+/** One trace event; 64 bytes. */
+struct at_trace_event {
+    uint64_t timestamp;     /**< Monotonic clock, nanoseconds. */
+    uint32_t seq;           /**< Internal; zero while being written. */
+    uint16_t type;          /**< enum at_trace_type. */
+    uint16_t len;           /**< Bytes used in text; may be truncated. */
+    int32_t arg;
+    char text[AT_TRACE_TEXT];
+};
+
+/** Record an event if the channel has a trace attached. */
+#define AT_TRACE(at, type, arg, text, len) \
+    do { \
+        if ((at) && (at)->trace) \
+            at_trace_event((at)->trace, (type), (arg), (text), (len)); \
+    } while (0)
+
+/** Record the start and end of a named operation (a string literal). */
+#define AT_TRACE_SPAN_BEGIN(at, name) \
+    AT_TRACE(at, AT_TRACE_BEGIN, 0, name, sizeof(name)-1)
+#define AT_TRACE_SPAN_END(at, name, result) \
+    AT_TRACE(at, AT_TRACE_END, (result), name, sizeof(name)-1)
+
+/** Record a state change; what is a string literal. */
+#define AT_TRACE_STATE_CHANGE(at, what, value) \
+    AT_TRACE(at, AT_TRACE_STATE, (value), what, sizeof(what)-1)
+
+/**
+ * Allocate a trace ring.
+ *
+ * @param name Channel name shown in trace viewers; copied.
+ * @param events Capacity in events; rounded up to a power of two.
+ * @returns Trace instance on success, NULL and sets errno on failure.
+ */
+struct at_trace *at_trace_alloc(const char *name, size_t events);
+
+/**
+ * Free a trace ring. Detach it from all channels first.
+ *
+ * @param trace Trace instance.
+ */
+void at_trace_free(struct at_trace *trace);
+
+/**
+ * Record an event. Lock-free; callable from any thread.
+ *
+ * @param trace Trace instance.
+ * @param type Event type.
+ * @param arg Type-specific argument.
+ * @param text Type-specific text; truncated to AT_TRACE_TEXT bytes. May be NULL.
+ * @param len Text length.
+ */
+void at_trace_event(struct at_trace *trace, enum at_trace_type type, int32_t arg,
+                    const void *text, size_t len);
+
+/**
+ * Copy the recorded events out, oldest first. Events overwritten or being
+ * written during the copy are skipped.
+ *
+ * @param trace Trace instance.
+ * @param events Output array.
+ * @param max Output array capacity.
+ * @returns Number of events copied.
+ */
+size_t at_trace_snapshot(struct at_trace *trace, struct at_trace_event *events, size_t max);
+
+/**
+ * Write a snapshot to a dump file.
+ *
+ * @param trace Trace instance.
+ * @param path Output file; truncated if it exists.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_trace_dump(struct at_trace *trace, const char *path);
+
+/**
+ * Read a dump file.
+ *
+ * @param path Dump file.
+ * @param name Filled in with the channel name; AT_TRACE_NAME bytes.
+ * @param count Filled in with the number of events.
+ * @returns Events (free() them) on success, NULL and sets errno on failure.
+ */
+struct at_trace_event *at_trace_load(const char *path, char *name, size_t *count);
+
+/**
+ * Write events as Chrome trace (Perfetto-compatible) JSON objects, separated
+ * by commas: wrap the output of one or more calls in "[" and "]". Commands
+ * become slices lasting until their response or timeout, BEGIN/END pairs
+ * become slices, everything else becomes an instant event.
+ *
+ * @param out Output stream.
+ * @param events Events, oldest first.
+ * @param count Number of events.
+ * @param tid Track (thread id) to put the events on.
+ * @param name Track name.
+ * @returns Zero on success, -1 on write errors.
+ */
+int at_trace_export_chrome(FILE *out, const struct at_trace_event *events, size_t count,
+                           int tid, const char *name);
+
+/**
+ * Get a short name for an event type.
+ *
+ * @param type Event type.
+ * @returns Static string.
+ */
+const char *at_trace_type_name(enum at_trace_type type);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -13,6 +13,11 @@
 
 #include <attentive/at.h>
 
+struct at_capture;
+struct at_clock;
+struct at_executor;
+struct at_ring_stats;
+
 /**
  * Create an AT channel instance.
  *
@@ -22,6 +27,69 @@
  */
 struct at *at_alloc_unix(const char *devpath, speed_t baudrate);
 
+#define AT_TCP_RFC2217  (1 << 0)    /**< Telnet COM-PORT-OPTION, not raw TCP. */
+#define AT_TCP_RTSCTS   (1 << 1)    /**< Ask for hardware flow control (RFC 2217). */
+
+/**
+ * Create an AT channel instance on a network serial port, e.g. a ser2net
+ * "raw" or "telnet" port. at_open() connects. Commands and raw data leave
+ * in one TCP segment each, without waiting for ACKs.
+ *
+ * @param host Host name or address.
+ * @param service TCP port number or service name.
+ * @param baudrate With AT_TCP_RFC2217, if non-zero, sets the remote port
+ *                 baudrate (see termios.h). The line is always set to 8N1.
+ * @param flags AT_TCP_* flags.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at *at_alloc_tcp(const char *host, const char *service, speed_t baudrate, int flags);
+
+/**
+ * Time the channel with a virtual clock (see at-clock.h). Set it before
+ * at_open(), and before computing deadlines with at_now().
+ *
+ * @param at AT channel instance.
+ * @param clock Clock instance, or NULL for the system clock. Not owned.
+ */
+void at_unix_set_clock(struct at *at, struct at_clock *clock);
+
+/**
+ * Record all traffic on the channel to a capture file (see at-capture.h).
+ *
+ * @param at AT channel instance.
+ * @param capture Capture instance, or NULL to stop recording. Not owned.
+ */
+void at_unix_set_capture(struct at *at, struct at_capture *capture);
+
+/**
+ * Run the URC callback on an executor (see at-executor.h) instead of the
+ * parser thread. URCs are copied (up to 255 bytes) and handled in order on
+ * a strand of their own, so a slow handler holds up neither parsing nor
+ * other channels. Handlers may then issue commands; at_send() takes the
+ * channel lock when called off the parser thread.
+ *
+ * Deferred handlers can't switch the parser into stream mode in time; do
+ * that from the scan_line callback, which always runs on the parser thread.
+ *
+ * Switching executors, or to NULL, waits for URCs already queued; don't do
+ * it from a URC handler. at_free() does it for you.
+ *
+ * @param at AT channel instance.
+ * @param executor Executor, or NULL to run handlers inline again. Not owned.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_unix_set_executor(struct at *at, struct at_executor *executor);
+
+/**
+ * Get statistics of the receive ring between the reader and parser threads.
+ * A high-water mark at the ring size means callbacks fell behind the
+ * incoming data and the reader had to leave it in the port for a while.
+ *
+ * @param at AT channel instance.
+ * @param stats Filled in with current values (see ring.h).
+ */
+void at_unix_get_rx_stats(struct at *at, struct at_ring_stats *stats);
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
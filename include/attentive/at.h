@@ -10,6 +10,9 @@
 #define ATTENTIVE_AT_H
 
 #include <attentive/parser.h>
+#include <attentive/at-buf.h>
+#include <attentive/at-trace.h>
+#include <attentive/at-stats.h>
 
 /*
  * Publicly accessible fields. Platform-specific implementations may add private
@@ -20,6 +23,8 @@ struct at {
     const struct at_callbacks *cbs;
     void *arg;
     at_line_scanner_t command_scanner;
+    at_stream_handler_t stream_handler;
+    struct at_trace *trace;
 };
 
 struct at_callbacks {
@@ -70,13 +75,33 @@ void at_free(struct at *at);
 void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg);
 
 /**
- * Set custom per-command line scanner for the next command.
+ * Set custom per-command line scanner for the next command. Consumed by
+ * whichever command the channel sends next; threads sharing a channel
+ * should pass at_command_options instead.
  *
  * @param at AT channel instance.
  * @param scanner Line scanner callback.
  */
 void at_set_command_scanner(struct at *at, at_line_scanner_t scanner);
 
+/**
+ * Record channel events (commands, lines, URCs, responses, timeouts) to a
+ * trace ring. Drivers add their own events with the AT_TRACE macros.
+ *
+ * @param at AT channel instance.
+ * @param trace Trace instance, or NULL to stop tracing. Not owned.
+ */
+void at_set_trace(struct at *at, struct at_trace *trace);
+
+/**
+ * Get channel performance counters and command latency histograms. Callable
+ * from any thread; see at-stats.h.
+ *
+ * @param at AT channel instance.
+ * @param stats Filled in with current values.
+ */
+void at_get_stats(struct at *at, struct at_stats *stats);
+
 /**
  * Set custom per-character handler for the next command.
  *
@@ -86,20 +111,147 @@ void at_set_command_scanner(struct at *at, at_line_scanner_t scanner);
 void at_set_character_handler(struct at *at, at_character_handler_t handler);
 
 /**
- * Expect "> " dataprompt as a response for the next command.
+ * Pass received data to a stream handler instead of parsing it, e.g. while a
+ * transparent data connection is up. Call from a line or URC callback (on the
+ * "CONNECT" line) to switch without losing data; the handler itself calls
+ * this with NULL when it sees the end of the stream. See
+ * at_parser_set_stream_handler() for the handler contract.
+ *
+ * @param at AT channel instance.
+ * @param handler Stream handler, or NULL to resume line parsing. Called
+ *                with the callback argument from at_set_callbacks().
+ */
+void at_set_stream_handler(struct at *at, at_stream_handler_t handler);
+
+/**
+ * Expect "> " dataprompt as a response for the next command. Like
+ * at_set_command_scanner(), a shortcut for single-threaded callers.
  *
  * @param at AT channel instance.
  */
 void at_expect_dataprompt(struct at *at);
 
 /**
- * Set command timeout.
+ * Set the default command timeout, used by commands whose options don't
+ * set one.
  *
  * @param at AT channel instance.
  * @param timeout Timeout in seconds (zero to disable).
  */
 void at_set_timeout(struct at *at, int timeout);
 
+struct at_cancel_wait;
+
+/**
+ * Cancellation token. Zero-initialize, pass it with the commands it should
+ * cover (see struct at_command_options) or make it a channel's default with
+ * at_set_cancel(), and call at_cancel() from any thread to abort them.
+ * Cancellation sticks: commands given the token keep failing.
+ */
+struct at_cancel {
+    bool cancelled;                 /**< Set by at_cancel(). Atomic. */
+    struct at_cancel_wait *waiters; /**< Callers blocked under the token, on
+                                         any channel; port-private. */
+};
+
+/**
+ * Cancel a token. Commands and at_delay() calls using it fail at once with
+ * ECANCELED, on whatever channel they wait, including those already waiting
+ * for a response or their turn. A command cancelled in flight may still be
+ * answered; the channel resynchronizes before the next one (see
+ * at_set_resync_register()). Not for line or URC callbacks that run under
+ * a channel's lock.
+ *
+ * @param token Cancellation token.
+ */
+void at_cancel(struct at_cancel *token);
+
+/**
+ * Set the channel's default cancellation token, for commands whose options
+ * don't carry one. One token may be the default on several channels.
+ *
+ * @param at AT channel instance.
+ * @param token Cancellation token, or NULL. Not copied; clear it before
+ *              freeing the token.
+ */
+void at_set_cancel(struct at *at, struct at_cancel *token);
+
+/**
+ * Set the channel's default deadline, for commands whose options don't
+ * carry one. Each command waits for the smaller of its timeout and the time
+ * left; once the deadline has passed, commands fail with ETIMEDOUT without
+ * being sent. Operations made of several commands thus share one budget
+ * instead of adding up their timeouts.
+ *
+ * @param at AT channel instance.
+ * @param deadline at_now() time, or zero for none.
+ */
+void at_set_deadline(struct at *at, uint64_t deadline);
+
+/**
+ * Read the clock the channel times commands, delays and deadlines with:
+ * the monotonic system clock, unless the port was given another one (see
+ * at_unix_set_clock()).
+ *
+ * @param at AT channel instance.
+ * @returns Current time, nanoseconds.
+ */
+uint64_t at_now(struct at *at);
+
+/**
+ * Sleep between polls. Cut short by cancellation and by the deadline.
+ *
+ * @param at AT channel instance.
+ * @param ms Time to sleep in milliseconds.
+ * @returns Zero after a full sleep, -1 and sets errno (ECANCELED or
+ *          ETIMEDOUT) if the budget ran out first.
+ */
+int at_delay(struct at *at, int ms);
+
+/** Default S-register for resync nonces: S8, the comma dial pause. */
+#define AT_RESYNC_REGISTER 8
+
+/**
+ * Choose how the channel gets back in sync after a command times out. The
+ * channel writes a nonce (1..255) to the given S-register and reads it back
+ * in one command line, discarding everything that arrives before it; the
+ * register is left holding the nonce. Until that succeeds, each command
+ * first retries it and fails if it times out again.
+ *
+ * @param at AT channel instance.
+ * @param reg S-register number, or -1 to just reset the parser (late
+ *            answers are then passed to the URC handler).
+ */
+void at_set_resync_register(struct at *at, int reg);
+
+/**
+ * Let identical read-only queries share answers. A query sent with the
+ * shared option that waited for its turn behind an identical one gets a
+ * reference to that one's answer instead of being sent again; so does one
+ * issued within the window after such an answer arrived. Any other command
+ * invalidates the answers kept.
+ *
+ * @param at AT channel instance.
+ * @param ms How long answers stay fresh, in milliseconds; zero (the
+ *           default) to only share among queries in flight together.
+ */
+void at_set_share_window(struct at *at, int ms);
+
+/**
+ * Tame bursts of URCs starting with a prefix: pass on only the latest one
+ * per window, at most one per window, or none at all (see enum
+ * at_urc_policy and at_parser_set_urc_policy()). Lines held back never
+ * reach the URC callback or the executor; the trace still shows them and
+ * at_get_stats() counts them. Windows run on the channel's clock.
+ *
+ * @param at AT channel instance.
+ * @param prefix Line prefix, e.g. "+CIEV:".
+ * @param policy Policy, or AT_URC_DELIVER to remove the prefix's policy.
+ * @param ms Window length in milliseconds.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_set_urc_policy(struct at *at, const char *prefix, enum at_urc_policy policy, int ms);
+
 /**
  * Send an AT command and receive a response. Accepts printf-compatible
  * format and arguments.
@@ -113,6 +265,53 @@ void at_set_timeout(struct at *at, int timeout);
 __attribute__ ((format (printf, 2, 3)))
 const char *at_command(struct at *at, const char *format, ...);
 
+/**
+ * Send an AT command and receive a response that stays valid until
+ * released, regardless of further commands. Zero-copy: the buffer is the
+ * one the parser collected the response in. Otherwise like at_command().
+ *
+ * @param at AT channel instance.
+ * @param format printf-comaptible format.
+ * @returns Response buffer (release with at_buf_release) or NULL and sets
+ *          errno on failure.
+ */
+__attribute__ ((format (printf, 2, 3)))
+struct at_buf *at_command_buf(struct at *at, const char *format, ...);
+
+/**
+ * Settings for one command, applied atomically with it. Zero-initialize
+ * and fill in what's needed.
+ */
+struct at_command_options {
+    int timeout;                /**< Seconds; zero for the at_set_timeout() value. */
+    uint64_t deadline;          /**< at_now() time; zero for the at_set_deadline() value. */
+    struct at_cancel *cancel;   /**< Token; NULL for the at_set_cancel() one. */
+    at_line_scanner_t scanner;  /**< Per-command line scanner, or NULL. */
+    bool dataprompt;            /**< Expect a "> " dataprompt. */
+    int priority;               /**< Higher goes first among waiting commands. */
+    bool shared;                /**< Read-only query; see at_set_share_window(). */
+    bool idle;                  /**< Background command: fail with EBUSY rather than
+                                     wait if the channel is busy, has commands waiting
+                                     or carries a data stream. */
+};
+
+/**
+ * Send an AT command with per-command options. Several threads may issue
+ * commands on one channel: they are sent one at a time, by priority and
+ * then in order of arrival, and the wait for a turn counts against the
+ * command's deadline and cancellation token. Sticky settings from
+ * at_set_command_scanner() and at_expect_dataprompt() are dropped.
+ *
+ * @param at AT channel instance.
+ * @param opts Options, or NULL to use the sticky settings.
+ * @param format printf-comaptible format.
+ * @returns Response buffer (release with at_buf_release) or NULL and sets
+ *          errno on failure.
+ */
+__attribute__ ((format (printf, 3, 4)))
+struct at_buf *at_command_opts(struct at *at, const struct at_command_options *opts,
+                               const char *format, ...);
+
 /**
  * Send raw data over the AT channel.
  *
@@ -124,6 +323,43 @@ const char *at_command(struct at *at, const char *format, ...);
  */
 const char *at_command_raw(struct at *at, const void *data, size_t size);
 
+/**
+ * Send raw data over the AT channel and receive a response that stays
+ * valid until released. See at_command_buf().
+ *
+ * @param at AT channel instance.
+ * @param data Raw data to send.
+ * @param size Data size in bytes.
+ * @returns Response buffer (release with at_buf_release) or NULL and sets
+ *          errno on failure.
+ */
+struct at_buf *at_command_raw_buf(struct at *at, const void *data, size_t size);
+
+/**
+ * Send raw data with per-command options. See at_command_opts().
+ *
+ * @param at AT channel instance.
+ * @param opts Options, or NULL to use the sticky settings.
+ * @param data Raw data to send.
+ * @param size Data size in bytes.
+ * @returns Response buffer (release with at_buf_release) or NULL and sets
+ *          errno on failure.
+ */
+struct at_buf *at_command_raw_opts(struct at *at, const struct at_command_options *opts,
+                                   const void *data, size_t size);
+
+/**
+ * Sleep under the deadline and cancellation token of the options; the
+ * other options don't apply. See at_delay().
+ *
+ * @param at AT channel instance.
+ * @param opts Options, or NULL for the channel defaults.
+ * @param ms Time to sleep in milliseconds.
+ * @returns Zero after a full sleep, -1 and sets errno (ECANCELED or
+ *          ETIMEDOUT) if the budget ran out first.
+ */
+int at_delay_opts(struct at *at, const struct at_command_options *opts, int ms);
+
 /**
  * Send an AT command. Accepts printf-compatible format and arguments.
  *
@@ -170,6 +406,36 @@ bool at_send_raw(struct at *at, const void *data, size_t size);
         }                                                                   \
     } while (0)
 
+/**
+ * Send an AT command with per-command options and return -1 if it doesn't
+ * return OK.
+ */
+#define at_command_opts_simple(at, opts, cmd...)                            \
+    do {                                                                    \
+        struct at_buf *_response = at_command_opts(at, opts, cmd);          \
+        if (!_response)                                                     \
+            return -1; /* timeout */                                        \
+        bool _ok = !strcmp(_response->data, "");                            \
+        at_buf_release(_response);                                          \
+        if (!_ok)                                                           \
+            return -1;                                                      \
+    } while (0)
+
+/**
+ * Send raw data with per-command options and return -1 if it doesn't
+ * return OK.
+ */
+#define at_command_raw_opts_simple(at, opts, cmd...)                        \
+    do {                                                                    \
+        struct at_buf *_response = at_command_raw_opts(at, opts, cmd);      \
+        if (!_response)                                                     \
+            return -1; /* timeout */                                        \
+        bool _ok = !strcmp(_response->data, "");                            \
+        at_buf_release(_response);                                          \
+        if (!_ok)                                                           \
+            return -1;                                                      \
+    } while (0)
+
 /**
  * Count macro arguments. Source:
  * http://stackoverflow.com/questions/2124339/c-preprocessor-va-args-number-of-arguments
@@ -16,7 +16,8 @@
 
 #include <attentive/at.h>
 
-#if defined(__cplusplus) || !defined(__STRICT_ANSI__) || !defined(__ssize_t)
+#if (defined(__cplusplus) || !defined(__STRICT_ANSI__) || !defined(__ssize_t)) && \
+    !defined(__ssize_t_defined)  /* glibc's <sys/types.h> got there first */
  /* always defined in C++ and non-strict C for consistency of debug info */
   typedef int ssize_t;   /* see <stddef.h> */
   #if !defined(__cplusplus) && defined(__STRICT_ANSI__)
@@ -38,14 +39,62 @@ enum {
     CREG_REGISTERED_ROAMING = 5,
 };
 
+/** Ports of a dual-port modem; see cellular_attach_dual(). */
+enum cellular_port {
+    CELLULAR_PORT_DATA,     /**< Data commands, transparent and PPP traffic. */
+    CELLULAR_PORT_CONTROL,  /**< Status polling, configuration and URCs. */
+};
+
+/** Status values the cellular layer can cache; see cellular_set_status_ttl(). */
+enum cellular_status {
+    CELLULAR_STATUS_CREG,   /**< Registration; updated by +CREG URCs. */
+    CELLULAR_STATUS_RSSI,   /**< Signal strength; invalidated by +CIEV signal URCs. */
+    CELLULAR_STATUS_IMEI,   /**< Serial number; cached until detach by default. */
+    CELLULAR_STATUS_ICCID,  /**< SIM serial number; cached until detach by default. */
+    CELLULAR_STATUS_FIELDS,
+};
+
+/* A cached status value. Fields are accessed atomically. */
+struct cellular_cached {
+    int ttl;                /**< Milliseconds; zero to not cache, -1 for ever. */
+    bool ttl_set;           /**< Set by cellular_set_status_ttl(). */
+    bool valid;
+    uint64_t when;          /**< at_now() time of the last update. */
+    int value;
+};
+
 struct cellular {
     const struct cellular_ops *ops;
     struct at *at;
+    struct at *control;     /**< Control port, or NULL for single-port modems. */
 
     /* Private fields. */
     const char *apn;
     int pdp_failures;
     int pdp_threshold;
+    unsigned long pdp_requests;
+    unsigned long pdp_errors;
+    unsigned long pdp_resets;
+    unsigned long pdp_reused;
+    bool pdp_active;        /**< Context believed up. Atomic. */
+    bool pdp_prewarm;
+    struct cellular_cached status[CELLULAR_STATUS_FIELDS];
+    char imei[CELLULAR_IMEI_LENGTH+1];
+    char iccid[CELLULAR_ICCID_LENGTH+2];    /**< Some are a digit longer. */
+    int signal_indicator;   /**< +CIEV index of "signal", or zero. */
+    int service_indicator;  /**< +CIEV index of "service", or zero. */
+};
+
+struct cellular_stats {
+    struct at_stats at;             /**< AT channel counters; see at-stats.h. */
+    struct at_stats control;        /**< Control port counters, on dual-port modems. */
+    unsigned long pdp_requests;     /**< Network operations that needed a PDP context. */
+    unsigned long pdp_errors;       /**< Failed network operations. */
+    unsigned long pdp_resets;       /**< Contexts closed as possibly stuck. */
+    unsigned long pdp_reused;       /**< Of the requests, those an active context served. */
+    bool pdp_active;                /**< Context believed up. */
+    int pdp_failures;               /**< Consecutive failures so far. */
+    int pdp_threshold;              /**< Failures before the next reset. */
 };
 
 struct cellular_ops {
@@ -109,6 +158,42 @@ struct cellular *cellular_alloc(void);
  */
 int cellular_attach(struct cellular *modem, struct at *at, const char *apn);
 
+/**
+ * Attach cellular modem instance to two AT channels, e.g. the AT and modem
+ * interfaces of a USB modem. Each port has a channel and parser of its own;
+ * drivers send data commands and transparent traffic on the data port and
+ * status polling on the control port (see cellular_port()), so polls and
+ * URCs don't queue behind transfers. URC callbacks are set on both ports
+ * and may run on either port's thread.
+ *
+ * @param modem Cellular modem instance.
+ * @param data AT channel for data.
+ * @param control AT channel for control; may be the same as data.
+ * @param apn APN name. Not copied.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_attach_dual(struct cellular *modem, struct at *data, struct at *control, const char *apn);
+
+/**
+ * Pick the channel for a kind of command. On single-port modems, both
+ * ports are the one channel.
+ *
+ * @param modem Cellular modem instance; must be attached.
+ * @param port Kind of command.
+ * @returns AT channel instance.
+ */
+struct at *cellular_port(struct cellular *modem, enum cellular_port port);
+
+/**
+ * Open the PDP context as part of attaching, so the first network
+ * operation finds it up. Attaching succeeds even if the context doesn't
+ * open; the operations that need it will try again.
+ *
+ * @param modem Cellular modem instance; not attached.
+ * @param enable True to open the context on attach.
+ */
+void cellular_set_pdp_prewarm(struct cellular *modem, bool enable);
+
 /**
  * Detach cellular modem instance.
  * @param modem Cellular modem instance.
@@ -123,6 +208,93 @@ int cellular_detach(struct cellular *modem);
  */
 void cellular_free(struct cellular *modem);
 
+/**
+ * Time and cancellation budget for operations. See cellular_budget_begin().
+ */
+struct cellular_budget {
+    uint64_t deadline;          /**< at_now() time, or zero for none. */
+    struct at_cancel *cancel;   /**< Cancellation token, or NULL. See at_cancel(). */
+};
+
+/**
+ * Give the calling thread's operations a budget, on both ports, until
+ * cellular_budget_end(). Each operation, and every command and wait within
+ * it, stops at the deadline or as soon as the token is cancelled, and fails
+ * with ETIMEDOUT or ECANCELED; the steps share what is left instead of each
+ * applying its own timeout in full. Cancelled operations don't count as PDP
+ * failures. Other threads' operations on the same modem aren't affected.
+ * Budgets don't nest.
+ *
+ * @param budget Budget; stays in use until cellular_budget_end().
+ */
+void cellular_budget_begin(const struct cellular_budget *budget);
+
+/**
+ * End the calling thread's budget; its operations go back to the channels'
+ * own deadline and token.
+ */
+void cellular_budget_end(void);
+
+/**
+ * Cache a status value. While it's fresh, the op that reads it (creg,
+ * rssi, imei or iccid) answers from memory without a command. Values are
+ * updated by the ops themselves, by cellular_refresh_status() and by URCs
+ * (see cellular_status_urc()); detaching forgets them all.
+ *
+ * @param modem Cellular modem instance.
+ * @param field Status value.
+ * @param ms How long a value stays fresh, in milliseconds; zero to not
+ *           cache it (the default for creg and rssi), -1 to keep it until
+ *           detach (the default for imei and iccid).
+ */
+void cellular_set_status_ttl(struct cellular *modem, enum cellular_status field, int ms);
+
+/**
+ * Turn on the unsolicited reports that keep cached status current:
+ * AT+CREG=2 for registration and, if the modem has a "signal" or
+ * "service" indicator, AT+CMER for +CIEV indicator events.
+ *
+ * @param modem Cellular modem instance; must be attached.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_status_reports(struct cellular *modem);
+
+/**
+ * Refresh cached status values that are stale or past half their TTL, so
+ * the ops keep answering from memory. Commands go on the control port
+ * only while it's idle (see at_command_options); the refresh stops at the
+ * first one that finds the port busy. Meant to be called periodically,
+ * e.g. from a health check loop; at_broker_run() does it while idle.
+ *
+ * @param modem Cellular modem instance; must be attached.
+ * @returns Number of values refreshed, or -1 and sets errno (EBUSY if the
+ *          port wasn't idle).
+ */
+int cellular_refresh_status(struct cellular *modem);
+
+/**
+ * Update cached status from a URC line: "+CREG: <stat>[,...]" sets the
+ * registration status, and "+CIEV:" events for the signal or service
+ * indicator mark signal strength or registration stale. Drivers call this
+ * from their URC handlers; applications using the generic driver call it
+ * from theirs. Callable from any thread.
+ *
+ * @param modem Cellular modem instance.
+ * @param line URC line.
+ * @param len Line length.
+ * @returns True if the line was a status report.
+ */
+bool cellular_status_urc(struct cellular *modem, const char *line, size_t len);
+
+/**
+ * Get modem and AT channel counters. Callable from any thread.
+ *
+ * @param modem Cellular modem instance.
+ * @param stats Filled in with current values; AT channel counters are
+ *              zero while the modem is detached.
+ */
+void cellular_get_stats(struct cellular *modem, struct cellular_stats *stats);
+
 
 /* Modem-specific variants below. */
 
@@ -135,6 +307,29 @@ void cellular_telit2_free(struct cellular *modem);
 struct cellular *cellular_sim800_alloc(void);
 void cellular_sim800_free(struct cellular *modem);
 
+/**
+ * Switch the SIM800 between multi-connection and transparent (AT+CIPMODE=1)
+ * sockets. In transparent mode there is a single connection, id 0; sent data
+ * goes straight onto the wire and received data bypasses the AT parser.
+ * Received data that doesn't fit the driver's buffer is lost, after which
+ * socket_recv fails with ENOBUFS until the next connect.
+ * Shuts down any open connections.
+ *
+ * @param modem SIM800 modem instance.
+ * @param enable True for transparent mode.
+ * @returns Zero on success, -1 on failure.
+ */
+int cellular_sim800_set_transparent(struct cellular *modem, bool enable);
+
+/**
+ * Escape from transparent data mode (+++) so AT commands can be issued while
+ * the connection stays up. The next socket send resumes data mode (ATO).
+ *
+ * @param modem SIM800 modem instance.
+ * @returns Zero on success, -1 on failure.
+ */
+int cellular_sim800_escape(struct cellular *modem);
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
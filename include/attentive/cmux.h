@@ -0,0 +1,166 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_CMUX_H
+#define ATTENTIVE_CMUX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <termios.h>
+
+#include <attentive/at.h>
+
+/*
+ * GSM 07.10 (3GPP TS 27.010) basic option multiplexer.
+ *
+ * After the modem has accepted "AT+CMUX=0", the serial port carries frames
+ * for several virtual channels (DLCs). DLC 0 is the control channel; DLCs
+ * 1..n are each exposed as a pseudo-terminal, so a plain unix AT channel can
+ * be opened on top of every one of them. Typical usage:
+ *
+ *     at_command(at, "AT+CMUX=0");
+ *     at_free(at);
+ *     struct cmux *mux = cmux_open("/dev/ttyUSB0", B115200, 2);
+ *     struct at *control = cmux_at_alloc(mux, 1);
+ *     struct at *data = cmux_at_alloc(mux, 2);
+ *
+ * Flow control is per DLC, using MSC (modem status command) messages in
+ * both directions.
+ */
+
+#define CMUX_MAX_CHANNELS   4       /**< Highest DLCI we open. */
+#define CMUX_FRAME_SIZE     127     /**< Default N1 (maximum information field). */
+#define CMUX_FRAME_MAX      1536    /**< Largest information field we decode. */
+
+/* Frame types; OR with CMUX_PF for the poll/final bit. */
+#define CMUX_SABM           0x2f
+#define CMUX_UA             0x63
+#define CMUX_DM             0x0f
+#define CMUX_DISC           0x43
+#define CMUX_UIH            0xef
+#define CMUX_UI             0x03
+#define CMUX_PF             0x10
+
+/* Control channel message types, without the C/R and EA bits. */
+#define CMUX_MSG_CLD        0xc0
+#define CMUX_MSG_TEST       0x20
+#define CMUX_MSG_MSC        0xe0
+#define CMUX_MSG_NSC        0x10
+#define CMUX_MSG_CR         0x02
+
+/* V.24 signals carried in MSC. */
+#define CMUX_V24_FC         0x02    /**< Flow control: stop sending. */
+#define CMUX_V24_RTC        0x04
+#define CMUX_V24_RTR        0x08
+#define CMUX_V24_DV         0x80
+
+struct cmux_frame {
+    int dlci;
+    bool cr;                /**< Command/response bit from the address. */
+    uint8_t control;        /**< Frame type, including the P/F bit. */
+    size_t len;
+    const uint8_t *data;
+};
+
+struct cmux_decoder {
+    int state;
+    uint8_t address;
+    uint8_t control;
+    uint8_t crc;
+    bool fcs_ok;
+    size_t len;
+    size_t used;
+    size_t errors;          /**< Frames dropped because of framing or FCS errors. */
+    uint8_t data[CMUX_FRAME_MAX];
+};
+
+/**
+ * Compute the frame check sequence over a run of bytes.
+ *
+ * @param data Bytes (address, control, length and, except for UIH, data).
+ * @param len Number of bytes.
+ * @returns FCS byte as transmitted.
+ */
+uint8_t cmux_fcs(const void *data, size_t len);
+
+/**
+ * Encode a frame, including the opening and closing flags.
+ *
+ * @param buf Output buffer.
+ * @param size Output buffer size; len + 7 bytes always suffice.
+ * @param dlci Data link connection identifier.
+ * @param cr Command/response bit.
+ * @param control Frame type, including the P/F bit.
+ * @param data Information field.
+ * @param len Information field length.
+ * @returns Encoded length, or zero if the buffer is too small.
+ */
+size_t cmux_frame_encode(void *buf, size_t size, int dlci, bool cr, uint8_t control,
+                         const void *data, size_t len);
+
+/**
+ * Reset a frame decoder.
+ *
+ * @param dec Decoder instance.
+ */
+void cmux_decoder_init(struct cmux_decoder *dec);
+
+/**
+ * Feed one byte to the decoder.
+ *
+ * @param dec Decoder instance.
+ * @param ch Received byte.
+ * @param frame Filled in when a complete, valid frame has been received. The
+ *              data pointer stays valid until the next call.
+ * @returns True if a frame was decoded.
+ */
+bool cmux_decoder_feed(struct cmux_decoder *dec, uint8_t ch, struct cmux_frame *frame);
+
+
+/**
+ * Start multiplexing on a serial port. The modem must already be in CMUX
+ * mode. Establishes the control channel and DLCs 1..channels.
+ *
+ * @param devpath Serial port device path.
+ * @param baudrate Serial port baudrate, or zero to leave it alone.
+ * @param channels Number of DLCs to open, up to CMUX_MAX_CHANNELS.
+ * @returns Multiplexer instance on success, NULL and sets errno on failure.
+ */
+struct cmux *cmux_open(const char *devpath, speed_t baudrate, int channels);
+
+/**
+ * Get the pseudo-terminal standing in for a DLC.
+ *
+ * @param cmux Multiplexer instance.
+ * @param dlci DLC number, 1..channels.
+ * @returns Device path, or NULL if the DLC isn't open.
+ */
+const char *cmux_devpath(struct cmux *cmux, int dlci);
+
+/**
+ * Allocate an AT channel on top of a DLC. Equivalent to calling
+ * at_alloc_unix() on cmux_devpath(); at_open() it as usual.
+ *
+ * @param cmux Multiplexer instance.
+ * @param dlci DLC number, 1..channels.
+ * @returns AT channel instance, or NULL and sets errno on failure.
+ */
+struct at *cmux_at_alloc(struct cmux *cmux, int dlci);
+
+/**
+ * Close all DLCs, take the modem out of CMUX mode and release resources.
+ * Free the AT channels on top of the multiplexer first.
+ *
+ * @param cmux Multiplexer instance.
+ */
+void cmux_close(struct cmux *cmux);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
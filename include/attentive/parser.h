@@ -13,6 +13,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <attentive/at-buf.h>
+
 /**
  * AT response type.
  *
@@ -50,6 +52,33 @@ typedef enum at_response_type (*at_line_scanner_t)(const char *line, size_t len,
 /** Response handler. */
 typedef void (*at_response_handler_t)(const char *line, size_t len, void *priv);
 
+/** Stream mode data handler. Returns the number of bytes that belonged to the
+ *  stream; see at_parser_set_stream_handler(). */
+typedef size_t (*at_stream_handler_t)(const void *data, size_t len, void *priv);
+
+/** Clock reader; returns the current time in nanoseconds. See
+ *  at_parser_set_clock(). */
+typedef uint64_t (*at_clock_handler_t)(void *priv);
+
+struct at_trace;
+struct at_stats;
+
+/** Longest sentinel line, with NUL; see at_parser_expect_sentinel(). */
+#define AT_PARSER_SENTINEL 16
+
+/** URC prefixes with a policy; see at_parser_set_urc_policy(). */
+#define AT_PARSER_URC_POLICIES 8
+/** Longest URC policy prefix, with NUL. */
+#define AT_PARSER_URC_PREFIX 16
+
+/** What to do with a burst of URCs. */
+enum at_urc_policy {
+    AT_URC_DELIVER = 0,     /**< Pass each one on (the default). */
+    AT_URC_COALESCE,        /**< Pass the first one on, then only the latest per window. */
+    AT_URC_RATE_LIMIT,      /**< Pass at most one per window on; drop the rest. */
+    AT_URC_DROP,            /**< Drop them all. */
+};
+
 struct at_parser_callbacks {
     at_line_scanner_t scan_line;
     at_response_handler_t handle_response;
@@ -61,7 +90,8 @@ struct at_parser_callbacks {
  *
  * @param cbs Parser callbacks. Structure is not copied; must persist for
  *            the lifetime of the parser.
- * @param bufsize Response buffer size on bytes.
+ * @param bufsize Response buffer size on bytes. Responses are collected in
+ *                a pool of buffers of this size.
  * @param priv Private argument; passed to callbacks.
  * @returns Parser instance pointer.
  */
@@ -82,6 +112,78 @@ void at_parser_reset(struct at_parser *parser);
  */
 void at_parser_set_character_handler(struct at_parser *parser, at_character_handler_t handler);
 
+/**
+ * Suspend line parsing and pass all received data to a stream handler, e.g.
+ * while a transparent data connection is up. Usually called from a callback
+ * on the line announcing the connection ("CONNECT"); bytes following that
+ * line in the same feed go to the handler.
+ *
+ * The handler must consume all data it is given unless it ends stream mode
+ * (by setting a NULL handler), in which case it returns the number of bytes
+ * that belonged to the stream and the rest is parsed as usual.
+ *
+ * @param parser Parser instance.
+ * @param handler Stream handler, or NULL to resume line parsing.
+ */
+void at_parser_set_stream_handler(struct at_parser *parser, at_stream_handler_t handler);
+
+/**
+ * Record every received line, with its classification, to a trace ring.
+ *
+ * @param parser Parser instance.
+ * @param trace Trace instance (see at-trace.h), or NULL.
+ */
+void at_parser_set_trace(struct at_parser *parser, struct at_trace *trace);
+
+/**
+ * Count lines, URCs and buffer usage in a set of channel statistics.
+ *
+ * @param parser Parser instance.
+ * @param stats Live counters (see at-stats.h), or NULL.
+ */
+void at_parser_set_stats(struct at_parser *parser, struct at_stats *stats);
+
+/**
+ * Time URC policy windows on the port's clock rather than real time.
+ *
+ * @param parser Parser instance.
+ * @param now Clock reader, called with the parser's priv; NULL for
+ *            at_stats_clock_ns().
+ */
+void at_parser_set_clock(struct at_parser *parser, at_clock_handler_t now);
+
+/**
+ * Set what happens to lines starting with a prefix that would go to the
+ * handle_urc callback, e.g. when a modem reports indicators or the network
+ * time in bursts. A window starts when a line is passed on. Coalesced
+ * lines arriving within it are held, each replacing the one before, and
+ * the last of them is passed on by at_parser_flush_urcs() once the window
+ * is over. Suppressed lines are counted in the stats (see at-stats.h).
+ * Windows are timed on the parser's clock (see at_parser_set_clock()).
+ *
+ * @param parser Parser instance.
+ * @param prefix Line prefix, e.g. "+CIEV:"; truncated to
+ *               AT_PARSER_URC_PREFIX-1 characters.
+ * @param policy Policy; AT_URC_DELIVER removes the prefix's policy and
+ *               discards a line being held.
+ * @param window Window length in nanoseconds.
+ * @returns Zero on success, -1 and sets errno to EINVAL if the prefix is
+ *          empty or ENOSPC if all AT_PARSER_URC_POLICIES slots are taken.
+ */
+int at_parser_set_urc_policy(struct at_parser *parser, const char *prefix,
+                             enum at_urc_policy policy, uint64_t window);
+
+/**
+ * Pass on coalesced lines whose window is over. Called by the port from
+ * the same context as at_parser_feed(), after feeding and whenever the
+ * returned time comes.
+ *
+ * @param parser Parser instance.
+ * @param now Time on the parser's clock.
+ * @returns When to call again, or UINT64_MAX if no line is being held.
+ */
+uint64_t at_parser_flush_urcs(struct at_parser *parser, uint64_t now);
+
 /**
  * Make the parser expect a dataprompt for the next command.
  *
@@ -93,6 +195,21 @@ void at_parser_set_character_handler(struct at_parser *parser, at_character_hand
  */
 void at_parser_expect_dataprompt(struct at_parser *parser);
 
+/**
+ * Discard response lines until a given one arrives, for the next command.
+ * Used to get back in sync after a timeout: the command is chosen to answer
+ * with a line nothing else would produce (a nonce), so anything before it,
+ * including a final response, is a late answer to an earlier command. URCs
+ * are still passed on. The sentinel line itself is discarded, and the
+ * command's final response then completes as usual. An ERROR or +CME ERROR
+ * in its place completes the response instead, as the modem rejecting the
+ * command.
+ *
+ * @param parser Parser instance.
+ * @param line Sentinel line; truncated to AT_PARSER_SENTINEL-1 characters.
+ */
+void at_parser_expect_sentinel(struct at_parser *parser, const char *line);
+
 /**
  * Inform the parser that a command will be invoked. Causes a response callback
  * at the next command completion.
@@ -101,6 +218,20 @@ void at_parser_expect_dataprompt(struct at_parser *parser);
  */
 void at_parser_await_response(struct at_parser *parser);
 
+/**
+ * Take ownership of the response being delivered. Only valid from the
+ * handle_response callback, in place of copying the line out: the parser
+ * hands over the buffer it collected the response in and continues in a
+ * fresh one from its pool (see at-buf.h), so the response stays valid
+ * however much is received afterwards.
+ *
+ * @param parser Parser instance.
+ * @returns Response buffer holding one reference, or NULL if no fresh
+ *          buffer could be allocated (the response is then still valid
+ *          for the duration of the callback only).
+ */
+struct at_buf *at_parser_take_response(struct at_parser *parser);
+
 /**
  * Feed parser. Callbacks are always called from this function's context.
  *
@@ -0,0 +1,98 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_RING_H
+#define ATTENTIVE_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lock-free single-producer, single-consumer byte ring.
+ *
+ * One thread (or interrupt) writes, another reads; neither ever blocks or
+ * takes a lock. Head and tail are free-running counters published with
+ * release/acquire ordering, so the buffer size must be a power of two.
+ * Statistics are maintained by the producer and may be read from anywhere.
+ */
+
+struct at_ring {
+    uint8_t *buf;
+    size_t size;            /**< Power of two. */
+    size_t head;            /**< Written by the producer only. */
+    size_t tail;            /**< Written by the consumer only. */
+    size_t high_water;      /**< Highest fill level seen, in bytes. */
+    size_t overruns;        /**< Bytes dropped because the ring was full. */
+    size_t total;           /**< Bytes ever written. */
+};
+
+struct at_ring_stats {
+    size_t size;
+    size_t used;
+    size_t high_water;
+    size_t overruns;
+    size_t total;
+};
+
+/**
+ * Initialize a ring over caller-provided storage.
+ *
+ * @param ring Ring instance.
+ * @param buf Storage; must persist for the lifetime of the ring.
+ * @param size Storage size; must be a power of two.
+ */
+void at_ring_init(struct at_ring *ring, void *buf, size_t size);
+
+/**
+ * Append bytes. Producer side. Whatever doesn't fit is dropped and counted
+ * as an overrun.
+ *
+ * @param ring Ring instance.
+ * @param data Bytes to append.
+ * @param len Number of bytes.
+ * @returns Number of bytes actually appended.
+ */
+size_t at_ring_write(struct at_ring *ring, const void *data, size_t len);
+
+/**
+ * Remove bytes. Consumer side.
+ *
+ * @param ring Ring instance.
+ * @param data Output buffer.
+ * @param len Output buffer size.
+ * @returns Number of bytes removed; zero if the ring is empty.
+ */
+size_t at_ring_read(struct at_ring *ring, void *data, size_t len);
+
+/**
+ * Number of bytes waiting to be read. Exact on the consumer side; a lower
+ * bound of the free space on the producer side.
+ *
+ * @param ring Ring instance.
+ * @returns Fill level in bytes.
+ */
+size_t at_ring_used(struct at_ring *ring);
+
+/**
+ * Discard all buffered data. Consumer side.
+ *
+ * @param ring Ring instance.
+ */
+void at_ring_flush(struct at_ring *ring);
+
+/**
+ * Take a snapshot of the ring statistics.
+ *
+ * @param ring Ring instance.
+ * @param stats Filled in with current values.
+ */
+void at_ring_get_stats(struct at_ring *ring, struct at_ring_stats *stats);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,167 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/at-batch.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#define printf(...)
+
+/* Final responses the parser leaves at the end of a failed answer. */
+static const char *const error_responses[] = {
+    "ERROR",
+    "NO CARRIER",
+    "+CME ERROR:",
+    "+CMS ERROR:",
+    NULL
+};
+
+/* The command without its "AT", as it goes after a ';'. */
+static const char *command_body(const char *command)
+{
+    if ((command[0] == 'A' || command[0] == 'a') && (command[1] == 'T' || command[1] == 't'))
+        return command + 2;
+    return command;
+}
+
+/* Whether an answer line is named after a command: "+CREG: 0,1" for "AT+CREG?". */
+static bool answers(const char *line, const char *command)
+{
+    const char *body = command_body(command);
+    size_t name = strcspn(body, "=?");
+    return name && !strncmp(line, body, name) && line[name] == ':';
+}
+
+/* Whether a command may share a line: retrying the line runs it again. */
+static bool joins(const struct at_batch_command *command)
+{
+    if (command->alone)
+        return false;
+    size_t len = strlen(command->command);
+    return command->repeat || (len && command->command[len-1] == '?');
+}
+
+/* Send commands on one line and share out the answer. */
+static int send_line(struct at *at, const struct at_command_options *opts,
+                     struct at_batch_command *commands, size_t count)
+{
+    char line[AT_BATCH_LINE+1];
+    size_t len = 0;
+    for (size_t i=0; i<count; i++) {
+        const char *part = i ? command_body(commands[i].command) : commands[i].command;
+        size_t n = strlen(part);
+        memcpy(line + len, part, n);
+        len += n;
+        line[len++] = i+1 < count ? ';' : '\r';
+    }
+
+    struct at_buf *response = at_command_raw_opts(at, opts, line, len);
+    if (!response)
+        return -1;
+    char *data = response->data;
+
+    /* A failed command ends the answer with the error, and nothing after
+     * it on the line was run. */
+    const char *last = strrchr(data, '\n');
+    if (at_prefix_in_table(last ? last+1 : data, error_responses)) {
+        if (count == 1) {
+            commands[0].text = data;
+            commands[0].response = response;
+        } else {
+            at_buf_release(response);
+        }
+        errno = EIO;
+        return -1;
+    }
+
+    for (size_t i=0; i<count; i++) {
+        commands[i].result = 0;
+        commands[i].text = "";
+        commands[i].response = at_buf_ref(response);
+    }
+
+    /* Answers come in command order; cut the lines into one string each. */
+    size_t owner = 0;
+    bool owned = false;
+    for (char *p = *data ? data : NULL; p; ) {
+        char *next = strchr(p, '\n');
+        for (size_t i=owner; i<count; i++) {
+            if (answers(p, commands[i].command)) {
+                if (i != owner) {
+                    if (owned)
+                        p[-1] = '\0';
+                    owner = i;
+                    owned = false;
+                }
+                break;
+            }
+        }
+        if (!owned) {
+            commands[owner].text = p;
+            owned = true;
+        }
+        p = next ? next+1 : NULL;
+    }
+
+    at_buf_release(response);
+    return 0;
+}
+
+int at_batch(struct at *at, const struct at_command_options *opts,
+             struct at_batch_command *commands, size_t count, size_t line_max)
+{
+    if (line_max > AT_BATCH_LINE)
+        line_max = AT_BATCH_LINE;
+    for (size_t i=0; i<count; i++) {
+        commands[i].result = -1;
+        commands[i].text = NULL;
+        commands[i].response = NULL;
+    }
+
+    size_t first = 0;
+    while (first < count) {
+        /* Fill a line, unless the command wants one of its own. */
+        size_t n = 1;
+        size_t len = strlen(commands[first].command);
+        if (len > line_max) {
+            errno = ENOMEM;
+            return -1;
+        }
+        while (joins(&commands[first]) && first+n < count && joins(&commands[first+n])) {
+            size_t more = 1 + strlen(command_body(commands[first+n].command));
+            if (len + more > line_max)
+                break;
+            len += more;
+            n++;
+        }
+
+        if (send_line(at, opts, commands + first, n) == -1) {
+            if (errno != EIO || n == 1)
+                return -1;
+            /* Find out which one failed; all of them may be run again. */
+            for (size_t i=first; i<first+n; i++)
+                if (send_line(at, opts, commands + i, 1) == -1)
+                    return -1;
+        }
+        first += n;
+    }
+
+    return 0;
+}
+
+void at_batch_release(struct at_batch_command *commands, size_t count)
+{
+    for (size_t i=0; i<count; i++) {
+        at_buf_release(commands[i].response);
+        commands[i].response = NULL;
+        commands[i].text = NULL;
+    }
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,1115 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <attentive/at-broker.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define printf(...)
+
+#define BROKER_MAGIC        0x41544252  /* "ATBR" */
+#define BROKER_VERSION      1
+#define BROKER_TEXT         256         /* Request strings, NUL-separated. */
+#define BROKER_REPLY_TEXT   32
+
+/*
+ * Shared memory rings. Head and tail are free-running positions; the
+ * producer only moves the head, the consumer only the tail. Messages on the
+ * socket say where their payload is, so a payload that wouldn't fit before
+ * the end of the buffer can start over at the beginning and stay in one
+ * piece for the other side to use in place.
+ */
+struct broker_ring {
+    uint64_t head;          /**< Written by the producer only. Atomic. */
+    uint64_t tail;          /**< Written by the consumer only. Atomic. */
+    uint8_t buf[AT_BROKER_RING_SIZE];
+};
+
+struct broker_shm {
+    struct broker_ring tx;  /**< Client to broker. */
+    struct broker_ring rx;  /**< Broker to client. */
+};
+
+enum broker_op {
+    OP_ATTACH,
+    OP_DETACH,
+    OP_PDP_OPEN,
+    OP_PDP_CLOSE,
+    OP_IMEI,
+    OP_MEID,
+    OP_ICCID,
+    OP_CREG,
+    OP_RSSI,
+    OP_SOCKET_CONNECT,
+    OP_SOCKET_SEND,
+    OP_SOCKET_RECV,
+    OP_SOCKET_WAITACK,
+    OP_SOCKET_CLOSE,
+    OP_FTP_OPEN,
+    OP_FTP_GET,
+    OP_FTP_GETDATA,
+    OP_FTP_CLOSE,
+    OP_LOCATE,
+    OP_COUNT,
+};
+
+/* Sent with the shared memory descriptor when a client connects. */
+struct broker_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ops;           /**< Bit per enum broker_op the modem has. */
+};
+
+struct broker_request {
+    uint32_t op;            /**< enum broker_op. */
+    int32_t connid;
+    int32_t flags;
+    uint32_t port;
+    uint32_t passive;
+    uint64_t pos;           /**< Payload position in the tx ring. */
+    uint64_t len;           /**< Payload length, or room for the answer. */
+    char text[BROKER_TEXT];
+};
+
+struct broker_reply {
+    int64_t result;
+    int32_t error;          /**< errno, if result is -1. */
+    uint64_t pos;           /**< Data position in the rx ring. */
+    uint64_t len;
+    char text[BROKER_REPLY_TEXT];
+    float location[3];
+};
+
+/* Contiguous room for up to len bytes at the head; len is cut down to fit. */
+static uint8_t *ring_reserve(struct broker_ring *ring, uint64_t *len, uint64_t *pos)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    uint64_t free = AT_BROKER_RING_SIZE - (head - tail);
+    uint64_t run = AT_BROKER_RING_SIZE - (head & (AT_BROKER_RING_SIZE-1));
+    if (run < *len && free > run) {
+        /* Skip the stub before the end. */
+        head += run;
+        free -= run;
+        run = AT_BROKER_RING_SIZE;
+    }
+    uint64_t room = run < free ? run : free;
+    if (*len > room)
+        *len = room;
+
+    *pos = head;
+    return ring->buf + (head & (AT_BROKER_RING_SIZE-1));
+}
+
+static void ring_publish(struct broker_ring *ring, uint64_t end)
+{
+    __atomic_store_n(&ring->head, end, __ATOMIC_RELEASE);
+}
+
+/* Find a payload the other side published; NULL if it's not all there. */
+static uint8_t *ring_payload(struct broker_ring *ring, uint64_t pos, uint64_t len)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    uint64_t offset = pos & (AT_BROKER_RING_SIZE-1);
+    if (pos - tail > head - tail || len > head - pos || offset + len > AT_BROKER_RING_SIZE)
+        return NULL;
+    return ring->buf + offset;
+}
+
+static void ring_consume(struct broker_ring *ring, uint64_t end)
+{
+    __atomic_store_n(&ring->tail, end, __ATOMIC_RELEASE);
+}
+
+/* Drop all the other side has published, e.g. a payload that made no
+ * sense, so the ring doesn't stay jammed on it. */
+static void ring_discard(struct broker_ring *ring)
+{
+    ring_consume(ring, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Broker side.
+ */
+
+/*
+ * Each client has a worker thread that takes its requests and runs them on
+ * the modem, so the poll loop only accepts clients and keeps status fresh.
+ * Status queries with a control port to themselves run alongside anything
+ * else; all other ops take the modem in turn, since driver sequences (a
+ * send's data prompt, say) mustn't be interleaved on one port.
+ */
+
+struct broker_client {
+    struct at_broker *broker;
+    int fd;                 /**< -1 if the slot is free. */
+    struct broker_shm *shm;
+    pthread_t thread;       /**< Worker serving the client. */
+    bool done;              /**< Worker finished; join it before reuse. */
+};
+
+struct at_broker {
+    struct cellular *modem;
+    struct sockaddr_un addr;
+    int listener;
+    int wakeup;             /**< eventfd; at_broker_stop(). */
+
+    pthread_mutex_t lock;   /**< Protects the client slots. */
+    struct broker_client clients[AT_BROKER_CLIENTS];
+    unsigned long requests; /**< Taken so far, by all workers. Atomic. */
+    int serving;            /**< Requests being run. Atomic. */
+
+    pthread_mutex_t modem_lock; /**< Held by ops taking turns; protects below. */
+    int owner[AT_BROKER_SOCKETS];   /**< Client index + 1, or zero. */
+    int ftp_owner;
+};
+
+static uint32_t modem_ops(const struct cellular_ops *ops)
+{
+    const void *const table[OP_COUNT] = {
+        [OP_ATTACH] = (void *) 1,
+        [OP_DETACH] = (void *) 1,
+        [OP_PDP_OPEN] = (void *) ops->pdp_open,
+        [OP_PDP_CLOSE] = (void *) ops->pdp_close,
+        [OP_IMEI] = (void *) ops->imei,
+        [OP_MEID] = (void *) ops->meid,
+        [OP_ICCID] = (void *) ops->iccid,
+        [OP_CREG] = (void *) ops->creg,
+        [OP_RSSI] = (void *) ops->rssi,
+        [OP_SOCKET_CONNECT] = (void *) ops->socket_connect,
+        [OP_SOCKET_SEND] = (void *) ops->socket_send,
+        [OP_SOCKET_RECV] = (void *) ops->socket_recv,
+        [OP_SOCKET_WAITACK] = (void *) ops->socket_waitack,
+        [OP_SOCKET_CLOSE] = (void *) ops->socket_close,
+        [OP_FTP_OPEN] = (void *) ops->ftp_open,
+        [OP_FTP_GET] = (void *) ops->ftp_get,
+        [OP_FTP_GETDATA] = (void *) ops->ftp_getdata,
+        [OP_FTP_CLOSE] = (void *) ops->ftp_close,
+        [OP_LOCATE] = (void *) ops->locate,
+    };
+    uint32_t mask = 0;
+    for (int op=0; op<OP_COUNT; op++)
+        if (table[op])
+            mask |= 1u << op;
+    return mask;
+}
+
+struct at_broker *at_broker_alloc(const char *path, struct cellular *modem)
+{
+    struct at_broker *broker = malloc(sizeof(struct at_broker));
+    if (!broker) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(broker, 0, sizeof(*broker));
+    broker->modem = modem;
+    for (int i=0; i<AT_BROKER_CLIENTS; i++) {
+        broker->clients[i].broker = broker;
+        broker->clients[i].fd = -1;
+    }
+
+    broker->addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(broker->addr.sun_path)) {
+        free(broker);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(broker->addr.sun_path, path);
+
+    broker->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    broker->listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (broker->wakeup == -1 || broker->listener == -1)
+        goto fail;
+    unlink(path);
+    if (bind(broker->listener, (struct sockaddr *) &broker->addr, sizeof(broker->addr)) == -1 ||
+        listen(broker->listener, AT_BROKER_CLIENTS) == -1)
+        goto fail;
+
+    pthread_mutex_init(&broker->lock, NULL);
+    pthread_mutex_init(&broker->modem_lock, NULL);
+    return broker;
+
+fail:;
+    int error = errno;
+    if (broker->listener != -1)
+        close(broker->listener);
+    if (broker->wakeup != -1)
+        close(broker->wakeup);
+    free(broker);
+    errno = error;
+    return NULL;
+}
+
+static void *client_worker(void *arg);
+
+/* Join the workers of clients that are gone, freeing their slots. Called
+ * with the lock held. */
+static void reap_clients(struct at_broker *broker)
+{
+    for (int c=0; c<AT_BROKER_CLIENTS; c++) {
+        struct broker_client *client = &broker->clients[c];
+        if (!client->done)
+            continue;
+        pthread_join(client->thread, NULL);
+        close(client->fd);
+        client->fd = -1;
+        client->done = false;
+    }
+}
+
+static void accept_client(struct at_broker *broker)
+{
+    int fd = accept4(broker->listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    pthread_mutex_lock(&broker->lock);
+    reap_clients(broker);
+    struct broker_client *client = NULL;
+    for (int i=0; i<AT_BROKER_CLIENTS && !client; i++)
+        if (broker->clients[i].fd == -1)
+            client = &broker->clients[i];
+    pthread_mutex_unlock(&broker->lock);
+    if (!client) {
+        printf("broker: too many clients\n");
+        close(fd);
+        return;
+    }
+
+    /* The rings live in an anonymous file passed over the socket. */
+    int memfd = memfd_create("attentive-broker", MFD_CLOEXEC);
+    if (memfd == -1 || ftruncate(memfd, sizeof(struct broker_shm)) == -1) {
+        if (memfd != -1)
+            close(memfd);
+        close(fd);
+        return;
+    }
+    void *shm = mmap(NULL, sizeof(struct broker_shm), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shm == MAP_FAILED) {
+        close(memfd);
+        close(fd);
+        return;
+    }
+
+    struct broker_hello hello = {
+        .magic = BROKER_MAGIC,
+        .version = BROKER_VERSION,
+        .ops = modem_ops(broker->modem->ops),
+    };
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    if (sent != sizeof(hello)) {
+        munmap(shm, sizeof(struct broker_shm));
+        close(fd);
+        return;
+    }
+
+    /* Only this thread fills free slots, so it's still ours. */
+    pthread_mutex_lock(&broker->lock);
+    client->fd = fd;
+    client->shm = shm;
+    if (pthread_create(&client->thread, NULL, client_worker, client) != 0) {
+        client->fd = -1;
+        client->shm = NULL;
+        munmap(shm, sizeof(struct broker_shm));
+        close(fd);
+    }
+    pthread_mutex_unlock(&broker->lock);
+    printf("broker: client %d connected\n", (int) (client - broker->clients));
+}
+
+/* Let go of whatever a client left open on the modem, and of its rings.
+ * The socket stays open until its worker is joined. */
+static void drop_client(struct at_broker *broker, int c)
+{
+    struct cellular *modem = broker->modem;
+    struct broker_client *client = &broker->clients[c];
+
+    pthread_mutex_lock(&broker->modem_lock);
+    for (int connid=0; connid<AT_BROKER_SOCKETS; connid++) {
+        if (broker->owner[connid] != c+1)
+            continue;
+        if (modem->ops->socket_close)
+            modem->ops->socket_close(modem, connid);
+        broker->owner[connid] = 0;
+    }
+    if (broker->ftp_owner == c+1) {
+        if (modem->ops->ftp_close)
+            modem->ops->ftp_close(modem);
+        broker->ftp_owner = 0;
+    }
+    pthread_mutex_unlock(&broker->modem_lock);
+
+    munmap(client->shm, sizeof(struct broker_shm));
+    client->shm = NULL;
+    printf("broker: client %d gone\n", c);
+}
+
+/* Check that the client may use a connection id; sets errno if not. */
+static bool owns(struct at_broker *broker, int c, int connid)
+{
+    if (connid < 0 || connid >= AT_BROKER_SOCKETS) {
+        errno = EINVAL;
+        return false;
+    }
+    if (broker->owner[connid] != c+1) {
+        errno = broker->owner[connid] ? EBUSY : ENOTCONN;
+        return false;
+    }
+    return true;
+}
+
+static bool others_connected(struct at_broker *broker, int c)
+{
+    for (int connid=0; connid<AT_BROKER_SOCKETS; connid++)
+        if (broker->owner[connid] && broker->owner[connid] != c+1)
+            return true;
+    return false;
+}
+
+/* Next NUL-terminated string in the request text, or NULL. */
+static const char *text_next(const struct broker_request *req, size_t *offset)
+{
+    if (*offset >= sizeof(req->text))
+        return NULL;
+    const char *s = req->text + *offset;
+    *offset += strlen(s) + 1;
+    return s;
+}
+
+static int64_t serve(struct at_broker *broker, int c, struct broker_request *req,
+                     struct broker_reply *rep)
+{
+    struct cellular *modem = broker->modem;
+    const struct cellular_ops *ops = modem->ops;
+    struct broker_shm *shm = broker->clients[c].shm;
+
+    req->text[sizeof(req->text)-1] = '\0';
+    size_t offset = 0;
+
+    if (req->op >= OP_COUNT || !(modem_ops(ops) & (1u << req->op))) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    switch (req->op) {
+        case OP_ATTACH:
+        case OP_DETACH:
+            /* The broker attaches the modem itself. */
+            return 0;
+
+        case OP_PDP_OPEN:
+            return ops->pdp_open(modem, text_next(req, &offset));
+
+        case OP_PDP_CLOSE:
+            if (others_connected(broker, c)) {
+                errno = EBUSY;
+                return -1;
+            }
+            return ops->pdp_close(modem);
+
+        case OP_IMEI:
+        case OP_MEID:
+        case OP_ICCID: {
+            int (*read)(struct cellular *, char *, size_t) =
+                req->op == OP_IMEI ? ops->imei : req->op == OP_MEID ? ops->meid : ops->iccid;
+            /* Room for the answer and its NUL, as the client asked. */
+            if (req->len == 0) {
+                errno = EINVAL;
+                return -1;
+            }
+            size_t len = req->len < sizeof(rep->text) ? req->len : sizeof(rep->text);
+            return read(modem, rep->text, len);
+        }
+
+        case OP_CREG:
+            return ops->creg(modem);
+
+        case OP_RSSI:
+            return ops->rssi(modem);
+
+        case OP_SOCKET_CONNECT: {
+            if (req->connid < 0 || req->connid >= AT_BROKER_SOCKETS) {
+                errno = EINVAL;
+                return -1;
+            }
+            if (broker->owner[req->connid] && broker->owner[req->connid] != c+1) {
+                errno = EBUSY;
+                return -1;
+            }
+            broker->owner[req->connid] = c+1;
+            int result = ops->socket_connect(modem, req->connid, text_next(req, &offset), req->port);
+            if (result != 0)
+                broker->owner[req->connid] = 0;
+            return result;
+        }
+
+        case OP_SOCKET_SEND: {
+            uint8_t *data = ring_payload(&shm->tx, req->pos, req->len);
+            if (!data) {
+                ring_discard(&shm->tx);
+                errno = EINVAL;
+                return -1;
+            }
+            ssize_t result = -1;
+            if (owns(broker, c, req->connid))
+                result = ops->socket_send(modem, req->connid, data, req->len, req->flags);
+            ring_consume(&shm->tx, req->pos + req->len);
+            return result;
+        }
+
+        case OP_SOCKET_RECV: {
+            if (!owns(broker, c, req->connid))
+                return -1;
+            uint64_t len = req->len;
+            uint8_t *data = ring_reserve(&shm->rx, &len, &rep->pos);
+            ssize_t result = ops->socket_recv(modem, req->connid, data, len, req->flags);
+            rep->len = result > 0 ? result : 0;
+            ring_publish(&shm->rx, rep->pos + rep->len);
+            return result;
+        }
+
+        case OP_SOCKET_WAITACK:
+            if (!owns(broker, c, req->connid))
+                return -1;
+            return ops->socket_waitack(modem, req->connid);
+
+        case OP_SOCKET_CLOSE: {
+            if (!owns(broker, c, req->connid))
+                return -1;
+            int result = ops->socket_close(modem, req->connid);
+            broker->owner[req->connid] = 0;
+            return result;
+        }
+
+        case OP_FTP_OPEN: {
+            if (broker->ftp_owner && broker->ftp_owner != c+1) {
+                errno = EBUSY;
+                return -1;
+            }
+            const char *host = text_next(req, &offset);
+            const char *username = text_next(req, &offset);
+            const char *password = text_next(req, &offset);
+            if (!host || !username || !password) {
+                errno = EINVAL;
+                return -1;
+            }
+            int result = ops->ftp_open(modem, host, req->port, username, password, req->passive);
+            if (result == 0)
+                broker->ftp_owner = c+1;
+            return result;
+        }
+
+        case OP_FTP_GET:
+        case OP_FTP_GETDATA:
+        case OP_FTP_CLOSE: {
+            if (broker->ftp_owner != c+1) {
+                errno = broker->ftp_owner ? EBUSY : ENOTCONN;
+                return -1;
+            }
+            if (req->op == OP_FTP_GET)
+                return ops->ftp_get(modem, text_next(req, &offset));
+            if (req->op == OP_FTP_CLOSE) {
+                broker->ftp_owner = 0;
+                return ops->ftp_close(modem);
+            }
+            uint64_t len = req->len;
+            char *data = (char *) ring_reserve(&shm->rx, &len, &rep->pos);
+            int result = ops->ftp_getdata(modem, data, len);
+            rep->len = result > 0 ? result : 0;
+            ring_publish(&shm->rx, rep->pos + rep->len);
+            return result;
+        }
+
+        case OP_LOCATE:
+            return ops->locate(modem, &rep->location[0], &rep->location[1], &rep->location[2]);
+    }
+
+    errno = ENOTSUP;
+    return -1;
+}
+
+/* Whether the modem's status queries have a port of their own. */
+static bool control_port(struct at_broker *broker)
+{
+    return cellular_port(broker->modem, CELLULAR_PORT_CONTROL) != broker->modem->at;
+}
+
+/* Whether an op may run alongside others, without taking turns. */
+static bool concurrent(struct at_broker *broker, uint32_t op)
+{
+    switch (op) {
+        case OP_ATTACH:
+        case OP_DETACH:
+            return true;
+        case OP_IMEI:
+        case OP_MEID:
+        case OP_ICCID:
+        case OP_CREG:
+        case OP_RSSI:
+            return control_port(broker);
+        default:
+            return false;
+    }
+}
+
+/* Handle one request from a client; false if it's gone. */
+static bool serve_client(struct at_broker *broker, int c)
+{
+    struct broker_request req;
+    ssize_t got;
+    do
+        got = recv(broker->clients[c].fd, &req, sizeof(req), 0);
+    while (got == -1 && errno == EINTR);
+    if (got != sizeof(req))
+        return false;
+
+    __atomic_add_fetch(&broker->requests, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&broker->serving, 1, __ATOMIC_RELAXED);
+    bool turn = !concurrent(broker, req.op);
+    if (turn)
+        pthread_mutex_lock(&broker->modem_lock);
+
+    struct broker_reply rep;
+    memset(&rep, 0, sizeof(rep));
+    errno = 0;
+    rep.result = serve(broker, c, &req, &rep);
+    rep.error = rep.result < 0 ? errno : 0;
+
+    if (turn)
+        pthread_mutex_unlock(&broker->modem_lock);
+    __atomic_sub_fetch(&broker->serving, 1, __ATOMIC_RELAXED);
+
+    return send(broker->clients[c].fd, &rep, sizeof(rep), MSG_NOSIGNAL) == sizeof(rep);
+}
+
+static void *client_worker(void *arg)
+{
+    struct broker_client *client = arg;
+    struct at_broker *broker = client->broker;
+    int c = client - broker->clients;
+
+    while (serve_client(broker, c))
+        ;
+    drop_client(broker, c);
+
+    pthread_mutex_lock(&broker->lock);
+    client->done = true;
+    pthread_mutex_unlock(&broker->lock);
+    return NULL;
+}
+
+/* Nobody's asking; get cached status fresh for when they do. On a single
+ * port, that waits for a moment between ops. */
+static void refresh_status(struct at_broker *broker)
+{
+    if (control_port(broker)) {
+        cellular_refresh_status(broker->modem);
+    } else if (pthread_mutex_trylock(&broker->modem_lock) == 0) {
+        cellular_refresh_status(broker->modem);
+        pthread_mutex_unlock(&broker->modem_lock);
+    }
+}
+
+int at_broker_run(struct at_broker *broker)
+{
+    unsigned long seen = 0;
+    for (;;) {
+        struct pollfd pfds[2] = {
+            { .fd = broker->wakeup, .events = POLLIN },
+            { .fd = broker->listener, .events = POLLIN },
+        };
+        int ready = poll(pfds, 2, AT_BROKER_REFRESH_MS);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ready == 0) {
+            /* Refresh only after a whole quiet period. */
+            unsigned long requests = __atomic_load_n(&broker->requests, __ATOMIC_RELAXED);
+            if (requests == seen && !__atomic_load_n(&broker->serving, __ATOMIC_RELAXED))
+                refresh_status(broker);
+            seen = requests;
+            continue;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            uint64_t value;
+            if (read(broker->wakeup, &value, sizeof(value)) == sizeof(value))
+                return 0;
+        }
+        if (pfds[1].revents & POLLIN)
+            accept_client(broker);
+    }
+}
+
+void at_broker_stop(struct at_broker *broker)
+{
+    uint64_t one = 1;
+    (void) !write(broker->wakeup, &one, sizeof(one));
+}
+
+void at_broker_free(struct at_broker *broker)
+{
+    /* Hang up on the clients; their workers drop them and finish. */
+    pthread_mutex_lock(&broker->lock);
+    for (int c=0; c<AT_BROKER_CLIENTS; c++)
+        if (broker->clients[c].fd != -1)
+            shutdown(broker->clients[c].fd, SHUT_RDWR);
+    pthread_mutex_unlock(&broker->lock);
+    for (int c=0; c<AT_BROKER_CLIENTS; c++) {
+        struct broker_client *client = &broker->clients[c];
+        if (client->fd != -1) {
+            pthread_join(client->thread, NULL);
+            close(client->fd);
+        }
+    }
+
+    pthread_mutex_destroy(&broker->modem_lock);
+    pthread_mutex_destroy(&broker->lock);
+    close(broker->listener);
+    close(broker->wakeup);
+    unlink(broker->addr.sun_path);
+    free(broker);
+}
+
+/*
+ * Client side.
+ */
+
+struct cellular_broker {
+    struct cellular dev;
+    struct cellular_ops ops;    /**< The modem's ops, forwarded. */
+    int fd;
+    struct broker_shm *shm;
+    pthread_mutex_t mutex;      /**< One op at a time. */
+    uint8_t *reserved;          /**< From cellular_broker_buffer(). */
+    uint64_t reserved_pos;
+    uint64_t reserved_len;
+};
+
+/* Send a request and wait for the answer. Called with the mutex held. */
+static int64_t call(struct cellular_broker *client, struct broker_request *req, struct broker_reply *rep)
+{
+    if (send(client->fd, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req))
+        return -1;
+    ssize_t got;
+    do
+        got = recv(client->fd, rep, sizeof(*rep), 0);
+    while (got == -1 && errno == EINTR);
+    if (got != sizeof(*rep)) {
+        if (got >= 0)
+            errno = ECONNRESET;
+        return -1;
+    }
+    if (rep->result < 0)
+        errno = rep->error;
+    return rep->result;
+}
+
+/* Pack strings into the request text; false if they don't fit. */
+static bool text_pack(struct broker_request *req, const char *const *strings, int count)
+{
+    size_t offset = 0;
+    for (int i=0; i<count; i++) {
+        size_t len = strlen(strings[i]) + 1;
+        if (offset + len > sizeof(req->text)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        memcpy(req->text + offset, strings[i], len);
+        offset += len;
+    }
+    return true;
+}
+
+static int64_t simple_call(struct cellular *modem, enum broker_op op, int connid)
+{
+    struct cellular_broker *client = (struct cellular_broker *) modem;
+    struct broker_request req = { .op = op, .connid = connid };
+    struct broker_reply rep;
+
+    pthread_mutex_lock(&client->mutex);
+    int64_t result = call(client, &req, &rep);
+    pthread_mutex_unlock(&client->mutex);
+    return result;
+}
+
+static int64_t text_call(struct cellular *modem, struct broker_request *req,
+                         const char *const *strings, int count)
+{
+    struct cellular_broker *client = (struct cellular_broker *) modem;
+    struct broker_reply rep;
+
+    if (!text_pack(req, strings, count))
+        return -1;
+    pthread_mutex_lock(&client->mutex);
+    int64_t result = call(client, req, &rep);
+    pthread_mutex_unlock(&client->mutex);
+    return result;
+}
+
+static int client_attach(struct cellular *modem)
+{
+    return simple_call(modem, OP_ATTACH, 0);
+}
+
+static int client_detach(struct cellular *modem)
+{
+    return simple_call(modem, OP_DETACH, 0);
+}
+
+static int client_pdp_open(struct cellular *modem, const char *apn)
+{
+    struct broker_request req = { .op = OP_PDP_OPEN };
+    return text_call(modem, &req, &apn, 1);
+}
+
+static int client_pdp_close(struct cellular *modem)
+{
+    return simple_call(modem, OP_PDP_CLOSE, 0);
+}
+
+static int read_text(struct cellular *modem, enum broker_op op, char *buf, size_t len)
+{
+    struct cellular_broker *client = (struct cellular_broker *) modem;
+    struct broker_request req = { .op = op, .len = len };
+    struct broker_reply rep;
+
+    pthread_mutex_lock(&client->mutex);
+    int64_t result = call(client, &req, &rep);
+    pthread_mutex_unlock(&client->mutex);
+    if (result >= 0 && len > 0)
+        snprintf(buf, len, "%.*s", (int) sizeof(rep.text), rep.text);
+    return result;
+}
+
+static int client_imei(struct cellular *modem, char *buf, size_t len)
+{
+    return read_text(modem, OP_IMEI, buf, len);
+}
+
+static int client_meid(struct cellular *modem, char *buf, size_t len)
+{
+    return read_text(modem, OP_MEID, buf, len);
+}
+
+static int client_iccid(struct cellular *modem, char *buf, size_t len)
+{
+    return read_text(modem, OP_ICCID, buf, len);
+}
+
+static int client_creg(struct cellular *modem)
+{
+    return simple_call(modem, OP_CREG, 0);
+}
+
+static int client_rssi(struct cellular *modem)
+{
+    return simple_call(modem, OP_RSSI, 0);
+}
+
+static int client_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    struct broker_request req = { .op = OP_SOCKET_CONNECT, .connid = connid, .port = port };
+    return text_call(modem, &req, &host, 1);
+}
+
+static ssize_t client_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
+{
+    struct cellular_broker *client = (struct cellular_broker *) modem;
+    struct broker_request req = { .op = OP_SOCKET_SEND, .connid = connid, .flags = flags };
+    struct broker_reply rep;
+
+    pthread_mutex_lock(&client->mutex);
+    const uint8_t *data = buffer;
+    if (client->reserved && data >= client->reserved &&
+        data + amount <= client->reserved + client->reserved_len) {
+        /* Built in place with cellular_broker_buffer(). */
+        req.pos = client->reserved_pos + (data - client->reserved);
+        req.len = amount;
+    } else {
+        req.len = amount;
+        uint8_t *room = ring_reserve(&client->shm->tx, &req.len, &req.pos);
+        memcpy(room, buffer, req.len);
+    }
+    client->reserved = NULL;
+    ring_publish(&client->shm->tx, req.pos + req.len);
+    ssize_t result = call(client, &req, &rep);
+    pthread_mutex_unlock(&client->mutex);
+    return result;
+}
+
+static ssize_t client_socket_recv(struct cellular *modem, int connid, void *buffer, size_t length, int flags)
+{
+    struct cellular_broker *client = (struct cellular_broker *) modem;
+    struct broker_request req = { .op = OP_SOCKET_RECV, .connid = connid, .flags = flags, .len = length };
+    struct broker_reply rep;
+
+    pthread_mutex_lock(&client->mutex);
+    ssize_t result = call(client, &req, &rep);
+    if (rep.len) {
+        uint8_t *data = ring_payload(&client->shm->rx, rep.pos, rep.len);
+        if (data && rep.len <= length) {
+            memcpy(buffer, data, rep.len);
+            ring_consume(&client->shm->rx, rep.pos + rep.len);
+        } else {
+            ring_discard(&client->shm->rx);
+            errno = EPROTO;
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return result;
+}
+
+static int client_socket_waitack(struct cellular *modem, int connid)
+{
+    return simple_call(modem, OP_SOCKET_WAITACK, connid);
+}
+
+static int client_socket_close(struct cellular *modem, int connid)
+{
+    return simple_call(modem, OP_SOCKET_CLOSE, connid);
+}
+
+static int client_ftp_open(struct cellular *modem, const char *host, uint16_t port,
+                           const char *username, const char *password, bool passive)
+{
+    struct broker_request req = { .op = OP_FTP_OPEN, .port = port, .passive = passive };
+    const char *strings[] = { host, username, password };
+    return text_call(modem, &req, strings, 3);
+}
+
+static int client_ftp_get(struct cellular *modem, const char *filename)
+{
+    struct broker_request req = { .op = OP_FTP_GET };
+    return text_call(modem, &req, &filename, 1);
+}
+
+static int client_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
+{
+    struct cellular_broker *client = (struct cellular_broker *) modem;
+    struct broker_request req = { .op = OP_FTP_GETDATA, .len = length };
+    struct broker_reply rep;
+
+    pthread_mutex_lock(&client->mutex);
+    int result = call(client, &req, &rep);
+    if (rep.len) {
+        uint8_t *data = ring_payload(&client->shm->rx, rep.pos, rep.len);
+        if (data && rep.len <= length) {
+            memcpy(buffer, data, rep.len);
+            ring_consume(&client->shm->rx, rep.pos + rep.len);
+        } else {
+            ring_discard(&client->shm->rx);
+            errno = EPROTO;
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return result;
+}
+
+static int client_ftp_close(struct cellular *modem)
+{
+    return simple_call(modem, OP_FTP_CLOSE, 0);
+}
+
+static int client_locate(struct cellular *modem, float *latitude, float *longitude, float *altitude)
+{
+    struct cellular_broker *client = (struct cellular_broker *) modem;
+    struct broker_request req = { .op = OP_LOCATE };
+    struct broker_reply rep;
+
+    pthread_mutex_lock(&client->mutex);
+    int result = call(client, &req, &rep);
+    pthread_mutex_unlock(&client->mutex);
+    if (result == 0) {
+        *latitude = rep.location[0];
+        *longitude = rep.location[1];
+        *altitude = rep.location[2];
+    }
+    return result;
+}
+
+static const struct cellular_ops client_ops = {
+    .attach = client_attach,
+    .detach = client_detach,
+    .pdp_open = client_pdp_open,
+    .pdp_close = client_pdp_close,
+    .imei = client_imei,
+    .meid = client_meid,
+    .iccid = client_iccid,
+    .creg = client_creg,
+    .rssi = client_rssi,
+    .socket_connect = client_socket_connect,
+    .socket_send = client_socket_send,
+    .socket_recv = client_socket_recv,
+    .socket_waitack = client_socket_waitack,
+    .socket_close = client_socket_close,
+    .ftp_open = client_ftp_open,
+    .ftp_get = client_ftp_get,
+    .ftp_getdata = client_ftp_getdata,
+    .ftp_close = client_ftp_close,
+    .locate = client_locate,
+};
+
+/* Keep only the ops the broker's modem has. */
+static void client_set_ops(struct cellular_ops *ops, uint32_t mask)
+{
+    *ops = client_ops;
+    void **const table[OP_COUNT] = {
+        [OP_PDP_OPEN] = (void **) &ops->pdp_open,
+        [OP_PDP_CLOSE] = (void **) &ops->pdp_close,
+        [OP_IMEI] = (void **) &ops->imei,
+        [OP_MEID] = (void **) &ops->meid,
+        [OP_ICCID] = (void **) &ops->iccid,
+        [OP_CREG] = (void **) &ops->creg,
+        [OP_RSSI] = (void **) &ops->rssi,
+        [OP_SOCKET_CONNECT] = (void **) &ops->socket_connect,
+        [OP_SOCKET_SEND] = (void **) &ops->socket_send,
+        [OP_SOCKET_RECV] = (void **) &ops->socket_recv,
+        [OP_SOCKET_WAITACK] = (void **) &ops->socket_waitack,
+        [OP_SOCKET_CLOSE] = (void **) &ops->socket_close,
+        [OP_FTP_OPEN] = (void **) &ops->ftp_open,
+        [OP_FTP_GET] = (void **) &ops->ftp_get,
+        [OP_FTP_GETDATA] = (void **) &ops->ftp_getdata,
+        [OP_FTP_CLOSE] = (void **) &ops->ftp_close,
+        [OP_LOCATE] = (void **) &ops->locate,
+    };
+    for (int op=0; op<OP_COUNT; op++)
+        if (table[op] && !(mask & (1u << op)))
+            *table[op] = NULL;
+}
+
+struct cellular *cellular_broker_alloc(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct cellular_broker *client = malloc(sizeof(struct cellular_broker));
+    if (!client) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(client, 0, sizeof(*client));
+
+    client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (client->fd == -1)
+        goto fail;
+    if (connect(client->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        goto fail;
+
+    /* The broker answers with its ops and the shared memory. */
+    struct broker_hello hello;
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t got;
+    do
+        got = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+    while (got == -1 && errno == EINTR);
+    struct cmsghdr *cmsg = got == sizeof(hello) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || hello.magic != BROKER_MAGIC ||
+        hello.version != BROKER_VERSION) {
+        /* Turned away: too many clients, or not a broker. */
+        errno = ECONNREFUSED;
+        goto fail;
+    }
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    void *shm = mmap(NULL, sizeof(struct broker_shm), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (shm == MAP_FAILED)
+        goto fail;
+
+    client->shm = shm;
+    pthread_mutex_init(&client->mutex, NULL);
+    client_set_ops(&client->ops, hello.ops);
+    client->dev.ops = &client->ops;
+
+    return (struct cellular *) client;
+
+fail:;
+    int error = errno;
+    if (client->fd != -1)
+        close(client->fd);
+    free(client);
+    errno = error;
+    return NULL;
+}
+
+void cellular_broker_free(struct cellular *modem)
+{
+    struct cellular_broker *client = (struct cellular_broker *) modem;
+
+    munmap(client->shm, sizeof(struct broker_shm));
+    close(client->fd);
+    pthread_mutex_destroy(&client->mutex);
+    free(client);
+}
+
+void *cellular_broker_buffer(struct cellular *modem, size_t *size)
+{
+    struct cellular_broker *client = (struct cellular_broker *) modem;
+
+    pthread_mutex_lock(&client->mutex);
+    client->reserved_len = AT_BROKER_RING_SIZE;
+    client->reserved = ring_reserve(&client->shm->tx, &client->reserved_len, &client->reserved_pos);
+    *size = client->reserved_len;
+    pthread_mutex_unlock(&client->mutex);
+    return client->reserved;
+}
+
+/* vim: set ts=4 sw=4 et: */
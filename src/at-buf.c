@@ -0,0 +1,130 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/at-buf.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct at_buf_pool {
+    struct at_buf *free;    /**< Free list; pushed by anyone, popped by one. */
+    size_t size;
+    size_t count;           /**< Buffers allocated. Atomic. */
+    unsigned refs;          /**< Owner plus buffers in use. Atomic. */
+};
+
+static struct at_buf *buf_new(struct at_buf_pool *pool)
+{
+    struct at_buf *buf = malloc(sizeof(struct at_buf) + pool->size);
+    if (!buf)
+        return NULL;
+    buf->pool = pool;
+    __atomic_add_fetch(&pool->count, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+static void buf_push(struct at_buf_pool *pool, struct at_buf *buf)
+{
+    buf->next = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pool->free, &buf->next, buf, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+static struct at_buf *buf_pop(struct at_buf_pool *pool)
+{
+    /* Only one thread pops, so a buffer can't leave and come back between
+     * loading the head and swapping it out: its next link is stable. */
+    struct at_buf *buf = __atomic_load_n(&pool->free, __ATOMIC_ACQUIRE);
+    while (buf && !__atomic_compare_exchange_n(&pool->free, &buf, buf->next, true,
+                                               __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        ;
+    return buf;
+}
+
+static void pool_unref(struct at_buf_pool *pool)
+{
+    if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    struct at_buf *buf;
+    while ((buf = buf_pop(pool)))
+        free(buf);
+    free(pool);
+}
+
+struct at_buf_pool *at_buf_pool_alloc(size_t size, size_t count)
+{
+    struct at_buf_pool *pool = calloc(1, sizeof(struct at_buf_pool));
+    if (!pool)
+        return NULL;
+    pool->size = size;
+    pool->refs = 1;
+
+    for (size_t i=0; i<count; i++) {
+        struct at_buf *buf = buf_new(pool);
+        if (!buf) {
+            pool_unref(pool);
+            return NULL;
+        }
+        buf_push(pool, buf);
+    }
+
+    return pool;
+}
+
+struct at_buf *at_buf_acquire(struct at_buf_pool *pool)
+{
+    struct at_buf *buf = buf_pop(pool);
+    if (!buf)
+        buf = buf_new(pool);
+    if (!buf)
+        return NULL;
+
+    __atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+    buf->refs = 1;
+    buf->len = 0;
+    buf->data[0] = '\0';
+    return buf;
+}
+
+size_t at_buf_pool_size(struct at_buf_pool *pool)
+{
+    return pool->size;
+}
+
+size_t at_buf_pool_count(struct at_buf_pool *pool)
+{
+    return __atomic_load_n(&pool->count, __ATOMIC_RELAXED);
+}
+
+void at_buf_pool_free(struct at_buf_pool *pool)
+{
+    pool_unref(pool);
+}
+
+struct at_buf *at_buf_ref(struct at_buf *buf)
+{
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void at_buf_release(struct at_buf *buf)
+{
+    if (!buf)
+        return;
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    /* Push before dropping the pool reference, which may free the pool. */
+    struct at_buf_pool *pool = buf->pool;
+    buf_push(pool, buf);
+    pool_unref(pool);
+}
+
+/* vim: set ts=4 sw=4 et: */
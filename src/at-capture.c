@@ -0,0 +1,466 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <attentive/at-capture.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#define printf(...)
+
+#define CAPTURE_MAGIC           "ATCAP"
+#define CAPTURE_HEADER_SIZE     16
+#define CAPTURE_RECORD_SIZE     8
+#define CAPTURE_MAX_PAYLOAD     0xffff
+#define CAPTURE_MERGE_NS        1000000
+#define CAPTURE_BUFFER_SIZE     4096
+
+/* How long to wait for the stack to send the bytes of a TX record. */
+#define REPLAY_TX_TIMEOUT_MS    5000
+/* Upper bound for a single blocking step, so at_replay_close() is honoured. */
+#define REPLAY_SLICE_MS         100
+
+struct at_capture {
+    int fd;
+    int error;                  /**< First write error, if any. */
+    pthread_mutex_t mutex;      /**< Protects everything below. */
+
+    uint64_t last;              /**< Monotonic time of the previous record. */
+    uint64_t last_byte;         /**< Monotonic time of the last appended byte. */
+    bool record_open;           /**< Last record in buf may be extended. */
+    size_t record;              /**< Offset of the open record in buf. */
+    enum at_capture_direction direction;
+
+    size_t used;
+    uint8_t buf[CAPTURE_BUFFER_SIZE];
+};
+
+struct at_replay {
+    const uint8_t *map;
+    size_t size;
+    enum at_replay_mode mode;
+
+    int master;                 /**< Pseudo-terminal master; we are the modem. */
+    char devpath[64];
+
+    pthread_t thread;
+    bool started;
+    volatile bool stop;
+    struct at_replay_stats stats;
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void put_le(uint8_t *p, uint64_t value, int bytes)
+{
+    for (int i=0; i<bytes; i++)
+        p[i] = (uint8_t) (value >> (8*i));
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i=bytes-1; i>=0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t result = write(fd, p, len);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += result;
+        len -= result;
+    }
+    return 0;
+}
+
+/**
+ * Write out the buffer. Called with the mutex held.
+ */
+static void capture_drain(struct at_capture *cap)
+{
+    if (cap->used && !cap->error && write_all(cap->fd, cap->buf, cap->used) == -1)
+        cap->error = errno;
+
+    cap->used = 0;
+    cap->record_open = false;
+}
+
+struct at_capture *at_capture_open(const char *path)
+{
+    struct at_capture *cap = malloc(sizeof(struct at_capture));
+    if (!cap) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(cap, 0, sizeof(struct at_capture));
+
+    cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (cap->fd == -1) {
+        free(cap);
+        return NULL;
+    }
+
+    /* Write the file header. */
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memcpy(cap->buf, CAPTURE_MAGIC, 6);
+    put_le(cap->buf + 6, AT_CAPTURE_VERSION, 2);
+    put_le(cap->buf + 8, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec, 8);
+    cap->used = CAPTURE_HEADER_SIZE;
+    cap->last = monotonic_ns();
+
+    pthread_mutex_init(&cap->mutex, NULL);
+
+    return cap;
+}
+
+void at_capture_write(struct at_capture *cap, enum at_capture_direction direction,
+                      const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t now = monotonic_ns();
+
+    pthread_mutex_lock(&cap->mutex);
+
+    while (len > 0) {
+        /* Extend the open record if it's a continuation of the same burst. */
+        if (cap->record_open && cap->direction == direction &&
+            now - cap->last_byte < CAPTURE_MERGE_NS)
+        {
+            size_t current = get_le(cap->buf + cap->record + 4, 2);
+            size_t amount = len;
+            if (amount > CAPTURE_MAX_PAYLOAD - current)
+                amount = CAPTURE_MAX_PAYLOAD - current;
+            if (amount > sizeof(cap->buf) - cap->used)
+                amount = sizeof(cap->buf) - cap->used;
+
+            if (amount > 0) {
+                memcpy(cap->buf + cap->used, p, amount);
+                cap->used += amount;
+                put_le(cap->buf + cap->record + 4, current + amount, 2);
+                cap->last_byte = now;
+                p += amount;
+                len -= amount;
+                continue;
+            }
+        }
+
+        /* Make room for a new record header and at least one byte. */
+        if (sizeof(cap->buf) - cap->used < CAPTURE_RECORD_SIZE + 1)
+            capture_drain(cap);
+
+        /* Accumulate rounded deltas so the timeline doesn't drift. */
+        uint64_t delta = (now - cap->last) / 1000;
+        if (delta > UINT32_MAX)
+            delta = UINT32_MAX;
+        cap->last += delta * 1000;
+
+        uint8_t *header = cap->buf + cap->used;
+        put_le(header, delta, 4);
+        put_le(header + 4, 0, 2);
+        header[6] = (uint8_t) direction;
+        header[7] = 0;
+
+        cap->record = cap->used;
+        cap->used += CAPTURE_RECORD_SIZE;
+        cap->record_open = true;
+        cap->direction = direction;
+        cap->last_byte = now;
+    }
+
+    pthread_mutex_unlock(&cap->mutex);
+}
+
+int at_capture_flush(struct at_capture *cap)
+{
+    pthread_mutex_lock(&cap->mutex);
+    capture_drain(cap);
+    int error = cap->error;
+    pthread_mutex_unlock(&cap->mutex);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int at_capture_close(struct at_capture *cap)
+{
+    int result = at_capture_flush(cap);
+    int why = errno;
+
+    if (close(cap->fd) == -1 && result == 0) {
+        result = -1;
+        why = errno;
+    }
+    pthread_mutex_destroy(&cap->mutex);
+    free(cap);
+
+    errno = why;
+    return result;
+}
+
+
+/**
+ * Read exactly len bytes from the stack, giving up after timeout_ms.
+ *
+ * @returns Number of bytes actually read.
+ */
+static size_t replay_read(struct at_replay *replay, uint8_t *buf, size_t len, int timeout_ms)
+{
+    size_t got = 0;
+
+    while (got < len && timeout_ms > 0 && !replay->stop) {
+        int slice = timeout_ms < REPLAY_SLICE_MS ? timeout_ms : REPLAY_SLICE_MS;
+        struct pollfd pfd = { .fd = replay->master, .events = POLLIN };
+
+        int result = poll(&pfd, 1, slice);
+        if (result == 0) {
+            timeout_ms -= slice;
+            continue;
+        }
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        ssize_t amount = read(replay->master, buf + got, len - got);
+        if (amount <= 0) {
+            /* EIO means the slave side is closed; wait for a reopen. */
+            if (amount == -1 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            if (amount == -1 && errno == EIO) {
+                usleep(REPLAY_SLICE_MS * 1000);
+                timeout_ms -= REPLAY_SLICE_MS;
+                continue;
+            }
+            break;
+        }
+        got += amount;
+    }
+
+    return got;
+}
+
+/**
+ * Sleep until the given monotonic time, in slices.
+ */
+static void replay_sleep_until(struct at_replay *replay, uint64_t deadline)
+{
+    while (!replay->stop) {
+        uint64_t now = monotonic_ns();
+        if (now >= deadline)
+            break;
+
+        uint64_t slice = deadline - now;
+        if (slice > (uint64_t) REPLAY_SLICE_MS * 1000000)
+            slice = (uint64_t) REPLAY_SLICE_MS * 1000000;
+        struct timespec ts = {
+            .tv_sec = slice / 1000000000,
+            .tv_nsec = slice % 1000000000,
+        };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void *replay_thread(void *arg)
+{
+    struct at_replay *replay = arg;
+    struct at_replay_stats *stats = &replay->stats;
+
+    uint8_t *scratch = malloc(CAPTURE_MAX_PAYLOAD);
+    if (!scratch)
+        return NULL;
+
+    uint64_t base = monotonic_ns();
+    uint64_t offset_us = 0;
+    size_t pos = CAPTURE_HEADER_SIZE;
+
+    while (!replay->stop && pos + CAPTURE_RECORD_SIZE <= replay->size) {
+        const uint8_t *header = replay->map + pos;
+        uint32_t delta = get_le(header, 4);
+        size_t len = get_le(header + 4, 2);
+        enum at_capture_direction direction = header[6];
+        const uint8_t *payload = header + CAPTURE_RECORD_SIZE;
+
+        /* Tolerate a truncated tail; the recorder may have been killed. */
+        if (pos + CAPTURE_RECORD_SIZE + len > replay->size)
+            break;
+
+        offset_us += delta;
+
+        if (direction == AT_CAPTURE_RX) {
+            /* Modem output: feed it to the stack. */
+            if (replay->mode == AT_REPLAY_REALTIME)
+                replay_sleep_until(replay, base + offset_us * 1000);
+            if (write_all(replay->master, payload, len) == -1)
+                break;
+            stats->rx_bytes += len;
+        } else {
+            /* Host output: make sure the stack sent exactly what was captured. */
+            size_t got = replay_read(replay, scratch, len, REPLAY_TX_TIMEOUT_MS);
+            stats->tx_bytes += got;
+            if (got != len || memcmp(scratch, payload, len)) {
+                printf("at_replay: divergence at offset %zu: expected '%.*s', got '%.*s'\n",
+                        pos, (int) len, payload, (int) got, scratch);
+                if (stats->divergences++ == 0)
+                    stats->first_divergence = pos;
+            }
+        }
+
+        stats->records++;
+        pos += CAPTURE_RECORD_SIZE + len;
+    }
+
+    free(scratch);
+    return NULL;
+}
+
+struct at_replay *at_replay_open(const char *path, enum at_replay_mode mode)
+{
+    struct at_replay *replay = malloc(sizeof(struct at_replay));
+    if (!replay) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(replay, 0, sizeof(struct at_replay));
+    replay->mode = mode;
+    replay->master = -1;
+
+    /* Map the capture. */
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        goto fail;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        goto fail;
+    }
+    if (st.st_size < CAPTURE_HEADER_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        goto fail;
+    }
+    replay->size = st.st_size;
+    void *map = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        goto fail;
+    replay->map = map;
+    madvise(map, replay->size, MADV_SEQUENTIAL);
+
+    /* Validate the header. */
+    if (memcmp(replay->map, CAPTURE_MAGIC, 6) ||
+        get_le(replay->map + 6, 2) != AT_CAPTURE_VERSION)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    /* Create the fake modem port. */
+    replay->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (replay->master == -1)
+        goto fail;
+    if (grantpt(replay->master) == -1 || unlockpt(replay->master) == -1)
+        goto fail;
+    if (ptsname_r(replay->master, replay->devpath, sizeof(replay->devpath)) != 0)
+        goto fail;
+
+    /* No echo, no newline translation: behave like a serial line. */
+    struct termios attr;
+    if (tcgetattr(replay->master, &attr) == -1)
+        goto fail;
+    cfmakeraw(&attr);
+    if (tcsetattr(replay->master, TCSANOW, &attr) == -1)
+        goto fail;
+
+    return replay;
+
+fail:
+    {
+        int why = errno;
+        at_replay_close(replay);
+        errno = why;
+    }
+    return NULL;
+}
+
+const char *at_replay_devpath(struct at_replay *replay)
+{
+    return replay->devpath;
+}
+
+int at_replay_start(struct at_replay *replay)
+{
+    if (replay->started) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    int result = pthread_create(&replay->thread, NULL, replay_thread, replay);
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+    replay->started = true;
+
+    return 0;
+}
+
+int at_replay_wait(struct at_replay *replay, struct at_replay_stats *stats)
+{
+    if (replay->started) {
+        pthread_join(replay->thread, NULL);
+        replay->started = false;
+    }
+
+    if (stats)
+        *stats = replay->stats;
+
+    return replay->stats.divergences ? -1 : 0;
+}
+
+void at_replay_close(struct at_replay *replay)
+{
+    replay->stop = true;
+    at_replay_wait(replay, NULL);
+
+    if (replay->master != -1)
+        close(replay->master);
+    if (replay->map)
+        munmap((void *) replay->map, replay->size);
+    free(replay);
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,159 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <attentive/at-clock.h>
+#include <attentive/at-stats.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/time.h>
+
+/* How often waiters on a virtual clock look at it. */
+#define AT_CLOCK_POLL_MS    1
+
+/* A thread in at_clock_wait(); lives on its stack. */
+struct at_clock_waiter {
+    struct at_clock_waiter *next;
+    uint64_t until;
+    pthread_cond_t *cond;
+};
+
+struct at_clock {
+    pthread_mutex_t mutex;  /**< Protects the fields below. */
+    uint64_t now;           /**< Virtual time. Atomic. */
+    int idle_ms;
+    uint64_t active;        /**< Real time of the last wakeup or advance. */
+    struct at_clock_waiter *waiters;
+};
+
+struct at_clock *at_clock_alloc_virtual(int idle_ms)
+{
+    struct at_clock *clock = malloc(sizeof(struct at_clock));
+    if (!clock) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(clock, 0, sizeof(*clock));
+
+    pthread_mutex_init(&clock->mutex, NULL);
+    clock->idle_ms = idle_ms;
+    clock->active = at_stats_clock_ns();
+
+    return clock;
+}
+
+void at_clock_free(struct at_clock *clock)
+{
+    pthread_mutex_destroy(&clock->mutex);
+    free(clock);
+}
+
+uint64_t at_clock_now(struct at_clock *clock)
+{
+    if (!clock)
+        return at_stats_clock_ns();
+    return __atomic_load_n(&clock->now, __ATOMIC_ACQUIRE);
+}
+
+/* Set the time and wake whoever it's come for. Called with the clock
+ * mutex held. */
+static void set_time(struct at_clock *clock, uint64_t now)
+{
+    __atomic_store_n(&clock->now, now, __ATOMIC_RELEASE);
+    clock->active = at_stats_clock_ns();
+    for (struct at_clock_waiter *waiter = clock->waiters; waiter; waiter = waiter->next)
+        if (waiter->until <= now)
+            pthread_cond_broadcast(waiter->cond);
+}
+
+void at_clock_advance(struct at_clock *clock, uint64_t ns)
+{
+    pthread_mutex_lock(&clock->mutex);
+    set_time(clock, at_clock_now(clock) + ns);
+    pthread_mutex_unlock(&clock->mutex);
+}
+
+/* Absolute CLOCK_REALTIME time ns from now, for pthread_cond_timedwait(). */
+static struct timespec *realtime_after(struct timespec *ts, uint64_t ns)
+{
+#if _POSIX_TIMERS > 0
+    clock_gettime(CLOCK_REALTIME, ts);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+#endif
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec += ns % 1000000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+int at_clock_wait(struct at_clock *clock, pthread_cond_t *cond, pthread_mutex_t *mutex,
+                  uint64_t until)
+{
+    if (until == UINT64_MAX)
+        return pthread_cond_wait(cond, mutex);
+
+    uint64_t now = at_clock_now(clock);
+    if (now >= until)
+        return ETIMEDOUT;
+
+    struct timespec ts;
+    if (!clock) {
+        /* The condition times out on the wall clock, which needn't keep pace
+         * with ours; it's only up once ours says so. */
+        int result = pthread_cond_timedwait(cond, mutex, realtime_after(&ts, until - now));
+        if (result == ETIMEDOUT && at_clock_now(clock) < until)
+            return 0;
+        return result;
+    }
+
+    /* Nap for a while, then see where the clock is. */
+    struct at_clock_waiter waiter = { .until = until, .cond = cond };
+    pthread_mutex_lock(&clock->mutex);
+    waiter.next = clock->waiters;
+    clock->waiters = &waiter;
+    pthread_mutex_unlock(&clock->mutex);
+
+    int result = pthread_cond_timedwait(cond, mutex, realtime_after(&ts, AT_CLOCK_POLL_MS * 1000000));
+
+    pthread_mutex_lock(&clock->mutex);
+    uint64_t real = at_stats_clock_ns();
+    if (result != ETIMEDOUT) {
+        clock->active = real;
+    } else if (clock->idle_ms && real - clock->active >= (uint64_t) clock->idle_ms * 1000000) {
+        /* Nothing going on; skip to whatever comes next. */
+        uint64_t next = UINT64_MAX;
+        for (struct at_clock_waiter *w = clock->waiters; w; w = w->next)
+            if (w->until < next)
+                next = w->until;
+        if (next > at_clock_now(clock))
+            set_time(clock, next);
+    }
+    struct at_clock_waiter **p = &clock->waiters;
+    while (*p != &waiter)
+        p = &(*p)->next;
+    *p = waiter.next;
+    pthread_mutex_unlock(&clock->mutex);
+
+    return at_clock_now(clock) >= until ? ETIMEDOUT : 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
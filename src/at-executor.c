@@ -0,0 +1,373 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <attentive/at-executor.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Work items a strand runs before letting other strands have a go. */
+#define AT_EXECUTOR_BATCH 16
+
+struct at_work {
+    struct at_work *next;
+    at_work_fn fn;
+    void *arg;
+    struct at_buf *buf;
+};
+
+struct at_strand {
+    struct at_executor *executor;
+    struct at_strand *prev, *next;  /**< Deque links while runnable. */
+
+    pthread_mutex_t lock;   /**< Protects the queue and the flag. */
+    pthread_cond_t idle;    /**< Signalled when scheduled is cleared. */
+    struct at_work *head, *tail;
+    bool scheduled;         /**< In a deque or running. */
+};
+
+struct at_worker {
+    struct at_executor *executor;
+    pthread_t thread;
+    pthread_mutex_t lock;   /**< Protects the deque. */
+    struct at_strand *front, *back;
+};
+
+struct at_executor {
+    struct at_worker *workers;
+    int nworkers;
+    unsigned next;          /**< Worker for posts from outside. Atomic. */
+    unsigned runnable;      /**< Strands in deques. Atomic. */
+    unsigned sleepers;      /**< Workers waiting for work. Atomic. */
+
+    pthread_mutex_t lock;   /**< For sleeping; protects running. */
+    pthread_cond_t wakeup;
+    bool running;
+
+    pthread_mutex_t pool_lock;
+    struct at_work *pool;   /**< Free work items. */
+
+    struct at_executor_stats stats;
+};
+
+static __thread struct at_worker *current_worker;
+
+/*
+ * Work items.
+ */
+
+static struct at_work *work_alloc(struct at_executor *executor)
+{
+    pthread_mutex_lock(&executor->pool_lock);
+    struct at_work *work = executor->pool;
+    if (work)
+        executor->pool = work->next;
+    pthread_mutex_unlock(&executor->pool_lock);
+
+    if (!work)
+        work = malloc(sizeof(struct at_work));
+    return work;
+}
+
+static void work_free(struct at_executor *executor, struct at_work *work)
+{
+    pthread_mutex_lock(&executor->pool_lock);
+    work->next = executor->pool;
+    executor->pool = work;
+    pthread_mutex_unlock(&executor->pool_lock);
+}
+
+/*
+ * Worker deques. The owner pushes and pops at the back; thieves and
+ * strands that used up their batch come in at the front.
+ */
+
+static void deque_push(struct at_worker *worker, struct at_strand *strand, bool front)
+{
+    struct at_executor *executor = worker->executor;
+
+    pthread_mutex_lock(&worker->lock);
+    if (front) {
+        strand->prev = NULL;
+        strand->next = worker->front;
+        if (worker->front)
+            worker->front->prev = strand;
+        else
+            worker->back = strand;
+        worker->front = strand;
+    } else {
+        strand->next = NULL;
+        strand->prev = worker->back;
+        if (worker->back)
+            worker->back->next = strand;
+        else
+            worker->front = strand;
+        worker->back = strand;
+    }
+    __atomic_add_fetch(&executor->runnable, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&worker->lock);
+
+    /* Pairs with the sleeper check in worker_thread(): either we see the
+     * sleeper, or it sees the runnable count. */
+    if (__atomic_load_n(&executor->sleepers, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&executor->lock);
+        pthread_cond_signal(&executor->wakeup);
+        pthread_mutex_unlock(&executor->lock);
+    }
+}
+
+static struct at_strand *deque_pop(struct at_worker *worker, bool front)
+{
+    pthread_mutex_lock(&worker->lock);
+    struct at_strand *strand = front ? worker->front : worker->back;
+    if (strand) {
+        if (strand->prev)
+            strand->prev->next = strand->next;
+        else
+            worker->front = strand->next;
+        if (strand->next)
+            strand->next->prev = strand->prev;
+        else
+            worker->back = strand->prev;
+        __atomic_sub_fetch(&worker->executor->runnable, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return strand;
+}
+
+static struct at_worker *pick_worker(struct at_executor *executor)
+{
+    /* Work created on a worker stays there while it's hot; posts from
+     * other threads are spread around. */
+    if (current_worker && current_worker->executor == executor)
+        return current_worker;
+    unsigned index = __atomic_fetch_add(&executor->next, 1, __ATOMIC_RELAXED);
+    return &executor->workers[index % executor->nworkers];
+}
+
+/*
+ * Workers.
+ */
+
+static void strand_run(struct at_strand *strand)
+{
+    struct at_executor *executor = strand->executor;
+
+    for (int i=0; i<AT_EXECUTOR_BATCH; i++) {
+        pthread_mutex_lock(&strand->lock);
+        struct at_work *work = strand->head;
+        if (!work) {
+            /* Nothing left; the strand may be freed once we unlock. */
+            strand->scheduled = false;
+            pthread_cond_broadcast(&strand->idle);
+            pthread_mutex_unlock(&strand->lock);
+            return;
+        }
+        strand->head = work->next;
+        if (!strand->head)
+            strand->tail = NULL;
+        pthread_mutex_unlock(&strand->lock);
+
+        work->fn(work->arg, work->buf);
+        at_buf_release(work->buf);
+        work_free(executor, work);
+        __atomic_add_fetch(&executor->stats.executed, 1, __ATOMIC_RELAXED);
+    }
+
+    /* Still scheduled; back of the line. */
+    deque_push(current_worker, strand, true);
+}
+
+static struct at_strand *steal(struct at_worker *self)
+{
+    struct at_executor *executor = self->executor;
+    int index = self - executor->workers;
+
+    for (int i=1; i<executor->nworkers; i++) {
+        struct at_worker *victim = &executor->workers[(index + i) % executor->nworkers];
+        struct at_strand *strand = deque_pop(victim, true);
+        if (strand) {
+            __atomic_add_fetch(&executor->stats.steals, 1, __ATOMIC_RELAXED);
+            return strand;
+        }
+    }
+    return NULL;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct at_worker *self = arg;
+    struct at_executor *executor = self->executor;
+
+    current_worker = self;
+
+    for (;;) {
+        struct at_strand *strand = deque_pop(self, false);
+        if (!strand)
+            strand = steal(self);
+        if (strand) {
+            strand_run(strand);
+            continue;
+        }
+
+        pthread_mutex_lock(&executor->lock);
+        __atomic_add_fetch(&executor->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (executor->running && !__atomic_load_n(&executor->runnable, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&executor->wakeup, &executor->lock);
+        __atomic_sub_fetch(&executor->sleepers, 1, __ATOMIC_SEQ_CST);
+        bool done = !executor->running && !__atomic_load_n(&executor->runnable, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&executor->lock);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Public interface.
+ */
+
+struct at_executor *at_executor_alloc(int threads)
+{
+    if (threads < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct at_executor *executor = calloc(1, sizeof(struct at_executor));
+    if (!executor) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    executor->workers = calloc(threads, sizeof(struct at_worker));
+    if (!executor->workers) {
+        free(executor);
+        errno = ENOMEM;
+        return NULL;
+    }
+    executor->nworkers = threads;
+    executor->running = true;
+    pthread_mutex_init(&executor->lock, NULL);
+    pthread_cond_init(&executor->wakeup, NULL);
+    pthread_mutex_init(&executor->pool_lock, NULL);
+
+    for (int i=0; i<threads; i++) {
+        executor->workers[i].executor = executor;
+        pthread_mutex_init(&executor->workers[i].lock, NULL);
+    }
+    for (int i=0; i<threads; i++) {
+        int error = pthread_create(&executor->workers[i].thread, NULL,
+                                   worker_thread, &executor->workers[i]);
+        if (error) {
+            /* Stop the ones already running. */
+            executor->nworkers = i;
+            at_executor_free(executor);
+            errno = error;
+            return NULL;
+        }
+    }
+
+    return executor;
+}
+
+void at_executor_free(struct at_executor *executor)
+{
+    pthread_mutex_lock(&executor->lock);
+    executor->running = false;
+    pthread_cond_broadcast(&executor->wakeup);
+    pthread_mutex_unlock(&executor->lock);
+
+    for (int i=0; i<executor->nworkers; i++)
+        pthread_join(executor->workers[i].thread, NULL);
+
+    struct at_work *work;
+    while ((work = executor->pool)) {
+        executor->pool = work->next;
+        free(work);
+    }
+
+    for (int i=0; i<executor->nworkers; i++)
+        pthread_mutex_destroy(&executor->workers[i].lock);
+    pthread_mutex_destroy(&executor->pool_lock);
+    pthread_cond_destroy(&executor->wakeup);
+    pthread_mutex_destroy(&executor->lock);
+    free(executor->workers);
+    free(executor);
+}
+
+void at_executor_get_stats(struct at_executor *executor, struct at_executor_stats *stats)
+{
+    stats->posted = __atomic_load_n(&executor->stats.posted, __ATOMIC_RELAXED);
+    stats->executed = __atomic_load_n(&executor->stats.executed, __ATOMIC_RELAXED);
+    stats->steals = __atomic_load_n(&executor->stats.steals, __ATOMIC_RELAXED);
+}
+
+struct at_strand *at_strand_alloc(struct at_executor *executor)
+{
+    struct at_strand *strand = calloc(1, sizeof(struct at_strand));
+    if (!strand) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    strand->executor = executor;
+    pthread_mutex_init(&strand->lock, NULL);
+    pthread_cond_init(&strand->idle, NULL);
+    return strand;
+}
+
+void at_strand_free(struct at_strand *strand)
+{
+    pthread_mutex_lock(&strand->lock);
+    while (strand->scheduled)
+        pthread_cond_wait(&strand->idle, &strand->lock);
+    pthread_mutex_unlock(&strand->lock);
+
+    pthread_cond_destroy(&strand->idle);
+    pthread_mutex_destroy(&strand->lock);
+    free(strand);
+}
+
+int at_strand_post(struct at_strand *strand, at_work_fn fn, void *arg, struct at_buf *buf)
+{
+    struct at_executor *executor = strand->executor;
+
+    struct at_work *work = work_alloc(executor);
+    if (!work) {
+        errno = ENOMEM;
+        return -1;
+    }
+    work->next = NULL;
+    work->fn = fn;
+    work->arg = arg;
+    work->buf = buf;
+
+    __atomic_add_fetch(&executor->stats.posted, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&strand->lock);
+    if (strand->tail)
+        strand->tail->next = work;
+    else
+        strand->head = work;
+    strand->tail = work;
+    bool idle = !strand->scheduled;
+    strand->scheduled = true;
+    pthread_mutex_unlock(&strand->lock);
+
+    if (idle)
+        deque_push(pick_worker(executor), strand, false);
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
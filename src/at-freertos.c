@@ -6,7 +6,9 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
-#include <attentive/at.h>
+#include <attentive/at-freertos.h>
+#include <attentive/at-probes.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,56 +21,129 @@
 // Remove once you refactor this out.
 #define AT_COMMAND_LENGTH 80
 
+#define AT_FREERTOS_BUFFER      512     /* Response buffer size. */
+#define AT_FREERTOS_RX_BUFFER   512     /* UART circular buffer size. */
+#define AT_FREERTOS_READ_SIZE   64      /* Bulk read size; on the reader stack. */
+/* An idle reader gives up the UART this often, so at_close() can take it. */
+#define AT_FREERTOS_IDLE_TICKS  pdMS_TO_TICKS(100)
+
+/* An answer to a shared query, kept for identical ones. */
+struct at_freertos_query {
+    char line[AT_COMMAND_LENGTH];
+    size_t len;
+    struct at_buf *response;    /**< NULL if the slot is free. */
+    uint64_t when;          /**< at_stats_clock_ns() time it arrived. */
+};
+
+#define AT_FREERTOS_QUERIES  4  /* Distinct shared queries remembered. */
+
 struct at_freertos {
     struct at at;
-    int timeout;            /**< Command timeout in seconds. */
-    const char *response;
-
-    TaskHandle_t xTask;
-    /*SemaphoreHandle_t xMutex;*/
-    SemaphoreHandle_t xSem;
+    int timeout;            /**< Default command timeout in seconds. Atomic. */
+    at_line_scanner_t scanner;  /**< From at_set_command_scanner(). Atomic. */
+    bool dataprompt;        /**< From at_expect_dataprompt(). Atomic. */
+    uint64_t deadline;      /**< Default deadline: at_stats_clock_ns() time, or zero. Atomic. */
+    struct at_cancel *token;    /**< Default cancellation token, if any. Atomic. */
+    struct at_buf *response;    /**< Taken over from the parser; see at-buf.h. */
+    struct at_buf *last;    /**< Held until the next at_command(). */
+    struct at_freertos_query queries[AT_FREERTOS_QUERIES];
+    uint64_t share_window;  /**< How long shared answers stay fresh, ns. */
+    struct at_stats stats;  /**< Live counters; see at-stats.h. */
+    int verb;               /**< Stats slot of the pending command, or -1. */
+    uint64_t sent;          /**< When the pending command was sent. */
+    int resync_register;    /**< S-register for the sentinel, or -1. */
+    int nonce;              /**< Last sentinel value, 1..255. */
+
+    TaskHandle_t xTask;     /**< Reader task; NULL once it has exited. */
+    SemaphoreHandle_t xCommand; /**< Serializes commands. */
+    SemaphoreHandle_t xMutex;   /**< Protects variables below and the parser. */
     Peripheral_Descriptor_t xUART;
+    TaskHandle_t xWaiter;   /**< Task waiting for a response. */
+    TaskHandle_t xCloser;   /**< Task in at_close()/at_free() waiting for the reader. */
 
-    bool running : 1;       /**< Reader thread should be running. */
-    bool open : 1;          /**< FD is valid. Set/cleared by open()/close(). */
-    bool busy : 1;          /**< FD is in use. Set/cleared by reader thread. */
+    bool running : 1;       /**< Reader task should be running. */
+    bool open : 1;          /**< UART is valid. Set/cleared by open()/close(). */
+    bool busy : 1;          /**< UART is in use. Set/cleared by reader task. */
     bool waiting : 1;       /**< Waiting for response callback to arrive. */
+    bool resync : 1;        /**< Channel out of sync since a timeout. */
+};
+
+/* A task blocked on a channel, listed on its cancellation token so that
+ * at_cancel() can notify it. Lives on the caller's stack. */
+struct at_cancel_wait {
+    struct at_cancel_wait *next;
+    TaskHandle_t xTask;
+};
+
+/* What one command or delay may spend; see the Unix port. */
+struct at_freertos_caller {
+    uint64_t deadline;          /**< at_stats_clock_ns() time, or zero. */
+    struct at_cancel *token;    /**< Cancellation token, or NULL. */
+    struct at_cancel_wait wait; /**< On the token's list meanwhile. */
 };
 
-void at_reader_thread(void *arg);
+static void at_reader_task(void *arg);
 
 static void handle_response(const char *buf, size_t len, void *arg)
 {
     struct at_freertos *priv = (struct at_freertos *) arg;
 
-    /* The mutex is held by the reader thread; don't reacquire. */
-    priv->response = buf;
-    (void) len;
+    /* The mutex is held by the reader task; don't reacquire. Take the
+     * buffer over, so URCs in the same chunk can't overwrite the response
+     * before the caller gets to look at it. */
+    at_buf_release(priv->response);
+    priv->response = at_parser_take_response(priv->at.parser);
+    AT_TRACE(&priv->at, AT_TRACE_RESPONSE, len, buf, len);
+    AT_PROBE4(response, &priv->at, buf, len, priv->sent);
+    if (priv->verb >= 0)
+        at_stats_response(&priv->stats, priv->verb, at_stats_clock_ns() - priv->sent);
     priv->waiting = false;
-    xSemaphoreGive(priv->xSem);
+    if (priv->xWaiter)
+        xTaskNotifyGive(priv->xWaiter);
 }
 
 static void handle_urc(const char *buf, size_t len, void *arg)
 {
-    struct at *at = (struct at *) arg;
+    struct at_freertos *priv = (struct at_freertos *) arg;
+    struct at *at = &priv->at;
+
+    AT_TRACE(at, AT_TRACE_URC, len, buf, len);
+    AT_PROBE3(urc, at, buf, len);
 
     /* Forward to caller's URC callback, if any. */
-    if (at->cbs->handle_urc)
+    if (at->cbs && at->cbs->handle_urc) {
+        uint64_t start = at_stats_cpu_ns();
         at->cbs->handle_urc(buf, len, at->arg);
+        AT_STATS_ADD(priv->stats.handle_urc_ns, at_stats_cpu_ns() - start);
+        AT_STATS_ADD(priv->stats.handle_urc_calls, 1);
+    }
 }
 
 enum at_response_type scan_line(const char *line, size_t len, void *arg)
 {
-    struct at *at = (struct at *) arg;
+    struct at_freertos *priv = (struct at_freertos *) arg;
+    struct at *at = &priv->at;
 
     enum at_response_type type = AT_RESPONSE_UNKNOWN;
     if (at->command_scanner)
         type = at->command_scanner(line, len, at->arg);
-    if (!type && at->cbs && at->cbs->scan_line)
+    if (!type && at->cbs && at->cbs->scan_line) {
+        uint64_t start = at_stats_cpu_ns();
         type = at->cbs->scan_line(line, len, at->arg);
+        AT_STATS_ADD(priv->stats.scan_line_ns, at_stats_cpu_ns() - start);
+        AT_STATS_ADD(priv->stats.scan_line_calls, 1);
+    }
     return type;
 }
 
+static size_t handle_stream(const void *data, size_t len, void *arg)
+{
+    struct at *at = (struct at *) arg;
+
+    /* Forward to caller's stream handler. */
+    return at->stream_handler(data, len, at->arg);
+}
+
 static const struct at_parser_callbacks parser_callbacks = {
     .handle_response = handle_response,
     .handle_urc = handle_urc,
@@ -85,51 +160,111 @@ struct at *at_alloc_freertos(void)
     memset(priv, 0, sizeof(struct at_freertos));
 
     /* allocate underlying parser */
-    priv->at.parser = at_parser_alloc(&parser_callbacks, 512, (void *) priv);
+    priv->at.parser = at_parser_alloc(&parser_callbacks, AT_FREERTOS_BUFFER, (void *) priv);
     if (!priv->at.parser) {
         free(priv);
         return NULL;
     }
+    at_parser_set_stats(priv->at.parser, &priv->stats);
+    priv->resync_register = AT_RESYNC_REGISTER;
 
-    /* initialize and start reader thread */
+    priv->xCommand = xSemaphoreCreateMutex();
+    priv->xMutex = xSemaphoreCreateMutex();
+    if (!priv->xCommand || !priv->xMutex)
+        goto fail;
+
+    /* initialize and start reader task */
     priv->running = true;
-    /*priv->xMutex = xSemaphoreCreateBinary();*/
-    priv->xSem = xSemaphoreCreateBinary();
-    xTaskCreate(at_reader_thread, "ATReadTask", configMINIMAL_STACK_SIZE * 2, priv, 4, &priv->xTask);
+    if (xTaskCreate(at_reader_task, "ATReadTask", configMINIMAL_STACK_SIZE * 2,
+                    priv, 4, &priv->xTask) != pdPASS)
+        goto fail;
 
     return (struct at *) priv;
+
+fail:
+    if (priv->xCommand)
+        vSemaphoreDelete(priv->xCommand);
+    if (priv->xMutex)
+        vSemaphoreDelete(priv->xMutex);
+    at_parser_free(priv->at.parser);
+    free(priv);
+    return NULL;
 }
 
 int at_open(struct at *at)
 {
     struct at_freertos *priv = (struct at_freertos *) at;
 
+    xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+    if (priv->open) {
+        xSemaphoreGive(priv->xMutex);
+        return 0;
+    }
+
     priv->xUART = FreeRTOS_open(boardGSM_SIM800_UART, 0);
-    if(priv->xUART == NULL) {
+    if (priv->xUART == NULL) {
+        xSemaphoreGive(priv->xMutex);
+        errno = ENODEV;
         return -1;
-    } else {
-        FreeRTOS_ioctl(priv->xUART, ioctlUSE_DMA_TX, (void*)0);
-        FreeRTOS_ioctl(priv->xUART, ioctlUSE_CIRCULAR_BUFFER_RX, (void*)512);
-        FreeRTOS_ioctl(priv->xUART, ioctlSET_TX_TIMEOUT, (void*)pdMS_TO_TICKS(200));
-        FreeRTOS_ioctl(priv->xUART, ioctlSET_RX_TIMEOUT, (void*)pdMS_TO_TICKS(50));
     }
+    FreeRTOS_ioctl(priv->xUART, ioctlUSE_DMA_TX, (void *) 0);
+    FreeRTOS_ioctl(priv->xUART, ioctlUSE_CIRCULAR_BUFFER_RX, (void *) AT_FREERTOS_RX_BUFFER);
+    FreeRTOS_ioctl(priv->xUART, ioctlSET_TX_TIMEOUT, (void *) (uintptr_t) pdMS_TO_TICKS(200));
 
     priv->open = true;
-    /*xSemaphoreGive(priv->xMutex);*/
-    xSemaphoreTake(priv->xSem, 0);
+    xSemaphoreGive(priv->xMutex);
+
+    /* Wake the reader up. */
+    xTaskNotifyGive(priv->xTask);
     return 0;
 }
 
+/* Wait for the reader to reach a state; the mutex is held. */
+static void wait_for_reader(struct at_freertos *priv, bool (*done)(struct at_freertos *))
+{
+    priv->xCloser = xTaskGetCurrentTaskHandle();
+    while (!done(priv)) {
+        xSemaphoreGive(priv->xMutex);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+    }
+    priv->xCloser = NULL;
+}
+
+static bool reader_idle(struct at_freertos *priv)
+{
+    return !priv->busy;
+}
+
+static bool reader_exited(struct at_freertos *priv)
+{
+    return !priv->xTask;
+}
+
 int at_close(struct at *at)
 {
     struct at_freertos *priv = (struct at_freertos *) at;
 
+    xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+    if (!priv->open) {
+        xSemaphoreGive(priv->xMutex);
+        return 0;
+    }
+
     /* Mark the port descriptor as invalid. */
     priv->open = false;
 
+    /* Fail the pending command, if any, right away. */
+    if (priv->waiting && priv->xWaiter)
+        xTaskNotifyGive(priv->xWaiter);
+
+    /* The reader lets go of the UART within AT_FREERTOS_IDLE_TICKS. */
+    wait_for_reader(priv, reader_idle);
+
     FreeRTOS_close(priv->xUART);
     priv->xUART = NULL;
 
+    xSemaphoreGive(priv->xMutex);
     return 0;
 }
 
@@ -137,17 +272,24 @@ void at_free(struct at *at)
 {
     struct at_freertos *priv = (struct at_freertos *) at;
 
-    /* make sure the channel is closed */
+    /* make sure the channel is closed and can't be woken up anymore */
     at_close(at);
 
-    /* ask the reader thread to terminate */
+    /* ask the reader task to terminate and wait for it */
+    xSemaphoreTake(priv->xMutex, portMAX_DELAY);
     priv->running = false;
-    if(priv->xTask != NULL) {
-        vTaskDelete(priv->xTask);
-    }
+    xTaskNotifyGive(priv->xTask);
+    wait_for_reader(priv, reader_exited);
+    xSemaphoreGive(priv->xMutex);
 
     /* free up resources */
-    free(priv->at.parser);
+    vSemaphoreDelete(priv->xMutex);
+    vSemaphoreDelete(priv->xCommand);
+    at_buf_release(priv->response);
+    at_buf_release(priv->last);
+    for (int i=0; i<AT_FREERTOS_QUERIES; i++)
+        at_buf_release(priv->queries[i].response);
+    at_parser_free(priv->at.parser);
     free(priv);
 }
 
@@ -159,14 +301,82 @@ void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
 
 void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
 {
-    at->command_scanner = scanner;
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    __atomic_store_n(&priv->scanner, scanner, __ATOMIC_RELAXED);
 }
 
 void at_set_timeout(struct at *at, int timeout)
 {
     struct at_freertos *priv = (struct at_freertos *) at;
 
-    priv->timeout = timeout;
+    __atomic_store_n(&priv->timeout, timeout, __ATOMIC_RELAXED);
+}
+
+void at_cancel(struct at_cancel *token)
+{
+    __atomic_store_n(&token->cancelled, true, __ATOMIC_SEQ_CST);
+
+    /* Notify every task waiting under the token, on whatever channel.
+     * Notifications are latched and waiters check the flag after taking
+     * stale ones, so this can't be missed. */
+    taskENTER_CRITICAL();
+    for (struct at_cancel_wait *wait = token->waiters; wait; wait = wait->next)
+        xTaskNotifyGive(wait->xTask);
+    taskEXIT_CRITICAL();
+}
+
+void at_set_cancel(struct at *at, struct at_cancel *token)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    /* Commands already going keep the token they started with. */
+    __atomic_store_n(&priv->token, token, __ATOMIC_RELAXED);
+}
+
+void at_set_deadline(struct at *at, uint64_t deadline)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    __atomic_store_n(&priv->deadline, deadline, __ATOMIC_RELAXED);
+}
+
+/* Waits run on kernel ticks; a simulated kernel can keep deadlines on the
+ * same clock by defining AT_STATS_CLOCK_NS. */
+uint64_t at_now(struct at *at)
+{
+    (void) at;
+    return at_stats_clock_ns();
+}
+
+void at_set_resync_register(struct at *at, int reg)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    xSemaphoreTake(priv->xCommand, portMAX_DELAY);
+    priv->resync_register = reg;
+    if (reg < 0)
+        priv->resync = false;
+    xSemaphoreGive(priv->xCommand);
+}
+
+void at_set_share_window(struct at *at, int ms)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+    priv->share_window = (uint64_t) ms * 1000000;
+    xSemaphoreGive(priv->xMutex);
+}
+
+int at_set_urc_policy(struct at *at, const char *prefix, enum at_urc_policy policy, int ms)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+    int result = at_parser_set_urc_policy(at->parser, prefix, policy, (uint64_t) ms * 1000000);
+    xSemaphoreGive(priv->xMutex);
+    return result;
 }
 
 void at_set_character_handler(struct at *at, at_character_handler_t handler)
@@ -174,108 +384,540 @@ void at_set_character_handler(struct at *at, at_character_handler_t handler)
     at_parser_set_character_handler(at->parser, handler);
 }
 
+void at_set_stream_handler(struct at *at, at_stream_handler_t handler)
+{
+    /* Normally called from parser callbacks, in the reader task. */
+    at->stream_handler = handler;
+    at_parser_set_stream_handler(at->parser, handler ? handle_stream : NULL);
+}
+
+void at_set_trace(struct at *at, struct at_trace *trace)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+    at->trace = trace;
+    at_parser_set_trace(at->parser, trace);
+    xSemaphoreGive(priv->xMutex);
+}
+
+void at_get_stats(struct at *at, struct at_stats *stats)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    at_stats_snapshot(&priv->stats, stats);
+}
+
 void at_expect_dataprompt(struct at *at)
 {
-    at_parser_expect_dataprompt(at->parser);
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    /* Applied by _at_command(), after any resync round trip. */
+    __atomic_store_n(&priv->dataprompt, true, __ATOMIC_RELAXED);
+}
+
+/* Set up a caller's budget from its options, or the channel defaults, and
+ * put it on its token's list. Pair with caller_end(). */
+static void caller_begin(struct at_freertos *priv, struct at_freertos_caller *caller,
+                         const struct at_command_options *opts)
+{
+    caller->deadline = opts && opts->deadline ? opts->deadline
+                                              : __atomic_load_n(&priv->deadline, __ATOMIC_RELAXED);
+    caller->token = opts && opts->cancel ? opts->cancel
+                                         : __atomic_load_n(&priv->token, __ATOMIC_RELAXED);
+    if (caller->token) {
+        caller->wait.xTask = xTaskGetCurrentTaskHandle();
+        taskENTER_CRITICAL();
+        caller->wait.next = caller->token->waiters;
+        caller->token->waiters = &caller->wait;
+        taskEXIT_CRITICAL();
+    }
+}
+
+static void caller_end(struct at_freertos_caller *caller)
+{
+    if (caller->token) {
+        taskENTER_CRITICAL();
+        struct at_cancel_wait **p = &caller->token->waiters;
+        while (*p != &caller->wait)
+            p = &(*p)->next;
+        *p = caller->wait.next;
+        taskEXIT_CRITICAL();
+    }
+}
+
+static bool cancelled(const struct at_freertos_caller *caller)
+{
+    return caller->token && __atomic_load_n(&caller->token->cancelled, __ATOMIC_SEQ_CST);
+}
+
+/* Time left for the caller, in nanoseconds; UINT64_MAX without a deadline.
+ * Zero, with errno set, once cancelled or past the deadline. */
+static uint64_t budget(const struct at_freertos_caller *caller)
+{
+    if (cancelled(caller)) {
+        errno = ECANCELED;
+        return 0;
+    }
+    if (!caller->deadline)
+        return UINT64_MAX;
+    uint64_t now = at_stats_clock_ns();
+    if (now >= caller->deadline) {
+        errno = ETIMEDOUT;
+        return 0;
+    }
+    return caller->deadline - now;
+}
+
+/* Shorten a wait in ticks to the time left, rounding up. */
+static bool clip_wait(TickType_t *wait, uint64_t left)
+{
+    if (left == UINT64_MAX)
+        return false;
+    uint64_t ticks = (left * configTICK_RATE_HZ + 999999999) / 1000000000;
+    if (ticks >= *wait)
+        return false;
+    *wait = ticks;
+    return true;
+}
+
+/* Like budget(), but also bounded by an at_stats_clock_ns() time
+ * (UINT64_MAX for none), e.g. the end of the command's timeout. */
+static uint64_t time_left(const struct at_freertos_caller *caller, uint64_t until)
+{
+    uint64_t left = budget(caller);
+    if (left && until != UINT64_MAX) {
+        uint64_t now = at_stats_clock_ns();
+        if (now >= until) {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        if (until - now < left)
+            left = until - now;
+    }
+    return left;
 }
 
-static const char *_at_command(struct at_freertos *priv, const void *data, size_t size)
+/* Send a command and wait for the reader task to collect the response,
+ * until the given time or the caller's deadline, whichever comes first.
+ * Called with both semaphores held. Returns zero once it's there, -1 and
+ * sets errno otherwise. */
+static int send_and_wait(struct at_freertos *priv, const struct at_freertos_caller *caller,
+                         uint64_t until, const void *data, size_t size)
 {
-    /*if(!xSemaphoreTake(priv->xMutex, pdMS_TO_TICKS(1000))) {*/
-        /*return NULL;*/
-    /*}*/
+    TickType_t timeout = portMAX_DELAY;
+    bool bounded = clip_wait(&timeout, time_left(caller, until));
+
+    priv->waiting = true;
+    priv->xWaiter = xTaskGetCurrentTaskHandle();
+    /* Drop wakeups left over from an earlier command. */
+    ulTaskNotifyTake(pdTRUE, 0);
+
+    /* Send the command. */
+    priv->sent = at_stats_clock_ns();
+    AT_PROBE3(command, &priv->at, data, size);
+    AT_STATS_ADD(priv->stats.tx_bytes, FreeRTOS_write(priv->xUART, data, size));
+
+    /* The deadline is kept in ticks; unsigned differences survive tick
+     * counter wraparound. */
+    TickType_t start = xTaskGetTickCount();
+    while (priv->open && priv->waiting && !cancelled(caller)) {
+        TickType_t wait = portMAX_DELAY;
+        if (bounded) {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= timeout)
+                break;
+            wait = timeout - elapsed;
+        }
+        xSemaphoreGive(priv->xMutex);
+        ulTaskNotifyTake(pdTRUE, wait);
+        xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+    }
+
+    bool waiting = priv->waiting;
+    priv->waiting = false;
+    priv->xWaiter = NULL;
 
-    /* Bail out if the channel is closing or closed. */
     if (!priv->open) {
-        /*xSemaphoreGive(priv->xMutex);*/
-        return NULL;
+        /* The serial port was closed behind our back. */
+        errno = ENODEV;
+        return -1;
+    }
+    if (waiting) {
+        errno = cancelled(caller) ? ECANCELED : ETIMEDOUT;
+        return -1;
     }
+    return 0;
+}
+
+/* Get back in sync after a timeout, before the next command and within
+ * its timeout; see the Unix port. */
+static int resync(struct at_freertos *priv, const struct at_freertos_caller *caller, uint64_t until)
+{
+    /* No time for it now; the next command will try. */
+    if (!time_left(caller, until))
+        return -1;
+
+    int reg = priv->resync_register;
+    priv->nonce = priv->nonce % 255 + 1;
+
+    char line[32], sentinel[8];
+    int len = snprintf(line, sizeof(line), "ATS%d=%d;S%d?", reg, priv->nonce, reg);
+    snprintf(sentinel, sizeof(sentinel), "%03d", priv->nonce);
+    printf("> %s\n", line);
+    AT_TRACE(&priv->at, AT_TRACE_COMMAND, len, line, len);
+    line[len++] = '\r';
 
-    /* Prepare parser. */
     at_parser_await_response(priv->at.parser);
+    at_parser_expect_sentinel(priv->at.parser, sentinel);
+    priv->verb = -1;
+    AT_STATS_ADD(priv->stats.resyncs, 1);
+
+    int result = send_and_wait(priv, caller, until, line, len);
+    if (result == 0 && priv->response && priv->response->len) {
+        /* Turned down; settle for a plain AT round trip. */
+        AT_STATS_ADD(priv->stats.resync_failures, 1);
+        at_buf_release(priv->response);
+        priv->response = NULL;
+        printf("> AT\n");
+        AT_TRACE(&priv->at, AT_TRACE_COMMAND, 2, "AT", 2);
+        at_parser_await_response(priv->at.parser);
+        result = send_and_wait(priv, caller, until, "AT\r", 3);
+        if (result == 0 && priv->response && priv->response->len) {
+            errno = EIO;
+            result = -1;
+        }
+    } else if (result == -1) {
+        AT_STATS_ADD(priv->stats.resync_failures, 1);
+    }
+    at_buf_release(priv->response);
+    priv->response = NULL;
+    if (result == 0) {
+        priv->resync = false;
+    } else {
+        /* Still out of sync; try again before the next command. */
+        at_parser_reset(priv->at.parser);
+        priv->resync = true;
+    }
+    return result;
+}
 
-    /* Send the command. */
-    // FIXME: handle interrupts, short writes, errors, etc.
-    FreeRTOS_write(priv->xUART, data, size);
+/*
+ * Shared queries. A read-only query that finds an identical one answered
+ * since it was issued (i.e. it waited its turn behind it), or within the
+ * share window, takes a reference to that answer instead of going out.
+ * Anything else may change what queries return, so it forgets them all.
+ */
+static struct at_buf *shared_answer(struct at_freertos *priv, const void *line, size_t len, uint64_t issued)
+{
+    uint64_t now = at_stats_clock_ns();
+    for (int i=0; i<AT_FREERTOS_QUERIES; i++) {
+        struct at_freertos_query *query = &priv->queries[i];
+        if (query->response && query->len == len && !memcmp(query->line, line, len) &&
+            (query->when >= issued || now - query->when < priv->share_window))
+            return at_buf_ref(query->response);
+    }
+    return NULL;
+}
 
-    /* Wait for the parser thread to collect a response. */
-    priv->waiting = true;
-    /*xSemaphoreGive(priv->xMutex);*/
-    xSemaphoreTake(priv->xSem, 0);
-    int timeout = priv->timeout;
-    while (timeout-- && priv->open && priv->waiting) {
-        if (xSemaphoreTake(priv->xSem, pdMS_TO_TICKS(1000))) {
+static void share_answer(struct at_freertos *priv, const void *line, size_t len, struct at_buf *response)
+{
+    /* Take the slot with the same line, or else the oldest one. */
+    struct at_freertos_query *slot = &priv->queries[0];
+    for (int i=0; i<AT_FREERTOS_QUERIES; i++) {
+        struct at_freertos_query *query = &priv->queries[i];
+        if (query->response && query->len == len && !memcmp(query->line, line, len)) {
+            slot = query;
             break;
         }
+        if (!query->response || (slot->response && query->when < slot->when))
+            slot = query;
+    }
+    at_buf_release(slot->response);
+    memcpy(slot->line, line, len);
+    slot->len = len;
+    slot->response = at_buf_ref(response);
+    slot->when = at_stats_clock_ns();
+}
+
+static void forget_answers(struct at_freertos *priv)
+{
+    for (int i=0; i<AT_FREERTOS_QUERIES; i++) {
+        at_buf_release(priv->queries[i].response);
+        priv->queries[i].response = NULL;
+    }
+}
+
+/*
+ * Commands take turns on xCommand. FreeRTOS hands a mutex to the waiting
+ * task with the highest priority, then in order of arrival, so that's the
+ * order commands go in; the per-command priority is not used here. The
+ * wait counts against the deadline, but cancellation can't cut it short.
+ * Idle commands don't wait at all.
+ */
+static int take_turn(struct at_freertos *priv, const struct at_freertos_caller *caller, bool idle)
+{
+    if (idle && __atomic_load_n(&priv->at.stream_handler, __ATOMIC_RELAXED)) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (xSemaphoreTake(priv->xCommand, 0) == pdTRUE)
+        return 0;
+    if (idle) {
+        errno = EBUSY;
+        return -1;
+    }
+    AT_STATS_ADD(priv->stats.queued, 1);
+
+    uint64_t left = budget(caller);
+    if (!left)
+        return -1;
+
+    TickType_t wait = portMAX_DELAY;
+    clip_wait(&wait, left);
+    if (xSemaphoreTake(priv->xCommand, wait) != pdTRUE) {
+        errno = ETIMEDOUT;
+        return -1;
     }
+    return 0;
+}
 
-    /*xSemaphoreTake(priv->xMutex, pdMS_TO_TICKS(1000));*/
-    const char *result;
+static struct at_buf *_at_command(struct at_freertos *priv, const struct at_command_options *opts,
+                                  const void *data, size_t size, bool raw)
+{
+    /* Settings from the sticky setters count for the next command. */
+    struct at_command_options sticky = {
+        .scanner = __atomic_exchange_n(&priv->scanner, NULL, __ATOMIC_RELAXED),
+        .dataprompt = __atomic_exchange_n(&priv->dataprompt, false, __ATOMIC_RELAXED),
+    };
+    if (!opts)
+        opts = &sticky;
+    int timeout = opts->timeout ? opts->timeout : __atomic_load_n(&priv->timeout, __ATOMIC_RELAXED);
+    bool shared = opts->shared && !raw;
+    uint64_t issued = at_stats_clock_ns();
+    struct at_freertos_caller caller;
+    caller_begin(priv, &caller, opts);
+
+    struct at_buf *result = NULL;
+    if (take_turn(priv, &caller, opts->idle) == -1)
+        goto out;
+    xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+
+    /* Bail out if the channel is closing or closed, or if it's still out
+     * of sync from an earlier timeout and can't be brought back. */
     if (!priv->open) {
-        /* The serial port was closed behind our back. */
-        result = NULL;
-    } else if (priv->waiting) {
+        errno = ENODEV;
+        goto done;
+    }
+    if (!budget(&caller))
+        goto done;
+    if (shared && (result = shared_answer(priv, data, size, issued))) {
+        AT_STATS_ADD(priv->stats.shared, 1);
+        goto done;
+    }
+    if (!shared)
+        forget_answers(priv);
+
+    /* The timeout runs from here, and covers a resync still owed. */
+    uint64_t until = timeout ? at_stats_clock_ns() + (uint64_t) timeout * 1000000000 : UINT64_MAX;
+    if (priv->resync && resync(priv, &caller, until) == -1)
+        goto done;
+
+    /* Prepare parser. */
+    priv->at.command_scanner = opts->scanner;
+    if (opts->dataprompt)
+        at_parser_expect_dataprompt(priv->at.parser);
+    at_parser_await_response(priv->at.parser);
+    priv->verb = at_stats_verb(&priv->stats, raw ? NULL : data, size);
+    AT_STATS_ADD(priv->stats.commands, 1);
+
+    if (send_and_wait(priv, &caller, until, data, size) == 0) {
+        /* Response arrived; hand it over. */
+        result = priv->response;
+        priv->response = NULL;
+        if (!result)
+            errno = ENOMEM;
+        else if (shared)
+            share_answer(priv, data, size, result);
+    } else if (errno == ETIMEDOUT) {
         /* Timed out waiting for a response. */
+        AT_TRACE(&priv->at, AT_TRACE_TIMEOUT, timeout, NULL, 0);
+        AT_PROBE2(timeout, &priv->at, timeout);
+        at_stats_timeout(&priv->stats, priv->verb);
         at_parser_reset(priv->at.parser);
-        result = NULL;
-    } else {
-        /* Response arrived. */
-        result = priv->response;
+        /* The answer may still come; resync before the next command. */
+        priv->resync = priv->resync_register >= 0;
+        errno = ETIMEDOUT;
+    } else if (errno == ECANCELED) {
+        /* Given up on; see the Unix port. */
+        AT_STATS_ADD(priv->stats.cancelled, 1);
+        at_parser_reset(priv->at.parser);
+        priv->resync = priv->resync_register >= 0;
+        errno = ECANCELED;
     }
 
-    /* Reset per-command settings. */
+done:
+    /* Per-command settings end with the command. */
     priv->at.command_scanner = NULL;
-    /*xSemaphoreGive(priv->xMutex);*/
 
+    xSemaphoreGive(priv->xMutex);
+    xSemaphoreGive(priv->xCommand);
+
+out:
+    caller_end(&caller);
     return result;
 }
 
-const char *at_command(struct at *at, const char *format, ...)
+int at_delay_opts(struct at *at, const struct at_command_options *opts, int ms)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+    struct at_freertos_caller caller;
+    caller_begin(priv, &caller, opts);
+
+    int result = 0;
+    uint64_t left = budget(&caller);
+    if (!left) {
+        result = -1;
+    } else {
+        TickType_t wait = pdMS_TO_TICKS(ms);
+        bool cut = clip_wait(&wait, left);
+
+        /* Drop stale wakeups; at_cancel() notifies us from the token. */
+        ulTaskNotifyTake(pdTRUE, 0);
+        TickType_t start = xTaskGetTickCount();
+        while (!cancelled(&caller)) {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= wait)
+                break;
+            ulTaskNotifyTake(pdTRUE, wait - elapsed);
+        }
+        if (cancelled(&caller) || cut) {
+            errno = cancelled(&caller) ? ECANCELED : ETIMEDOUT;
+            result = -1;
+        }
+    }
+
+    caller_end(&caller);
+    return result;
+}
+
+int at_delay(struct at *at, int ms)
+{
+    return at_delay_opts(at, NULL, ms);
+}
+
+static struct at_buf *at_vcommand(struct at *at, const struct at_command_options *opts,
+                                  const char *format, va_list ap)
 {
     struct at_freertos *priv = (struct at_freertos *) at;
 
     /* Build command string. */
-    va_list ap;
-    va_start(ap, format);
     char line[AT_COMMAND_LENGTH];
     int len = vsnprintf(line, sizeof(line)-1, format, ap);
-    va_end(ap);
 
     /* Bail out if we run out of space. */
     if (len >= (int)(sizeof(line)-1)) {
+        errno = ENOMEM;
         return NULL;
     }
 
     printf("> %s\n", line);
+    AT_TRACE(at, AT_TRACE_COMMAND, len, line, len);
 
     /* Append modem-style newline. */
     line[len++] = '\r';
 
     /* Send the command. */
-    return _at_command(priv, line, len);
+    return _at_command(priv, opts, line, len, false);
+}
+
+static const char *keep_response(struct at_freertos *priv, struct at_buf *response)
+{
+    /* Keep the response until the next at_command(), as documented. */
+    xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+    struct at_buf *last = priv->last;
+    priv->last = response;
+    xSemaphoreGive(priv->xMutex);
+    at_buf_release(last);
+
+    return response ? response->data : NULL;
+}
+
+const char *at_command(struct at *at, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    struct at_buf *response = at_vcommand(at, NULL, format, ap);
+    va_end(ap);
+
+    return keep_response((struct at_freertos *) at, response);
+}
+
+struct at_buf *at_command_buf(struct at *at, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    struct at_buf *response = at_vcommand(at, NULL, format, ap);
+    va_end(ap);
+
+    return response;
+}
+
+struct at_buf *at_command_opts(struct at *at, const struct at_command_options *opts,
+                               const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    struct at_buf *response = at_vcommand(at, opts, format, ap);
+    va_end(ap);
+
+    return response;
 }
 
 const char *at_command_raw(struct at *at, const void *data, size_t size)
+{
+    return keep_response((struct at_freertos *) at, at_command_raw_buf(at, data, size));
+}
+
+struct at_buf *at_command_raw_buf(struct at *at, const void *data, size_t size)
+{
+    return at_command_raw_opts(at, NULL, data, size);
+}
+
+struct at_buf *at_command_raw_opts(struct at *at, const struct at_command_options *opts,
+                                   const void *data, size_t size)
 {
     struct at_freertos *priv = (struct at_freertos *) at;
 
     printf("> [%zu bytes]\n", size);
+    AT_TRACE(at, AT_TRACE_COMMAND_RAW, size, data, size);
 
-    return _at_command(priv, data, size);
+    return _at_command(priv, opts, data, size, true);
 }
 
-bool _at_send(struct at_freertos *priv, const void *data, size_t size)
+static bool _at_send(struct at_freertos *priv, const void *data, size_t size)
 {
-    /* Bail out if the channel is closing or closed. */
+    /* Drivers call this from URC callbacks. In the reader task the mutex
+     * is already held; anywhere else, take it so the write can't land in
+     * the middle of a command. */
+    bool lock = xTaskGetCurrentTaskHandle() != priv->xTask;
+    if (lock)
+        xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+
     if (!priv->open) {
-        /*xSemaphoreGive(priv->xMutex);*/
+        if (lock)
+            xSemaphoreGive(priv->xMutex);
+        errno = ENODEV;
         return false;
     }
 
-    /* Send the command. */
-    // FIXME: handle interrupts, short writes, errors, etc.
-    FreeRTOS_write(priv->xUART, data, size);
-    return true;
+    /* Send the data without waiting for a response. */
+    size_t written = FreeRTOS_write(priv->xUART, data, size);
+    AT_STATS_ADD(priv->stats.tx_bytes, written);
+
+    if (lock)
+        xSemaphoreGive(priv->xMutex);
+    return written == size;
 }
 
 bool at_send(struct at *at, const char *format, ...)
@@ -291,10 +933,12 @@ bool at_send(struct at *at, const char *format, ...)
 
     /* Bail out if we run out of space. */
     if (len >= (int)(sizeof(line)-1)) {
+        errno = ENOMEM;
         return false;
     }
 
     printf("> %s\n", line);
+    AT_TRACE(at, AT_TRACE_SEND, len, line, len);
 
     /* Append modem-style newline. */
     line[len++] = '\r';
@@ -308,48 +952,65 @@ bool at_send_raw(struct at *at, const void *data, size_t size)
     struct at_freertos *priv = (struct at_freertos *) at;
 
     printf("> [%zu bytes]\n", size);
+    AT_TRACE(at, AT_TRACE_SEND, size, data, size);
 
     return _at_send(priv, data, size);
 }
 
-void at_reader_thread(void *arg)
+static void at_reader_task(void *arg)
 {
     struct at_freertos *priv = (struct at_freertos *)arg;
-
-//    printf("at_reader_thread: starting\n");
-
-    while (true) {
-        if (!priv->running) {
-            vTaskDelay(pdMS_TO_TICKS(200));
-            continue;
-        }
-        /* Wait for the port descriptor to be valid. */
-        else if(!priv->open) {
-            vTaskDelay(pdMS_TO_TICKS(200));
+    uint8_t buf[AT_FREERTOS_READ_SIZE];
+
+    xSemaphoreTake(priv->xMutex, portMAX_DELAY);
+    while (priv->running) {
+        /* Sleep until at_open() or at_free() notifies us. */
+        if (!priv->open) {
+            xSemaphoreGive(priv->xMutex);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            xSemaphoreTake(priv->xMutex, portMAX_DELAY);
             continue;
         }
 
         /* Lock access to the port descriptor. */
-        /*xSemaphoreTake(priv->xMutex, pdMS_TO_TICKS(1000));*/
         priv->busy = true;
+        Peripheral_Descriptor_t uart = priv->xUART;
+        xSemaphoreGive(priv->xMutex);
+
+        /* Block for the first byte, then take whatever else has piled up
+         * in the circular buffer in one go. */
+        FreeRTOS_ioctl(uart, ioctlSET_RX_TIMEOUT, (void *) (uintptr_t) AT_FREERTOS_IDLE_TICKS);
+        size_t len = FreeRTOS_read(uart, buf, 1);
+        if (len) {
+            FreeRTOS_ioctl(uart, ioctlSET_RX_TIMEOUT, (void *) 0);
+            len += FreeRTOS_read(uart, buf + 1, sizeof(buf) - 1);
+        }
 
-        /* Attempt to read some data. */
-        char ch;
-        int result = FreeRTOS_read(priv->xUART, &ch, 1);
-
+        xSemaphoreTake(priv->xMutex, portMAX_DELAY);
         /* Unlock access to the port descriptor. */
         priv->busy = false;
         /* Notify at_close() that the port is now free. */
+        if (priv->xCloser)
+            xTaskNotifyGive(priv->xCloser);
 
-        if (result == 1) {
+        if (len) {
             /* Data received, feed the parser. */
-            at_parser_feed(priv->at.parser, &ch, 1);
+            AT_STATS_ADD(priv->stats.rx_bytes, len);
+            at_parser_feed(priv->at.parser, buf, len);
         }
-        /*xSemaphoreGive(priv->xMutex);*/
+
+        /* Pass on coalesced URCs that are due; we're up every idle tick. */
+        at_parser_flush_urcs(priv->at.parser, at_stats_clock_ns());
     }
 
-//    printf("at_reader_thread: finished\n");
+    /* Tell at_free() we're done with the instance. */
+    TaskHandle_t closer = priv->xCloser;
+    priv->xTask = NULL;
+    xSemaphoreGive(priv->xMutex);
+    if (closer)
+        xTaskNotifyGive(closer);
 
+    vTaskDelete(NULL);
 }
 
 /* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,184 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <attentive/at-stats.h>
+
+#include <string.h>
+#include <time.h>
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/*
+ * Find a named slot in a verb or URC table, claiming a free one if needed.
+ * Names are the first member of both slot types. Only one thread ever
+ * writes a table, so publishing the new slot count is enough for readers.
+ */
+static int table_lookup(void *table, size_t stride, unsigned *used, unsigned slots,
+                        const char *name, size_t len)
+{
+    if (len > AT_STATS_NAME-1)
+        len = AT_STATS_NAME-1;
+
+    unsigned count = __atomic_load_n(used, __ATOMIC_RELAXED);
+    for (unsigned i=0; i<count && i<slots-1; i++) {
+        const char *slot = (const char *) table + i * stride;
+        if (!strncmp(slot, name, len) && slot[len] == '\0')
+            return i;
+    }
+    if (count < slots-1) {
+        char *slot = (char *) table + count * stride;
+        memcpy(slot, name, len);
+        slot[len] = '\0';
+        __atomic_store_n(used, count + 1, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    /* Table full; everything else goes to the catch-all slot. */
+    if (count < slots) {
+        char *slot = (char *) table + (slots-1) * stride;
+        strcpy(slot, "*");
+        __atomic_store_n(used, slots, __ATOMIC_RELEASE);
+    }
+    return slots-1;
+}
+
+int at_stats_verb(struct at_stats *stats, const char *command, size_t len)
+{
+    if (!command)
+        return table_lookup(stats->verbs, sizeof(stats->verbs[0]), &stats->verbs_used,
+                            AT_STATS_VERBS, AT_STATS_VERB_RAW, strlen(AT_STATS_VERB_RAW));
+
+    size_t verb = 0;
+    while (verb < len && !strchr("=?;\r\n", command[verb]))
+        verb++;
+
+    return table_lookup(stats->verbs, sizeof(stats->verbs[0]), &stats->verbs_used,
+                        AT_STATS_VERBS, command, verb);
+}
+
+int at_stats_bucket(uint64_t us)
+{
+    if (!us)
+        return 0;
+    int bucket = 64 - __builtin_clzll(us);
+    return bucket < AT_STATS_BUCKETS ? bucket : AT_STATS_BUCKETS-1;
+}
+
+void at_stats_response(struct at_stats *stats, int verb, uint64_t ns)
+{
+    struct at_stats_verb *slot = &stats->verbs[verb];
+    unsigned long us = ns / 1000;
+
+    AT_STATS_ADD(slot->responses, 1);
+    AT_STATS_ADD(slot->total_us, us);
+    AT_STATS_ADD(slot->buckets[at_stats_bucket(us)], 1);
+
+    unsigned long max = LOAD(slot->max_us);
+    while (us > max && !__atomic_compare_exchange_n(&slot->max_us, &max, us, true,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void at_stats_timeout(struct at_stats *stats, int verb)
+{
+    AT_STATS_ADD(stats->timeouts, 1);
+    AT_STATS_ADD(stats->verbs[verb].timeouts, 1);
+}
+
+int at_stats_urc(struct at_stats *stats, const char *line, size_t len)
+{
+    size_t class = 0;
+    while (class < len && line[class] != ':')
+        class++;
+
+    int slot = table_lookup(stats->urc_classes, sizeof(stats->urc_classes[0]), &stats->urcs_used,
+                            AT_STATS_URCS, line, class);
+    AT_STATS_ADD(stats->urc_classes[slot].count, 1);
+    return slot;
+}
+
+void at_stats_snapshot(const struct at_stats *stats, struct at_stats *copy)
+{
+    memset(copy, 0, sizeof(*copy));
+
+    copy->rx_bytes = LOAD(stats->rx_bytes);
+    copy->tx_bytes = LOAD(stats->tx_bytes);
+    copy->lines = LOAD(stats->lines);
+    copy->urcs = LOAD(stats->urcs);
+    copy->urcs_coalesced = LOAD(stats->urcs_coalesced);
+    copy->urcs_limited = LOAD(stats->urcs_limited);
+    copy->urcs_dropped = LOAD(stats->urcs_dropped);
+    copy->unexpected = LOAD(stats->unexpected);
+    copy->commands = LOAD(stats->commands);
+    copy->queued = LOAD(stats->queued);
+    copy->shared = LOAD(stats->shared);
+    copy->timeouts = LOAD(stats->timeouts);
+    copy->cancelled = LOAD(stats->cancelled);
+    copy->resyncs = LOAD(stats->resyncs);
+    copy->resync_failures = LOAD(stats->resync_failures);
+    copy->stale_lines = LOAD(stats->stale_lines);
+
+    copy->parser_size = LOAD(stats->parser_size);
+    copy->parser_high_water = LOAD(stats->parser_high_water);
+    copy->parser_dropped = LOAD(stats->parser_dropped);
+
+    copy->scan_line_calls = LOAD(stats->scan_line_calls);
+    copy->scan_line_ns = LOAD(stats->scan_line_ns);
+    copy->handle_urc_calls = LOAD(stats->handle_urc_calls);
+    copy->handle_urc_ns = LOAD(stats->handle_urc_ns);
+
+    /* Slot names never change once published. */
+    copy->verbs_used = __atomic_load_n(&stats->verbs_used, __ATOMIC_ACQUIRE);
+    for (unsigned i=0; i<copy->verbs_used; i++) {
+        const struct at_stats_verb *from = &stats->verbs[i];
+        struct at_stats_verb *to = &copy->verbs[i];
+        memcpy(to->name, from->name, AT_STATS_NAME);
+        to->responses = LOAD(from->responses);
+        to->timeouts = LOAD(from->timeouts);
+        to->total_us = LOAD(from->total_us);
+        to->max_us = LOAD(from->max_us);
+        for (int j=0; j<AT_STATS_BUCKETS; j++)
+            to->buckets[j] = LOAD(from->buckets[j]);
+    }
+
+    copy->urcs_used = __atomic_load_n(&stats->urcs_used, __ATOMIC_ACQUIRE);
+    for (unsigned i=0; i<copy->urcs_used; i++) {
+        memcpy(copy->urc_classes[i].name, stats->urc_classes[i].name, AT_STATS_NAME);
+        copy->urc_classes[i].count = LOAD(stats->urc_classes[i].count);
+        copy->urc_classes[i].suppressed = LOAD(stats->urc_classes[i].suppressed);
+    }
+}
+
+/* Ports without POSIX clocks can supply their own nanosecond clocks. */
+uint64_t at_stats_clock_ns(void)
+{
+#ifdef AT_STATS_CLOCK_NS
+    return AT_STATS_CLOCK_NS();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+uint64_t at_stats_cpu_ns(void)
+{
+#if defined(AT_STATS_CPU_NS)
+    return AT_STATS_CPU_NS();
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return at_stats_clock_ns();
+#endif
+}
+
+/* vim: set ts=4 sw=4 et: */
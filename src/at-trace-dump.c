@@ -0,0 +1,95 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Convert trace dumps (see at-trace.h) to Chrome trace JSON.
+ *
+ * Usage: at-trace-dump [-t] dump... > trace.json
+ *
+ * Each dump becomes one track. Open the output in chrome://tracing or
+ * https://ui.perfetto.dev. With -t, print the events as text instead.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <attentive/at-trace.h>
+
+static void print_text(const char *name, const struct at_trace_event *events, size_t count)
+{
+    for (size_t i=0; i<count; i++) {
+        const struct at_trace_event *event = &events[i];
+        printf("%s %llu.%09llu %-12s %6d ", name,
+                (unsigned long long) (event->timestamp / 1000000000),
+                (unsigned long long) (event->timestamp % 1000000000),
+                at_trace_type_name(event->type), (int) event->arg);
+        for (size_t j=0; j<event->len; j++) {
+            unsigned char ch = event->text[j];
+            if (ch >= 0x20 && ch < 0x7f)
+                putchar(ch);
+            else
+                printf("\\x%02x", ch);
+        }
+        putchar('\n');
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool text = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        switch (opt) {
+            case 't': text = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-t] dump...\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-t] dump...\n", argv[0]);
+        return 1;
+    }
+
+    if (!text)
+        printf("[\n");
+
+    for (int i=optind; i<argc; i++) {
+        char name[AT_TRACE_NAME];
+        size_t count;
+        struct at_trace_event *events = at_trace_load(argv[i], name, &count);
+        if (!events) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+            return 1;
+        }
+        if (!*name)
+            snprintf(name, sizeof(name), "%s", argv[i]);
+
+        if (text) {
+            print_text(name, events, count);
+        } else {
+            if (i > optind)
+                printf(",\n");
+            at_trace_export_chrome(stdout, events, count, i - optind + 1, name);
+        }
+        free(events);
+    }
+
+    if (!text)
+        printf("\n]\n");
+
+    return ferror(stdout) ? 1 : 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
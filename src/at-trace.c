@@ -0,0 +1,339 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <attentive/at-trace.h>
+#include <attentive/parser.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_MAGIC         "ATTRC"
+#define TRACE_HEADER_SIZE   48
+
+/* Ports without POSIX clocks can supply their own nanosecond timestamp. */
+#ifndef AT_TRACE_CLOCK_NS
+static uint64_t trace_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#define AT_TRACE_CLOCK_NS() trace_clock_ns()
+#endif
+
+struct at_trace {
+    char name[AT_TRACE_NAME];
+    size_t mask;
+    size_t head;            /**< Next event index; claimed with fetch-and-add. */
+    struct at_trace_event events[];
+};
+
+struct at_trace *at_trace_alloc(const char *name, size_t events)
+{
+    size_t size = 1;
+    while (size < events)
+        size <<= 1;
+
+    struct at_trace *trace = calloc(1, sizeof(struct at_trace) + size * sizeof(struct at_trace_event));
+    if (!trace) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    snprintf(trace->name, sizeof(trace->name), "%s", name ? name : "");
+    trace->mask = size - 1;
+
+    return trace;
+}
+
+void at_trace_free(struct at_trace *trace)
+{
+    free(trace);
+}
+
+void at_trace_event(struct at_trace *trace, enum at_trace_type type, int32_t arg,
+                    const void *text, size_t len)
+{
+    uint64_t now = AT_TRACE_CLOCK_NS();
+    size_t index = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    struct at_trace_event *event = &trace->events[index & trace->mask];
+
+    /* Per-slot seqlock: readers discard the slot while seq is zero or has
+     * changed under them. */
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (len > AT_TRACE_TEXT)
+        len = AT_TRACE_TEXT;
+    event->timestamp = now;
+    event->type = type;
+    event->len = text ? len : 0;
+    event->arg = arg;
+    if (text)
+        memcpy(event->text, text, len);
+
+    __atomic_store_n(&event->seq, (uint32_t) (index + 1), __ATOMIC_RELEASE);
+}
+
+size_t at_trace_snapshot(struct at_trace *trace, struct at_trace_event *events, size_t max)
+{
+    size_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    size_t start = head > trace->mask + 1 ? head - (trace->mask + 1) : 0;
+    if (head - start > max)
+        start = head - max;
+
+    size_t count = 0;
+    for (size_t i=start; i<head; i++) {
+        struct at_trace_event *event = &trace->events[i & trace->mask];
+        uint32_t seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+        if (seq != (uint32_t) (i + 1))
+            continue;
+        memcpy(&events[count], event, sizeof(*event));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&event->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        count++;
+    }
+
+    return count;
+}
+
+int at_trace_dump(struct at_trace *trace, const char *path)
+{
+    size_t max = trace->mask + 1;
+    struct at_trace_event *events = malloc(max * sizeof(struct at_trace_event));
+    if (!events) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t count = at_trace_snapshot(trace, events, max);
+
+    uint8_t header[TRACE_HEADER_SIZE] = {0};
+    uint16_t version = AT_TRACE_VERSION;
+    uint16_t event_size = sizeof(struct at_trace_event);
+    uint32_t count32 = count;
+    memcpy(header, TRACE_MAGIC, 6);
+    memcpy(header + 6, &version, 2);
+    memcpy(header + 8, &event_size, 2);
+    memcpy(header + 12, &count32, 4);
+    memcpy(header + 16, trace->name, AT_TRACE_NAME);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        free(events);
+        return -1;
+    }
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+              fwrite(events, sizeof(struct at_trace_event), count, f) == count;
+    free(events);
+    if (fclose(f) != 0 || !ok) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+struct at_trace_event *at_trace_load(const char *path, char *name, size_t *count)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    uint8_t header[TRACE_HEADER_SIZE];
+    uint16_t version, event_size;
+    uint32_t count32;
+    if (fread(header, sizeof(header), 1, f) != 1)
+        goto invalid;
+    memcpy(&version, header + 6, 2);
+    memcpy(&event_size, header + 8, 2);
+    memcpy(&count32, header + 12, 4);
+    if (memcmp(header, TRACE_MAGIC, 6) || version != AT_TRACE_VERSION ||
+        event_size != sizeof(struct at_trace_event))
+        goto invalid;
+
+    struct at_trace_event *events = malloc((count32 ? count32 : 1) * sizeof(struct at_trace_event));
+    if (!events) {
+        fclose(f);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (fread(events, sizeof(struct at_trace_event), count32, f) != count32) {
+        free(events);
+        goto invalid;
+    }
+    fclose(f);
+
+    memcpy(name, header + 16, AT_TRACE_NAME);
+    name[AT_TRACE_NAME-1] = '\0';
+    *count = count32;
+    return events;
+
+invalid:
+    fclose(f);
+    errno = EINVAL;
+    return NULL;
+}
+
+const char *at_trace_type_name(enum at_trace_type type)
+{
+    switch (type) {
+        case AT_TRACE_COMMAND: return "command";
+        case AT_TRACE_COMMAND_RAW: return "command-raw";
+        case AT_TRACE_SEND: return "send";
+        case AT_TRACE_RX: return "rx";
+        case AT_TRACE_LINE: return "line";
+        case AT_TRACE_URC: return "urc";
+        case AT_TRACE_RESPONSE: return "response";
+        case AT_TRACE_TIMEOUT: return "timeout";
+        case AT_TRACE_STATE: return "state";
+        case AT_TRACE_BEGIN: return "begin";
+        case AT_TRACE_END: return "end";
+    }
+    return "unknown";
+}
+
+static const char *line_type_name(int32_t type)
+{
+    switch (type & _AT_RESPONSE_TYPE_MASK) {
+        case AT_RESPONSE_INTERMEDIATE: return "intermediate";
+        case AT_RESPONSE_FINAL_OK: return "final-ok";
+        case AT_RESPONSE_FINAL: return "final";
+        case AT_RESPONSE_URC: return "urc";
+        case _AT_RESPONSE_RAWDATA_FOLLOWS: return "rawdata";
+        case _AT_RESPONSE_HEXDATA_FOLLOWS: return "hexdata";
+        case AT_RESPONSE_UNEXPECTED & _AT_RESPONSE_TYPE_MASK: return "unexpected";
+        default: return "unknown";
+    }
+}
+
+static void json_string(FILE *out, const char *text, size_t len)
+{
+    fputc('"', out);
+    for (size_t i=0; i<len; i++) {
+        unsigned char ch = text[i];
+        if (ch == '"' || ch == '\\')
+            fprintf(out, "\\%c", ch);
+        else if (ch < 0x20 || ch >= 0x7f)
+            fprintf(out, "\\u%04x", ch);
+        else
+            fputc(ch, out);
+    }
+    fputc('"', out);
+}
+
+static void chrome_event(FILE *out, const struct at_trace_event *event, const char *ph,
+                         const char *name, size_t name_len, int tid)
+{
+    fprintf(out, ",\n{\"name\":");
+    json_string(out, name, name_len);
+    fprintf(out, ",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+            at_trace_type_name(event->type), ph, event->timestamp / 1000.0, tid);
+    if (!strcmp(ph, "i"))
+        fprintf(out, ",\"s\":\"t\"");
+}
+
+int at_trace_export_chrome(FILE *out, const struct at_trace_event *events, size_t count,
+                           int tid, const char *name)
+{
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", tid);
+    json_string(out, name, strlen(name));
+    fprintf(out, "}}");
+
+    /* The command awaiting its response, if any. */
+    const struct at_trace_event *command = NULL;
+
+    for (size_t i=0; i<count; i++) {
+        const struct at_trace_event *event = &events[i];
+        switch (event->type) {
+            case AT_TRACE_COMMAND:
+            case AT_TRACE_COMMAND_RAW:
+                if (command) {
+                    /* Never completed; show where it started. */
+                    chrome_event(out, command, "i", command->text, command->len, tid);
+                    fprintf(out, "}");
+                }
+                command = event;
+                break;
+
+            case AT_TRACE_RESPONSE:
+            case AT_TRACE_TIMEOUT:
+                if (!command) {
+                    chrome_event(out, event, "i", at_trace_type_name(event->type),
+                                 strlen(at_trace_type_name(event->type)), tid);
+                    fprintf(out, "}");
+                    break;
+                }
+                if (command->type == AT_TRACE_COMMAND_RAW) {
+                    char label[32];
+                    int n = snprintf(label, sizeof(label), "raw %d bytes", (int) command->arg);
+                    chrome_event(out, command, "X", label, n, tid);
+                } else {
+                    chrome_event(out, command, "X", command->text, command->len, tid);
+                }
+                fprintf(out, ",\"dur\":%.3f,\"args\":{",
+                        (event->timestamp - command->timestamp) / 1000.0);
+                if (event->type == AT_TRACE_TIMEOUT) {
+                    fprintf(out, "\"timeout\":true}}");
+                } else {
+                    fprintf(out, "\"response\":");
+                    json_string(out, event->text, event->len);
+                    fprintf(out, ",\"length\":%d}}", (int) event->arg);
+                }
+                command = NULL;
+                break;
+
+            case AT_TRACE_BEGIN:
+            case AT_TRACE_END:
+                chrome_event(out, event, event->type == AT_TRACE_BEGIN ? "B" : "E",
+                             event->text, event->len, tid);
+                if (event->type == AT_TRACE_END)
+                    fprintf(out, ",\"args\":{\"result\":%d}", (int) event->arg);
+                fprintf(out, "}");
+                break;
+
+            case AT_TRACE_LINE:
+            {
+                const char *kind = line_type_name(event->arg);
+                chrome_event(out, event, "i", kind, strlen(kind), tid);
+                fprintf(out, ",\"args\":{\"line\":");
+                json_string(out, event->text, event->len);
+                fprintf(out, "}}");
+                break;
+            }
+
+            case AT_TRACE_STATE:
+                chrome_event(out, event, "i", event->text, event->len, tid);
+                fprintf(out, ",\"args\":{\"value\":%d}}", (int) event->arg);
+                break;
+
+            default:
+            {
+                const char *kind = at_trace_type_name(event->type);
+                chrome_event(out, event, "i", kind, strlen(kind), tid);
+                fprintf(out, ",\"args\":{\"arg\":%d,\"text\":", (int) event->arg);
+                json_string(out, event->text, event->len);
+                fprintf(out, "}}");
+                break;
+            }
+        }
+    }
+
+    if (command) {
+        chrome_event(out, command, "i", command->text, command->len, tid);
+        fprintf(out, "}");
+    }
+
+    return ferror(out) ? -1 : 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
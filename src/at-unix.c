@@ -6,86 +6,234 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
-#include <attentive/at.h>
+#define _GNU_SOURCE
+
+#include <attentive/at-unix.h>
+#include <attentive/at-capture.h>
+#include <attentive/at-clock.h>
+#include <attentive/at-executor.h>
+#include <attentive/at-probes.h>
+#include <attentive/ring.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
-#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <termios.h>
 #include <unistd.h>
 
-#if _POSIX_TIMERS > 0
-#include <time.h>
-#else
-#include <sys/time.h>
-#endif
-
 // Remove once you refactor this out.
 #define AT_COMMAND_LENGTH 80
 
+#define AT_UNIX_BUFFER      256     /* Response and deferred URC size. */
+#define AT_UNIX_RING_SIZE   16384   /* Power of two. */
+#define AT_UNIX_READ_SIZE   512
+#define AT_UNIX_CLOCK_POLL_MS 10    /* How often to check held URCs on a virtual clock. */
+
+/* An answer to a shared query, kept for identical ones. */
+struct at_unix_query {
+    char line[AT_COMMAND_LENGTH];
+    size_t len;
+    struct at_buf *response;    /**< NULL if the slot is free. */
+    uint64_t when;          /**< Clock time it arrived. */
+};
+
+#define AT_UNIX_QUERIES      4  /* Distinct shared queries remembered. */
+
 struct at_unix {
     struct at at;
 
-    const char *devpath;    /**< Serial port device path. */
+    const char *devpath;    /**< Serial port device path, or TCP host. */
     speed_t baudrate;       /**< Serial port baudate. */
-
-    int timeout;            /**< Command timeout in seconds. */
-    const char *response;
+    const char *service;    /**< TCP port; set by at_alloc_tcp(). */
+    int flags;              /**< AT_TCP_* flags. */
+
+    int timeout;            /**< Default command timeout in seconds. Atomic. */
+    at_line_scanner_t scanner;  /**< From at_set_command_scanner(). Atomic. */
+    bool dataprompt;        /**< From at_expect_dataprompt(). Atomic. */
+    uint64_t deadline;      /**< Default deadline: clock time, or zero. Atomic. */
+    struct at_cancel *token;    /**< Default cancellation token, if any. Atomic. */
+    struct at_buf *response;    /**< Taken over from the parser; see at-buf.h. */
+    struct at_buf *last;    /**< Held until the next at_command(). */
+    struct at_unix_query queries[AT_UNIX_QUERIES];
+    uint64_t share_window;  /**< How long shared answers stay fresh, ns. */
+    struct at_clock *clock; /**< Virtual clock, or NULL for the system one. */
+
+    struct at_capture *capture; /**< Traffic recorder, if any. Atomic. */
+    pthread_mutex_t capture_lock;   /**< Held while recording; see record(). */
+    struct at_strand *strand;   /**< URC handlers run here, if set. */
+    struct at_buf_pool *urcs;   /**< URC copies queued on the strand. */
+    struct at_stats stats;  /**< Live counters; see at-stats.h. */
+    int verb;               /**< Stats slot of the pending command, or -1. */
+    uint64_t sent;          /**< When the pending command was sent. */
+
+    /* The reader thread only moves bytes from the port into the ring, and
+     * takes no lock doing so, so a slow callback can't keep it from draining
+     * the tty. The parser thread
+     * feeds the parser, and runs all callbacks, under the mutex. When the
+     * ring is full the reader leaves the rest in the port until there's
+     * room again, so nothing is lost. */
+    struct at_ring ring;
+    uint8_t ring_buf[AT_UNIX_RING_SIZE];
+    int wakeup;             /**< eventfd; reader to parser thread. */
+    bool stalled;           /**< Reader waiting for room in the ring. Atomic. */
+    bool release;           /**< Reader should hand the port back. Atomic. */
+    pthread_t parser_thread;
 
     pthread_t thread;       /**< Reader thread. */
+    int cancel;             /**< eventfd; interrupts the reader's poll(). */
     pthread_mutex_t mutex;  /**< Protects variables below and the parser. */
     pthread_cond_t cond;    /**< For signalling open/busy release. */
+    pthread_cond_t turn;    /**< Signalled when the channel is up for grabs. */
+    struct at_unix_turn *queue; /**< Commands waiting, in order of service. */
+    bool commanding;        /**< A command has the channel. */
 
     int fd;                 /**< Serial port file descriptor. */
     bool running : 1;       /**< Reader thread should be running. */
     bool open : 1;          /**< FD is valid. Set/cleared by open()/close(). */
     bool busy : 1;          /**< FD is in use. Set/cleared by reader thread. */
     bool waiting : 1;       /**< Waiting for response callback to arrive. */
+    bool resync : 1;        /**< Channel out of sync since a timeout. */
+    int resync_register;    /**< S-register for the sentinel, or -1. */
+    int nonce;              /**< Last sentinel value, 1..255. */
+    bool rx_mark;           /**< Trace the next received chunk. Atomic. */
+
+    /* Telnet decoder; reader thread only. */
+    int telnet;             /**< Where we are in a command sequence. */
+    uint8_t telnet_verb;    /**< WILL/WONT/DO/DONT being parsed. */
 };
 
-void *at_reader_thread(void *arg);
+/* A command waiting for the channel; lives on the caller's stack. */
+struct at_unix_turn {
+    struct at_unix_turn *next;
+    int priority;
+};
 
-static void handle_sigusr1(int signal)
-{
-    (void)signal;
-}
+/* A caller blocked on a channel, listed on its cancellation token so that
+ * at_cancel() can wake it up. Lives on the caller's stack. */
+struct at_cancel_wait {
+    struct at_cancel_wait *next;
+    struct at_unix *priv;
+};
+
+/* What one command or delay may spend: its own deadline and token, or the
+ * channel defaults, read once when it starts. */
+struct at_unix_caller {
+    uint64_t deadline;          /**< Clock time, or zero. */
+    struct at_cancel *token;    /**< Cancellation token, or NULL. */
+    struct at_cancel_wait wait; /**< On the token's list meanwhile. */
+};
+
+/* Guards the waiter lists of all tokens. Taken before a channel mutex,
+ * never while holding one. */
+static pthread_mutex_t cancel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *at_reader_thread(void *arg);
+static void *at_parser_thread(void *arg);
 
 static void handle_response(const char *buf, size_t len, void *arg)
 {
     struct at_unix *priv = (struct at_unix *) arg;
 
-    /* The mutex is held by the reader thread; don't reacquire. */
-    priv->response = buf;
-    (void) len;
+    /* The mutex is held by the parser thread; don't reacquire. Take the
+     * buffer over, so URCs in the same chunk can't overwrite the response
+     * before the caller gets to look at it. */
+    at_buf_release(priv->response);
+    priv->response = at_parser_take_response(priv->at.parser);
+    AT_TRACE(&priv->at, AT_TRACE_RESPONSE, len, buf, len);
+    AT_PROBE4(response, &priv->at, buf, len, priv->sent);
+    if (priv->verb >= 0)
+        at_stats_response(&priv->stats, priv->verb, at_stats_clock_ns() - priv->sent);
     priv->waiting = false;
-    pthread_cond_signal(&priv->cond);
+    /* at_delay() callers may be waiting on the same condition. */
+    pthread_cond_broadcast(&priv->cond);
+}
+
+static void run_urc(struct at_unix *priv, const char *buf, size_t len)
+{
+    struct at *at = &priv->at;
+
+    uint64_t start = at_stats_cpu_ns();
+    at->cbs->handle_urc(buf, len, at->arg);
+    AT_STATS_ADD(priv->stats.handle_urc_ns, at_stats_cpu_ns() - start);
+    AT_STATS_ADD(priv->stats.handle_urc_calls, 1);
+}
+
+static void run_deferred_urc(void *arg, struct at_buf *buf)
+{
+    run_urc((struct at_unix *) arg, buf->data, buf->len);
 }
 
 static void handle_urc(const char *buf, size_t len, void *arg)
 {
-    struct at *at = (struct at *) arg;
+    struct at_unix *priv = (struct at_unix *) arg;
+    struct at *at = &priv->at;
+
+    AT_TRACE(at, AT_TRACE_URC, len, buf, len);
+    AT_PROBE3(urc, at, buf, len);
 
     /* Forward to caller's URC callback, if any. */
-    if (at->cbs->handle_urc)
-        at->cbs->handle_urc(buf, len, at->arg);
+    if (!at->cbs || !at->cbs->handle_urc)
+        return;
+
+    /* With an executor, queue a copy and get on with parsing. */
+    if (priv->strand) {
+        struct at_buf *event = at_buf_acquire(priv->urcs);
+        if (event) {
+            event->len = len < AT_UNIX_BUFFER ? len : AT_UNIX_BUFFER - 1;
+            memcpy(event->data, buf, event->len);
+            event->data[event->len] = '\0';
+            if (at_strand_post(priv->strand, run_deferred_urc, priv, event) == 0)
+                return;
+            at_buf_release(event);
+        }
+        /* Out of memory; better late than never. */
+    }
+
+    run_urc(priv, buf, len);
 }
 
 enum at_response_type scan_line(const char *line, size_t len, void *arg)
 {
-    struct at *at = (struct at *) arg;
+    struct at_unix *priv = (struct at_unix *) arg;
+    struct at *at = &priv->at;
 
     enum at_response_type type = AT_RESPONSE_UNKNOWN;
     if (at->command_scanner)
         type = at->command_scanner(line, len, at->arg);
-    if (!type && at->cbs && at->cbs->scan_line)
+    if (!type && at->cbs && at->cbs->scan_line) {
+        uint64_t start = at_stats_cpu_ns();
         type = at->cbs->scan_line(line, len, at->arg);
+        AT_STATS_ADD(priv->stats.scan_line_ns, at_stats_cpu_ns() - start);
+        AT_STATS_ADD(priv->stats.scan_line_calls, 1);
+    }
     return type;
 }
 
+static size_t handle_stream(const void *data, size_t len, void *arg)
+{
+    struct at *at = (struct at *) arg;
+
+    /* Forward to caller's stream handler. */
+    return at->stream_handler(data, len, at->arg);
+}
+
+/* URC policy windows run on the channel's clock. Called with the mutex held. */
+static uint64_t parser_clock(void *arg)
+{
+    struct at_unix *priv = (struct at_unix *) arg;
+    return at_clock_now(priv->clock);
+}
+
 static const struct at_parser_callbacks parser_callbacks = {
     .handle_response = handle_response,
     .handle_urc = handle_urc,
@@ -103,54 +251,325 @@ struct at *at_alloc_unix(const char *devpath, speed_t baudrate)
     memset(priv, 0, sizeof(struct at_unix));
 
     /* allocate underlying parser */
-    priv->at.parser = at_parser_alloc(&parser_callbacks, 256, (void *) priv);
+    priv->at.parser = at_parser_alloc(&parser_callbacks, AT_UNIX_BUFFER, (void *) priv);
     if (!priv->at.parser) {
         free(priv);
         return NULL;
     }
+    at_parser_set_stats(priv->at.parser, &priv->stats);
+    at_parser_set_clock(priv->at.parser, parser_clock);
+
+    /* receive path between the threads */
+    at_ring_init(&priv->ring, priv->ring_buf, sizeof(priv->ring_buf));
+    priv->wakeup = eventfd(0, EFD_CLOEXEC);
+    if (priv->wakeup == -1) {
+        at_parser_free(priv->at.parser);
+        free(priv);
+        return NULL;
+    }
+    priv->cancel = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (priv->cancel == -1) {
+        close(priv->wakeup);
+        at_parser_free(priv->at.parser);
+        free(priv);
+        return NULL;
+    }
 
     /* copy over device parameters */
     priv->devpath = devpath;
     priv->baudrate = baudrate;
+    priv->resync_register = AT_RESYNC_REGISTER;
 
-    /* install empty SIGUSR1 handler */
-    struct sigaction sa = {
-        .sa_handler = handle_sigusr1,
-    };
-    sigaction(SIGUSR1, &sa, NULL);
-
-    /* initialize and start reader thread */
+    /* initialize and start reader and parser threads */
     priv->running = true;
     pthread_mutex_init(&priv->mutex, NULL);
+    pthread_mutex_init(&priv->capture_lock, NULL);
     pthread_cond_init(&priv->cond, NULL);
+    pthread_cond_init(&priv->turn, NULL);
     pthread_create(&priv->thread, NULL, at_reader_thread, (void *) priv);
+    pthread_create(&priv->parser_thread, NULL, at_parser_thread, (void *) priv);
+
+    return (struct at *) priv;
+}
+
+struct at *at_alloc_tcp(const char *host, const char *service, speed_t baudrate, int flags)
+{
+    struct at_unix *priv = (struct at_unix *) at_alloc_unix(host, baudrate);
+    if (!priv)
+        return NULL;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->service = service;
+    priv->flags = flags;
+    pthread_mutex_unlock(&priv->mutex);
 
     return (struct at *) priv;
 }
 
+/*
+ * Network serial ports.
+ *
+ * Raw TCP carries the serial stream as is (ser2net "raw" ports). RFC 2217
+ * runs it over Telnet: 0xFF bytes are doubled, and the COM-PORT-OPTION
+ * subnegotiation sets the line up on the far end. We announce what we need
+ * right after connecting, refuse anything else the server asks for, and
+ * drop its notifications and replies.
+ */
+
+#define TELNET_SE       240
+#define TELNET_SB       250
+#define TELNET_WILL     251
+#define TELNET_WONT     252
+#define TELNET_DO       253
+#define TELNET_DONT     254
+#define TELNET_IAC      255
+
+#define TELNET_BINARY   0
+#define TELNET_SGA      3
+#define TELNET_COMPORT  44
+
+#define COMPORT_SET_BAUDRATE    1
+#define COMPORT_SET_DATASIZE    2
+#define COMPORT_SET_PARITY      3
+#define COMPORT_SET_STOPSIZE    4
+#define COMPORT_SET_CONTROL     5
+
+enum { TELNET_DATA, TELNET_COMMAND, TELNET_OPTION, TELNET_SUB, TELNET_SUB_IAC };
+
+static uint32_t baud_bps(speed_t speed)
+{
+    static const struct { speed_t speed; uint32_t bps; } rates[] = {
+        { B1200, 1200 }, { B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 },
+        { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+        { B115200, 115200 }, { B230400, 230400 }, { B460800, 460800 },
+        { B921600, 921600 },
+    };
+    for (size_t i=0; i<sizeof(rates)/sizeof(rates[0]); i++)
+        if (rates[i].speed == speed)
+            return rates[i].bps;
+    return 0;
+}
+
+/* Write everything, as one segment where possible. Returns bytes of data
+ * written; the port escapes them on the way out. */
+static size_t port_write(struct at_unix *priv, const void *data, size_t size)
+{
+    bool tcp = priv->service;
+    bool telnet = priv->flags & AT_TCP_RFC2217;
+    if (tcp)
+        setsockopt(priv->fd, IPPROTO_TCP, TCP_CORK, &(int) { 1 }, sizeof(int));
+
+    const uint8_t *p = data;
+    size_t done = 0;
+    while (done < size) {
+        /* Escape into a bounce buffer; worst case doubles the size. */
+        uint8_t escaped[AT_UNIX_READ_SIZE];
+        const uint8_t *out = p + done;
+        size_t take = size - done, len = take;
+        if (telnet) {
+            if (take > sizeof(escaped) / 2)
+                take = sizeof(escaped) / 2;
+            len = 0;
+            for (size_t i=0; i<take; i++) {
+                escaped[len++] = p[done + i];
+                if (p[done + i] == TELNET_IAC)
+                    escaped[len++] = TELNET_IAC;
+            }
+            out = escaped;
+        }
+
+        size_t off = 0;
+        while (off < len) {
+            ssize_t written = tcp ? send(priv->fd, out + off, len - off, MSG_NOSIGNAL)
+                                  : write(priv->fd, out + off, len - off);
+            if (written == -1 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                break;
+            off += written;
+        }
+        if (off < len)
+            break;
+        done += take;
+    }
+
+    if (tcp)
+        setsockopt(priv->fd, IPPROTO_TCP, TCP_CORK, &(int) { 0 }, sizeof(int));
+    return done;
+}
+
+/* Raw protocol bytes, unescaped. Each send() lands whole, between the
+ * escaped chunks of port_write(), so the reader needs no lock for this. */
+static void telnet_send(struct at_unix *priv, const uint8_t *data, size_t size)
+{
+    size_t off = 0;
+    while (off < size) {
+        ssize_t written = send(priv->fd, data + off, size - off, MSG_NOSIGNAL);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        off += written;
+    }
+}
+
+static size_t comport_option(uint8_t *buf, uint8_t command, uint32_t value, int bytes)
+{
+    size_t len = 0;
+    buf[len++] = TELNET_IAC;
+    buf[len++] = TELNET_SB;
+    buf[len++] = TELNET_COMPORT;
+    buf[len++] = command;
+    while (bytes--) {
+        buf[len] = value >> (8 * bytes);
+        if (buf[len++] == TELNET_IAC)
+            buf[len++] = TELNET_IAC;
+    }
+    buf[len++] = TELNET_IAC;
+    buf[len++] = TELNET_SE;
+    return len;
+}
+
+static void telnet_start(struct at_unix *priv)
+{
+    uint8_t buf[96];
+    size_t len = 0;
+    static const uint8_t options[][2] = {
+        { TELNET_WILL, TELNET_BINARY }, { TELNET_DO, TELNET_BINARY },
+        { TELNET_WILL, TELNET_SGA }, { TELNET_DO, TELNET_SGA },
+        { TELNET_WILL, TELNET_COMPORT },
+    };
+    for (size_t i=0; i<sizeof(options)/sizeof(options[0]); i++) {
+        buf[len++] = TELNET_IAC;
+        buf[len++] = options[i][0];
+        buf[len++] = options[i][1];
+    }
+
+    /* 8N1, at the requested rate if any, with the requested flow control. */
+    uint32_t bps = baud_bps(priv->baudrate);
+    if (bps)
+        len += comport_option(buf + len, COMPORT_SET_BAUDRATE, bps, 4);
+    len += comport_option(buf + len, COMPORT_SET_DATASIZE, 8, 1);
+    len += comport_option(buf + len, COMPORT_SET_PARITY, 1, 1);
+    len += comport_option(buf + len, COMPORT_SET_STOPSIZE, 1, 1);
+    len += comport_option(buf + len, COMPORT_SET_CONTROL, (priv->flags & AT_TCP_RTSCTS) ? 3 : 1, 1);
+
+    priv->telnet = TELNET_DATA;
+    telnet_send(priv, buf, len);
+}
+
+/* Strip Telnet commands from received data, in place. Called by the reader
+ * thread while it owns the descriptor. */
+static size_t telnet_decode(struct at_unix *priv, uint8_t *buf, size_t len)
+{
+    size_t out = 0;
+    for (size_t i=0; i<len; i++) {
+        uint8_t ch = buf[i];
+        switch (priv->telnet) {
+            case TELNET_DATA:
+                if (ch == TELNET_IAC)
+                    priv->telnet = TELNET_COMMAND;
+                else
+                    buf[out++] = ch;
+                break;
+            case TELNET_COMMAND:
+                priv->telnet = TELNET_DATA;
+                if (ch == TELNET_IAC) {
+                    buf[out++] = ch;
+                } else if (ch == TELNET_SB) {
+                    priv->telnet = TELNET_SUB;
+                } else if (ch >= TELNET_WILL) {
+                    priv->telnet_verb = ch;
+                    priv->telnet = TELNET_OPTION;
+                }
+                break;
+            case TELNET_OPTION:
+                priv->telnet = TELNET_DATA;
+                if ((priv->telnet_verb == TELNET_WILL || priv->telnet_verb == TELNET_DO) &&
+                    ch != TELNET_BINARY && ch != TELNET_SGA && ch != TELNET_COMPORT) {
+                    uint8_t refusal[3] = {
+                        TELNET_IAC, priv->telnet_verb == TELNET_WILL ? TELNET_DONT : TELNET_WONT, ch,
+                    };
+                    telnet_send(priv, refusal, sizeof(refusal));
+                }
+                break;
+            case TELNET_SUB:
+                if (ch == TELNET_IAC)
+                    priv->telnet = TELNET_SUB_IAC;
+                break;
+            case TELNET_SUB_IAC:
+                priv->telnet = ch == TELNET_SE ? TELNET_DATA : TELNET_SUB;
+                break;
+        }
+    }
+    return out;
+}
+
+static int open_tcp(struct at_unix *priv)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *addrs;
+    int error = getaddrinfo(priv->devpath, priv->service, &hints, &addrs);
+    if (error) {
+        errno = error == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = addrs; ai && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+            int why = errno;
+            close(fd);
+            fd = -1;
+            errno = why;
+        }
+    }
+    freeaddrinfo(addrs);
+    if (fd == -1)
+        return -1;
+
+    /* Whole commands go out at once (see port_write()); don't hold them
+     * back waiting for ACKs. */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) { 1 }, sizeof(int));
+    return fd;
+}
+
 int at_open(struct at *at)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
     pthread_mutex_lock(&priv->mutex);
-    if (priv->open) {
-        pthread_mutex_unlock(&priv->mutex);
+    bool already = priv->open;
+    pthread_mutex_unlock(&priv->mutex);
+    if (already)
         return 0;
-    }
 
-    priv->fd = open(priv->devpath, O_RDWR);
-    if (priv->fd == -1) {
-        pthread_mutex_unlock(&priv->mutex);
+    /* Name lookup and connect can take long; don't hold the channel up
+     * meanwhile. */
+    int fd = priv->service ? open_tcp(priv) : open(priv->devpath, O_RDWR);
+    if (fd == -1)
         return -1;
+
+    pthread_mutex_lock(&priv->mutex);
+    if (priv->open) {
+        /* Opened by someone else in the meantime. */
+        pthread_mutex_unlock(&priv->mutex);
+        close(fd);
+        return 0;
     }
+    priv->fd = fd;
 
-    if (priv->baudrate) {
+    if (priv->flags & AT_TCP_RFC2217) {
+        telnet_start(priv);
+    } else if (priv->baudrate && !priv->service) {
         struct termios attr;
         tcgetattr(priv->fd, &attr);
         cfsetspeed(&attr, priv->baudrate);
         tcsetattr(priv->fd, TCSANOW, &attr);
     }
 
+    __atomic_store_n(&priv->release, false, __ATOMIC_SEQ_CST);
     priv->open = true;
     pthread_cond_signal(&priv->cond);
     pthread_mutex_unlock(&priv->mutex);
@@ -168,11 +587,15 @@ int at_close(struct at *at)
         return 0;
     }
 
-    /* Mark the port descriptor as invalid. */
+    /* Mark the port descriptor as invalid; queued commands give up. */
     priv->open = false;
+    pthread_cond_broadcast(&priv->turn);
 
-    /* Interrupt read() in the reader thread. */
-    pthread_kill(priv->thread, SIGUSR1);
+    /* Ask the reader thread for the port back and interrupt its poll(). The
+     * count stays set until the reader consumes it, so this can't be missed. */
+    __atomic_store_n(&priv->release, true, __ATOMIC_SEQ_CST);
+    uint64_t one = 1;
+    write(priv->cancel, &one, sizeof(one));
 
     /* Wait for the read operation to complete. */
     while (priv->busy)
@@ -190,22 +613,38 @@ void at_free(struct at *at)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
-    /* make sure the channel is closed */
+    /* make sure the channel is closed and can't be woken up anymore */
     at_close(at);
+    at_set_cancel(at, NULL);
 
     /* ask the reader thread to terminate */
     pthread_mutex_lock(&priv->mutex);
     priv->running = false;
+    pthread_cond_broadcast(&priv->cond);
     pthread_mutex_unlock(&priv->mutex);
 
-    /* wait for the reader thread to terminate */
-    pthread_kill(priv->thread, SIGUSR1);
+    /* wait for the reader and parser threads to terminate */
+    uint64_t one = 1;
+    write(priv->cancel, &one, sizeof(one));
     pthread_join(priv->thread, NULL);
+    write(priv->wakeup, &one, sizeof(one));
+    pthread_join(priv->parser_thread, NULL);
+
+    /* let deferred URC handlers finish; commands from them fail now */
+    at_unix_set_executor(at, NULL);
+    pthread_cond_destroy(&priv->turn);
     pthread_cond_destroy(&priv->cond);
+    pthread_mutex_destroy(&priv->capture_lock);
     pthread_mutex_destroy(&priv->mutex);
 
     /* free up resources */
-    free(priv->at.parser);
+    close(priv->cancel);
+    close(priv->wakeup);
+    at_buf_release(priv->response);
+    at_buf_release(priv->last);
+    for (int i=0; i<AT_UNIX_QUERIES; i++)
+        at_buf_release(priv->queries[i].response);
+    at_parser_free(priv->at.parser);
     free(priv);
 }
 
@@ -215,87 +654,725 @@ void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
     at->arg = arg;
 }
 
+void at_unix_set_clock(struct at *at, struct at_clock *clock)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->clock = clock;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+uint64_t at_now(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    return at_clock_now(priv->clock);
+}
+
+void at_unix_set_capture(struct at *at, struct at_capture *capture)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Records in progress finish first; the old capture may be closed
+     * once this returns. */
+    pthread_mutex_lock(&priv->capture_lock);
+    __atomic_store_n(&priv->capture, capture, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&priv->capture_lock);
+}
+
+/* Record traffic, if a capture is set. Called from the reader thread as
+ * data arrives, and by senders; takes only the capture lock, so the reader
+ * doesn't wait for the parser to time what it read. */
+static void record(struct at_unix *priv, enum at_capture_direction direction,
+                   const void *data, size_t size)
+{
+    if (!__atomic_load_n(&priv->capture, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&priv->capture_lock);
+    if (priv->capture)
+        at_capture_write(priv->capture, direction, data, size);
+    pthread_mutex_unlock(&priv->capture_lock);
+}
+
+int at_unix_set_executor(struct at *at, struct at_executor *executor)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    struct at_strand *strand = NULL;
+    struct at_buf_pool *urcs = NULL;
+    if (executor) {
+        strand = at_strand_alloc(executor);
+        urcs = at_buf_pool_alloc(AT_UNIX_BUFFER, 4);
+        if (!strand || !urcs) {
+            if (strand)
+                at_strand_free(strand);
+            if (urcs)
+                at_buf_pool_free(urcs);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&priv->mutex);
+    struct at_strand *old_strand = priv->strand;
+    struct at_buf_pool *old_urcs = priv->urcs;
+    priv->strand = strand;
+    priv->urcs = urcs;
+    pthread_mutex_unlock(&priv->mutex);
+
+    /* URCs already queued run before this returns. Their buffers keep the
+     * old pool alive until then. */
+    if (old_strand)
+        at_strand_free(old_strand);
+    if (old_urcs)
+        at_buf_pool_free(old_urcs);
+
+    return 0;
+}
+
+void at_unix_get_rx_stats(struct at *at, struct at_ring_stats *stats)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    at_ring_get_stats(&priv->ring, stats);
+}
+
+void at_get_stats(struct at *at, struct at_stats *stats)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    at_stats_snapshot(&priv->stats, stats);
+}
+
 void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
 {
-    at->command_scanner = scanner;
+    struct at_unix *priv = (struct at_unix *) at;
+
+    __atomic_store_n(&priv->scanner, scanner, __ATOMIC_RELAXED);
+}
+
+void at_set_trace(struct at *at, struct at_trace *trace)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    at->trace = trace;
+    at_parser_set_trace(at->parser, trace);
+    pthread_mutex_unlock(&priv->mutex);
 }
 
 void at_set_timeout(struct at *at, int timeout)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
-    priv->timeout = timeout;
+    __atomic_store_n(&priv->timeout, timeout, __ATOMIC_RELAXED);
 }
 
-void at_expect_dataprompt(struct at *at)
+void at_cancel(struct at_cancel *token)
+{
+    __atomic_store_n(&token->cancelled, true, __ATOMIC_SEQ_CST);
+
+    /* Wake everyone waiting under the token, whatever the channel. They
+     * check the flag under their channel's mutex, and join the list before
+     * they do, so this can't be missed. */
+    pthread_mutex_lock(&cancel_lock);
+    for (struct at_cancel_wait *wait = token->waiters; wait; wait = wait->next) {
+        struct at_unix *priv = wait->priv;
+        pthread_mutex_lock(&priv->mutex);
+        pthread_cond_broadcast(&priv->cond);
+        pthread_cond_broadcast(&priv->turn);
+        pthread_mutex_unlock(&priv->mutex);
+    }
+    pthread_mutex_unlock(&cancel_lock);
+}
+
+void at_set_cancel(struct at *at, struct at_cancel *token)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Commands already going keep the token they started with. */
+    __atomic_store_n(&priv->token, token, __ATOMIC_RELAXED);
+}
+
+void at_set_deadline(struct at *at, uint64_t deadline)
 {
-    at_parser_expect_dataprompt(at->parser);
+    struct at_unix *priv = (struct at_unix *) at;
+
+    __atomic_store_n(&priv->deadline, deadline, __ATOMIC_RELAXED);
 }
 
-static const char *_at_command(struct at_unix *priv, const void *data, size_t size)
+void at_set_resync_register(struct at *at, int reg)
 {
+    struct at_unix *priv = (struct at_unix *) at;
+
     pthread_mutex_lock(&priv->mutex);
+    priv->resync_register = reg;
+    if (reg < 0)
+        priv->resync = false;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+void at_set_share_window(struct at *at, int ms)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->share_window = (uint64_t) ms * 1000000;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+int at_set_urc_policy(struct at *at, const char *prefix, enum at_urc_policy policy, int ms)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    int result = at_parser_set_urc_policy(at->parser, prefix, policy, (uint64_t) ms * 1000000);
+    pthread_mutex_unlock(&priv->mutex);
+    return result;
+}
+
+void at_set_stream_handler(struct at *at, at_stream_handler_t handler)
+{
+    /* Called from parser callbacks; the parser thread holds the lock. */
+    at->stream_handler = handler;
+    at_parser_set_stream_handler(at->parser, handler ? handle_stream : NULL);
+}
+
+void at_expect_dataprompt(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Applied by _at_command(), after any resync round trip. */
+    __atomic_store_n(&priv->dataprompt, true, __ATOMIC_RELAXED);
+}
+
+static void send_command(struct at_unix *priv, const void *data, size_t size)
+{
+    priv->sent = at_stats_clock_ns();
+    AT_PROBE3(command, &priv->at, data, size);
+    /* Recorded first: the reader records the answer as it arrives. */
+    record(priv, AT_CAPTURE_TX, data, size);
+    AT_STATS_ADD(priv->stats.tx_bytes, port_write(priv, data, size));
+}
+
+/* Set up a caller's budget from its options, or the channel defaults, and
+ * put it on its token's list. Called without the channel mutex; pair with
+ * caller_end(). */
+static void caller_begin(struct at_unix *priv, struct at_unix_caller *caller,
+                         const struct at_command_options *opts)
+{
+    caller->deadline = opts && opts->deadline ? opts->deadline
+                                              : __atomic_load_n(&priv->deadline, __ATOMIC_RELAXED);
+    caller->token = opts && opts->cancel ? opts->cancel
+                                         : __atomic_load_n(&priv->token, __ATOMIC_RELAXED);
+    if (caller->token) {
+        caller->wait.priv = priv;
+        pthread_mutex_lock(&cancel_lock);
+        caller->wait.next = caller->token->waiters;
+        caller->token->waiters = &caller->wait;
+        pthread_mutex_unlock(&cancel_lock);
+    }
+}
+
+static void caller_end(struct at_unix_caller *caller)
+{
+    if (caller->token) {
+        pthread_mutex_lock(&cancel_lock);
+        struct at_cancel_wait **p = &caller->token->waiters;
+        while (*p != &caller->wait)
+            p = &(*p)->next;
+        *p = caller->wait.next;
+        pthread_mutex_unlock(&cancel_lock);
+    }
+}
+
+static bool cancelled(const struct at_unix_caller *caller)
+{
+    return caller->token && __atomic_load_n(&caller->token->cancelled, __ATOMIC_SEQ_CST);
+}
+
+/* Time left for the caller, in nanoseconds; UINT64_MAX without a deadline.
+ * Zero, with errno set, once cancelled or past the deadline. */
+static uint64_t budget(struct at_unix *priv, const struct at_unix_caller *caller)
+{
+    if (cancelled(caller)) {
+        errno = ECANCELED;
+        return 0;
+    }
+    if (!caller->deadline)
+        return UINT64_MAX;
+    uint64_t now = at_clock_now(priv->clock);
+    if (now >= caller->deadline) {
+        errno = ETIMEDOUT;
+        return 0;
+    }
+    return caller->deadline - now;
+}
+
+/* Wait on the condition until the given clock time, or for good if
+ * UINT64_MAX. Called with the mutex held; may return early, and returns
+ * ETIMEDOUT once the time is up. */
+static int wait_for(struct at_unix *priv, pthread_cond_t *cond, uint64_t until)
+{
+    return at_clock_wait(priv->clock, cond, &priv->mutex, until);
+}
+
+/* Clock time ns from now, for wait_for(). */
+static uint64_t wait_until(struct at_unix *priv, uint64_t ns)
+{
+    if (ns == UINT64_MAX)
+        return UINT64_MAX;
+    return at_clock_now(priv->clock) + ns;
+}
+
+/* Like budget(), but also bounded by a clock time (UINT64_MAX for none),
+ * e.g. the end of the command's timeout. */
+static uint64_t time_left(struct at_unix *priv, const struct at_unix_caller *caller, uint64_t until)
+{
+    uint64_t left = budget(priv, caller);
+    if (left && until != UINT64_MAX) {
+        uint64_t now = at_clock_now(priv->clock);
+        if (now >= until) {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        if (until - now < left)
+            left = until - now;
+    }
+    return left;
+}
+
+/* Wait for the parser thread to collect a response, until the given clock
+ * time or the caller's deadline, whichever comes first. Called with the
+ * mutex held. Returns zero once it's there, -1 and sets errno otherwise. */
+static int await_response(struct at_unix *priv, const struct at_unix_caller *caller, uint64_t until)
+{
+    until = wait_until(priv, time_left(priv, caller, until));
+
+    priv->waiting = true;
+    while (priv->open && priv->waiting && !cancelled(caller))
+        if (wait_for(priv, &priv->cond, until) == ETIMEDOUT)
+            break;
 
-    /* Bail out if the channel is closing or closed. */
     if (!priv->open) {
-        pthread_mutex_unlock(&priv->mutex);
+        /* The serial port was closed behind our back. */
         errno = ENODEV;
-        return NULL;
+        return -1;
     }
+    if (priv->waiting) {
+        priv->waiting = false;
+        errno = cancelled(caller) ? ECANCELED : ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
 
-    /* Prepare parser. */
-    at_parser_await_response(priv->at.parser);
+/*
+ * Get back in sync after a timeout. The late answer may still be on its way,
+ * and would otherwise be taken for the answer to the next command. Store a
+ * fresh nonce in an S-register and read it back in the same command line:
+ * the modem answers in order, so everything before the nonce is stale, and
+ * the final response after it ends the round trip.
+ *
+ * The next command does this before going out, within its own timeout, so
+ * the one that timed out returns on time. A modem that answers the sentinel
+ * command with an error gets a plain AT round trip instead.
+ */
+static int resync(struct at_unix *priv, const struct at_unix_caller *caller, uint64_t until)
+{
+    /* No time for it now; the next command will try. */
+    if (!time_left(priv, caller, until))
+        return -1;
 
-    /* Send the command. */
-    // FIXME: handle interrupts, short writes, errors, etc.
-    write(priv->fd, data, size);
+    int reg = priv->resync_register;
+    priv->nonce = priv->nonce % 255 + 1;
 
-    /* Wait for the parser thread to collect a response. */
-    priv->waiting = true;
-    if (priv->timeout) {
-        struct timespec ts;
-#if _POSIX_TIMERS > 0
-        clock_gettime(CLOCK_REALTIME, &ts);
-#else
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        ts.tv_sec = tv.tv_sec;
-        ts.tv_nsec = tv.tv_usec * 1000;
-#endif
-        ts.tv_sec += priv->timeout;
-
-        while (priv->open && priv->waiting)
-            if (pthread_cond_timedwait(&priv->cond, &priv->mutex, &ts) == ETIMEDOUT)
-                break;
+    char line[32], sentinel[8];
+    int len = snprintf(line, sizeof(line), "ATS%d=%d;S%d?", reg, priv->nonce, reg);
+    snprintf(sentinel, sizeof(sentinel), "%03d", priv->nonce);
+    printf("> %s\n", line);
+    AT_TRACE(&priv->at, AT_TRACE_COMMAND, len, line, len);
+    line[len++] = '\r';
+
+    at_parser_await_response(priv->at.parser);
+    at_parser_expect_sentinel(priv->at.parser, sentinel);
+    priv->verb = -1;
+    AT_STATS_ADD(priv->stats.resyncs, 1);
+    send_command(priv, line, len);
+
+    int result = await_response(priv, caller, until);
+    if (result == 0 && priv->response && priv->response->len) {
+        /* Turned down; settle for a plain AT round trip, which can't tell
+         * a late answer from its own but needn't wait out the timeout. */
+        AT_STATS_ADD(priv->stats.resync_failures, 1);
+        at_buf_release(priv->response);
+        priv->response = NULL;
+        printf("> AT\n");
+        AT_TRACE(&priv->at, AT_TRACE_COMMAND, 2, "AT", 2);
+        at_parser_await_response(priv->at.parser);
+        send_command(priv, "AT\r", 3);
+        result = await_response(priv, caller, until);
+        if (result == 0 && priv->response && priv->response->len) {
+            errno = EIO;
+            result = -1;
+        }
+    } else if (result == -1) {
+        AT_STATS_ADD(priv->stats.resync_failures, 1);
+    }
+    at_buf_release(priv->response);
+    priv->response = NULL;
+    if (result == 0) {
+        priv->resync = false;
     } else {
-        while (priv->open && priv->waiting)
-            pthread_cond_wait(&priv->cond, &priv->mutex);
+        /* Still out of sync; try again before the next command. */
+        at_parser_reset(priv->at.parser);
+        priv->resync = true;
+    }
+    return result;
+}
+
+/*
+ * Commands take turns on the channel: highest priority first, then in order
+ * of arrival. Waiting for a turn counts against the caller's budget. Idle
+ * commands don't wait at all.
+ */
+static int take_turn(struct at_unix *priv, const struct at_unix_caller *caller, int priority, bool idle)
+{
+    if (idle && (priv->commanding || priv->queue || priv->at.stream_handler)) {
+        errno = EBUSY;
+        return -1;
     }
 
-    const char *result;
+    struct at_unix_turn turn = { .priority = priority };
+    struct at_unix_turn **p = &priv->queue;
+    while (*p && (*p)->priority >= priority)
+        p = &(*p)->next;
+    turn.next = *p;
+    *p = &turn;
+
+    if (priv->commanding || priv->queue != &turn)
+        AT_STATS_ADD(priv->stats.queued, 1);
+
+    int result = 0;
+    while (priv->commanding || priv->queue != &turn) {
+        uint64_t left = budget(priv, caller);
+        if (!priv->open || !left) {
+            if (!priv->open)
+                errno = ENODEV;
+            result = -1;
+            break;
+        }
+        wait_for(priv, &priv->turn, wait_until(priv, left));
+    }
+
+    for (p = &priv->queue; *p != &turn; p = &(*p)->next)
+        ;
+    *p = turn.next;
+    if (result == 0)
+        priv->commanding = true;
+    else
+        /* The next one in line may be up now. */
+        pthread_cond_broadcast(&priv->turn);
+    return result;
+}
+
+static void end_turn(struct at_unix *priv)
+{
+    priv->commanding = false;
+    pthread_cond_broadcast(&priv->turn);
+}
+
+/*
+ * Shared queries. A read-only query that finds an identical one answered
+ * since it was issued (i.e. it waited its turn behind it), or within the
+ * share window, takes a reference to that answer instead of going out.
+ * Anything else may change what queries return, so it forgets them all.
+ */
+static struct at_buf *shared_answer(struct at_unix *priv, const void *line, size_t len, uint64_t issued)
+{
+    uint64_t now = at_clock_now(priv->clock);
+    for (int i=0; i<AT_UNIX_QUERIES; i++) {
+        struct at_unix_query *query = &priv->queries[i];
+        if (query->response && query->len == len && !memcmp(query->line, line, len) &&
+            (query->when >= issued || now - query->when < priv->share_window))
+            return at_buf_ref(query->response);
+    }
+    return NULL;
+}
+
+static void share_answer(struct at_unix *priv, const void *line, size_t len, struct at_buf *response)
+{
+    /* Take the slot with the same line, or else the oldest one. */
+    struct at_unix_query *slot = &priv->queries[0];
+    for (int i=0; i<AT_UNIX_QUERIES; i++) {
+        struct at_unix_query *query = &priv->queries[i];
+        if (query->response && query->len == len && !memcmp(query->line, line, len)) {
+            slot = query;
+            break;
+        }
+        if (!query->response || (slot->response && query->when < slot->when))
+            slot = query;
+    }
+    at_buf_release(slot->response);
+    memcpy(slot->line, line, len);
+    slot->len = len;
+    slot->response = at_buf_ref(response);
+    slot->when = at_clock_now(priv->clock);
+}
+
+static void forget_answers(struct at_unix *priv)
+{
+    for (int i=0; i<AT_UNIX_QUERIES; i++) {
+        at_buf_release(priv->queries[i].response);
+        priv->queries[i].response = NULL;
+    }
+}
+
+static struct at_buf *_at_command(struct at_unix *priv, const struct at_command_options *opts,
+                                  const void *data, size_t size, bool raw)
+{
+    /* Settings from the sticky setters count for the next command. */
+    struct at_command_options sticky = {
+        .scanner = __atomic_exchange_n(&priv->scanner, NULL, __ATOMIC_RELAXED),
+        .dataprompt = __atomic_exchange_n(&priv->dataprompt, false, __ATOMIC_RELAXED),
+    };
+    if (!opts)
+        opts = &sticky;
+    int timeout = opts->timeout ? opts->timeout : __atomic_load_n(&priv->timeout, __ATOMIC_RELAXED);
+    bool shared = opts->shared && !raw;
+    uint64_t issued = at_clock_now(priv->clock);
+    struct at_unix_caller caller;
+    caller_begin(priv, &caller, opts);
+
+    pthread_mutex_lock(&priv->mutex);
+
+    /* Bail out if the channel is closing or closed, if the budget runs out
+     * before our turn, or if the channel is still out of sync from an
+     * earlier timeout and can't be brought back. */
+    struct at_buf *result = NULL;
     if (!priv->open) {
-        /* The serial port was closed behind our back. */
         errno = ENODEV;
-        result = NULL;
-    } else if (priv->waiting) {
+        goto out;
+    }
+    if (take_turn(priv, &caller, opts->priority, opts->idle) == -1)
+        goto out;
+    if (!budget(priv, &caller))
+        goto done;
+    if (shared && (result = shared_answer(priv, data, size, issued))) {
+        AT_STATS_ADD(priv->stats.shared, 1);
+        goto done;
+    }
+    if (!shared)
+        forget_answers(priv);
+
+    /* The timeout runs from here, and covers a resync still owed. */
+    uint64_t until = timeout ? wait_until(priv, (uint64_t) timeout * 1000000000) : UINT64_MAX;
+    if (priv->resync && resync(priv, &caller, until) == -1)
+        goto done;
+
+    /* Prepare parser. */
+    priv->at.command_scanner = opts->scanner;
+    if (opts->dataprompt)
+        at_parser_expect_dataprompt(priv->at.parser);
+    at_parser_await_response(priv->at.parser);
+    __atomic_store_n(&priv->rx_mark, true, __ATOMIC_RELAXED);
+    priv->verb = at_stats_verb(&priv->stats, raw ? NULL : data, size);
+    AT_STATS_ADD(priv->stats.commands, 1);
+
+    /* Send the command. */
+    send_command(priv, data, size);
+
+    if (await_response(priv, &caller, until) == 0) {
+        /* Response arrived; hand it over. */
+        result = priv->response;
+        priv->response = NULL;
+        if (!result)
+            errno = ENOMEM;
+        else if (shared)
+            share_answer(priv, data, size, result);
+    } else if (errno == ETIMEDOUT) {
         /* Timed out waiting for a response. */
+        AT_TRACE(&priv->at, AT_TRACE_TIMEOUT, timeout, NULL, 0);
+        AT_PROBE2(timeout, &priv->at, timeout);
+        at_stats_timeout(&priv->stats, priv->verb);
         at_parser_reset(priv->at.parser);
+        /* The answer may still come; resync before the next command. */
+        priv->resync = priv->resync_register >= 0;
         errno = ETIMEDOUT;
-        result = NULL;
-    } else {
-        /* Response arrived. */
-        result = priv->response;
+    } else if (errno == ECANCELED) {
+        /* Given up on; the answer may still come. Resync later, since the
+         * canceller wants us back now. */
+        AT_STATS_ADD(priv->stats.cancelled, 1);
+        at_parser_reset(priv->at.parser);
+        priv->resync = priv->resync_register >= 0;
+        errno = ECANCELED;
     }
 
-    /* Reset per-command settings. */
+done:
+    /* Per-command settings end with the command. */
     priv->at.command_scanner = NULL;
+    end_turn(priv);
 
+out:
     pthread_mutex_unlock(&priv->mutex);
+    caller_end(&caller);
 
     return result;
 }
 
+int at_delay_opts(struct at *at, const struct at_command_options *opts, int ms)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+    struct at_unix_caller caller;
+    caller_begin(priv, &caller, opts);
+
+    pthread_mutex_lock(&priv->mutex);
+
+    uint64_t wait = (uint64_t) ms * 1000000;
+    uint64_t left = budget(priv, &caller);
+    int result = 0;
+    if (!left) {
+        result = -1;
+    } else {
+        bool cut = left < wait;
+        uint64_t until = wait_until(priv, cut ? left : wait);
+        while (!cancelled(&caller))
+            if (wait_for(priv, &priv->cond, until) == ETIMEDOUT)
+                break;
+        if (cancelled(&caller) || cut) {
+            errno = cancelled(&caller) ? ECANCELED : ETIMEDOUT;
+            result = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&priv->mutex);
+    caller_end(&caller);
+    return result;
+}
+
+int at_delay(struct at *at, int ms)
+{
+    return at_delay_opts(at, NULL, ms);
+}
+
+static struct at_buf *at_vcommand(struct at *at, const struct at_command_options *opts,
+                                  const char *format, va_list ap)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string. */
+    char line[AT_COMMAND_LENGTH];
+    int len = vsnprintf(line, sizeof(line)-1, format, ap);
+
+    /* Bail out if we run out of space. */
+    if (len >= (int)(sizeof(line)-1)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    printf("> %s\n", line);
+    AT_TRACE(at, AT_TRACE_COMMAND, len, line, len);
+
+    /* Append modem-style newline. */
+    line[len++] = '\r';
+
+    /* Send the command. */
+    return _at_command(priv, opts, line, len, false);
+}
+
+static const char *keep_response(struct at_unix *priv, struct at_buf *response)
+{
+    /* Keep the response until the next at_command(), as documented. */
+    pthread_mutex_lock(&priv->mutex);
+    struct at_buf *last = priv->last;
+    priv->last = response;
+    pthread_mutex_unlock(&priv->mutex);
+    at_buf_release(last);
+
+    return response ? response->data : NULL;
+}
+
 const char *at_command(struct at *at, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    struct at_buf *response = at_vcommand(at, NULL, format, ap);
+    va_end(ap);
+
+    return keep_response((struct at_unix *) at, response);
+}
+
+struct at_buf *at_command_buf(struct at *at, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    struct at_buf *response = at_vcommand(at, NULL, format, ap);
+    va_end(ap);
+
+    return response;
+}
+
+struct at_buf *at_command_opts(struct at *at, const struct at_command_options *opts,
+                               const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    struct at_buf *response = at_vcommand(at, opts, format, ap);
+    va_end(ap);
+
+    return response;
+}
+
+const char *at_command_raw(struct at *at, const void *data, size_t size)
+{
+    return keep_response((struct at_unix *) at, at_command_raw_buf(at, data, size));
+}
+
+struct at_buf *at_command_raw_buf(struct at *at, const void *data, size_t size)
+{
+    return at_command_raw_opts(at, NULL, data, size);
+}
+
+struct at_buf *at_command_raw_opts(struct at *at, const struct at_command_options *opts,
+                                   const void *data, size_t size)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    printf("> [%zu bytes]\n", size);
+    AT_TRACE(at, AT_TRACE_COMMAND_RAW, size, data, size);
+
+    return _at_command(priv, opts, data, size, true);
+}
+
+static bool _at_send(struct at_unix *priv, const void *data, size_t size)
+{
+    /* Drivers call this from URC callbacks. On the parser thread the mutex
+     * is already held; anywhere else, e.g. on an executor, take it so the
+     * write can't land in the middle of a command. */
+    bool lock = !pthread_equal(pthread_self(), priv->parser_thread);
+    if (lock)
+        pthread_mutex_lock(&priv->mutex);
+
+    if (!priv->open) {
+        if (lock)
+            pthread_mutex_unlock(&priv->mutex);
+        errno = ENODEV;
+        return false;
+    }
+
+    /* Send the data without waiting for a response; recorded first, like
+     * commands. */
+    record(priv, AT_CAPTURE_TX, data, size);
+    size_t written = port_write(priv, data, size);
+    AT_STATS_ADD(priv->stats.tx_bytes, written);
+
+    if (lock)
+        pthread_mutex_unlock(&priv->mutex);
+    return written == size;
+}
+
+bool at_send(struct at *at, const char *format, ...)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
@@ -309,25 +1386,95 @@ const char *at_command(struct at *at, const char *format, ...)
     /* Bail out if we run out of space. */
     if (len >= (int)(sizeof(line)-1)) {
         errno = ENOMEM;
-        return NULL;
+        return false;
     }
 
     printf("> %s\n", line);
+    AT_TRACE(at, AT_TRACE_SEND, len, line, len);
 
     /* Append modem-style newline. */
     line[len++] = '\r';
 
-    /* Send the command. */
-    return _at_command(priv, line, len);
+    return _at_send(priv, line, len);
 }
 
-const char *at_command_raw(struct at *at, const void *data, size_t size)
+bool at_send_raw(struct at *at, const void *data, size_t size)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
     printf("> [%zu bytes]\n", size);
+    AT_TRACE(at, AT_TRACE_SEND, size, data, size);
+
+    return _at_send(priv, data, size);
+}
+
+/* Move data from the port into the ring until at_close() wants the port
+ * back (-1, errno EINTR), on error (-1) or at end of stream (zero). Called
+ * by the reader thread while it owns the descriptor; takes no locks. */
+static int reader_pump(struct at_unix *priv)
+{
+    while (true) {
+        /* Read no more than the ring takes. With the ring full, leave the
+         * data in the port: the tty or socket buffer holds the burst (and
+         * flow control, if any, holds the modem back) until the parser
+         * thread makes room and pokes us. Stalling and the parser's check
+         * pair up through the fences, so the poke can't be missed. */
+        size_t room = priv->ring.size - at_ring_used(&priv->ring);
+        if (!room) {
+            __atomic_store_n(&priv->stalled, true, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            room = priv->ring.size - at_ring_used(&priv->ring);
+        }
+        if (room > AT_UNIX_READ_SIZE)
+            room = AT_UNIX_READ_SIZE;
+
+        /* Wait for data, for room, or for at_close() to take the port away. */
+        struct pollfd pfds[2] = {
+            { .fd = room ? priv->fd : -1, .events = POLLIN },
+            { .fd = priv->cancel, .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (pfds[1].revents & POLLIN) {
+            uint64_t count;
+            read(priv->cancel, &count, sizeof(count));
+            if (__atomic_load_n(&priv->release, __ATOMIC_SEQ_CST)) {
+                errno = EINTR;
+                return -1;
+            }
+            continue;
+        }
+
+        uint8_t buf[AT_UNIX_READ_SIZE];
+        ssize_t result = read(priv->fd, buf, room);
+        if (result == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (result <= 0)
+            return result;
+        /* Telnet replies go out while we still own the descriptor. */
+        if (priv->flags & AT_TCP_RFC2217) {
+            result = telnet_decode(priv, buf, result);
+            if (!result)
+                continue;   /* Nothing but protocol; not the end of the stream. */
+        }
 
-    return _at_command(priv, data, size);
+        /* Counted as payload, like tx_bytes. Stamped on arrival, not when
+         * parsed, for faithful replays. */
+        AT_STATS_ADD(priv->stats.rx_bytes, result);
+        record(priv, AT_CAPTURE_RX, buf, result);
+        /* First bytes after a command; timed here, not after parsing. */
+        if (__atomic_exchange_n(&priv->rx_mark, false, __ATOMIC_RELAXED))
+            AT_TRACE(&priv->at, AT_TRACE_RX, result, buf, result);
+
+        /* Hand it over without waiting for the parser. It fits, since we
+         * read no more than there was room for. */
+        at_ring_write(&priv->ring, buf, result);
+        uint64_t one = 1;
+        write(priv->wakeup, &one, sizeof(one));
+    }
 }
 
 void *at_reader_thread(void *arg)
@@ -353,9 +1500,7 @@ void *at_reader_thread(void *arg)
         priv->busy = true;
         pthread_mutex_unlock(&priv->mutex);
 
-        /* Attempt to read some data. */
-        char ch;
-        int result = read(priv->fd, &ch, 1);
+        int result = reader_pump(priv);
         int why = errno;
 
         pthread_mutex_lock(&priv->mutex);
@@ -365,17 +1510,11 @@ void *at_reader_thread(void *arg)
         pthread_cond_signal(&priv->cond);
         pthread_mutex_unlock(&priv->mutex);
 
-        if (result == 1) {
-            /* Data received, feed the parser. */
-            pthread_mutex_lock(&priv->mutex);
-            at_parser_feed(priv->at.parser, &ch, 1);
-            pthread_mutex_unlock(&priv->mutex);
-        } else if (result == -1) {
-            printf("at_reader_thread[%s]: %s\n", priv->devpath, strerror(why));
+        if (result == -1) {
             if (why == EINTR)
                 continue;
-            else
-                break;
+            printf("at_reader_thread[%s]: %s\n", priv->devpath, strerror(why));
+            break;
         } else {
             printf("at_reader_thread[%s]: received EOF\n", priv->devpath);
             break;
@@ -387,4 +1526,57 @@ void *at_reader_thread(void *arg)
     return NULL;
 }
 
+static void *at_parser_thread(void *arg)
+{
+    struct at_unix *priv = (struct at_unix *)arg;
+
+    uint64_t due = UINT64_MAX;
+    struct at_clock *clock = NULL;
+    while (true) {
+        /* Sleep until the reader has pushed something (or at_free), or a
+         * coalesced URC is due. Virtual time may jump ahead meanwhile, so
+         * look again every so often. */
+        int timeout = -1;
+        if (due != UINT64_MAX) {
+            uint64_t now = at_clock_now(clock);
+            timeout = due > now ? (int) ((due - now + 999999) / 1000000) : 0;
+            if (clock && timeout > AT_UNIX_CLOCK_POLL_MS)
+                timeout = AT_UNIX_CLOCK_POLL_MS;
+        }
+        struct pollfd pfd = { .fd = priv->wakeup, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        uint64_t count;
+        if (ready > 0 && read(priv->wakeup, &count, sizeof(count)) == -1 && errno == EINTR)
+            continue;
+
+        /* Drain the ring, letting commands in between chunks. */
+        uint8_t buf[AT_UNIX_READ_SIZE];
+        size_t len;
+        while ((len = at_ring_read(&priv->ring, buf, sizeof(buf))) > 0) {
+            /* There's room now; wake the reader if it ran out. */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_exchange_n(&priv->stalled, false, __ATOMIC_RELAXED)) {
+                uint64_t one = 1;
+                write(priv->cancel, &one, sizeof(one));
+            }
+
+            pthread_mutex_lock(&priv->mutex);
+            at_parser_feed(priv->at.parser, buf, len);
+            pthread_mutex_unlock(&priv->mutex);
+        }
+
+        pthread_mutex_lock(&priv->mutex);
+        clock = priv->clock;
+        due = at_parser_flush_urcs(priv->at.parser, at_clock_now(clock));
+        bool running = priv->running;
+        pthread_mutex_unlock(&priv->mutex);
+        if (!running)
+            break;
+    }
+
+    return NULL;
+}
+
 /* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,146 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Modem broker daemon (see at-broker.h).
+ *
+ * Usage: attentived -d device [-b baud] [-m generic|sim800] [-a apn] [-s socket]
+ *
+ * Opens the port, attaches the modem and serves it on the socket until
+ * SIGINT or SIGTERM. Clients connect with cellular_broker_alloc().
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <attentive/at-broker.h>
+#include <attentive/at-unix.h>
+
+#define DEFAULT_SOCKET "/var/run/attentived.sock"
+#define STATUS_TTL_MS  10000
+
+static struct at_broker *broker;
+
+static void stop(int signum)
+{
+    (void) signum;
+    at_broker_stop(broker);
+}
+
+static speed_t baudrate(long baud)
+{
+    static const struct { long baud; speed_t speed; } speeds[] = {
+        { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+        { 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+    };
+    for (size_t i=0; i<sizeof(speeds)/sizeof(*speeds); i++)
+        if (speeds[i].baud == baud)
+            return speeds[i].speed;
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s -d device [-b baud] [-m generic|sim800] [-a apn] [-s socket]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *devpath = NULL;
+    const char *model = "generic";
+    const char *apn = NULL;
+    const char *path = DEFAULT_SOCKET;
+    speed_t speed = B115200;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:b:m:a:s:")) != -1) {
+        switch (opt) {
+            case 'd': devpath = optarg; break;
+            case 'b':
+                if (!(speed = baudrate(strtol(optarg, NULL, 10)))) {
+                    fprintf(stderr, "%s: unsupported baud rate: %s\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'm': model = optarg; break;
+            case 'a': apn = optarg; break;
+            case 's': path = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!devpath || optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct cellular *modem;
+    void (*modem_free)(struct cellular *modem);
+    if (!strcmp(model, "generic")) {
+        modem = cellular_generic_alloc();
+        modem_free = cellular_generic_free;
+    } else if (!strcmp(model, "sim800")) {
+        modem = cellular_sim800_alloc();
+        modem_free = cellular_sim800_free;
+    } else {
+        fprintf(stderr, "%s: unknown modem: %s\n", argv[0], model);
+        return 1;
+    }
+
+    struct at *at = at_alloc_unix(devpath, speed);
+    if (!at || !modem) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+    if (at_open(at) != 0) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], devpath, strerror(errno));
+        return 1;
+    }
+    if (cellular_attach(modem, at, apn) != 0) {
+        fprintf(stderr, "%s: attach: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+
+    /* Answer status polls from memory; the broker refreshes it while idle. */
+    cellular_set_status_ttl(modem, CELLULAR_STATUS_CREG, STATUS_TTL_MS);
+    cellular_set_status_ttl(modem, CELLULAR_STATUS_RSSI, STATUS_TTL_MS);
+    if (cellular_status_reports(modem) != 0)
+        fprintf(stderr, "%s: no status reports, polling only\n", argv[0]);
+
+    broker = at_broker_alloc(path, modem);
+    if (!broker) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+        return 1;
+    }
+
+    struct sigaction action = { .sa_handler = stop };
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int result = at_broker_run(broker);
+    if (result != 0)
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+
+    at_broker_free(broker);
+    cellular_detach(modem);
+    modem_free(modem);
+    at_close(at);
+    at_free(at);
+
+    return result ? 1 : 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
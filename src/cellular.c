@@ -8,23 +8,39 @@
 
 #include <attentive/cellular.h>
 
+#include <string.h>
+
 #include "modem/at-common.h"
 #define printf(...)
 
 
 int cellular_attach(struct cellular *modem, struct at *at, const char *apn)
+{
+    return cellular_attach_dual(modem, at, at, apn);
+}
+
+int cellular_attach_dual(struct cellular *modem, struct at *data, struct at *control, const char *apn)
 {
     /* Do nothing if we're already attached. */
     if (modem->at)
         return 0;
 
-    modem->at = at;
+    modem->at = data;
+    modem->control = control != data ? control : NULL;
     modem->apn = apn;
 
-    /* Reset PDP failure counters. */
-    cellular_pdp_success(modem);
+    /* Reset PDP failure counters; whether there's a context is anyone's guess. */
+    cellular_pdp_reset(modem);
 
-    return modem->ops->attach ? modem->ops->attach(modem) : 0;
+    int result = modem->ops->attach ? modem->ops->attach(modem) : 0;
+    if (result == 0 && modem->pdp_prewarm && modem->ops->pdp_open)
+        cellular_pdp_request(modem);
+    return result;
+}
+
+void cellular_set_pdp_prewarm(struct cellular *modem, bool enable)
+{
+    modem->pdp_prewarm = enable;
 }
 
 int cellular_detach(struct cellular *modem)
@@ -34,8 +50,69 @@ int cellular_detach(struct cellular *modem)
         return 0;
 
     int result = modem->ops->detach? modem->ops->detach(modem) : 0;
+    cellular_status_forget(modem);
+    cellular_pdp_down(modem);
     modem->at = NULL;
+    modem->control = NULL;
     return result;
 }
 
+struct at *cellular_port(struct cellular *modem, enum cellular_port port)
+{
+    if (port == CELLULAR_PORT_CONTROL && modem->control)
+        return modem->control;
+    return modem->at;
+}
+
+/* The calling thread's budget; drivers pick it up in CELLULAR_OPTIONS(). */
+static __thread const struct cellular_budget *thread_budget;
+
+void cellular_budget_begin(const struct cellular_budget *budget)
+{
+    thread_budget = budget;
+}
+
+void cellular_budget_end(void)
+{
+    thread_budget = NULL;
+}
+
+uint64_t cellular_budget_deadline(void)
+{
+    return thread_budget ? thread_budget->deadline : 0;
+}
+
+struct at_cancel *cellular_budget_cancel(void)
+{
+    return thread_budget ? thread_budget->cancel : NULL;
+}
+
+int cellular_delay(struct cellular *modem, int ms)
+{
+    struct at_command_options opts = CELLULAR_OPTIONS();
+    return at_delay_opts(modem->at, &opts, ms);
+}
+
+void cellular_get_stats(struct cellular *modem, struct cellular_stats *stats)
+{
+    struct at *at = modem->at;
+    if (at)
+        at_get_stats(at, &stats->at);
+    else
+        memset(&stats->at, 0, sizeof(stats->at));
+    struct at *control = modem->control;
+    if (control)
+        at_get_stats(control, &stats->control);
+    else
+        memset(&stats->control, 0, sizeof(stats->control));
+
+    stats->pdp_requests = __atomic_load_n(&modem->pdp_requests, __ATOMIC_RELAXED);
+    stats->pdp_errors = __atomic_load_n(&modem->pdp_errors, __ATOMIC_RELAXED);
+    stats->pdp_resets = __atomic_load_n(&modem->pdp_resets, __ATOMIC_RELAXED);
+    stats->pdp_reused = __atomic_load_n(&modem->pdp_reused, __ATOMIC_RELAXED);
+    stats->pdp_active = __atomic_load_n(&modem->pdp_active, __ATOMIC_RELAXED);
+    stats->pdp_failures = __atomic_load_n(&modem->pdp_failures, __ATOMIC_RELAXED);
+    stats->pdp_threshold = __atomic_load_n(&modem->pdp_threshold, __ATOMIC_RELAXED);
+}
+
 /* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,709 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <attentive/cmux.h>
+#include <attentive/at-unix.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define printf(...)
+
+#define CMUX_FLAG           0xf9
+#define CMUX_EA             0x01
+#define CMUX_FCS_GOOD       0xcf
+
+#define CMUX_RETRIES        3       /**< SABM/DISC transmissions (N2). */
+#define CMUX_T1_MS          1000    /**< Acknowledgement timer. */
+#define CMUX_PENDING_MAX    16384   /**< Bytes held for a stalled DLC. */
+
+/*
+ * Frame codec.
+ */
+
+enum {
+    DECODER_HUNT,
+    DECODER_ADDRESS,
+    DECODER_CONTROL,
+    DECODER_LENGTH,
+    DECODER_LENGTH2,
+    DECODER_DATA,
+    DECODER_FCS,
+    DECODER_END,
+};
+
+static uint8_t crc_update(uint8_t crc, uint8_t ch)
+{
+    /* Reversed CRC-8, polynomial x^8 + x^2 + x + 1. */
+    crc ^= ch;
+    for (int i=0; i<8; i++)
+        crc = (crc & 1) ? (crc >> 1) ^ 0xe0 : (crc >> 1);
+    return crc;
+}
+
+uint8_t cmux_fcs(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint8_t crc = 0xff;
+    while (len--)
+        crc = crc_update(crc, *p++);
+    return 0xff - crc;
+}
+
+static bool frame_covers_data(uint8_t control)
+{
+    /* UIH frames only protect the header; everything else covers the data. */
+    return (control & ~CMUX_PF) != CMUX_UIH;
+}
+
+size_t cmux_frame_encode(void *buf, size_t size, int dlci, bool cr, uint8_t control,
+                         const void *data, size_t len)
+{
+    uint8_t *p = buf;
+    size_t header = (len > 127) ? 4 : 3;
+    if (size < 1 + header + len + 2 || len > 0x7fff)
+        return 0;
+
+    p[0] = CMUX_FLAG;
+    p[1] = (dlci << 2) | (cr ? 0x02 : 0) | CMUX_EA;
+    p[2] = control;
+    if (len > 127) {
+        p[3] = (len & 0x7f) << 1;
+        p[4] = len >> 7;
+    } else {
+        p[3] = (len << 1) | CMUX_EA;
+    }
+    if (len)
+        memcpy(p + 1 + header, data, len);
+
+    uint8_t crc = 0xff;
+    for (size_t i=1; i<=header; i++)
+        crc = crc_update(crc, p[i]);
+    if (frame_covers_data(control))
+        for (size_t i=0; i<len; i++)
+            crc = crc_update(crc, p[1 + header + i]);
+
+    p[1 + header + len] = 0xff - crc;
+    p[1 + header + len + 1] = CMUX_FLAG;
+    return 1 + header + len + 2;
+}
+
+void cmux_decoder_init(struct cmux_decoder *dec)
+{
+    dec->state = DECODER_HUNT;
+    dec->errors = 0;
+}
+
+static void decoder_error(struct cmux_decoder *dec, uint8_t ch)
+{
+    dec->errors++;
+    /* A flag may open the next frame. */
+    dec->state = (ch == CMUX_FLAG) ? DECODER_ADDRESS : DECODER_HUNT;
+}
+
+bool cmux_decoder_feed(struct cmux_decoder *dec, uint8_t ch, struct cmux_frame *frame)
+{
+    switch (dec->state) {
+        case DECODER_HUNT:
+            if (ch == CMUX_FLAG)
+                dec->state = DECODER_ADDRESS;
+            break;
+
+        case DECODER_ADDRESS:
+            /* Repeated flags are idle fill. */
+            if (ch == CMUX_FLAG)
+                break;
+            if (!(ch & CMUX_EA)) {
+                decoder_error(dec, ch);
+                break;
+            }
+            dec->address = ch;
+            dec->crc = crc_update(0xff, ch);
+            dec->state = DECODER_CONTROL;
+            break;
+
+        case DECODER_CONTROL:
+            dec->control = ch;
+            dec->crc = crc_update(dec->crc, ch);
+            dec->state = DECODER_LENGTH;
+            break;
+
+        case DECODER_LENGTH:
+        case DECODER_LENGTH2:
+            dec->crc = crc_update(dec->crc, ch);
+            if (dec->state == DECODER_LENGTH) {
+                dec->len = ch >> 1;
+                if (!(ch & CMUX_EA)) {
+                    dec->state = DECODER_LENGTH2;
+                    break;
+                }
+            } else {
+                dec->len |= (size_t) ch << 7;
+            }
+            if (dec->len > CMUX_FRAME_MAX) {
+                decoder_error(dec, ch);
+                break;
+            }
+            dec->used = 0;
+            dec->state = dec->len ? DECODER_DATA : DECODER_FCS;
+            break;
+
+        case DECODER_DATA:
+            dec->data[dec->used++] = ch;
+            if (frame_covers_data(dec->control))
+                dec->crc = crc_update(dec->crc, ch);
+            if (dec->used == dec->len)
+                dec->state = DECODER_FCS;
+            break;
+
+        case DECODER_FCS:
+            dec->fcs_ok = (crc_update(dec->crc, ch) == CMUX_FCS_GOOD);
+            dec->state = DECODER_END;
+            break;
+
+        case DECODER_END:
+            if (ch != CMUX_FLAG || !dec->fcs_ok) {
+                decoder_error(dec, ch);
+                break;
+            }
+            /* The closing flag may double as the next opening flag. */
+            dec->state = DECODER_ADDRESS;
+            frame->dlci = dec->address >> 2;
+            frame->cr = dec->address & 0x02;
+            frame->control = dec->control;
+            frame->len = dec->len;
+            frame->data = dec->data;
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Multiplexer.
+ */
+
+enum dlc_state {
+    DLC_CLOSED,
+    DLC_OPENING,
+    DLC_OPEN,
+    DLC_CLOSING,
+};
+
+struct cmux_dlc {
+    enum dlc_state state;
+    int master;             /**< Pseudo-terminal master; the mux end. */
+    int slave;              /**< Held open so the master never sees a hangup. */
+    char devpath[64];
+
+    bool remote_fc;         /**< Modem asked us to stop sending. */
+    bool local_fc;          /**< We asked the modem to stop sending. */
+    uint8_t *pending;       /**< Received data the pty didn't take yet. */
+    size_t pending_len;
+};
+
+struct cmux {
+    int fd;                 /**< Serial port file descriptor. */
+    int channels;
+    size_t frame_size;      /**< N1. */
+
+    pthread_t thread;       /**< Demultiplexer thread. */
+    pthread_mutex_t mutex;  /**< Protects DLC state and serial port writes. */
+    pthread_cond_t cond;    /**< Signals DLC state changes. */
+    int wake[2];            /**< Self-pipe to stop the thread. */
+    bool running;
+    bool closed_down;       /**< CLD acknowledged. */
+
+    struct cmux_decoder decoder;
+    struct cmux_dlc dlc[CMUX_MAX_CHANNELS+1];
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t result = write(fd, p, len);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += result;
+        len -= result;
+    }
+    return 0;
+}
+
+/** Send a frame. Called with the mutex held. */
+static void send_frame(struct cmux *cmux, int dlci, bool cr, uint8_t control,
+                       const void *data, size_t len)
+{
+    uint8_t buf[CMUX_FRAME_MAX + 8];
+    size_t size = cmux_frame_encode(buf, sizeof(buf), dlci, cr, control, data, len);
+    if (size)
+        write_all(cmux->fd, buf, size);
+}
+
+/** Send a control channel message. We are the initiator: commands carry C/R. */
+static void send_message(struct cmux *cmux, uint8_t type, bool command,
+                         const uint8_t *values, size_t len)
+{
+    uint8_t msg[8];
+    msg[0] = type | (command ? CMUX_MSG_CR : 0) | CMUX_EA;
+    msg[1] = (len << 1) | CMUX_EA;
+    if (len)
+        memcpy(msg + 2, values, len);
+    send_frame(cmux, 0, true, CMUX_UIH, msg, 2 + len);
+}
+
+static void send_msc(struct cmux *cmux, int dlci, bool command, uint8_t signals)
+{
+    uint8_t values[2] = { (dlci << 2) | 0x02 | CMUX_EA, signals | CMUX_EA };
+    send_message(cmux, CMUX_MSG_MSC, command, values, sizeof(values));
+}
+
+static uint8_t local_signals(struct cmux_dlc *dlc)
+{
+    return CMUX_V24_RTC | CMUX_V24_RTR | CMUX_V24_DV | (dlc->local_fc ? CMUX_V24_FC : 0);
+}
+
+/** Hand received data to the pty; stall the DLC if it doesn't keep up. */
+static void deliver(struct cmux *cmux, int dlci, const uint8_t *data, size_t len)
+{
+    struct cmux_dlc *dlc = &cmux->dlc[dlci];
+
+    if (!dlc->pending_len) {
+        ssize_t written = write(dlc->master, data, len);
+        if (written > 0) {
+            data += written;
+            len -= written;
+        }
+    }
+    if (!len)
+        return;
+
+    /* Keep the rest and ask the modem to hold off. */
+    if (dlc->pending_len + len > CMUX_PENDING_MAX)
+        len = CMUX_PENDING_MAX - dlc->pending_len;
+    if (!dlc->pending)
+        dlc->pending = malloc(CMUX_PENDING_MAX);
+    if (dlc->pending) {
+        memcpy(dlc->pending + dlc->pending_len, data, len);
+        dlc->pending_len += len;
+    }
+    if (!dlc->local_fc) {
+        dlc->local_fc = true;
+        send_msc(cmux, dlci, true, local_signals(dlc));
+    }
+}
+
+static void drain(struct cmux *cmux, int dlci)
+{
+    struct cmux_dlc *dlc = &cmux->dlc[dlci];
+
+    ssize_t written = write(dlc->master, dlc->pending, dlc->pending_len);
+    if (written <= 0)
+        return;
+    memmove(dlc->pending, dlc->pending + written, dlc->pending_len - written);
+    dlc->pending_len -= written;
+
+    if (!dlc->pending_len && dlc->local_fc) {
+        dlc->local_fc = false;
+        send_msc(cmux, dlci, true, local_signals(dlc));
+    }
+}
+
+static void handle_message(struct cmux *cmux, const uint8_t *data, size_t len)
+{
+    if (len < 2)
+        return;
+    uint8_t type = data[0] & ~(CMUX_MSG_CR | CMUX_EA);
+    bool command = data[0] & CMUX_MSG_CR;
+    size_t vlen = data[1] >> 1;
+    const uint8_t *values = data + 2;
+    if (vlen > len - 2)
+        return;
+
+    if (!command) {
+        /* Responses to our own commands. */
+        if (type == CMUX_MSG_CLD) {
+            cmux->closed_down = true;
+            pthread_cond_broadcast(&cmux->cond);
+        }
+        return;
+    }
+
+    switch (type) {
+        case CMUX_MSG_MSC:
+        {
+            if (vlen < 2)
+                return;
+            int dlci = values[0] >> 2;
+            if (dlci >= 1 && dlci <= cmux->channels) {
+                cmux->dlc[dlci].remote_fc = values[1] & CMUX_V24_FC;
+                printf("cmux: dlc %d flow %s\n", dlci, cmux->dlc[dlci].remote_fc ? "off" : "on");
+            }
+            send_message(cmux, type, false, values, vlen);
+        }
+        break;
+
+        case CMUX_MSG_TEST:
+        {
+            send_message(cmux, type, false, values, vlen);
+        }
+        break;
+
+        default:
+        {
+            uint8_t nsc = data[0];
+            send_message(cmux, CMUX_MSG_NSC, false, &nsc, 1);
+        }
+        break;
+    }
+}
+
+/** Act on a received frame. Called with the mutex held. */
+static void handle_frame(struct cmux *cmux, const struct cmux_frame *frame)
+{
+    if (frame->dlci > cmux->channels)
+        return;
+    struct cmux_dlc *dlc = &cmux->dlc[frame->dlci];
+
+    switch (frame->control & ~CMUX_PF) {
+        case CMUX_UA:
+        {
+            if (dlc->state == DLC_OPENING)
+                dlc->state = DLC_OPEN;
+            else if (dlc->state == DLC_CLOSING)
+                dlc->state = DLC_CLOSED;
+            pthread_cond_broadcast(&cmux->cond);
+        }
+        break;
+
+        case CMUX_DM:
+        {
+            dlc->state = DLC_CLOSED;
+            pthread_cond_broadcast(&cmux->cond);
+        }
+        break;
+
+        case CMUX_DISC:
+        {
+            send_frame(cmux, frame->dlci, true, CMUX_UA | CMUX_PF, NULL, 0);
+            dlc->state = DLC_CLOSED;
+            pthread_cond_broadcast(&cmux->cond);
+        }
+        break;
+
+        case CMUX_SABM:
+        {
+            /* We're the initiator; the modem doesn't get to open DLCs. */
+            send_frame(cmux, frame->dlci, true, CMUX_DM | CMUX_PF, NULL, 0);
+        }
+        break;
+
+        case CMUX_UIH:
+        case CMUX_UI:
+        {
+            if (frame->dlci == 0)
+                handle_message(cmux, frame->data, frame->len);
+            else if (dlc->state == DLC_OPEN)
+                deliver(cmux, frame->dlci, frame->data, frame->len);
+        }
+        break;
+    }
+}
+
+static void *cmux_thread(void *arg)
+{
+    struct cmux *cmux = arg;
+
+    printf("cmux_thread: starting\n");
+
+    for (;;) {
+        struct pollfd pfds[2 + CMUX_MAX_CHANNELS];
+        int dlcis[2 + CMUX_MAX_CHANNELS];
+        int n = 0;
+
+        pthread_mutex_lock(&cmux->mutex);
+        if (!cmux->running) {
+            pthread_mutex_unlock(&cmux->mutex);
+            break;
+        }
+        pfds[n++] = (struct pollfd) { .fd = cmux->wake[0], .events = POLLIN };
+        pfds[n++] = (struct pollfd) { .fd = cmux->fd, .events = POLLIN };
+        for (int i=1; i<=cmux->channels; i++) {
+            struct cmux_dlc *dlc = &cmux->dlc[i];
+            short events = 0;
+            if (dlc->state == DLC_OPEN && !dlc->remote_fc)
+                events |= POLLIN;
+            if (dlc->pending_len)
+                events |= POLLOUT;
+            if (events) {
+                dlcis[n] = i;
+                pfds[n++] = (struct pollfd) { .fd = dlc->master, .events = events };
+            }
+        }
+        pthread_mutex_unlock(&cmux->mutex);
+
+        if (poll(pfds, n, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfds[0].revents)
+            continue;
+
+        if (pfds[1].revents & POLLIN) {
+            uint8_t buf[256];
+            ssize_t amount = read(cmux->fd, buf, sizeof(buf));
+            if (amount == -1 && errno != EINTR && errno != EAGAIN)
+                break;
+            pthread_mutex_lock(&cmux->mutex);
+            for (ssize_t i=0; i<amount; i++) {
+                struct cmux_frame frame;
+                if (cmux_decoder_feed(&cmux->decoder, buf[i], &frame))
+                    handle_frame(cmux, &frame);
+            }
+            pthread_mutex_unlock(&cmux->mutex);
+        }
+
+        for (int i=2; i<n; i++) {
+            struct cmux_dlc *dlc = &cmux->dlc[dlcis[i]];
+            if (pfds[i].revents & POLLOUT) {
+                pthread_mutex_lock(&cmux->mutex);
+                drain(cmux, dlcis[i]);
+                pthread_mutex_unlock(&cmux->mutex);
+            }
+            if (pfds[i].revents & POLLIN) {
+                uint8_t buf[CMUX_FRAME_MAX];
+                ssize_t amount = read(dlc->master, buf, cmux->frame_size);
+                if (amount <= 0)
+                    continue;
+                pthread_mutex_lock(&cmux->mutex);
+                send_frame(cmux, dlcis[i], true, CMUX_UIH, buf, amount);
+                pthread_mutex_unlock(&cmux->mutex);
+            }
+        }
+    }
+
+    printf("cmux_thread: finished\n");
+    return NULL;
+}
+
+/**
+ * Send SABM or DISC and wait for the answer, retransmitting on timeout.
+ * Called with the mutex held.
+ */
+static int dlc_request(struct cmux *cmux, int dlci, uint8_t control, enum dlc_state transient)
+{
+    struct cmux_dlc *dlc = &cmux->dlc[dlci];
+    enum dlc_state start = dlc->state;
+
+    for (int attempt=0; attempt<CMUX_RETRIES; attempt++) {
+        dlc->state = transient;
+        send_frame(cmux, dlci, true, control | CMUX_PF, NULL, 0);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CMUX_T1_MS / 1000;
+        deadline.tv_nsec += (CMUX_T1_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        while (dlc->state == transient)
+            if (pthread_cond_timedwait(&cmux->cond, &cmux->mutex, &deadline) == ETIMEDOUT)
+                break;
+
+        if (dlc->state != transient)
+            return (control == CMUX_SABM && dlc->state != DLC_OPEN) ? -1 : 0;
+    }
+
+    dlc->state = start;
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+static int dlc_create_pty(struct cmux_dlc *dlc)
+{
+    dlc->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (dlc->master == -1)
+        return -1;
+    if (grantpt(dlc->master) == -1 || unlockpt(dlc->master) == -1)
+        return -1;
+    if (ptsname_r(dlc->master, dlc->devpath, sizeof(dlc->devpath)) != 0)
+        return -1;
+    if (fcntl(dlc->master, F_SETFL, O_NONBLOCK) == -1)
+        return -1;
+
+    dlc->slave = open(dlc->devpath, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (dlc->slave == -1)
+        return -1;
+
+    /* No echo, no newline translation: behave like a serial line. */
+    struct termios attr;
+    if (tcgetattr(dlc->slave, &attr) == -1)
+        return -1;
+    cfmakeraw(&attr);
+    return tcsetattr(dlc->slave, TCSANOW, &attr);
+}
+
+static void cmux_release(struct cmux *cmux)
+{
+    if (cmux->running) {
+        pthread_mutex_lock(&cmux->mutex);
+        cmux->running = false;
+        pthread_mutex_unlock(&cmux->mutex);
+        if (write(cmux->wake[1], "", 1) != 1) {
+            printf("cmux: wake failed\n");
+        }
+        pthread_join(cmux->thread, NULL);
+    }
+
+    for (int i=1; i<=CMUX_MAX_CHANNELS; i++) {
+        struct cmux_dlc *dlc = &cmux->dlc[i];
+        if (dlc->master != -1)
+            close(dlc->master);
+        if (dlc->slave != -1)
+            close(dlc->slave);
+        free(dlc->pending);
+    }
+    for (int i=0; i<2; i++)
+        if (cmux->wake[i] != -1)
+            close(cmux->wake[i]);
+    if (cmux->fd != -1)
+        close(cmux->fd);
+
+    pthread_cond_destroy(&cmux->cond);
+    pthread_mutex_destroy(&cmux->mutex);
+    free(cmux);
+}
+
+struct cmux *cmux_open(const char *devpath, speed_t baudrate, int channels)
+{
+    if (channels < 1 || channels > CMUX_MAX_CHANNELS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct cmux *cmux = calloc(1, sizeof(struct cmux));
+    if (!cmux) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    cmux->channels = channels;
+    cmux->frame_size = CMUX_FRAME_SIZE;
+    cmux->fd = cmux->wake[0] = cmux->wake[1] = -1;
+    for (int i=0; i<=CMUX_MAX_CHANNELS; i++)
+        cmux->dlc[i].master = cmux->dlc[i].slave = -1;
+    cmux_decoder_init(&cmux->decoder);
+    pthread_mutex_init(&cmux->mutex, NULL);
+    pthread_cond_init(&cmux->cond, NULL);
+
+    cmux->fd = open(devpath, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (cmux->fd == -1)
+        goto fail;
+
+    struct termios attr;
+    if (tcgetattr(cmux->fd, &attr) == 0) {
+        cfmakeraw(&attr);
+        if (baudrate)
+            cfsetspeed(&attr, baudrate);
+        tcsetattr(cmux->fd, TCSANOW, &attr);
+    }
+
+    for (int i=1; i<=channels; i++)
+        if (dlc_create_pty(&cmux->dlc[i]) == -1)
+            goto fail;
+    if (pipe2(cmux->wake, O_CLOEXEC) == -1)
+        goto fail;
+
+    cmux->running = true;
+    if ((errno = pthread_create(&cmux->thread, NULL, cmux_thread, cmux)) != 0) {
+        cmux->running = false;
+        goto fail;
+    }
+
+    /* Control channel first, then the DLCs, each announcing its signals. */
+    pthread_mutex_lock(&cmux->mutex);
+    int result = dlc_request(cmux, 0, CMUX_SABM, DLC_OPENING);
+    for (int i=1; i<=channels && result == 0; i++) {
+        result = dlc_request(cmux, i, CMUX_SABM, DLC_OPENING);
+        if (result == 0)
+            send_msc(cmux, i, true, local_signals(&cmux->dlc[i]));
+    }
+    pthread_mutex_unlock(&cmux->mutex);
+    if (result == -1) {
+        if (errno != ETIMEDOUT)
+            errno = ECONNREFUSED;
+        goto fail;
+    }
+
+    return cmux;
+
+fail:
+    {
+        int why = errno;
+        cmux_release(cmux);
+        errno = why;
+    }
+    return NULL;
+}
+
+const char *cmux_devpath(struct cmux *cmux, int dlci)
+{
+    if (dlci < 1 || dlci > cmux->channels)
+        return NULL;
+    return cmux->dlc[dlci].devpath;
+}
+
+struct at *cmux_at_alloc(struct cmux *cmux, int dlci)
+{
+    const char *devpath = cmux_devpath(cmux, dlci);
+    if (!devpath) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return at_alloc_unix(devpath, 0);
+}
+
+void cmux_close(struct cmux *cmux)
+{
+    pthread_mutex_lock(&cmux->mutex);
+    for (int i=cmux->channels; i>=1; i--)
+        if (cmux->dlc[i].state == DLC_OPEN)
+            dlc_request(cmux, i, CMUX_DISC, DLC_CLOSING);
+
+    /* Close down the multiplexer; the modem goes back to AT command mode. */
+    if (cmux->dlc[0].state == DLC_OPEN) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        send_message(cmux, CMUX_MSG_CLD, true, NULL, 0);
+        while (!cmux->closed_down)
+            if (pthread_cond_timedwait(&cmux->cond, &cmux->mutex, &deadline) == ETIMEDOUT)
+                break;
+    }
+    pthread_mutex_unlock(&cmux->mutex);
+
+    cmux_release(cmux);
+}
+
+/* vim: set ts=4 sw=4 et: */
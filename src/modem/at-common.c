@@ -8,6 +8,8 @@
 
 #include <attentive/cellular.h>
 
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -30,22 +32,53 @@
  *    data can be transmitted. Telit modems are especially prone to this if
  *    AT+CGDCONT is invoked while the context is active. Our logic should handle
  *    this after a few connection failures.
+ *
+ * 3. Opening a context that's already up still costs a few round trips, so
+ *    we skip it while the context is believed up: since it last opened or
+ *    carried a command, with no failure, close or deactivation URC since.
  */
 
+static const char *const pdp_down_urcs[] = {
+    "+PDP: DEACT",
+    "+SAPBR 1: DEACT",
+    "+CGEV: NW DEACT",
+    "+CGEV: ME DEACT",
+    "NO CARRIER",       /* May leave the context up; no telling. */
+    NULL
+};
+
+static void pdp_set_active(struct cellular *modem, bool active)
+{
+    if (__atomic_exchange_n(&modem->pdp_active, active, __ATOMIC_ACQ_REL) != active)
+        AT_TRACE_STATE_CHANGE(modem->at, "pdp_active", active);
+}
+
 int cellular_pdp_request(struct cellular *modem)
 {
     if (modem->pdp_failures >= modem->pdp_threshold) {
         /* Possibly stuck PDP context; close it. */
         modem->ops->pdp_close(modem);
+        cellular_pdp_down(modem);
+        AT_STATS_ADD(modem->pdp_resets, 1);
         /* Perform exponential backoff. */
         modem->pdp_threshold *= (1+PDP_RETRY_THRESHOLD_MULTIPLIER);
     }
 
+    AT_STATS_ADD(modem->pdp_requests, 1);
+    if (__atomic_load_n(&modem->pdp_active, __ATOMIC_ACQUIRE)) {
+        AT_STATS_ADD(modem->pdp_reused, 1);
+        return 0;
+    }
+
+    errno = 0;
     if (modem->ops->pdp_open(modem, modem->apn) != 0) {
-        cellular_pdp_failure(modem);
+        /* Cancelled; says nothing about the context. */
+        if (errno != ECANCELED)
+            cellular_pdp_failure(modem);
         return -1;
     }
 
+    pdp_set_active(modem, true);
     return 0;
 }
 
@@ -53,66 +86,328 @@ void cellular_pdp_success(struct cellular *modem)
 {
     modem->pdp_failures = 0;
     modem->pdp_threshold = PDP_RETRY_THRESHOLD_INITIAL;
+    AT_TRACE_STATE_CHANGE(modem->at, "pdp_failures", 0);
+    pdp_set_active(modem, true);
+}
+
+void cellular_pdp_reset(struct cellular *modem)
+{
+    modem->pdp_failures = 0;
+    modem->pdp_threshold = PDP_RETRY_THRESHOLD_INITIAL;
+    __atomic_store_n(&modem->pdp_active, false, __ATOMIC_RELEASE);
 }
 
 void cellular_pdp_failure(struct cellular *modem)
 {
     modem->pdp_failures++;
+    AT_STATS_ADD(modem->pdp_errors, 1);
+    AT_TRACE_STATE_CHANGE(modem->at, "pdp_failures", modem->pdp_failures);
+    pdp_set_active(modem, false);
+}
+
+void cellular_pdp_down(struct cellular *modem)
+{
+    pdp_set_active(modem, false);
 }
 
+bool cellular_pdp_urc(struct cellular *modem, const char *line)
+{
+    if (!at_prefix_in_table(line, pdp_down_urcs))
+        return false;
+    cellular_pdp_down(modem);
+    return true;
+}
 
-int cellular_op_imei(struct cellular *modem, char *buf, size_t len)
+/*
+ * Status queries below go to the control port, and are shared: threads
+ * asking the same thing at once get one answer (see at_set_share_window()).
+ * The answer may be held by others, so scan it before releasing it.
+ */
+__attribute__ ((format (scanf, 2, 3)))
+static int shared_scanf(struct at_buf *response, const char *format, ...)
+{
+    if (!response)
+        return -1; /* timeout */
+
+    va_list ap;
+    va_start(ap, format);
+    int result = vsscanf(response->data, format, ap);
+    va_end(ap);
+    at_buf_release(response);
+
+    return result == 1 ? 0 : -1;
+}
+
+/*
+ * Status cache. Each value is kept with the at_now() time of its last
+ * update and the ops answer from memory while it's fresh. URC handlers
+ * update it from the port threads, so values are accessed atomically; the
+ * text ones are written before being marked valid, and only ever rewritten
+ * with the same serial number.
+ */
+static const int status_default_ttl[CELLULAR_STATUS_FIELDS] = {
+    [CELLULAR_STATUS_IMEI] = -1,
+    [CELLULAR_STATUS_ICCID] = -1,
+};
+
+static int status_ttl(struct cellular *modem, enum cellular_status field)
+{
+    struct cellular_cached *cached = &modem->status[field];
+    return cached->ttl_set ? cached->ttl : status_default_ttl[field];
+}
+
+/* Whether a value is cached and younger than its TTL divided by div. */
+static bool status_fresh(struct cellular *modem, enum cellular_status field, int div)
+{
+    struct cellular_cached *cached = &modem->status[field];
+    int ttl = status_ttl(modem, field);
+    if (!ttl || !__atomic_load_n(&cached->valid, __ATOMIC_ACQUIRE))
+        return false;
+    if (ttl < 0)
+        return true;
+
+    struct at *at = cellular_port(modem, CELLULAR_PORT_CONTROL);
+    uint64_t age = at_now(at) - __atomic_load_n(&cached->when, __ATOMIC_RELAXED);
+    return age < (uint64_t) ttl * 1000000 / div;
+}
+
+static void status_update(struct cellular *modem, enum cellular_status field, int value)
+{
+    struct cellular_cached *cached = &modem->status[field];
+    struct at *at = cellular_port(modem, CELLULAR_PORT_CONTROL);
+    __atomic_store_n(&cached->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&cached->when, at_now(at), __ATOMIC_RELAXED);
+    __atomic_store_n(&cached->valid, true, __ATOMIC_RELEASE);
+}
+
+static void status_update_text(struct cellular *modem, enum cellular_status field,
+                               char *cache, size_t size, const char *text)
+{
+    if (strlen(text) >= size)
+        return;
+    strcpy(cache, text);
+    status_update(modem, field, 0);
+}
+
+static void status_invalidate(struct cellular *modem, enum cellular_status field)
+{
+    __atomic_store_n(&modem->status[field].valid, false, __ATOMIC_RELEASE);
+}
+
+void cellular_set_status_ttl(struct cellular *modem, enum cellular_status field, int ms)
+{
+    modem->status[field].ttl = ms;
+    modem->status[field].ttl_set = true;
+}
+
+void cellular_status_forget(struct cellular *modem)
+{
+    for (int field=0; field<CELLULAR_STATUS_FIELDS; field++)
+        status_invalidate(modem, field);
+    modem->signal_indicator = 0;
+    modem->service_indicator = 0;
+}
+
+bool cellular_status_scan(const char *line)
+{
+    /* Answers to AT+CREG? are "+CREG: <n>,<stat>[,...]"; reports lack <n>,
+     * so their first field ends the line or comes before a quoted LAC. */
+    if (strncmp(line, "+CREG: ", 7))
+        return false;
+    const char *p = line + 7;
+    while (*p >= '0' && *p <= '9')
+        p++;
+    return p > line + 7 && (*p == '\0' || (p[0] == ',' && p[1] == '"'));
+}
+
+bool cellular_status_urc(struct cellular *modem, const char *line, size_t len)
 {
+    (void) len;
+
+    int stat;
+    if (cellular_status_scan(line) && sscanf(line, "+CREG: %d", &stat) == 1) {
+        status_update(modem, CELLULAR_STATUS_CREG, stat);
+        return true;
+    }
+
+    /* Indicators report bars or a flag; have the real value read again. */
+    int indicator, value;
+    if (sscanf(line, "+CIEV: %d,%d", &indicator, &value) == 2 && indicator > 0) {
+        if (indicator == modem->signal_indicator) {
+            status_invalidate(modem, CELLULAR_STATUS_RSSI);
+            return true;
+        }
+        if (indicator == modem->service_indicator) {
+            status_invalidate(modem, CELLULAR_STATUS_CREG);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Send a setting on its own timeout, leaving the port's alone; zero if it
+ * came back OK. */
+static int status_setting(struct at *at, const char *command)
+{
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 5);
+    struct at_buf *response = at_command_opts(at, &opts, "%s", command);
+    int result = response && !strcmp(response->data, "") ? 0 : -1;
+    at_buf_release(response);
+    return result;
+}
+
+int cellular_status_reports(struct cellular *modem)
+{
+    struct at *at = cellular_port(modem, CELLULAR_PORT_CONTROL);
+
+    if (status_setting(at, "AT+CREG=2") != 0)
+        return -1;
+
+    /* Find the indicators in +CIND: ("battchg",(0-5)),("signal",(0-5)),... */
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 5);
+    struct at_buf *response = at_command_opts(at, &opts, "AT+CIND=?");
+    if (response == NULL || strncmp(response->data, "+CIND: ", 7)) {
+        at_buf_release(response);
+        return 0;   /* No indicators; registration reports will have to do. */
+    }
+    int index = 0;
+    for (const char *p = strstr(response->data, "(\""); p; p = strstr(p+2, "(\"")) {
+        index++;
+        if (!strncmp(p+2, "signal\"", 7))
+            modem->signal_indicator = index;
+        else if (!strncmp(p+2, "service\"", 8))
+            modem->service_indicator = index;
+    }
+    at_buf_release(response);
+    if (modem->signal_indicator || modem->service_indicator)
+        return status_setting(at, "AT+CMER=3,0,0,1");
+
+    return 0;
+}
+
+static int query_imei(struct cellular *modem, char *buf, size_t len, bool idle)
+{
+    /* Digits up to the room left for the NUL. */
     char fmt[16];
-    if (snprintf(fmt, sizeof(fmt), "%%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
+    if (len < 2 || snprintf(fmt, sizeof(fmt), "%%%d[0-9]", (int) len - 1) >= (int) sizeof(fmt)) {
+        errno = EINVAL;
         return -1;
     }
 
-    at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CGSN");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    struct at *at = cellular_port(modem, CELLULAR_PORT_CONTROL);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 1, .shared = true, .idle = idle);
+    struct at_buf *response = at_command_opts(at, &opts, "AT+CGSN");
+    int result = shared_scanf(response, fmt, buf);
+    if (result == 0) {
+        status_update_text(modem, CELLULAR_STATUS_IMEI, modem->imei, sizeof(modem->imei), buf);
+    }
 
-    return 0;
+    return result;
 }
 
-int cellular_op_iccid(struct cellular *modem, char *buf, size_t len)
+static int query_iccid(struct cellular *modem, char *buf, size_t len, bool idle)
 {
+    /* Digits up to the room left for the NUL. */
     char fmt[16];
-    if (snprintf(fmt, sizeof(fmt), "%%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
+    if (len < 2 || snprintf(fmt, sizeof(fmt), "%%%d[0-9]", (int) len - 1) >= (int) sizeof(fmt)) {
+        errno = EINVAL;
         return -1;
     }
 
-    at_set_timeout(modem->at, 5);
-    const char *response = at_command(modem->at, "AT+CCID");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    struct at *at = cellular_port(modem, CELLULAR_PORT_CONTROL);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 5, .shared = true, .idle = idle);
+    struct at_buf *response = at_command_opts(at, &opts, "AT+CCID");
+    int result = shared_scanf(response, fmt, buf);
+    if (result == 0) {
+        status_update_text(modem, CELLULAR_STATUS_ICCID, modem->iccid, sizeof(modem->iccid), buf);
+    }
 
-    return 0;
+    return result;
 }
 
-int cellular_op_creg(struct cellular *modem)
+static int query_creg(struct cellular *modem, bool idle)
 {
     int creg;
 
-    at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CREG?");
-    at_simple_scanf(response, "+CREG: %*d,%d", &creg);
+    struct at *at = cellular_port(modem, CELLULAR_PORT_CONTROL);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 1, .shared = true, .idle = idle);
+    struct at_buf *response = at_command_opts(at, &opts, "AT+CREG?");
+    if (shared_scanf(response, "+CREG: %*d,%d", &creg) == -1)
+        return -1;
 
+    status_update(modem, CELLULAR_STATUS_CREG, creg);
     return creg;
 }
 
-int cellular_op_rssi(struct cellular *modem)
+static int query_rssi(struct cellular *modem, bool idle)
 {
     int rssi;
 
-    at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CSQ");
-    at_simple_scanf(response, "+CSQ: %d,%*d", &rssi);
+    struct at *at = cellular_port(modem, CELLULAR_PORT_CONTROL);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 1, .shared = true, .idle = idle);
+    struct at_buf *response = at_command_opts(at, &opts, "AT+CSQ");
+    if (shared_scanf(response, "+CSQ: %d,%*d", &rssi) == -1)
+        return -1;
 
+    status_update(modem, CELLULAR_STATUS_RSSI, rssi);
     return rssi;
 }
 
+int cellular_refresh_status(struct cellular *modem)
+{
+    int refreshed = 0;
+    for (int field=0; field<CELLULAR_STATUS_FIELDS; field++) {
+        if (!status_ttl(modem, field) || status_fresh(modem, field, 2))
+            continue;
+
+        int result;
+        char buf[CELLULAR_ICCID_LENGTH+2];
+        switch (field) {
+            case CELLULAR_STATUS_CREG: result = query_creg(modem, true); break;
+            case CELLULAR_STATUS_RSSI: result = query_rssi(modem, true); break;
+            case CELLULAR_STATUS_IMEI: result = query_imei(modem, buf, sizeof(buf), true); break;
+            default: result = query_iccid(modem, buf, sizeof(buf), true); break;
+        }
+        if (result == -1)
+            return -1;
+        refreshed++;
+    }
+    return refreshed;
+}
+
+int cellular_op_imei(struct cellular *modem, char *buf, size_t len)
+{
+    if (status_fresh(modem, CELLULAR_STATUS_IMEI, 1) && strlen(modem->imei) < len) {
+        strcpy(buf, modem->imei);
+        return 0;
+    }
+    return query_imei(modem, buf, len, false);
+}
+
+int cellular_op_iccid(struct cellular *modem, char *buf, size_t len)
+{
+    if (status_fresh(modem, CELLULAR_STATUS_ICCID, 1) && strlen(modem->iccid) < len) {
+        strcpy(buf, modem->iccid);
+        return 0;
+    }
+    return query_iccid(modem, buf, len, false);
+}
+
+int cellular_op_creg(struct cellular *modem)
+{
+    if (status_fresh(modem, CELLULAR_STATUS_CREG, 1))
+        return __atomic_load_n(&modem->status[CELLULAR_STATUS_CREG].value, __ATOMIC_RELAXED);
+    return query_creg(modem, false);
+}
+
+int cellular_op_rssi(struct cellular *modem)
+{
+    if (status_fresh(modem, CELLULAR_STATUS_RSSI, 1))
+        return __atomic_load_n(&modem->status[CELLULAR_STATUS_RSSI].value, __ATOMIC_RELAXED);
+    return query_rssi(modem, false);
+}
+
 //int cellular_op_clock_gettime(struct cellular *modem, struct timespec *ts)
 //{
 //    struct tm tm;
@@ -11,6 +11,8 @@
 
 #include <attentive/cellular.h>
 
+#include <errno.h>
+
 /**
  * Request a PDP context. Opens one if isn't already active.
  *
@@ -19,27 +21,76 @@
 int cellular_pdp_request(struct cellular *modem);
 
 /**
- * Signal network connection success.
+ * Signal network connection success; the context is up.
  */
 void cellular_pdp_success(struct cellular *modem);
 
 /**
- * Signal network connection failure.
+ * Forget failures and any context without reporting either; for attach,
+ * where nothing is known yet.
+ */
+void cellular_pdp_reset(struct cellular *modem);
+
+/**
+ * Signal network connection failure. The context may be gone, so the next
+ * request opens it again.
  */
 void cellular_pdp_failure(struct cellular *modem);
 
 /**
- * Perform a network command, requesting a PDP context and signalling success
- * or failure to the PDP machinery. Returns -1 on failure.
+ * Signal that the PDP context is, or may be, down: closed, or reported
+ * deactivated.
+ */
+void cellular_pdp_down(struct cellular *modem);
+
+/**
+ * Track the PDP context from a URC line ("+PDP: DEACT", "+SAPBR 1: DEACT",
+ * "NO CARRIER"). Callable from any thread.
+ *
+ * @returns True if the line reported the context down.
+ */
+bool cellular_pdp_urc(struct cellular *modem, const char *line);
+
+/*
+ * The calling thread's budget (see cellular_budget_begin()); zero and NULL
+ * without one.
+ */
+uint64_t cellular_budget_deadline(void);
+struct at_cancel *cellular_budget_cancel(void);
+
+/**
+ * Options for a driver command: the calling thread's budget plus the given
+ * settings, e.g. CELLULAR_OPTIONS(.timeout = 5, .scanner = scanner).
  */
-#define cellular_command_simple_pdp(modem, command...)                      \
+#define CELLULAR_OPTIONS(...)                                               \
+    { .deadline = cellular_budget_deadline(),                               \
+      .cancel = cellular_budget_cancel(), __VA_ARGS__ }
+
+/**
+ * Wait on the data port within the calling thread's budget.
+ *
+ * @returns Zero after the delay, -1 and sets errno if the budget ran out.
+ */
+int cellular_delay(struct cellular *modem, int ms);
+
+/**
+ * Perform a network command with per-command options, requesting a PDP
+ * context and signalling success or failure to the PDP machinery. Returns -1
+ * on failure.
+ */
+#define cellular_command_simple_pdp(modem, opts, command...)                \
     do {                                                                    \
         /* Attempt to establish a PDP context. */                           \
         if (cellular_pdp_request(modem) != 0)                               \
             return -1;                                                      \
         /* Send the command */                                              \
-        const char *netresponse = at_command(modem->at, command);           \
-        if (netresponse == NULL || strcmp(netresponse, "")) {               \
+        struct at_buf *netresponse = at_command_opts(modem->at, opts, command); \
+        /* Cancelled; says nothing about the context. */                    \
+        if (netresponse == NULL && errno == ECANCELED)                      \
+            return -1;                                                      \
+        bool netok = netresponse && !strcmp(netresponse->data, "");         \
+        at_buf_release(netresponse);                                        \
+        if (!netok) {                                                       \
             cellular_pdp_failure(modem);                                    \
             return -1;                                                      \
         } else {                                                            \
@@ -47,6 +98,17 @@ void cellular_pdp_failure(struct cellular *modem);
         }                                                                   \
     } while (0)
 
+/**
+ * Tell registration reports (+CREG: <stat>[,<lac>,<ci>]) from answers to
+ * AT+CREG?, for line scanners.
+ */
+bool cellular_status_scan(const char *line);
+
+/**
+ * Forget cached status; called on detach.
+ */
+void cellular_status_forget(struct cellular *modem);
+
 /*
  * 3GPP TS 27.007 compatible operations.
  */
@@ -6,14 +6,13 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
+#include <attentive/at-batch.h>
 #include <attentive/cellular.h>
+#include <attentive/ring.h>
 
 #include <stdio.h>
 #include <string.h>
 
-#include "FreeRTOS.h"
-#include "task.h"
-
 #include "at-common.h"
 #define printf(...)
 
@@ -38,6 +37,7 @@
 #define SET_TIMEOUT              10
 #define GET_TIMEOUT              2
 #define NTP_BUF_SIZE             4
+#define SIM800_LINE_MAX          556     /* Command line length, "AT" included. */
 
 enum sim800_socket_status {
     SIM800_SOCKET_STATUS_ERROR = -1,
@@ -50,6 +50,28 @@ enum sim800_socket_status {
 #define SIM800_CONNECT_TIMEOUT          20
 #define SIM800_CIPCFG_RETRIES           10
 
+#define SIM800_STREAM_BUFFER            2048    /* Power of two. */
+#define SIM800_STREAM_GUARD_MS          600     /* Default +++ guard time is 500ms. */
+#define SIM800_STREAM_POLL_MS           50
+
+/* Transparent mode connection state. */
+enum sim800_stream_state {
+    SIM800_STREAM_IDLE,         /* No connection; AT command mode. */
+    SIM800_STREAM_CONNECTING,   /* Waiting for CONNECT after CIPSTART or ATO. */
+    SIM800_STREAM_ONLINE,       /* Data flows; the parser is suspended. */
+    SIM800_STREAM_COMMAND,      /* Escaped with +++; connection still up. */
+    SIM800_STREAM_FAILED,       /* CONNECT FAIL or ATO refused. */
+};
+
+/* Lines that end a transparent mode stream. The first two characters are the
+ * modem's own CRLF, which can't be told apart from data. */
+static const char *const sim800_stream_endings[] = {
+    "\r\nOK\r\n",           /* After our +++; only while escaping. */
+    "\r\nCLOSED\r\n",
+    "\r\nNO CARRIER\r\n",
+    NULL
+};
+
 static char spp_recv_buf[1024] = {0};
 static const char *const sim800_urc_responses[] = {
     "=>",               /* BT data received via the spp channel */
@@ -87,16 +109,46 @@ struct cellular_sim800 {
     enum sim800_socket_status socket_status[SIM800_NSOCKETS];
     enum sim800_socket_status spp_status;
     int spp_connid;
+
+    /* Transparent mode (AT+CIPMODE=1). */
+    bool transparent;
+    volatile enum sim800_stream_state stream_state;
+    volatile bool stream_escaping;
+    char stream_held[16];           /* Possible start of an ending line. */
+    size_t stream_held_len;
+    size_t stream_held_sent;        /* Of which already passed on as data. */
+    struct at_ring stream_ring;     /* Reader to socket_recv. */
+    volatile bool stream_overflow;  /* Ring overran; the stream has a gap. */
+    uint8_t stream_buf[SIM800_STREAM_BUFFER];
 };
 
+static size_t sim800_stream(const void *data, size_t len, void *arg);
+
 static enum at_response_type scan_line(const char *line, size_t len, void *arg)
 {
     (void) len;
     struct cellular_sim800 *priv = arg;
 
-    if (at_prefix_in_table(line, sim800_urc_responses))
+    if (at_prefix_in_table(line, sim800_urc_responses) || cellular_status_scan(line))
         return AT_RESPONSE_URC;
 
+    /* Transparent mode connection results. Acted on here rather than in
+     * handle_urc, which may run later on an executor: everything after
+     * CONNECT is socket data. */
+    if (priv->stream_state == SIM800_STREAM_CONNECTING) {
+        if (!strcmp(line, "CONNECT")) {
+            priv->stream_held_len = priv->stream_held_sent = 0;
+            priv->stream_state = SIM800_STREAM_ONLINE;
+            AT_TRACE_STATE_CHANGE(priv->dev.at, "stream_state", SIM800_STREAM_ONLINE);
+            at_set_stream_handler(priv->dev.at, sim800_stream);
+            return AT_RESPONSE_URC;
+        }
+        if (!strcmp(line, "CONNECT FAIL") || !strcmp(line, "ALREADY CONNECT")) {
+            priv->stream_state = SIM800_STREAM_FAILED;
+            return AT_RESPONSE_URC;
+        }
+    }
+
     /* Socket status notifications in form of "%d, <status>". */
     if (line[0] >= '0' && line[0] <= '0'+SIM800_NSOCKETS &&
         !strncmp(line+1, ", ", 2))
@@ -106,6 +158,7 @@ static enum at_response_type scan_line(const char *line, size_t len, void *arg)
         if (!strcmp(line+3, "CONNECT OK"))
         {
             priv->socket_status[socket] = SIM800_SOCKET_STATUS_CONNECTED;
+            AT_TRACE_STATE_CHANGE(priv->dev.at, "socket_status", socket << 8 | SIM800_SOCKET_STATUS_CONNECTED);
             return AT_RESPONSE_URC;
         }
 
@@ -114,6 +167,7 @@ static enum at_response_type scan_line(const char *line, size_t len, void *arg)
             !strcmp(line+3, "CLOSED"))
         {
             priv->socket_status[socket] = SIM800_SOCKET_STATUS_ERROR;
+            AT_TRACE_STATE_CHANGE(priv->dev.at, "socket_status", socket << 8 | SIM800_SOCKET_STATUS_ERROR);
             return AT_RESPONSE_URC;
         }
     }
@@ -124,9 +178,17 @@ static enum at_response_type scan_line(const char *line, size_t len, void *arg)
 static void handle_urc(const char *line, size_t len, void *arg)
 {
     struct cellular_sim800 *priv = arg;
+    (void) len;
 
     printf("[sim800@%p] urc: %.*s\n", priv, (int) len, line);
-    if(sscanf(line, "=>%s", &spp_recv_buf[0]) == 1) {
+    if (cellular_status_urc(&priv->dev, line, len)) {
+        /* Registration or indicator report; cached status updated. */
+    } else if (cellular_pdp_urc(&priv->dev, line)) {
+        /* Context deactivated; the next network operation reopens it. */
+    } else if (priv->transparent && (!strcmp(line, "CONNECT") || !strcmp(line, "CONNECT FAIL") ||
+                              !strcmp(line, "ALREADY CONNECT"))) {
+        /* Transparent mode results; handled in scan_line. */
+    } else if(sscanf(line, "=>%s", &spp_recv_buf[0]) == 1) {
 
     } else if (!strncmp(line, "+BTPAIRING: \"Druid_Tech\"", strlen("+BTPAIRING: \"Druid_Tech\""))) {
       at_send(priv->dev.at, "AT+BTPAIR=1,1");
@@ -147,6 +209,87 @@ static void handle_urc(const char *line, size_t len, void *arg)
     return;
 }
 
+/*
+ * Transparent mode receive path. Runs in the AT reader context: received
+ * bytes go into a single-producer, single-consumer ring drained by
+ * socket_recv(), while watching for the lines that end the stream.
+ */
+
+static void sim800_stream_push(struct cellular_sim800 *priv, uint8_t ch)
+{
+    /* No flow control with AT+IFC=0,0; the reader must never block, so
+     * overflow is dropped (and counted by the ring). A stream with a gap
+     * is no use to anyone, so remember it for socket_recv. */
+    if (at_ring_write(&priv->stream_ring, &ch, 1) == 0)
+        priv->stream_overflow = true;
+}
+
+/**
+ * Match held bytes against the stream endings.
+ *
+ * @returns Index of a fully matched ending, -1 for a partial match, -2 for
+ *          no match.
+ */
+static int sim800_stream_match(struct cellular_sim800 *priv)
+{
+    bool partial = false;
+    for (int i=0; sim800_stream_endings[i]; i++) {
+        const char *ending = sim800_stream_endings[i];
+        if (i == 0 && !priv->stream_escaping)
+            continue;
+        size_t n = strlen(ending);
+        size_t cmp = priv->stream_held_len < n ? priv->stream_held_len : n;
+        if (memcmp(priv->stream_held, ending, cmp))
+            continue;
+        if (priv->stream_held_len == n)
+            return i;
+        partial = true;
+    }
+    return partial ? -1 : -2;
+}
+
+static size_t sim800_stream(const void *data, size_t len, void *arg)
+{
+    struct cellular_sim800 *priv = arg;
+    const uint8_t *p = data;
+
+    for (size_t i=0; i<len; i++) {
+        priv->stream_held[priv->stream_held_len++] = p[i];
+
+        for (;;) {
+            int match = sim800_stream_match(priv);
+            if (match >= 0) {
+                /* End of stream; whatever follows is for the parser. */
+                priv->stream_held_len = priv->stream_held_sent = 0;
+                priv->stream_state = (match == 0) ? SIM800_STREAM_COMMAND : SIM800_STREAM_IDLE;
+                AT_TRACE_STATE_CHANGE(priv->dev.at, "stream_state", priv->stream_state);
+                at_set_stream_handler(priv->dev.at, NULL);
+                return i + 1;
+            }
+            if (match == -1) {
+                /* Don't sit on a CRLF unless we expect an answer to +++: a
+                 * line-based protocol would stall. The price is a stray CRLF
+                 * in front of CLOSED. */
+                while (!priv->stream_escaping && priv->stream_held_sent < 2 &&
+                       priv->stream_held_sent < priv->stream_held_len)
+                    sim800_stream_push(priv, priv->stream_held[priv->stream_held_sent++]);
+                break;
+            }
+
+            /* Not an ending; release the first byte and try again. */
+            if (priv->stream_held_sent)
+                priv->stream_held_sent--;
+            else
+                sim800_stream_push(priv, priv->stream_held[0]);
+            memmove(priv->stream_held, priv->stream_held + 1, --priv->stream_held_len);
+            if (!priv->stream_held_len)
+                break;
+        }
+    }
+
+    return len;
+}
+
 static const struct at_callbacks sim800_callbacks = {
     .scan_line = scan_line,
     .handle_urc = handle_urc,
@@ -160,69 +303,94 @@ static const struct at_callbacks sim800_callbacks = {
  */
 static int sim800_config(struct cellular *modem, const char *option, const char *value, int attempts)
 {
-    at_set_timeout(modem->at, 10);
+    struct at *at = cellular_port(modem, CELLULAR_PORT_CONTROL);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 10);
+
+    /* Check if the setting has the correct value. */
+    char expected[16];
+    if (snprintf(expected, sizeof(expected), "+%s: %s", option, value) >= (int) sizeof(expected)) {
+        return -1;
+    }
 
     for (int i=0; i<attempts; i++) {
         /* Blindly try to set the configuration option. */
-        at_command(modem->at, "AT+%s=%s", option, value);
+        at_buf_release(at_command_opts(at, &opts, "AT+%s=%s", option, value));
 
         /* Query the setting status. */
-        const char *response = at_command(modem->at, "AT+%s?", option);
+        struct at_buf *response = at_command_opts(at, &opts, "AT+%s?", option);
         /* Bail out on timeouts. */
         if (response == NULL)
             return -1;
 
-        /* Check if the setting has the correct value. */
-        char expected[16];
-        if (snprintf(expected, sizeof(expected), "+%s: %s", option, value) >= (int) sizeof(expected)) {
-            return -1;
-        }
-        if (!strcmp(response, expected))
+        bool set = !strcmp(response->data, expected);
+        at_buf_release(response);
+        if (set)
             return 0;
 
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        if (at_delay_opts(at, &opts, 1000) == -1)
+            return -1;
     }
 
     return -1;
 }
 
 
-static int sim800_attach(struct cellular *modem)
+/* Get a port talking: autobaud, then turn its local echo off. */
+static int sim800_handshake(struct at *at)
 {
-    at_set_callbacks(modem->at, &sim800_callbacks, (void *) modem);
-
-    at_set_timeout(modem->at, 2);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 2);
 
     /* Perform autobauding. */
     for (int i=0; i<SIM800_AUTOBAUD_ATTEMPTS; i++) {
-        const char *response = at_command(modem->at, "AT");
+        struct at_buf *response = at_command_opts(at, &opts, "AT");
+        at_buf_release(response);
         if (response != NULL)
             /* Modem replied. Good. */
             break;
     }
 
     /* Disable local echo. */
-    at_command(modem->at, "ATE0");
+    at_buf_release(at_command_opts(at, &opts, "ATE0"));
 
     /* Disable local echo again; make sure it was disabled successfully. */
-    at_command_simple(modem->at, "ATE0");
-
-    /* Initialize modem. */
-    static const char *const init_strings[] = {
-//        "AT+IPR=0",                     /* Enable autobauding if not already enabled. */
-        "AT+IFC=0,0",                   /* Disable hardware flow control. */
-        "AT+CMEE=2",                    /* Enable extended error reporting. */
-        "AT+CLTS=0",                    /* Don't sync RTC with network time, it's broken. */
-        "AT+CIURC=0",                   /* Disable "Call Ready" URC. */
-        "AT&W0",                        /* Save configuration. */
-        "AT+BTSPPCFG=\"TT\",1",
-        "AT+BTPAIRCFG=0",
-        "AT+BTSPPGET=1",
-        "AT+BTPOWER=1",
-        NULL
+    at_command_opts_simple(at, &opts, "ATE0");
+
+    return 0;
+}
+
+static int sim800_attach(struct cellular *modem)
+{
+    struct at *control = cellular_port(modem, CELLULAR_PORT_CONTROL);
+
+    at_set_callbacks(modem->at, &sim800_callbacks, (void *) modem);
+    if (control != modem->at)
+        at_set_callbacks(control, &sim800_callbacks, (void *) modem);
+
+    if (sim800_handshake(modem->at) != 0)
+        return -1;
+    if (control != modem->at && sim800_handshake(control) != 0)
+        return -1;
+
+    /* Initialize modem, in as few lines as it takes. Powering on twice
+     * is an error, so that goes on its own. */
+    struct at_batch_command init[] = {
+//        { .command = "AT+IPR=0", .repeat = true },    /* Enable autobauding if not already enabled. */
+        { .command = "AT+IFC=0,0", .repeat = true },    /* Disable hardware flow control. */
+        { .command = "AT+CMEE=2", .repeat = true },     /* Enable extended error reporting. */
+        { .command = "AT+CLTS=0", .repeat = true },     /* Don't sync RTC with network time, it's broken. */
+        { .command = "AT+CIURC=0", .repeat = true },    /* Disable "Call Ready" URC. */
+        { .command = "AT&W0", .repeat = true },         /* Save configuration. */
+        { .command = "AT+BTSPPCFG=\"TT\",1", .repeat = true },
+        { .command = "AT+BTPAIRCFG=0", .repeat = true },
+        { .command = "AT+BTSPPGET=1", .repeat = true },
+        { .command = "AT+BTPOWER=1" },
     };
-    for (const char *const *command=init_strings; *command; command++)
-        at_command_simple(modem->at, "%s", *command);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT);
+    size_t count = sizeof(init) / sizeof(*init);
+    int result = at_batch(control, &opts, init, count, SIM800_LINE_MAX);
+    at_batch_release(init, count);
+    if (result != 0)
+        return -1;
 
     /* Configure IP application. */
 
@@ -242,6 +410,8 @@ static int sim800_attach(struct cellular *modem)
 static int sim800_detach(struct cellular *modem)
 {
     at_set_callbacks(modem->at, NULL, NULL);
+    if (modem->control)
+        at_set_callbacks(modem->control, NULL, NULL);
     return 0;
 }
 
@@ -339,24 +509,24 @@ static enum at_response_type scanner_cipstatus(const char *line, size_t len, voi
  */
 static int sim800_ipstatus(struct cellular *modem)
 {
-    at_set_timeout(modem->at, 10);
-    at_set_command_scanner(modem->at, scanner_cipstatus);
-    const char *response = at_command(modem->at, "AT+CIPSTATUS");
+    struct at *at = cellular_port(modem, CELLULAR_PORT_CONTROL);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 10, .scanner = scanner_cipstatus);
+    struct at_buf *response = at_command_opts(at, &opts, "AT+CIPSTATUS");
 
     if (response == NULL)
         return -1;
 
-    const char *state = strstr(response, "STATE: ");
-    if (!state) {
-        return -1;
+    int result = -1;
+    const char *state = strstr(response->data, "STATE: ");
+    if (state) {
+        state += strlen("STATE: ");
+        if (!strncmp(state, "IP STATUS", strlen("IP STATUS")) ||
+            !strncmp(state, "IP PROCESSING", strlen("IP PROCESSING")))
+            result = 0;
     }
-    state += strlen("STATE: ");
-    if (!strncmp(state, "IP STATUS", strlen("IP STATUS")))
-        return 0;
-    if (!strncmp(state, "IP PROCESSING", strlen("IP PROCESSING")))
-        return 0;
+    at_buf_release(response);
 
-    return -1;
+    return result;
 }
 
 static enum at_response_type scanner_cifsr(const char *line, size_t len, void *arg)
@@ -371,13 +541,13 @@ static enum at_response_type scanner_cifsr(const char *line, size_t len, void *a
     return AT_RESPONSE_UNKNOWN;
 }
 
-static int sim800_pdp_open(struct cellular *modem, const char *apn)
+static int _sim800_pdp_open(struct cellular *modem, const char *apn)
 {
-    at_set_timeout(modem->at, SET_TIMEOUT);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT);
 
     /* Configure and open context for FTP/HTTP applications. */
-    at_command_simple(modem->at, "AT+SAPBR=3,1,APN,\"%s\"", apn);
-    at_command(modem->at, "AT+SAPBR=1,1");
+    at_command_opts_simple(modem->at, &opts, "AT+SAPBR=3,1,APN,\"%s\"", apn);
+    at_buf_release(at_command_opts(modem->at, &opts, "AT+SAPBR=1,1"));
 
     /* Skip the configuration if context is already open. */
     if (sim800_ipstatus(modem) == 0)
@@ -390,12 +560,12 @@ static int sim800_pdp_open(struct cellular *modem, const char *apn)
      * the GPRS states documentation. */
 
     /* Configure context for TCP/IP applications. */
-    at_command(modem->at, "AT+CSTT=\"%s\"", apn);
+    at_buf_release(at_command_opts(modem->at, &opts, "AT+CSTT=\"%s\"", apn));
     /* Establish context. */
-    at_command(modem->at, "AT+CIICR");
+    at_buf_release(at_command_opts(modem->at, &opts, "AT+CIICR"));
     /* Read local IP address. Switches modem to IP STATUS state. */
-    at_set_command_scanner(modem->at, scanner_cifsr);
-    at_command(modem->at, "AT+CIFSR");
+    struct at_command_options cifsr = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT, .scanner = scanner_cifsr);
+    at_buf_release(at_command_opts(modem->at, &cifsr, "AT+CIFSR"));
 
     return sim800_ipstatus(modem);
 }
@@ -412,25 +582,137 @@ static enum at_response_type scanner_cipshut(const char *line, size_t len, void
 
 static int sim800_pdp_close(struct cellular *modem)
 {
-    at_set_timeout(modem->at, SET_TIMEOUT);
-    at_set_command_scanner(modem->at, scanner_cipshut);
-    at_command_simple(modem->at, "AT+CIPSHUT");
+    cellular_pdp_down(modem);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT, .scanner = scanner_cipshut);
+    at_command_opts_simple(modem->at, &opts, "AT+CIPSHUT");
 
     return 0;
 }
 
 
-static int sim800_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
+/**
+ * Wait for the transparent mode state to move away from a transient one.
+ */
+static enum sim800_stream_state sim800_stream_wait(struct cellular_sim800 *priv,
+        enum sim800_stream_state transient, int timeout_ms)
+{
+    for (int elapsed=0; priv->stream_state == transient && elapsed < timeout_ms;
+         elapsed += SIM800_STREAM_POLL_MS)
+        if (cellular_delay(&priv->dev, SIM800_STREAM_POLL_MS) == -1)
+            break;
+    return priv->stream_state;
+}
+
+static int sim800_stream_connect(struct cellular *modem, const char *host, uint16_t port)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
 
-    if(connid == SIM800_NSOCKETS) {
+    if (priv->stream_state != SIM800_STREAM_IDLE && priv->stream_state != SIM800_STREAM_FAILED)
+        return -1;
+
+    /* Drop leftovers of the previous connection. */
+    at_ring_flush(&priv->stream_ring);
+    priv->stream_overflow = false;
+
+    /* Single connection; OK comes first, CONNECT follows. */
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT);
+    priv->stream_state = SIM800_STREAM_CONNECTING;
+    cellular_command_simple_pdp(modem, &opts, "AT+CIPSTART=\"TCP\",\"%s\",%d", host, port);
+
+    if (sim800_stream_wait(priv, SIM800_STREAM_CONNECTING, SIM800_CONNECT_TIMEOUT * 1000) != SIM800_STREAM_ONLINE) {
+        priv->stream_state = SIM800_STREAM_IDLE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Leave data mode with the +++ escape sequence, keeping the connection.
+ */
+static int sim800_stream_escape(struct cellular *modem)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (priv->stream_state != SIM800_STREAM_ONLINE)
+        return priv->stream_state == SIM800_STREAM_COMMAND ? 0 : -1;
+
+    /* Silence, +++, silence; the modem answers OK. */
+    priv->stream_escaping = true;
+    if (cellular_delay(modem, SIM800_STREAM_GUARD_MS) == -1) {
+        priv->stream_escaping = false;
+        return -1;
+    }
+    at_send_raw(modem->at, "+++", 3);
+    sim800_stream_wait(priv, SIM800_STREAM_ONLINE, 2 * SIM800_STREAM_GUARD_MS + 1000);
+    priv->stream_escaping = false;
+
+    return priv->stream_state == SIM800_STREAM_COMMAND ? 0 : -1;
+}
+
+/**
+ * Go back to data mode after an escape.
+ */
+static int sim800_stream_resume(struct cellular *modem)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (priv->stream_state != SIM800_STREAM_COMMAND)
+        return priv->stream_state == SIM800_STREAM_ONLINE ? 0 : -1;
+
+    /* ATO answers CONNECT (or NO CARRIER), not OK; don't wait for a response. */
+    priv->stream_state = SIM800_STREAM_CONNECTING;
+    at_send(modem->at, "ATO");
+    if (sim800_stream_wait(priv, SIM800_STREAM_CONNECTING, SET_TIMEOUT * 1000) != SIM800_STREAM_ONLINE) {
+        priv->stream_state = SIM800_STREAM_IDLE;
+        return -1;
+    }
+    return 0;
+}
+
+int cellular_sim800_set_transparent(struct cellular *modem, bool enable)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (priv->stream_state != SIM800_STREAM_IDLE && priv->stream_state != SIM800_STREAM_FAILED)
+        return -1;
+
+    /* Connection mode can only be changed with the IP application shut,
+     * which takes the context down. */
+    cellular_pdp_down(modem);
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT, .scanner = scanner_cipshut);
+    at_command_opts_simple(modem->at, &opts, "AT+CIPSHUT");
+
+    if (sim800_config(modem, "CIPMUX", enable ? "0" : "1", SIM800_CIPCFG_RETRIES) != 0)
+        return -1;
+    if (sim800_config(modem, "CIPMODE", enable ? "1" : "0", SIM800_CIPCFG_RETRIES) != 0)
+        return -1;
+
+    priv->transparent = enable;
+    priv->stream_state = SIM800_STREAM_IDLE;
+    return 0;
+}
+
+int cellular_sim800_escape(struct cellular *modem)
+{
+    return sim800_stream_escape(modem);
+}
+
+static int _sim800_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (priv->transparent && connid == 0) {
+        return sim800_stream_connect(modem, host, port);
+    } else if (priv->transparent && connid < SIM800_NSOCKETS) {
+        /* One connection only in transparent mode. */
+        return -1;
+    } else if(connid == SIM800_NSOCKETS) {
       return !(SIM800_SOCKET_STATUS_CONNECTED == priv->spp_status);
     } else if(connid < SIM800_NSOCKETS) {
       /* Send connection request. */
-      at_set_timeout(modem->at, SET_TIMEOUT);
+      struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT);
       priv->socket_status[connid] = SIM800_SOCKET_STATUS_UNKNOWN;
-      cellular_command_simple_pdp(modem, "AT+CIPSTART=%d,TCP,\"%s\",%d", connid, host, port);
+      cellular_command_simple_pdp(modem, &opts, "AT+CIPSTART=%d,TCP,\"%s\",%d", connid, host, port);
 
       /* Wait for socket status URC. */
       for (int i=0; i<SIM800_CONNECT_TIMEOUT; i++) {
@@ -439,7 +721,8 @@ static int sim800_socket_connect(struct cellular *modem, int connid, const char
           } else if (priv->socket_status[connid] == SIM800_SOCKET_STATUS_ERROR) {
               return -1;
           }
-          vTaskDelay(pdMS_TO_TICKS(1000));
+          if (cellular_delay(modem, 1000) == -1)
+              return -1;
       }
     }
 
@@ -466,7 +749,7 @@ static enum at_response_type scanner_cipsend(const char *line, size_t len, void
     return AT_RESPONSE_UNKNOWN;
 }
 
-static ssize_t sim800_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
+static ssize_t _sim800_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
     (void) flags;
@@ -480,19 +763,25 @@ static ssize_t sim800_socket_send(struct cellular *modem, int connid, const void
       /* Request transmission. */
       at_send_raw(modem->at, buffer, amount);
       return amount;
+    } else if (priv->transparent && connid == 0) {
+      /* Straight onto the wire; no prompt, no size limit. */
+      if (sim800_stream_resume(modem) != 0)
+        return -1;
+      if (!at_send_raw(modem->at, buffer, amount))
+        return -1;
+      return amount;
     } else if(connid < SIM800_NSOCKETS) {
       if(priv->socket_status[connid] != SIM800_SOCKET_STATUS_CONNECTED) {
         return -1;
       }
       amount = amount > 1460 ? 1460 : amount;
       /* Request transmission. */
-      at_set_timeout(modem->at, SET_TIMEOUT);
-      at_expect_dataprompt(modem->at);
-      at_command_simple(modem->at, "AT+CIPSEND=%d,%zu", connid, amount);
+      struct at_command_options prompt = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT, .dataprompt = true);
+      at_command_opts_simple(modem->at, &prompt, "AT+CIPSEND=%d,%zu", connid, amount);
 
       /* Send raw data. */
-      at_set_command_scanner(modem->at, scanner_cipsend);
-      at_command_raw_simple(modem->at, buffer, amount);
+      struct at_command_options data = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT, .scanner = scanner_cipsend);
+      at_command_raw_opts_simple(modem->at, &data, buffer, amount);
     } else {
       return 0;
     }
@@ -513,7 +802,7 @@ static enum at_response_type scanner_ciprxget(const char *line, size_t len, void
     return AT_RESPONSE_UNKNOWN;
 }
 
-static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buffer, size_t length, int flags)
+static ssize_t _sim800_socket_recv(struct cellular *modem, int connid, void *buffer, size_t length, int flags)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
     (void) flags;
@@ -534,6 +823,17 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
           spp_recv_buf[0] = '\0';
       }
     }
+    else if (priv->transparent && connid == 0) {
+      /* Data was lost; don't hand out a stream with a hole in it. */
+      if (priv->stream_overflow) {
+        errno = ENOBUFS;
+        return -1;
+      }
+      /* Buffered data stays readable after the connection went away. */
+      cnt = at_ring_read(&priv->stream_ring, buffer, length);
+      if (cnt == 0 && priv->stream_state == SIM800_STREAM_IDLE)
+        return -1;
+    }
     else if(connid < SIM800_NSOCKETS) {
       if(priv->socket_status[connid] != SIM800_SOCKET_STATUS_CONNECTED) {
         return -1;
@@ -545,9 +845,8 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
           chunk = chunk > 480 ? 480 : chunk;
 
           /* Perform the read. */
-          at_set_timeout(modem->at, SET_TIMEOUT);
-          at_set_command_scanner(modem->at, scanner_ciprxget);
-          const char *response = at_command(modem->at, "AT+CIPRXGET=2,%d,%d", connid, chunk);
+          struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT, .scanner = scanner_ciprxget);
+          struct at_buf *response = at_command_opts(modem->at, &opts, "AT+CIPRXGET=2,%d,%d", connid, chunk);
           if (response == NULL)
               return -1;
 
@@ -559,23 +858,30 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
           // then wierd things can happen. see memcpy
           // requested should be equal to chunk
           // confirmed is that what can be read
-          at_simple_scanf(response, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed);
+          if (sscanf(response->data, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed) != 2) {
+              at_buf_release(response);
+              return -1;
+          }
 
           /* Bail out if we're out of data. */
           /* FIXME: We should maybe block until we receive something? */
-          if (confirmed == 0)
+          if (confirmed == 0) {
+              at_buf_release(response);
               break;
+          }
 
           /* Locate the payload. */
           /* TODO: what if no \n is in input stream?
            * should use strnchr at least */
-          const char *data = strchr(response, '\n');
+          const char *data = strchr(response->data, '\n');
           if (data++ == NULL) {
+              at_buf_release(response);
               return -1;
           }
 
           /* Copy payload to result buffer. */
           memcpy((char *)buffer + cnt, data, confirmed);
+          at_buf_release(response);
           cnt += confirmed;
       }
     }
@@ -585,22 +891,31 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
 
 static int sim800_socket_waitack(struct cellular *modem, int connid)
 {
-    const char *response;
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
     if(connid == SIM800_NSOCKETS) {
       return 0;
+    } else if (priv->transparent && connid == 0) {
+      /* AT+CIPACK isn't available in data mode; TCP takes care of it. */
+      return 0;
     } else if(connid < SIM800_NSOCKETS) {
-      at_set_timeout(modem->at, 5);
+      struct at_command_options opts = CELLULAR_OPTIONS(.timeout = 5);
       for (int i=0; i<SIM800_WAITACK_TIMEOUT; i++) {
           /* Read number of bytes waiting. */
           int nacklen;
-          response = at_command(modem->at, "AT+CIPACK=%d", connid);
-          at_simple_scanf(response, "+CIPACK: %*d,%*d,%d", &nacklen);
+          struct at_buf *response = at_command_opts(modem->at, &opts, "AT+CIPACK=%d", connid);
+          if (response == NULL)
+              return -1; /* timeout */
+          int scanned = sscanf(response->data, "+CIPACK: %*d,%*d,%d", &nacklen);
+          at_buf_release(response);
+          if (scanned != 1)
+              return -1;
 
           /* Return if all bytes were acknowledged. */
           if (nacklen == 0)
               return 0;
 
-          vTaskDelay(pdMS_TO_TICKS(1000));
+          if (cellular_delay(modem, 1000) == -1)
+              return -1;
       }
     }
     return -1;
@@ -618,45 +933,71 @@ static enum at_response_type scanner_cipclose(const char *line, size_t len, void
     return AT_RESPONSE_UNKNOWN;
 }
 
-int sim800_socket_close(struct cellular *modem, int connid)
+static int _sim800_socket_close(struct cellular *modem, int connid)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT, .scanner = scanner_cipclose);
 
     if(connid == SIM800_NSOCKETS) {
-      at_command_simple(modem->at, "AT+BTDISCONN=%d", priv->spp_connid);
+      struct at_command_options disconnect = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT);
+      at_command_opts_simple(modem->at, &disconnect, "AT+BTDISCONN=%d", priv->spp_connid);
+    } else if (priv->transparent && connid == 0) {
+      /* Get back to command mode first, unless the peer closed already. */
+      if (priv->stream_state == SIM800_STREAM_IDLE)
+        return 0;
+      if (sim800_stream_escape(modem) != 0 && priv->stream_state != SIM800_STREAM_IDLE)
+        return -1;
+      if (priv->stream_state == SIM800_STREAM_COMMAND)
+        at_buf_release(at_command_opts(modem->at, &opts, "AT+CIPCLOSE"));
+      priv->stream_state = SIM800_STREAM_IDLE;
     } else if(connid < SIM800_NSOCKETS) {
-      at_set_timeout(modem->at, SET_TIMEOUT);
-      at_set_command_scanner(modem->at, scanner_cipclose);
-      at_command_simple(modem->at, "AT+CIPCLOSE=%d", connid);
+      at_command_opts_simple(modem->at, &opts, "AT+CIPCLOSE=%d", connid);
     }
     return 0;
 }
 
 static int sim800_ftp_open(struct cellular *modem, const char *host, uint16_t port, const char *username, const char *password, bool passive)
 {
-    /* Configure server parameters. */
-    at_command_simple(modem->at, "AT+FTPCID=1");
-    at_command_simple(modem->at, "AT+FTPSERV=\"%s\"", host);
-    at_command_simple(modem->at, "AT+FTPPORT=%d", port);
-    at_command_simple(modem->at, "AT+FTPUN=\"%s\"", username);
-    at_command_simple(modem->at, "AT+FTPPW=\"%s\"", password);
-    at_command_simple(modem->at, "AT+FTPMODE=%d", (int) passive);
-    at_command_simple(modem->at, "AT+FTPTYPE=I");
+    /* Configure server parameters, all on one line. */
+    char server[96], user[96], pass[96], portno[24], mode[24];
+    if (snprintf(server, sizeof(server), "AT+FTPSERV=\"%s\"", host) >= (int) sizeof(server) ||
+        snprintf(user, sizeof(user), "AT+FTPUN=\"%s\"", username) >= (int) sizeof(user) ||
+        snprintf(pass, sizeof(pass), "AT+FTPPW=\"%s\"", password) >= (int) sizeof(pass) ||
+        snprintf(portno, sizeof(portno), "AT+FTPPORT=%d", port) >= (int) sizeof(portno) ||
+        snprintf(mode, sizeof(mode), "AT+FTPMODE=%d", (int) passive) >= (int) sizeof(mode)) {
+        errno = ENOMEM;
+        return -1;
+    }
 
-    return 0;
+    struct at_batch_command setup[] = {
+        { .command = "AT+FTPCID=1", .repeat = true },
+        { .command = server, .repeat = true },
+        { .command = portno, .repeat = true },
+        { .command = user, .repeat = true },
+        { .command = pass, .repeat = true },
+        { .command = mode, .repeat = true },
+        { .command = "AT+FTPTYPE=I", .repeat = true },
+    };
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT);
+    size_t count = sizeof(setup) / sizeof(*setup);
+    int result = at_batch(modem->at, &opts, setup, count, SIM800_LINE_MAX);
+    at_batch_release(setup, count);
+
+    return result;
 }
 
-static int sim800_ftp_get(struct cellular *modem, const char *filename)
+static int _sim800_ftp_get(struct cellular *modem, const char *filename)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT);
 
     /* Configure filename. */
-    at_command_simple(modem->at, "AT+FTPGETPATH=\"/\"");
-    at_command_simple(modem->at, "AT+FTPGETNAME=\"%s\"", filename);
+    at_command_opts_simple(modem->at, &opts, "AT+FTPGETPATH=\"/\"");
+    at_command_opts_simple(modem->at, &opts, "AT+FTPGETNAME=\"%s\"", filename);
 
     /* Try to open the connection. */
     priv->ftpget1_status = -1;
-    cellular_command_simple_pdp(modem, "AT+FTPGET=1");
+    cellular_command_simple_pdp(modem, &opts, "AT+FTPGET=1");
 
     /* Wait for the operation result. */
     for (int i=0; i<SIM800_FTP_TIMEOUT; i++) {
@@ -667,7 +1008,8 @@ static int sim800_ftp_get(struct cellular *modem, const char *filename)
             return -1;
         }
 
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        if (cellular_delay(modem, 1000) == -1)
+            return -1;
     }
 
     return -1;
@@ -685,41 +1027,46 @@ static enum at_response_type scanner_ftpget2(const char *line, size_t len, void
     return AT_RESPONSE_UNKNOWN;
 }
 
-static int sim800_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
+static int _sim800_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
 
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT, .scanner = scanner_ftpget2);
+    struct at_buf *response;
     int retries = 0;
 retry:
-    at_set_timeout(modem->at, SET_TIMEOUT);
-    at_set_command_scanner(modem->at, scanner_ftpget2);
-    const char *response = at_command(modem->at, "AT+FTPGET=2,%zu", length);
+    response = at_command_opts(modem->at, &opts, "AT+FTPGET=2,%zu", length);
 
     if (response == NULL)
         return -1;
 
     int cnflength;
-    if (sscanf(response, "+FTPGET: 2,%d", &cnflength) == 1) {
-        /* Zero means no data is available. Wait for it. */
-        if (cnflength == 0) {
-            /* Bail out on timeout. */
-            if (++retries >= SIM800_FTP_TIMEOUT) {
-                return -1;
-            }
-            vTaskDelay(pdMS_TO_TICKS(1000));
-            goto retry;
-        }
-
+    int scanned = sscanf(response->data, "+FTPGET: 2,%d", &cnflength);
+    if (scanned == 1 && cnflength > 0) {
         /* Locate the payload. */
-        const char *data = strchr(response, '\n');
+        const char *data = strchr(response->data, '\n');
         if (data == NULL) {
+            at_buf_release(response);
             return -1;
         }
         data += 1;
 
         /* Copy payload to result buffer. */
         memcpy((char *)buffer, data, cnflength);
+        at_buf_release(response);
         return cnflength;
+    }
+    at_buf_release(response);
+
+    if (scanned == 1) {
+        /* Zero means no data is available. Wait for it. */
+        /* Bail out on timeout. */
+        if (++retries >= SIM800_FTP_TIMEOUT) {
+            return -1;
+        }
+        if (cellular_delay(modem, 1000) == -1)
+            return -1;
+        goto retry;
     } else if (priv->ftpget1_status == 0) {
         /* Transfer finished. */
         return 0;
@@ -731,11 +1078,72 @@ retry:
 static int sim800_ftp_close(struct cellular *modem)
 {
     /* Requires fairly recent SIM800 firmware. */
-    at_command_simple(modem->at, "AT+FTPQUIT");
+    struct at_command_options opts = CELLULAR_OPTIONS(.timeout = SET_TIMEOUT);
+    at_command_opts_simple(modem->at, &opts, "AT+FTPQUIT");
 
     return 0;
 }
 
+/*
+ * The operations that move data, traced as spans.
+ */
+
+static int sim800_pdp_open(struct cellular *modem, const char *apn)
+{
+    AT_TRACE_SPAN_BEGIN(modem->at, "pdp_open");
+    int result = _sim800_pdp_open(modem, apn);
+    AT_TRACE_SPAN_END(modem->at, "pdp_open", result);
+    return result;
+}
+
+static int sim800_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    AT_TRACE_SPAN_BEGIN(modem->at, "socket_connect");
+    int result = _sim800_socket_connect(modem, connid, host, port);
+    AT_TRACE_SPAN_END(modem->at, "socket_connect", result);
+    return result;
+}
+
+static ssize_t sim800_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
+{
+    AT_TRACE_SPAN_BEGIN(modem->at, "socket_send");
+    ssize_t result = _sim800_socket_send(modem, connid, buffer, amount, flags);
+    AT_TRACE_SPAN_END(modem->at, "socket_send", result);
+    return result;
+}
+
+static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buffer, size_t length, int flags)
+{
+    AT_TRACE_SPAN_BEGIN(modem->at, "socket_recv");
+    ssize_t result = _sim800_socket_recv(modem, connid, buffer, length, flags);
+    AT_TRACE_SPAN_END(modem->at, "socket_recv", result);
+    return result;
+}
+
+static int sim800_socket_close(struct cellular *modem, int connid)
+{
+    AT_TRACE_SPAN_BEGIN(modem->at, "socket_close");
+    int result = _sim800_socket_close(modem, connid);
+    AT_TRACE_SPAN_END(modem->at, "socket_close", result);
+    return result;
+}
+
+static int sim800_ftp_get(struct cellular *modem, const char *filename)
+{
+    AT_TRACE_SPAN_BEGIN(modem->at, "ftp_get");
+    int result = _sim800_ftp_get(modem, filename);
+    AT_TRACE_SPAN_END(modem->at, "ftp_get", result);
+    return result;
+}
+
+static int sim800_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
+{
+    AT_TRACE_SPAN_BEGIN(modem->at, "ftp_getdata");
+    int result = _sim800_ftp_getdata(modem, buffer, length);
+    AT_TRACE_SPAN_END(modem->at, "ftp_getdata", result);
+    return result;
+}
+
 static const struct cellular_ops sim800_ops = {
     .attach = sim800_attach,
     .detach = sim800_detach,
@@ -770,6 +1178,7 @@ struct cellular *cellular_sim800_alloc(void)
     memset(modem, 0, sizeof(*modem));
 
     modem->dev.ops = &sim800_ops;
+    at_ring_init(&modem->stream_ring, modem->stream_buf, sizeof(modem->stream_buf));
 
     return (struct cellular *) modem;
 }
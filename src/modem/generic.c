@@ -34,6 +34,7 @@ struct cellular *cellular_generic_alloc(void)
     if (modem == NULL) {
         return NULL;
     }
+    memset(modem, 0, sizeof(*modem));
 
     modem->dev.ops = &generic_ops;
 
@@ -7,7 +7,11 @@
  */
 
 #include <attentive/parser.h>
+#include <attentive/at-probes.h>
+#include <attentive/at-trace.h>
+#include <attentive/at-stats.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #define printf(...)
@@ -20,20 +24,39 @@ enum at_parser_state {
     STATE_HEXDATA,
 };
 
+struct at_parser_urc_policy {
+    char prefix[AT_PARSER_URC_PREFIX];  /**< Empty if the slot is free. */
+    size_t len;
+    enum at_urc_policy policy;
+    uint64_t window;
+    bool open;              /**< A window is running. */
+    uint64_t passed;        /**< When it started. */
+    struct at_buf *held;    /**< Latest coalesced line, or NULL. */
+};
+
 struct at_parser {
     const struct at_parser_callbacks *cbs;
     at_character_handler_t character_handler;
+    at_stream_handler_t stream_handler;
+    struct at_trace *trace;
+    struct at_stats *stats;
+    at_clock_handler_t now;
     void *priv;
 
     enum at_parser_state state;
     bool expect_dataprompt;
+    char sentinel[AT_PARSER_SENTINEL];  /**< Discard lines up to this one. */
     size_t data_left;
     int nibble;
 
-    char *buf;
+    struct at_buf_pool *pool;
+    struct at_buf *response;    /**< Buffer the response is collected in. */
+    char *buf;                  /**< Its data. */
     size_t buf_used;
     size_t buf_size;
     size_t buf_current;
+
+    struct at_parser_urc_policy urc_policies[AT_PARSER_URC_POLICIES];
 };
 
 static const char *const final_ok_responses[] = {
@@ -63,15 +86,21 @@ struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t
         return NULL;
     }
 
-    /* Allocate response buffer. */
-    parser->buf = malloc(bufsize);
-    if (parser->buf == NULL) {
+    /* Allocate response buffers; one to fill and one to switch to. */
+    parser->pool = at_buf_pool_alloc(bufsize, 2);
+    if (parser->pool == NULL) {
         free(parser);
         return NULL;
     }
+    parser->response = at_buf_acquire(parser->pool);
+    parser->buf = parser->response->data;
     parser->cbs = cbs;
     parser->buf_size = bufsize;
     parser->priv = priv;
+    parser->stream_handler = NULL;
+    parser->trace = NULL;
+    parser->stats = NULL;
+    memset(parser->urc_policies, 0, sizeof(parser->urc_policies));
 
     /* Prepare instance. */
     at_parser_reset(parser);
@@ -83,6 +112,7 @@ void at_parser_reset(struct at_parser *parser)
 {
     parser->state = STATE_IDLE;
     parser->expect_dataprompt = false;
+    parser->sentinel[0] = '\0';
     parser->buf_used = 0;
     parser->buf_current = 0;
     parser->data_left = 0;
@@ -94,16 +124,188 @@ void at_parser_set_character_handler(struct at_parser *parser, at_character_hand
     parser->character_handler = handler;
 }
 
+void at_parser_set_stream_handler(struct at_parser *parser, at_stream_handler_t handler)
+{
+    parser->stream_handler = handler;
+}
+
+void at_parser_set_trace(struct at_parser *parser, struct at_trace *trace)
+{
+    parser->trace = trace;
+}
+
+void at_parser_set_stats(struct at_parser *parser, struct at_stats *stats)
+{
+    parser->stats = stats;
+    if (stats)
+        stats->parser_size = parser->buf_size;
+}
+
+void at_parser_set_clock(struct at_parser *parser, at_clock_handler_t now)
+{
+    parser->now = now;
+}
+
 void at_parser_expect_dataprompt(struct at_parser *parser)
 {
     parser->expect_dataprompt = true;
 }
 
+void at_parser_expect_sentinel(struct at_parser *parser, const char *line)
+{
+    size_t len = strlen(line);
+    if (len >= sizeof(parser->sentinel))
+        len = sizeof(parser->sentinel) - 1;
+    memcpy(parser->sentinel, line, len);
+    parser->sentinel[len] = '\0';
+}
+
 void at_parser_await_response(struct at_parser *parser)
 {
     parser->state = (parser->expect_dataprompt ? STATE_DATAPROMPT : STATE_READLINE);
 }
 
+int at_parser_set_urc_policy(struct at_parser *parser, const char *prefix,
+                             enum at_urc_policy policy, uint64_t window)
+{
+    size_t len = strlen(prefix);
+    if (!len) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len >= AT_PARSER_URC_PREFIX)
+        len = AT_PARSER_URC_PREFIX - 1;
+
+    struct at_parser_urc_policy *slot = NULL, *free_slot = NULL;
+    for (int i=0; i<AT_PARSER_URC_POLICIES; i++) {
+        struct at_parser_urc_policy *p = &parser->urc_policies[i];
+        if (!p->prefix[0] && !free_slot)
+            free_slot = p;
+        else if (p->len == len && !memcmp(p->prefix, prefix, len))
+            slot = p;
+    }
+
+    if (slot && slot->held) {
+        at_buf_release(slot->held);
+        slot->held = NULL;
+    }
+    if (policy == AT_URC_DELIVER) {
+        if (slot)
+            memset(slot, 0, sizeof(*slot));
+        return 0;
+    }
+    if (!slot) {
+        if (!free_slot) {
+            errno = ENOSPC;
+            return -1;
+        }
+        slot = free_slot;
+        memcpy(slot->prefix, prefix, len);
+        slot->prefix[len] = '\0';
+        slot->len = len;
+    }
+    slot->policy = policy;
+    slot->window = window;
+    slot->open = false;
+    return 0;
+}
+
+/* Count a line a policy kept back. */
+static void parser_suppressed(struct at_parser *parser, enum at_urc_policy policy, int class)
+{
+    struct at_stats *stats = parser->stats;
+    if (!stats)
+        return;
+    if (policy == AT_URC_COALESCE)
+        AT_STATS_ADD(stats->urcs_coalesced, 1);
+    else if (policy == AT_URC_RATE_LIMIT)
+        AT_STATS_ADD(stats->urcs_limited, 1);
+    else
+        AT_STATS_ADD(stats->urcs_dropped, 1);
+    if (class >= 0)
+        AT_STATS_ADD(stats->urc_classes[class].suppressed, 1);
+}
+
+/* Apply the URC policies to a line; false if it's not to be passed on. */
+static bool parser_admit_urc(struct at_parser *parser, const char *line, size_t len, int class)
+{
+    struct at_parser_urc_policy *p = NULL;
+    for (int i=0; i<AT_PARSER_URC_POLICIES && !p; i++) {
+        struct at_parser_urc_policy *slot = &parser->urc_policies[i];
+        if (slot->prefix[0] && len >= slot->len && !memcmp(line, slot->prefix, slot->len))
+            p = slot;
+    }
+    if (!p)
+        return true;
+
+    uint64_t now = parser->now ? parser->now(parser->priv) : at_stats_clock_ns();
+    bool open = p->open && now - p->passed < p->window;
+
+    switch (p->policy) {
+        case AT_URC_DROP:
+            parser_suppressed(parser, p->policy, class);
+            return false;
+
+        case AT_URC_RATE_LIMIT:
+            if (open) {
+                parser_suppressed(parser, p->policy, class);
+                return false;
+            }
+            break;
+
+        case AT_URC_COALESCE:
+            if (p->held) {
+                /* This one is newer, whether or not the window is over. */
+                parser_suppressed(parser, p->policy, class);
+                if (!open) {
+                    at_buf_release(p->held);
+                    p->held = NULL;
+                }
+            }
+            if (open) {
+                if (!p->held)
+                    p->held = at_buf_acquire(parser->pool);
+                if (!p->held)
+                    return true;    /* Out of memory; pass it on. */
+                p->held->len = len < parser->buf_size ? len : parser->buf_size - 1;
+                memcpy(p->held->data, line, p->held->len);
+                p->held->data[p->held->len] = '\0';
+                return false;
+            }
+            break;
+
+        default:
+            return true;
+    }
+
+    p->open = true;
+    p->passed = now;
+    return true;
+}
+
+uint64_t at_parser_flush_urcs(struct at_parser *parser, uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+    for (int i=0; i<AT_PARSER_URC_POLICIES; i++) {
+        struct at_parser_urc_policy *p = &parser->urc_policies[i];
+        if (!p->held)
+            continue;
+        if (now - p->passed < p->window) {
+            if (p->passed + p->window < next)
+                next = p->passed + p->window;
+            continue;
+        }
+
+        /* The window is over; the latest line starts the next one. */
+        struct at_buf *held = p->held;
+        p->held = NULL;
+        p->passed = now;
+        parser->cbs->handle_urc(held->data, held->len, parser->priv);
+        at_buf_release(held);
+    }
+    return next;
+}
+
 bool at_prefix_in_table(const char *line, const char *const table[])
 {
     for (int i=0; table[i] != NULL; i++)
@@ -135,12 +337,22 @@ static void parser_append(struct at_parser *parser, char ch)
 {
     if (parser->buf_used < parser->buf_size-1)
         parser->buf[parser->buf_used++] = ch;
+    else if (parser->stats)
+        AT_STATS_ADD(parser->stats->parser_dropped, 1);
+}
+
+static void parser_note_usage(struct at_parser *parser)
+{
+    /* Only the parser writes the high-water mark. */
+    if (parser->stats && parser->buf_used > parser->stats->parser_high_water)
+        __atomic_store_n(&parser->stats->parser_high_water, parser->buf_used, __ATOMIC_RELAXED);
 }
 
 static void parser_include_line(struct at_parser *parser)
 {
     /* Append a newline. */
     parser_append(parser, '\n');
+    parser_note_usage(parser);
 
     /* Advance the current command pointer to the new position. */
     parser->buf_current = parser->buf_used;
@@ -188,13 +400,32 @@ static void parser_handle_line(struct at_parser *parser)
     if (!type)
         type = generic_line_scanner(line, len, parser);
 
+    AT_PROBE4(line, parser, type, line, len);
+    if (parser->trace)
+        at_trace_event(parser->trace, AT_TRACE_LINE, type, line, len);
+    if (parser->stats) {
+        AT_STATS_ADD(parser->stats->lines, 1);
+        parser_note_usage(parser);
+    }
+
     /* Expected URCs and all unexpected lines are sent to URC handler. */
     if (type == AT_RESPONSE_URC || parser->state == STATE_IDLE)
     {
-        /* Fire the callback on the URC line. */
-        parser->cbs->handle_urc(parser->buf + parser->buf_current,
-                                parser->buf_used - parser->buf_current,
-                                parser->priv);
+        int class = -1;
+        if (parser->stats) {
+            if (type == AT_RESPONSE_URC) {
+                AT_STATS_ADD(parser->stats->urcs, 1);
+                class = at_stats_urc(parser->stats, line, len);
+            } else {
+                AT_STATS_ADD(parser->stats->unexpected, 1);
+            }
+        }
+
+        /* Fire the callback on the URC line, unless a policy holds it back. */
+        if (parser_admit_urc(parser, line, len, class))
+            parser->cbs->handle_urc(parser->buf + parser->buf_current,
+                                    parser->buf_used - parser->buf_current,
+                                    parser->priv);
 
         /* Discard the URC line from the buffer. */
         parser_discard_line(parser);
@@ -202,6 +433,22 @@ static void parser_handle_line(struct at_parser *parser)
         return;
     }
 
+    /* Whatever comes before the sentinel answers an earlier command. An
+     * error means the modem turned the sentinel command down (no such
+     * register, say); that ends the wait, with the error as the response. */
+    if (parser->sentinel[0]) {
+        bool rejected = !strcmp(line, "ERROR") || !strncmp(line, "+CME ERROR:", 11);
+        if (!rejected) {
+            if (!strcmp(line, parser->sentinel))
+                parser->sentinel[0] = '\0';
+            else if (parser->stats)
+                AT_STATS_ADD(parser->stats->stale_lines, 1);
+            parser_discard_line(parser);
+            return;
+        }
+        parser->sentinel[0] = '\0';
+    }
+
     /* Accumulate everything that's not a final OK. */
     if (type != AT_RESPONSE_FINAL_OK) {
         /* Include the line in the buffer. */
@@ -230,6 +477,7 @@ static void parser_handle_line(struct at_parser *parser)
             /* Switch parser state to rawdata mode. */
             parser->data_left = (int)type >> 8;
             parser->state = STATE_RAWDATA;
+            AT_PROBE2(rawdata_start, parser, parser->data_left);
         }
         break;
 
@@ -239,6 +487,7 @@ static void parser_handle_line(struct at_parser *parser)
             parser->data_left = (int)type >> 8;
             parser->nibble = -1;
             parser->state = STATE_HEXDATA;
+            AT_PROBE2(rawdata_start, parser, parser->data_left);
         }
         break;
 
@@ -261,12 +510,22 @@ static int hex2int(char c)
     return -1;
 }
 
-void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
+static void parser_feed(struct at_parser *parser, const void *data, size_t len)
 {
     const uint8_t *buf = data;
 
     while (len > 0)
     {
+        /* Stream mode bypasses line parsing altogether. */
+        if (parser->stream_handler) {
+            size_t used = parser->stream_handler(buf, len, parser->priv);
+            if (parser->stream_handler || used >= len)
+                return;
+            buf += used;
+            len -= used;
+            continue;
+        }
+
         /* Fetch next character. */
         uint8_t ch = *buf++; len--;
 
@@ -306,6 +565,7 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
                 }
 
                 if (parser->data_left == 0) {
+                    AT_PROBE2(rawdata_end, parser, parser->buf_used - parser->buf_current);
                     parser_include_line(parser);
                     parser->state = STATE_READLINE;
                 }
@@ -327,6 +587,7 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
                 }
 
                 if (parser->data_left == 0) {
+                    AT_PROBE2(rawdata_end, parser, parser->buf_used - parser->buf_current);
                     parser_include_line(parser);
                     parser->state = STATE_READLINE;
                 }
@@ -335,9 +596,33 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
     }
 }
 
+void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
+{
+    AT_PROBE3(parser_feed_entry, parser, data, len);
+    parser_feed(parser, data, len);
+    AT_PROBE2(parser_feed_return, parser, len);
+}
+
+struct at_buf *at_parser_take_response(struct at_parser *parser)
+{
+    struct at_buf *fresh = at_buf_acquire(parser->pool);
+    if (!fresh)
+        return NULL;
+
+    struct at_buf *response = parser->response;
+    response->len = parser->buf_used;
+    parser->response = fresh;
+    parser->buf = fresh->data;
+    return response;
+}
+
 void at_parser_free(struct at_parser *parser)
 {
-    free(parser->buf);
+    for (int i=0; i<AT_PARSER_URC_POLICIES; i++)
+        if (parser->urc_policies[i].held)
+            at_buf_release(parser->urc_policies[i].held);
+    at_buf_release(parser->response);
+    at_buf_pool_free(parser->pool);
     free(parser);
 }
 
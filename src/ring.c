@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/ring.h>
+
+#include <string.h>
+
+void at_ring_init(struct at_ring *ring, void *buf, size_t size)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->buf = buf;
+    ring->size = size;
+}
+
+size_t at_ring_write(struct at_ring *ring, const void *data, size_t len)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    size_t space = ring->size - (head - tail);
+    size_t amount = len < space ? len : space;
+
+    /* Copy in at most two pieces: up to the end, then from the start. */
+    size_t offset = head & (ring->size - 1);
+    size_t first = ring->size - offset < amount ? ring->size - offset : amount;
+    memcpy(ring->buf + offset, data, first);
+    memcpy(ring->buf, (const uint8_t *) data + first, amount - first);
+
+    __atomic_store_n(&ring->head, head + amount, __ATOMIC_RELEASE);
+
+    /* Statistics; only the producer writes them. */
+    size_t used = head + amount - tail;
+    if (used > ring->high_water)
+        __atomic_store_n(&ring->high_water, used, __ATOMIC_RELAXED);
+    if (amount < len)
+        __atomic_store_n(&ring->overruns, ring->overruns + (len - amount), __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->total, ring->total + amount, __ATOMIC_RELAXED);
+
+    return amount;
+}
+
+size_t at_ring_read(struct at_ring *ring, void *data, size_t len)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    size_t amount = head - tail < len ? head - tail : len;
+
+    size_t offset = tail & (ring->size - 1);
+    size_t first = ring->size - offset < amount ? ring->size - offset : amount;
+    memcpy(data, ring->buf + offset, first);
+    memcpy((uint8_t *) data + first, ring->buf, amount - first);
+
+    __atomic_store_n(&ring->tail, tail + amount, __ATOMIC_RELEASE);
+
+    return amount;
+}
+
+size_t at_ring_used(struct at_ring *ring)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    return head - tail;
+}
+
+void at_ring_flush(struct at_ring *ring)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+void at_ring_get_stats(struct at_ring *ring, struct at_ring_stats *stats)
+{
+    stats->size = ring->size;
+    stats->used = at_ring_used(ring);
+    stats->high_water = __atomic_load_n(&ring->high_water, __ATOMIC_RELAXED);
+    stats->overruns = __atomic_load_n(&ring->overruns, __ATOMIC_RELAXED);
+    stats->total = __atomic_load_n(&ring->total, __ATOMIC_RELAXED);
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,39 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Minimal pthread-backed stand-in for the FreeRTOS API, just enough to build
+ * and run the FreeRTOS AT port on a host. Not a scheduler: tasks are plain
+ * threads and priorities are ignored.
+ */
+
+#ifndef FREERTOS_SHIM_H
+#define FREERTOS_SHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t StackType_t;
+
+#define pdFALSE                 ((BaseType_t) 0)
+#define pdTRUE                  ((BaseType_t) 1)
+#define pdFAIL                  pdFALSE
+#define pdPASS                  pdTRUE
+
+#define portMAX_DELAY           ((TickType_t) 0xffffffffUL)
+#define configTICK_RATE_HZ      ((TickType_t) 1000)
+#define configMINIMAL_STACK_SIZE 128
+#define portTICK_PERIOD_MS      ((TickType_t) 1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)       ((TickType_t) (((TickType_t) (ms) * configTICK_RATE_HZ) / (TickType_t) 1000))
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,33 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef FREERTOS_SHIM_IO_H
+#define FREERTOS_SHIM_IO_H
+
+#include "FreeRTOS.h"
+
+typedef void *Peripheral_Descriptor_t;
+
+/* The board UART is whatever host device the test points it at. */
+extern const char *freertos_shim_uart_path;
+#define boardGSM_SIM800_UART ((const int8_t *) freertos_shim_uart_path)
+
+#define ioctlUSE_DMA_TX             1
+#define ioctlUSE_CIRCULAR_BUFFER_RX 2
+#define ioctlSET_TX_TIMEOUT         3
+#define ioctlSET_RX_TIMEOUT         4
+
+Peripheral_Descriptor_t FreeRTOS_open(const int8_t *path, const uint32_t flags);
+size_t FreeRTOS_read(Peripheral_Descriptor_t port, void *buffer, const size_t bytes);
+size_t FreeRTOS_write(Peripheral_Descriptor_t port, const void *buffer, const size_t bytes);
+BaseType_t FreeRTOS_ioctl(Peripheral_Descriptor_t port, uint32_t request, void *value);
+void FreeRTOS_close(Peripheral_Descriptor_t port);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,376 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include "FreeRTOS.h"
+#include "FreeRTOS_IO.h"
+#include "semphr.h"
+#include "task.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The tick counter starts shortly before wrapping around, so deadline
+ * arithmetic gets exercised by every test run that lasts long enough. */
+#define SHIM_TICK_OFFSET    ((TickType_t) -10000)
+
+struct tskTaskControlBlock {
+    pthread_t thread;
+    TaskFunction_t code;
+    void *arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notification;
+};
+
+struct QueueDefinition {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t count;
+};
+
+struct shim_peripheral {
+    int fd;
+    TickType_t rx_timeout;
+};
+
+const char *freertos_shim_uart_path;
+
+static __thread struct tskTaskControlBlock *current_task;
+static pthread_mutex_t critical = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/*
+ * Time.
+ */
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t epoch;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+
+static void epoch_init(void)
+{
+    epoch = monotonic_ms();
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    pthread_once(&epoch_once, epoch_init);
+
+    uint64_t ms = monotonic_ms() - epoch;
+    return (TickType_t) (ms * configTICK_RATE_HZ / 1000) + SHIM_TICK_OFFSET;
+}
+
+/* Absolute CLOCK_MONOTONIC deadline for a relative tick count. */
+static struct timespec deadline(TickType_t ticks)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ns = (uint64_t) ticks * (1000000000 / configTICK_RATE_HZ) + ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return ts;
+}
+
+static void init_cond(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* Wait until *value is non-zero or the ticks run out; lock held. */
+static bool wait_nonzero(pthread_mutex_t *lock, pthread_cond_t *cond,
+                         uint32_t *value, TickType_t ticks)
+{
+    struct timespec until = deadline(ticks);
+    while (!*value) {
+        if (!ticks)
+            return false;
+        if (ticks == portMAX_DELAY)
+            pthread_cond_wait(cond, lock);
+        else if (pthread_cond_timedwait(cond, lock, &until) == ETIMEDOUT)
+            return *value != 0;
+    }
+    return true;
+}
+
+/*
+ * Tasks.
+ */
+
+static struct tskTaskControlBlock *task_alloc(void)
+{
+    struct tskTaskControlBlock *task = calloc(1, sizeof(*task));
+    if (!task)
+        return NULL;
+    pthread_mutex_init(&task->lock, NULL);
+    init_cond(&task->cond);
+    return task;
+}
+
+static void task_free(struct tskTaskControlBlock *task)
+{
+    pthread_cond_destroy(&task->cond);
+    pthread_mutex_destroy(&task->lock);
+    free(task);
+}
+
+static void *task_trampoline(void *arg)
+{
+    current_task = arg;
+    current_task->code(current_task->arg);
+    /* FreeRTOS tasks must not return. */
+    abort();
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint16_t stack_depth,
+                       void *arg, UBaseType_t priority, TaskHandle_t *created)
+{
+    (void) name;
+    (void) stack_depth;
+    (void) priority;
+
+    struct tskTaskControlBlock *task = task_alloc();
+    if (!task)
+        return pdFAIL;
+    task->code = code;
+    task->arg = arg;
+
+    /* The handle must be valid before the task gets to run. */
+    if (created)
+        *created = task;
+    if (pthread_create(&task->thread, NULL, task_trampoline, task) != 0) {
+        if (created)
+            *created = NULL;
+        task_free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    /* Only self-deletion is supported; threads can't be killed safely. */
+    if (task && task != current_task)
+        abort();
+
+    task = current_task;
+    current_task = NULL;
+    task_free(task);
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec until = deadline(ticks);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+        ;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    /* Threads not created as tasks get a control block on first use. */
+    if (!current_task) {
+        current_task = task_alloc();
+        if (!current_task)
+            abort();
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+    struct tskTaskControlBlock *task = xTaskGetCurrentTaskHandle();
+
+    pthread_mutex_lock(&task->lock);
+    wait_nonzero(&task->lock, &task->cond, &task->notification, ticks);
+    uint32_t value = task->notification;
+    if (value)
+        task->notification = clear_on_exit ? 0 : value - 1;
+    pthread_mutex_unlock(&task->lock);
+
+    return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notification++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+
+    return pdPASS;
+}
+
+void vTaskEnterCritical(void)
+{
+    pthread_mutex_lock(&critical);
+}
+
+void vTaskExitCritical(void)
+{
+    pthread_mutex_unlock(&critical);
+}
+
+/*
+ * Semaphores. Mutexes are binary semaphores that start out given; there is
+ * no priority inheritance.
+ */
+
+static SemaphoreHandle_t semaphore_alloc(uint32_t count)
+{
+    struct QueueDefinition *sem = calloc(1, sizeof(*sem));
+    if (!sem)
+        return NULL;
+    pthread_mutex_init(&sem->lock, NULL);
+    init_cond(&sem->cond);
+    sem->count = count;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return semaphore_alloc(0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return semaphore_alloc(1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    pthread_mutex_lock(&sem->lock);
+    bool taken = wait_nonzero(&sem->lock, &sem->cond, &sem->count, ticks);
+    if (taken)
+        sem->count = 0;
+    pthread_mutex_unlock(&sem->lock);
+
+    return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    bool given = !sem->count;
+    sem->count = 1;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->lock);
+
+    return given ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    pthread_cond_destroy(&sem->cond);
+    pthread_mutex_destroy(&sem->lock);
+    free(sem);
+}
+
+/*
+ * FreeRTOS+IO over a host tty. Reads wait up to the RX timeout for the
+ * first byte and return whatever is buffered after it; the real circular
+ * buffer driver waits for all requested bytes, which only differs when more
+ * than one byte is requested with a non-zero timeout.
+ */
+
+Peripheral_Descriptor_t FreeRTOS_open(const int8_t *path, const uint32_t flags)
+{
+    (void) flags;
+
+    struct shim_peripheral *port = calloc(1, sizeof(*port));
+    if (!port)
+        return NULL;
+    port->fd = open((const char *) path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (port->fd == -1) {
+        free(port);
+        return NULL;
+    }
+    port->rx_timeout = portMAX_DELAY;
+    return port;
+}
+
+size_t FreeRTOS_read(Peripheral_Descriptor_t descriptor, void *buffer, const size_t bytes)
+{
+    struct shim_peripheral *port = descriptor;
+
+    struct pollfd pfd = { .fd = port->fd, .events = POLLIN };
+    int timeout = port->rx_timeout == portMAX_DELAY ? -1 :
+                  (int) (port->rx_timeout * 1000 / configTICK_RATE_HZ);
+    if (poll(&pfd, 1, timeout) <= 0)
+        return 0;
+
+    ssize_t result = read(port->fd, buffer, bytes);
+    return result > 0 ? (size_t) result : 0;
+}
+
+size_t FreeRTOS_write(Peripheral_Descriptor_t descriptor, const void *buffer, const size_t bytes)
+{
+    struct shim_peripheral *port = descriptor;
+
+    const uint8_t *p = buffer;
+    size_t left = bytes;
+    while (left) {
+        ssize_t written = write(port->fd, p, left);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        p += written;
+        left -= written;
+    }
+    return bytes - left;
+}
+
+BaseType_t FreeRTOS_ioctl(Peripheral_Descriptor_t descriptor, uint32_t request, void *value)
+{
+    struct shim_peripheral *port = descriptor;
+
+    switch (request) {
+        case ioctlSET_RX_TIMEOUT:
+            port->rx_timeout = (TickType_t) (uintptr_t) value;
+            return pdPASS;
+        case ioctlUSE_DMA_TX:
+        case ioctlUSE_CIRCULAR_BUFFER_RX:
+        case ioctlSET_TX_TIMEOUT:
+            /* Host ttys are buffered and writes block. */
+            return pdPASS;
+        default:
+            return pdFAIL;
+    }
+}
+
+void FreeRTOS_close(Peripheral_Descriptor_t descriptor)
+{
+    struct shim_peripheral *port = descriptor;
+
+    close(port->fd);
+    free(port);
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,1881 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Scriptable SIM800/Telit modem simulator.
+ *
+ * Opens a pseudo-terminal master and impersonates a modem on it, so the real
+ * channel and driver code can be exercised (and benchmarked) without
+ * hardware. TCP sockets opened by the driver are backed by real connections;
+ * by default they all go to a built-in loopback echo server.
+ *
+ * Usage: modem-sim [-m sim800|telit] [-s script] [-l symlink] [-b baud] [-t raw|rfc2217] [-a]
+ *
+ * The slave device path is printed on stdout as "pty: <path>". With -t, the
+ * modem sits behind a stand-in terminal server on a loopback TCP port
+ * instead, printed as "tcp: <port>": one client at a time, either raw or
+ * speaking RFC 2217 (Telnet escaping, COM-PORT-OPTION; the baudrate it sets
+ * shows in AT+IPR?). With -a, a second pty, printed as "aux: <path>", stands
+ * for the extra AT port of a USB modem: it runs a command interpreter of its
+ * own on the shared modem state, and gets the injected URCs. Script lines
+ * and lines read from stdin share the same grammar:
+ *
+ *   model sim800|telit          Select the personality.
+ *   echo on|off                 Local echo (ATE1/ATE0).
+ *   baud <bps>                  Pace output at the given line rate (0: off).
+ *   linebuf <bytes>             Maximum command line length.
+ *   sockbuf <bytes>             Per-socket receive buffer size.
+ *   latency <prefix> <ms>       Delay responses to commands with this prefix.
+ *   fault <prefix> <kind> <probability> [ms]
+ *                               Inject faults: drop, error, garble, late, noise.
+ *   reply <prefix> <text>       Canned response; "\n" separates lines.
+ *   route <host> <addr>:<port>  Connect sockets for <host> ("*": all) there.
+ *   ftproot <dir>               Serve FTP downloads from this directory.
+ *   set creg|rssi|imei|iccid <value>
+ *   urc <text>                  Emit an unsolicited line right away.
+ *   after <ms> <line>           Run a script line once, after a delay.
+ *   every <ms> <line>           Run a script line periodically.
+ *   mux urc <dlci>              Send injected URCs on this DLC in CMUX mode.
+ *   mux fc <dlci> on|off        Ask the host to stop/resume sending on a DLC.
+ *   seed <n>                    Seed the fault injection PRNG.
+ *   quit                        Exit.
+ *
+ * Prefixes match the command text after "AT", e.g. "+CSQ" or "#SRECV"; "*"
+ * matches everything.
+ *
+ * With AT+CIPMUX=0 and AT+CIPMODE=1, the SIM800 personality runs a single
+ * transparent connection: after CONNECT, bytes pass straight between the line
+ * and the socket until "+++" (surrounded by 500ms of silence) returns to
+ * command mode; ATO goes back online.
+ *
+ * "AT+CMUX=0" switches to GSM 07.10 basic mode. Every DLC then runs its own
+ * command interpreter (line buffer, echo, response ordering), sharing the
+ * modem state; socket notifications go to the DLC that opened the socket.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <attentive/cmux.h>
+
+#define SIM_NSOCKETS        7
+#define SIM_MAX_RULES       64
+#define SIM_MAX_EVENTS      64
+#define SIM_MAX_ROUTES      16
+#define SIM_MAX_ECHO        16
+#define SIM_OUT_SIZE        65536
+#define SIM_LINE_MAX        4096
+#define SIM_MAX_DLCI        CMUX_MAX_CHANNELS
+#define SIM_AUX             (SIM_MAX_DLCI+1)    /* Channel of the aux port. */
+#define SIM_AUX_PORT        -2                  /* Chunk "DLC" for the aux port. */
+#define SIM_GUARD_MS        500
+
+enum sim_model {
+    MODEL_SIM800,
+    MODEL_TELIT,
+};
+
+enum sim_fault {
+    FAULT_NONE,
+    FAULT_DROP,             /**< Swallow the command; no response at all. */
+    FAULT_ERROR,            /**< Answer ERROR instead. */
+    FAULT_GARBLE,           /**< Corrupt one byte of the response. */
+    FAULT_LATE,             /**< Answer after an extra delay. */
+    FAULT_NOISE,            /**< Emit a garbage line before the response. */
+};
+
+struct sim_rule {
+    char prefix[32];
+    int latency;
+    enum sim_fault fault;
+    double probability;
+    int fault_ms;
+    char *reply;
+};
+
+struct sim_event {
+    int64_t due;
+    int period;
+    char *line;
+};
+
+struct sim_route {
+    char host[64];
+    struct sockaddr_in addr;
+};
+
+struct sim_chunk {
+    struct sim_chunk *next;
+    int64_t due;
+    int dlci;               /**< DLC to frame for, -1 to send as-is, or SIM_AUX_PORT. */
+    size_t len;
+    uint8_t data[];
+};
+
+struct sim_socket {
+    int fd;
+    int channel;            /**< Channel that opened the socket. */
+    bool connected;
+    size_t sent;
+    size_t received;
+    size_t used;
+    uint8_t *buf;
+};
+
+enum sim_input_state {
+    INPUT_LINE,
+    INPUT_DATA,             /**< Collecting a CIPSEND/SSENDEXT payload. */
+    INPUT_TRANSPARENT,      /**< Online in transparent mode; watching for +++. */
+};
+
+/** A command interpreter: the plain serial line, one CMUX DLC, or the aux port. */
+struct sim_channel {
+    bool open;
+    bool echo;
+    bool paused;            /**< Host asked us to stop sending (MSC FC). */
+    enum sim_input_state input;
+    char line[SIM_LINE_MAX];
+    size_t line_len;
+    bool line_overflow;
+    int data_socket;
+    size_t data_left;
+    int64_t last_response_due;
+    int64_t last_input;     /**< For the +++ guard time. */
+    int escape_plus;
+    int64_t escape_due;
+};
+
+static struct {
+    enum sim_model model;
+    bool echo;
+    int baud;
+    size_t linebuf;
+    size_t sockbuf;
+    char imei[32];
+    char iccid[32];
+    int creg;
+    int rssi;
+    const char *ftproot;
+
+    int master;
+    bool quit;
+
+    /* Stand-in terminal server; master is then the client connection. */
+    int server;
+    bool telnet;
+    int telnet_state;
+    uint8_t telnet_verb;
+    uint8_t telnet_sub[8];
+    size_t telnet_sub_len;
+    long ipr;
+
+    /* Second AT port (-a), unpaced; -1 if none. */
+    int aux;
+    uint8_t aux_out[SIM_OUT_SIZE];
+    size_t aux_len;
+
+    /* Input parsing; channel 0 is the plain serial line. */
+    struct sim_channel channels[SIM_AUX+1];
+    struct sim_channel *chan;
+
+    /* CMUX state. */
+    bool mux;
+    bool mux_pending;       /**< Switch to CMUX once the OK is queued. */
+    struct cmux_decoder decoder;
+    int urc_dlci;
+
+    /* Output scheduling. */
+    struct sim_chunk *queue;
+    uint8_t out[SIM_OUT_SIZE];
+    size_t out_len;
+    int64_t out_credit_time;
+    double out_credit;
+
+    /* Scripting. */
+    struct sim_rule rules[SIM_MAX_RULES];
+    int nrules;
+    struct sim_event events[SIM_MAX_EVENTS];
+    int nevents;
+    struct sim_route routes[SIM_MAX_ROUTES];
+    int nroutes;
+    unsigned int seed;
+
+    /* Modem state. */
+    int sreg[256];
+    const char *ip_state;
+    bool sapbr_open;
+    bool context_active;
+    int cipmux;
+    int cipmode;
+    struct sim_socket sockets[SIM_NSOCKETS];
+
+    /* FTP state. */
+    char ftp_name[256];
+    FILE *ftp_file;
+    bool ftp_eof;
+
+    /* Built-in echo server. */
+    int echo_listen;
+    struct sockaddr_in echo_addr;
+    int echo_clients[SIM_MAX_ECHO];
+} sim = {
+    .model = MODEL_SIM800,
+    .echo = true,
+    .linebuf = 556,
+    .sockbuf = 4096,
+    .imei = "490154203237518",
+    .iccid = "89860000000000000000",
+    .creg = 1,
+    .rssi = 20,
+    .master = -1,
+    .server = -1,
+    .aux = -1,
+    .ip_state = "IP INITIAL",
+    .cipmux = 1,
+    .echo_listen = -1,
+    .channels[0] = { .open = true, .echo = true },
+    .chan = &sim.channels[0],
+    .urc_dlci = 1,
+};
+
+static void run_line(char *line);
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool chance(double probability)
+{
+    return probability > 0 && rand_r(&sim.seed) < probability * ((double) RAND_MAX + 1);
+}
+
+/*
+ * Output path.
+ */
+
+static int channel_dlci(struct sim_channel *chan)
+{
+    if (chan == &sim.channels[SIM_AUX])
+        return SIM_AUX_PORT;
+    return sim.mux ? (int) (chan - sim.channels) : -1;
+}
+
+static void emit_raw(int dlci, int64_t due, const void *data, size_t len)
+{
+    struct sim_chunk *chunk = malloc(sizeof(struct sim_chunk) + len);
+    if (!chunk)
+        return;
+    chunk->due = due;
+    chunk->dlci = dlci;
+    chunk->len = len;
+    chunk->next = NULL;
+    memcpy(chunk->data, data, len);
+
+    /* Keep the queue sorted by due time; equal times stay in FIFO order. */
+    struct sim_chunk **p = &sim.queue;
+    while (*p && (*p)->due <= due)
+        p = &(*p)->next;
+    chunk->next = *p;
+    *p = chunk;
+}
+
+/** Queue output for the current channel. */
+static void emit_at(int64_t due, const void *data, size_t len)
+{
+    emit_raw(channel_dlci(sim.chan), due, data, len);
+}
+
+static void emit_frame(int dlci, bool cr, uint8_t control, const void *data, size_t len)
+{
+    uint8_t buf[CMUX_FRAME_MAX + 8];
+    size_t size = cmux_frame_encode(buf, sizeof(buf), dlci, cr, control, data, len);
+    if (size)
+        emit_raw(-1, now_ms(), buf, size);
+}
+
+/** Queue an unsolicited line for immediate output. */
+static void urc(const char *format, ...)
+{
+    char buf[SIM_LINE_MAX];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buf+2, sizeof(buf)-4, format, ap);
+    va_end(ap);
+    if (len < 0 || len >= (int) sizeof(buf)-4)
+        return;
+
+    buf[0] = '\r'; buf[1] = '\n';
+    buf[len+2] = '\r'; buf[len+3] = '\n';
+    emit_at(now_ms(), buf, len+4);
+}
+
+/** A response under construction; sent as a whole after the command latency. */
+struct sim_response {
+    char *data;
+    size_t len;
+    size_t size;
+    bool final;             /**< A final result was appended. */
+};
+
+static void response_append(struct sim_response *r, const void *data, size_t len)
+{
+    if (r->len + len > r->size) {
+        size_t size = r->size ? r->size : 256;
+        while (size < r->len + len)
+            size *= 2;
+        char *p = realloc(r->data, size);
+        if (!p)
+            return;
+        r->data = p;
+        r->size = size;
+    }
+    memcpy(r->data + r->len, data, len);
+    r->len += len;
+}
+
+__attribute__ ((format (printf, 2, 3)))
+static void response_line(struct sim_response *r, const char *format, ...)
+{
+    char buf[SIM_LINE_MAX];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (len < 0 || len >= (int) sizeof(buf))
+        return;
+
+    response_append(r, "\r\n", 2);
+    response_append(r, buf, len);
+    response_append(r, "\r\n", 2);
+}
+
+static void response_final(struct sim_response *r, const char *result)
+{
+    response_line(r, "%s", result);
+    r->final = true;
+}
+
+/* Double 0xFF bytes appended to the output since start (RFC 2217). */
+static void telnet_escape(size_t start)
+{
+    size_t iacs = 0;
+    for (size_t i=start; i<sim.out_len; i++)
+        iacs += sim.out[i] == 0xff;
+    size_t i = sim.out_len, o = sim.out_len + iacs;
+    sim.out_len = o;
+    while (o > i) {
+        sim.out[--o] = sim.out[--i];
+        if (sim.out[i] == 0xff)
+            sim.out[--o] = 0xff;
+    }
+}
+
+static void output_pump(void)
+{
+    int64_t now = now_ms();
+
+    /* Move due chunks into the output buffer, framing DLC traffic. */
+    struct sim_chunk **p = &sim.queue;
+    while (*p && (*p)->due <= now) {
+        struct sim_chunk *chunk = *p;
+        if (chunk->dlci > 0 && sim.channels[chunk->dlci].paused) {
+            p = &chunk->next;
+            continue;
+        }
+        if (chunk->dlci == SIM_AUX_PORT) {
+            if (sim.aux_len + chunk->len > sizeof(sim.aux_out))
+                break;
+            *p = chunk->next;
+            memcpy(sim.aux_out + sim.aux_len, chunk->data, chunk->len);
+            sim.aux_len += chunk->len;
+            free(chunk);
+            continue;
+        }
+        size_t frames = chunk->dlci > 0 ? (chunk->len + CMUX_FRAME_SIZE - 1) / CMUX_FRAME_SIZE : 0;
+        size_t room = chunk->len + frames * 8;
+        if (sim.out_len + (sim.telnet ? 2 * room : room) > sizeof(sim.out))
+            break;
+        *p = chunk->next;
+        size_t start = sim.out_len;
+        if (chunk->dlci > 0) {
+            for (size_t off=0; off<chunk->len; off+=CMUX_FRAME_SIZE) {
+                size_t len = chunk->len - off < CMUX_FRAME_SIZE ? chunk->len - off : CMUX_FRAME_SIZE;
+                sim.out_len += cmux_frame_encode(sim.out + sim.out_len, sizeof(sim.out) - sim.out_len,
+                                                 chunk->dlci, false, CMUX_UIH, chunk->data + off, len);
+            }
+        } else {
+            memcpy(sim.out + sim.out_len, chunk->data, chunk->len);
+            sim.out_len += chunk->len;
+        }
+        if (sim.telnet)
+            telnet_escape(start);
+        free(chunk);
+    }
+
+    if (sim.aux_len) {
+        ssize_t written = write(sim.aux, sim.aux_out, sim.aux_len);
+        if (written > 0) {
+            memmove(sim.aux_out, sim.aux_out + written, sim.aux_len - written);
+            sim.aux_len -= written;
+        }
+    }
+
+    if (!sim.out_len || sim.master == -1)
+        return;
+
+    /* Pace output at the configured baudrate: 10 bit times per byte. */
+    size_t amount = sim.out_len;
+    if (sim.baud) {
+        sim.out_credit += (now - sim.out_credit_time) * (sim.baud / 10000.0);
+        if (sim.out_credit > sim.baud / 100.0)
+            sim.out_credit = sim.baud / 100.0;
+        if (amount > (size_t) sim.out_credit)
+            amount = (size_t) sim.out_credit;
+    }
+    sim.out_credit_time = now;
+    if (!amount)
+        return;
+
+    ssize_t written = write(sim.master, sim.out, amount);
+    if (written <= 0)
+        return;
+    memmove(sim.out, sim.out + written, sim.out_len - written);
+    sim.out_len -= written;
+    if (sim.baud)
+        sim.out_credit -= written;
+}
+
+/*
+ * Scripting helpers.
+ */
+
+static struct sim_rule *rule_for(const char *command, bool (*has)(const struct sim_rule *))
+{
+    struct sim_rule *best = NULL;
+    size_t best_len = 0;
+
+    for (int i=0; i<sim.nrules; i++) {
+        struct sim_rule *rule = &sim.rules[i];
+        if (!has(rule))
+            continue;
+        if (!strcmp(rule->prefix, "*")) {
+            if (!best)
+                best = rule;
+            continue;
+        }
+        size_t len = strlen(rule->prefix);
+        if (!strncasecmp(command, rule->prefix, len) && len >= best_len) {
+            best = rule;
+            best_len = len;
+        }
+    }
+
+    return best;
+}
+
+static bool has_latency(const struct sim_rule *rule) { return rule->latency >= 0; }
+static bool has_fault(const struct sim_rule *rule) { return rule->fault != FAULT_NONE; }
+static bool has_reply(const struct sim_rule *rule) { return rule->reply != NULL; }
+
+static struct sim_rule *rule_get(const char *prefix)
+{
+    for (int i=0; i<sim.nrules; i++)
+        if (!strcmp(sim.rules[i].prefix, prefix))
+            return &sim.rules[i];
+
+    if (sim.nrules == SIM_MAX_RULES)
+        return NULL;
+
+    struct sim_rule *rule = &sim.rules[sim.nrules++];
+    memset(rule, 0, sizeof(*rule));
+    snprintf(rule->prefix, sizeof(rule->prefix), "%s", prefix);
+    rule->latency = -1;
+    return rule;
+}
+
+/**
+ * Split a comma-separated argument list in place, stripping quotes.
+ */
+static int split_args(char *args, char *argv[], int max)
+{
+    int argc = 0;
+    if (!args || !*args)
+        return 0;
+
+    while (argc < max) {
+        char *p = args;
+        if (*p == '"') {
+            argv[argc++] = ++p;
+            while (*p && *p != '"')
+                p++;
+            if (*p)
+                *p++ = '\0';
+        } else {
+            argv[argc++] = p;
+        }
+        while (*p && *p != ',')
+            p++;
+        if (!*p)
+            break;
+        *p++ = '\0';
+        args = p;
+    }
+
+    return argc;
+}
+
+/*
+ * Sockets.
+ */
+
+static int sim_connect(int connid, const char *host, int port)
+{
+    struct sim_socket *s = &sim.sockets[connid];
+    struct sockaddr_in addr = sim.echo_addr;
+
+    for (int i=0; i<sim.nroutes; i++) {
+        if (!strcmp(sim.routes[i].host, "*") || !strcasecmp(sim.routes[i].host, host)) {
+            addr = sim.routes[i].addr;
+            break;
+        }
+    }
+    (void) port;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (!s->buf)
+        s->buf = malloc(sim.sockbuf);
+    s->fd = fd;
+    s->channel = sim.chan - sim.channels;
+    s->connected = true;
+    s->sent = s->received = s->used = 0;
+    return 0;
+}
+
+static void sim_disconnect(int connid)
+{
+    struct sim_socket *s = &sim.sockets[connid];
+    if (s->fd > 0)
+        close(s->fd);
+    s->fd = 0;
+    s->connected = false;
+    s->used = 0;
+}
+
+static void socket_readable(int connid)
+{
+    struct sim_socket *s = &sim.sockets[connid];
+    bool was_empty = (s->used == 0);
+    sim.chan = &sim.channels[s->channel];
+
+    ssize_t amount = read(s->fd, s->buf + s->used, sim.sockbuf - s->used);
+    if (amount <= 0) {
+        if (amount == -1 && errno == EINTR)
+            return;
+        /* Remote end closed. Data already buffered stays readable. */
+        close(s->fd);
+        s->fd = 0;
+        s->connected = false;
+        if (sim.model == MODEL_SIM800 && sim.cipmode) {
+            sim.chan->input = INPUT_LINE;
+            urc("CLOSED");
+        } else if (sim.model == MODEL_SIM800) {
+            urc("%d, CLOSED", connid);
+        }
+        return;
+    }
+
+    s->used += amount;
+    s->received += amount;
+
+    if (sim.model == MODEL_SIM800 && sim.cipmode) {
+        /* Straight through while online; held back in command mode. */
+        if (sim.chan->input == INPUT_TRANSPARENT) {
+            emit_at(now_ms(), s->buf, s->used);
+            s->used = 0;
+        }
+        return;
+    }
+
+    if (was_empty) {
+        if (sim.model == MODEL_SIM800)
+            urc("+CIPRXGET: 1,%d", connid);
+        else
+            urc("SRING: %d", connid);
+    }
+}
+
+static size_t socket_take(int connid, void *buf, size_t max)
+{
+    struct sim_socket *s = &sim.sockets[connid];
+    size_t amount = s->used < max ? s->used : max;
+    memcpy(buf, s->buf, amount);
+    memmove(s->buf, s->buf + amount, s->used - amount);
+    s->used -= amount;
+    return amount;
+}
+
+/** Go online in transparent mode, passing on data received meanwhile. */
+static void transparent_connect(struct sim_response *r)
+{
+    struct sim_socket *s = &sim.sockets[0];
+    response_final(r, "CONNECT");
+    response_append(r, s->buf, s->used);
+    s->used = 0;
+    sim.chan->input = INPUT_TRANSPARENT;
+    sim.chan->last_input = now_ms();
+    sim.chan->escape_plus = 0;
+    sim.chan->escape_due = 0;
+}
+
+static void echo_accept(void)
+{
+    int fd = accept4(sim.echo_listen, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+    for (int i=0; i<SIM_MAX_ECHO; i++) {
+        if (sim.echo_clients[i] <= 0) {
+            sim.echo_clients[i] = fd;
+            return;
+        }
+    }
+    close(fd);
+}
+
+static void echo_readable(int i)
+{
+    char buf[4096];
+    ssize_t amount = read(sim.echo_clients[i], buf, sizeof(buf));
+    if (amount <= 0) {
+        close(sim.echo_clients[i]);
+        sim.echo_clients[i] = 0;
+        return;
+    }
+    if (write(sim.echo_clients[i], buf, amount) != amount) {
+        close(sim.echo_clients[i]);
+        sim.echo_clients[i] = 0;
+    }
+}
+
+/*
+ * Command handlers. Each handles a single command (the part after "AT", or
+ * after ';' in a concatenated line) and appends its result to the response.
+ * Returning false aborts the rest of the line.
+ */
+
+static bool handle_common(const char *name, char *args, bool query, struct sim_response *r)
+{
+    char *argv[8];
+    int argc = split_args(args, argv, 8);
+
+    if (!*name) {
+        /* Plain "AT". */
+    } else if (!strcasecmp(name, "E0")) {
+        sim.chan->echo = false;
+    } else if (!strcasecmp(name, "E1") || !strcasecmp(name, "E")) {
+        sim.chan->echo = true;
+    } else if (!strcasecmp(name, "+CMUX") && !query) {
+        /* Basic option only; we ignore the frame size and stick to N1=127. */
+        if (argc < 1 || atoi(argv[0]) != 0 || sim.mux)
+            return false;
+        sim.mux_pending = true;
+    } else if (!strcasecmp(name, "&W") || !strcasecmp(name, "&W0") ||
+               !strcasecmp(name, "&K0") || !strcasecmp(name, "&F") ||
+               !strcasecmp(name, "Z") || !strcasecmp(name, "O")) {
+        /* Accepted, no effect. */
+    } else if (!strcasecmp(name, "I")) {
+        response_line(r, sim.model == MODEL_SIM800 ? "SIM800 R14.18" : "Telit GC864-QUAD");
+    } else if (!strcasecmp(name, "+CGMI")) {
+        response_line(r, sim.model == MODEL_SIM800 ? "SIMCOM_Ltd" : "Telit");
+    } else if (!strcasecmp(name, "+CGMM")) {
+        response_line(r, sim.model == MODEL_SIM800 ? "SIMCOM_SIM800" : "GC864-QUAD");
+    } else if (!strcasecmp(name, "+CGMR")) {
+        response_line(r, sim.model == MODEL_SIM800 ? "Revision:1418B04SIM800L24" : "07.02.504");
+    } else if (!strcasecmp(name, "+CGSN") || !strcasecmp(name, "+GSN")) {
+        response_line(r, "%s", sim.imei);
+    } else if (!strcasecmp(name, "+CREG") && query) {
+        response_line(r, "+CREG: 0,%d", sim.creg);
+    } else if (!strcasecmp(name, "+CSQ")) {
+        response_line(r, "+CSQ: %d,0", sim.rssi);
+    } else if (!strcasecmp(name, "+CGATT") && query) {
+        response_line(r, "+CGATT: %d", sim.creg == 1 || sim.creg == 5);
+    } else if (!strcasecmp(name, "+IPR")) {
+        if (query)
+            response_line(r, "+IPR: %ld", sim.ipr);
+        else if (argc == 1)
+            sim.ipr = atol(argv[0]);
+    } else if (!strcasecmp(name, "+CCLK") && query) {
+        time_t t = time(NULL);
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        response_line(r, "+CCLK: \"%02d/%02d/%02d,%02d:%02d:%02d+00\"",
+                tm.tm_year % 100, tm.tm_mon+1, tm.tm_mday,
+                tm.tm_hour, tm.tm_min, tm.tm_sec);
+    } else if (toupper((unsigned char) name[0]) == 'S' && isdigit((unsigned char) name[1])) {
+        int reg = atoi(name+1);
+        if (reg < 0 || reg > 255)
+            return false;
+        if (query)
+            response_line(r, "%03d", sim.sreg[reg]);
+        else if (argc == 1)
+            sim.sreg[reg] = atoi(argv[0]) & 0xff;
+    } else if (name[0] == '+' || name[0] == '#' || name[0] == '&') {
+        /* Unknown extended commands are accepted if they look like config. */
+        if (!strncasecmp(name, "+CMEE", 5) || !strncasecmp(name, "+IFC", 4) ||
+            !strncasecmp(name, "+CLTS", 5) || !strncasecmp(name, "+CIURC", 6) ||
+            !strncasecmp(name, "+BT", 3) ||
+            !strncasecmp(name, "+CMER", 5) || !strncasecmp(name, "#SELINT", 7) ||
+            !strncasecmp(name, "+CREG", 5) || !strncasecmp(name, "+CMUX", 5))
+            return true;
+        return false;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static bool handle_sim800(const char *name, char *args, bool query, struct sim_response *r, bool *async)
+{
+    char *argv[8];
+    int argc = split_args(args, argv, 8);
+
+    if (!strcasecmp(name, "+CCID")) {
+        response_line(r, "%s", sim.iccid);
+    } else if (!strcasecmp(name, "+SAPBR")) {
+        if (argc < 2)
+            return false;
+        int cmd = atoi(argv[0]);
+        if (cmd == 1) {
+            if (sim.sapbr_open)
+                return false;
+            sim.sapbr_open = true;
+        } else if (cmd == 0) {
+            sim.sapbr_open = false;
+        } else if (cmd == 2) {
+            response_line(r, "+SAPBR: 1,%d,\"%s\"", sim.sapbr_open ? 1 : 3,
+                    sim.sapbr_open ? "10.0.0.2" : "0.0.0.0");
+        }
+    } else if (!strcasecmp(name, "+CIPSTATUS")) {
+        response_final(r, "OK");
+        response_line(r, "STATE: %s", sim.ip_state);
+        for (int i=0; i<SIM_NSOCKETS-1; i++) {
+            struct sim_socket *s = &sim.sockets[i];
+            response_line(r, "C: %d,0,\"TCP\",\"127.0.0.1\",\"0\",\"%s\"", i,
+                    s->connected ? "CONNECTED" : "INITIAL");
+        }
+        return true;
+    } else if (!strcasecmp(name, "+CSTT")) {
+        if (strcmp(sim.ip_state, "IP INITIAL"))
+            return false;
+        sim.ip_state = "IP START";
+    } else if (!strcasecmp(name, "+CIICR")) {
+        if (strcmp(sim.ip_state, "IP START"))
+            return false;
+        sim.ip_state = "IP GPRSACT";
+    } else if (!strcasecmp(name, "+CIFSR")) {
+        if (strcmp(sim.ip_state, "IP GPRSACT") && strcmp(sim.ip_state, "IP STATUS"))
+            return false;
+        sim.ip_state = "IP STATUS";
+        /* Famously answered without a final OK. */
+        response_line(r, "10.0.0.2");
+        r->final = true;
+    } else if (!strcasecmp(name, "+CIPSHUT")) {
+        for (int i=0; i<SIM_NSOCKETS-1; i++)
+            sim_disconnect(i);
+        sim.ip_state = "IP INITIAL";
+        response_final(r, "SHUT OK");
+    } else if (!strcasecmp(name, "+CIPMUX") || !strcasecmp(name, "+CIPMODE")) {
+        int *value = !strcasecmp(name, "+CIPMUX") ? &sim.cipmux : &sim.cipmode;
+        if (query) {
+            response_line(r, "%s: %d", name, *value);
+        } else {
+            /* Only changeable with the IP application shut. */
+            if (argc < 1 || strcmp(sim.ip_state, "IP INITIAL"))
+                return false;
+            *value = atoi(argv[0]) ? 1 : 0;
+        }
+    } else if (!strcasecmp(name, "O")) {
+        if (!sim.cipmode || !sim.sockets[0].connected) {
+            response_final(r, "NO CARRIER");
+            return true;
+        }
+        transparent_connect(r);
+    } else if (!strcasecmp(name, "+CIPSTART") && !sim.cipmux) {
+        if (argc < 3 || sim.sockets[0].connected)
+            return false;
+        if (strcmp(sim.ip_state, "IP STATUS") && strcmp(sim.ip_state, "IP PROCESSING"))
+            return false;
+        response_final(r, "OK");
+        if (sim_connect(0, argv[1], atoi(argv[2])) != 0)
+            response_line(r, "CONNECT FAIL");
+        else if (sim.cipmode)
+            transparent_connect(r);
+        else
+            response_line(r, "CONNECT OK");
+    } else if (!strcasecmp(name, "+CIPCLOSE") && !sim.cipmux) {
+        if (!sim.sockets[0].connected)
+            return false;
+        sim_disconnect(0);
+        response_final(r, "CLOSE OK");
+    } else if (!strcasecmp(name, "+CIPRXGET") || !strcasecmp(name, "+CIPQSEND")) {
+        if (!strcasecmp(name, "+CIPRXGET") && argc >= 1 && atoi(argv[0]) == 2)
+            goto ciprxget;
+        if (query)
+            response_line(r, "%s: 1", name);
+    } else if (!strcasecmp(name, "+CIPSTART")) {
+        if (argc < 4)
+            return false;
+        int connid = atoi(argv[0]);
+        if (connid < 0 || connid >= SIM_NSOCKETS-1 || sim.sockets[connid].connected)
+            return false;
+        if (strcmp(sim.ip_state, "IP STATUS") && strcmp(sim.ip_state, "IP PROCESSING"))
+            return false;
+        response_final(r, "OK");
+        if (sim_connect(connid, argv[2], atoi(argv[3])) == 0)
+            response_line(r, "%d, CONNECT OK", connid);
+        else
+            response_line(r, "%d, CONNECT FAIL", connid);
+    } else if (!strcasecmp(name, "+CIPSEND")) {
+        if (argc < 2)
+            return false;
+        int connid = atoi(argv[0]);
+        int len = atoi(argv[1]);
+        if (connid < 0 || connid >= SIM_NSOCKETS-1 || !sim.sockets[connid].connected ||
+            len <= 0 || len > 1460)
+            return false;
+        response_append(r, "\r\n> ", 4);
+        r->final = true;
+        sim.chan->data_socket = connid;
+        sim.chan->data_left = len;
+        *async = true;
+    } else if (!strcasecmp(name, "+CIPACK")) {
+        if (argc < 1)
+            return false;
+        int connid = atoi(argv[0]);
+        if (connid < 0 || connid >= SIM_NSOCKETS-1)
+            return false;
+        response_line(r, "+CIPACK: %zu,%zu,0", sim.sockets[connid].sent, sim.sockets[connid].sent);
+    } else if (!strcasecmp(name, "+CIPCLOSE")) {
+        if (argc < 1)
+            return false;
+        int connid = atoi(argv[0]);
+        if (connid < 0 || connid >= SIM_NSOCKETS-1 || !sim.sockets[connid].connected)
+            return false;
+        sim_disconnect(connid);
+        /* SIM800 reports only the CLOSE OK line. */
+        response_line(r, "%d, CLOSE OK", connid);
+        r->final = true;
+    } else if (!strncasecmp(name, "+FTP", 4) && strcasecmp(name, "+FTPGET")) {
+        if (!strcasecmp(name, "+FTPGETNAME") && argc >= 1)
+            snprintf(sim.ftp_name, sizeof(sim.ftp_name), "%s", argv[0]);
+    } else if (!strcasecmp(name, "+FTPGET")) {
+        if (argc < 1)
+            return false;
+        int mode = atoi(argv[0]);
+        if (mode == 1) {
+            char path[512];
+            snprintf(path, sizeof(path), "%s/%s", sim.ftproot ? sim.ftproot : ".", sim.ftp_name);
+            if (sim.ftp_file)
+                fclose(sim.ftp_file);
+            sim.ftp_file = sim.sapbr_open ? fopen(path, "rb") : NULL;
+            sim.ftp_eof = false;
+            response_final(r, "OK");
+            response_line(r, "+FTPGET: 1,%d", sim.ftp_file ? 1 : 77);
+        } else if (mode == 2 && argc >= 2) {
+            if (!sim.ftp_file)
+                return false;
+            char buf[1460];
+            size_t want = atoi(argv[1]);
+            if (want > sizeof(buf))
+                want = sizeof(buf);
+            size_t got = fread(buf, 1, want, sim.ftp_file);
+            response_line(r, "+FTPGET: 2,%zu", got);
+            response_append(r, buf, got);
+            response_final(r, "OK");
+            if (got < want && !sim.ftp_eof) {
+                sim.ftp_eof = true;
+                response_line(r, "+FTPGET: 1,0");
+            }
+        } else {
+            return false;
+        }
+    } else {
+        return handle_common(name, args, query, r);
+    }
+
+    return true;
+
+ciprxget:
+    {
+        if (argc < 3)
+            return false;
+        int connid = atoi(argv[1]);
+        int want = atoi(argv[2]);
+        if (connid < 0 || connid >= SIM_NSOCKETS-1 || want <= 0 || want > 1460)
+            return false;
+        char buf[1460];
+        size_t got = socket_take(connid, buf, want);
+        response_line(r, "+CIPRXGET: 2,%d,%d,%zu", connid, want, got);
+        response_append(r, buf, got);
+    }
+    return true;
+}
+
+static bool handle_telit(const char *name, char *args, bool query, struct sim_response *r, bool *async)
+{
+    char *argv[8];
+    int argc = split_args(args, argv, 8);
+
+    if (!strcasecmp(name, "#CCID")) {
+        response_line(r, "#CCID: %s", sim.iccid);
+    } else if (!strcasecmp(name, "+CGDCONT") || !strcasecmp(name, "#SCFGEXT") ||
+               !strcasecmp(name, "#SCFGEXT2") || !strcasecmp(name, "#FTPOPEN") ||
+               !strcasecmp(name, "#FTPCLOSE")) {
+        /* Accepted, no effect. */
+    } else if (!strcasecmp(name, "#SGACT")) {
+        if (argc < 2)
+            return false;
+        if (atoi(argv[1]) == 1) {
+            if (sim.context_active) {
+                response_final(r, "+CME ERROR: context already activated");
+                return false;
+            }
+            sim.context_active = true;
+            response_line(r, "#SGACT: 10.0.0.2");
+        } else {
+            sim.context_active = false;
+        }
+    } else if (!strcasecmp(name, "#SD")) {
+        if (argc < 4)
+            return false;
+        int connid = atoi(argv[0]);
+        if (connid < 1 || connid >= SIM_NSOCKETS || sim.sockets[connid].connected || !sim.context_active)
+            return false;
+        if (sim_connect(connid, argv[3], atoi(argv[2])) != 0) {
+            response_final(r, "NO CARRIER");
+            return false;
+        }
+    } else if (!strcasecmp(name, "#SSENDEXT")) {
+        if (argc < 2)
+            return false;
+        int connid = atoi(argv[0]);
+        int len = atoi(argv[1]);
+        if (connid < 1 || connid >= SIM_NSOCKETS || !sim.sockets[connid].connected ||
+            len <= 0 || len > 1500)
+            return false;
+        response_append(r, "\r\n> ", 4);
+        r->final = true;
+        sim.chan->data_socket = connid;
+        sim.chan->data_left = len;
+        *async = true;
+    } else if (!strcasecmp(name, "#SRECV")) {
+        if (argc < 2)
+            return false;
+        int connid = atoi(argv[0]);
+        int want = atoi(argv[1]);
+        if (connid < 1 || connid >= SIM_NSOCKETS || want <= 0 || want > 1500)
+            return false;
+        char buf[1500];
+        size_t got = socket_take(connid, buf, want);
+        if (!got) {
+            response_final(r, "+CME ERROR: activation failed");
+            return false;
+        }
+        response_line(r, "#SRECV: %d,%zu", connid, got);
+        response_append(r, buf, got);
+    } else if (!strcasecmp(name, "#SI")) {
+        int connid = argc ? atoi(argv[0]) : 1;
+        if (connid < 1 || connid >= SIM_NSOCKETS)
+            return false;
+        struct sim_socket *s = &sim.sockets[connid];
+        response_line(r, "#SI: %d,%zu,%zu,%zu,0", connid, s->sent, s->received, s->used);
+    } else if (!strcasecmp(name, "#SS")) {
+        int connid = argc ? atoi(argv[0]) : 1;
+        if (connid < 1 || connid >= SIM_NSOCKETS)
+            return false;
+        struct sim_socket *s = &sim.sockets[connid];
+        response_line(r, "#SS: %d,%d", connid, s->connected ? (s->used ? 3 : 2) : 0);
+    } else if (!strcasecmp(name, "#SH")) {
+        int connid = argc ? atoi(argv[0]) : 1;
+        if (connid < 1 || connid >= SIM_NSOCKETS)
+            return false;
+        sim_disconnect(connid);
+    } else if (!strcasecmp(name, "#FTPGETPKT")) {
+        if (query) {
+            response_line(r, "#FTPGETPKT: %s,0,%d", sim.ftp_name, sim.ftp_eof);
+            return true;
+        }
+        if (argc < 1)
+            return false;
+        snprintf(sim.ftp_name, sizeof(sim.ftp_name), "%s", argv[0]);
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", sim.ftproot ? sim.ftproot : ".", sim.ftp_name);
+        if (sim.ftp_file)
+            fclose(sim.ftp_file);
+        sim.ftp_file = fopen(path, "rb");
+        sim.ftp_eof = false;
+        if (!sim.ftp_file)
+            return false;
+    } else if (!strcasecmp(name, "#FTPRECV")) {
+        if (!sim.ftp_file || argc < 1)
+            return false;
+        char buf[1500];
+        size_t want = atoi(argv[0]);
+        if (want > sizeof(buf))
+            want = sizeof(buf);
+        size_t got = fread(buf, 1, want, sim.ftp_file);
+        if (!got) {
+            sim.ftp_eof = true;
+            return false;
+        }
+        response_line(r, "#FTPRECV: %zu", got);
+        response_append(r, buf, got);
+    } else if (!strcasecmp(name, "#AGPSSND")) {
+        if (!sim.context_active)
+            return false;
+        response_final(r, "OK");
+        response_line(r, "#AGPSRING: 200,52.229676,21.012229,100.0");
+        return true;
+    } else {
+        return handle_common(name, args, query, r);
+    }
+
+    return true;
+}
+
+/**
+ * Execute a command line (without the "AT" prefix) and queue the response.
+ */
+static void execute(char *line)
+{
+    struct sim_response r = {0};
+    bool async = false;
+    bool ok = true;
+    char command[SIM_LINE_MAX];
+    snprintf(command, sizeof(command), "%s", line);
+
+    /* Canned replies take precedence. */
+    struct sim_rule *rule = rule_for(command, has_reply);
+    if (rule) {
+        for (const char *p=rule->reply; *p; ) {
+            const char *end = strstr(p, "\\n");
+            size_t len = end ? (size_t) (end - p) : strlen(p);
+            response_line(&r, "%.*s", (int) len, p);
+            p += len + (end ? 2 : 0);
+        }
+        r.final = true;
+    } else {
+        /* Split concatenated commands on ';' outside quotes. */
+        char *cmd = line;
+        while (ok && cmd) {
+            char *next = NULL;
+            bool quoted = false;
+            for (char *p=cmd; *p; p++) {
+                if (*p == '"')
+                    quoted = !quoted;
+                else if (*p == ';' && !quoted) {
+                    *p = '\0';
+                    next = p+1;
+                    break;
+                }
+            }
+
+            /* Separate the name from arguments. */
+            char name[64];
+            size_t n = strcspn(cmd, "=?");
+            if (n >= sizeof(name))
+                n = sizeof(name)-1;
+            memcpy(name, cmd, n);
+            name[n] = '\0';
+            bool query = (cmd[n] == '?') || (cmd[n] == '=' && cmd[n+1] == '?');
+            char *args = (cmd[n] == '=') ? cmd+n+1 : NULL;
+            if (args && *args == '?')
+                args = NULL;
+
+            if (sim.model == MODEL_SIM800)
+                ok = handle_sim800(name, args, query, &r, &async);
+            else
+                ok = handle_telit(name, args, query, &r, &async);
+
+            if (async || r.final)
+                break;
+            cmd = next;
+        }
+
+        if (!r.final)
+            response_final(&r, ok ? "OK" : "ERROR");
+        else if (!ok && !r.len)
+            response_final(&r, "ERROR");
+    }
+
+    /* Apply latency and faults. */
+    int64_t due = now_ms();
+    rule = rule_for(command, has_latency);
+    if (rule)
+        due += rule->latency;
+
+    rule = rule_for(command, has_fault);
+    if (rule && chance(rule->probability)) {
+        switch (rule->fault) {
+            case FAULT_DROP:
+                r.len = 0;
+                if (async)
+                    sim.chan->input = INPUT_DATA;
+                free(r.data);
+                return;
+            case FAULT_ERROR:
+                r.len = 0;
+                response_final(&r, "ERROR");
+                async = false;
+                break;
+            case FAULT_GARBLE:
+                if (r.len > 2)
+                    r.data[2 + rand_r(&sim.seed) % (r.len - 2)] ^= 0x20;
+                break;
+            case FAULT_LATE:
+                due += rule->fault_ms;
+                break;
+            case FAULT_NOISE:
+                emit_at(due, "\r\n\x7f\x01garbage\r\n", 13);
+                break;
+            default:
+                break;
+        }
+    }
+
+    /* Responses on a channel never overtake each other. */
+    if (due < sim.chan->last_response_due)
+        due = sim.chan->last_response_due;
+    sim.chan->last_response_due = due;
+
+    emit_at(due, r.data, r.len);
+    free(r.data);
+
+    if (async)
+        sim.chan->input = INPUT_DATA;
+
+    /* Frames start right after the OK. */
+    if (sim.mux_pending) {
+        sim.mux_pending = false;
+        sim.mux = true;
+        cmux_decoder_init(&sim.decoder);
+        for (int i=1; i<=SIM_MAX_DLCI; i++)
+            sim.channels[i].open = false;
+    }
+}
+
+static void data_complete(void)
+{
+    if (sim.model == MODEL_SIM800) {
+        struct sim_response r = {0};
+        response_line(&r, "%d, SEND OK", sim.chan->data_socket);
+        emit_at(now_ms(), r.data, r.len);
+        free(r.data);
+    } else {
+        urc("OK");
+    }
+    sim.chan->input = INPUT_LINE;
+}
+
+static void input_byte(uint8_t ch)
+{
+    struct sim_channel *chan = sim.chan;
+
+    if (chan->input == INPUT_DATA) {
+        struct sim_socket *s = &sim.sockets[chan->data_socket];
+        if (s->connected && write(s->fd, &ch, 1) == 1)
+            s->sent++;
+        if (--chan->data_left == 0)
+            data_complete();
+        return;
+    }
+
+    if (chan->input == INPUT_TRANSPARENT) {
+        struct sim_socket *s = &sim.sockets[0];
+        int64_t now = now_ms();
+        bool quiet = now - chan->last_input >= SIM_GUARD_MS;
+        chan->last_input = now;
+
+        /* "+++" counts only after a guard time of silence. */
+        if (ch == '+' && chan->escape_plus < 3 && (chan->escape_plus || quiet)) {
+            if (++chan->escape_plus == 3)
+                chan->escape_due = now + SIM_GUARD_MS;
+            return;
+        }
+
+        /* False alarm; the pluses were data. */
+        for (; chan->escape_plus; chan->escape_plus--)
+            if (s->connected && write(s->fd, "+", 1) == 1)
+                s->sent++;
+        chan->escape_due = 0;
+        if (s->connected && write(s->fd, &ch, 1) == 1)
+            s->sent++;
+        return;
+    }
+
+    if (chan->echo) {
+        emit_at(now_ms(), &ch, 1);
+    }
+
+    if (ch == '\n')
+        return;
+
+    if (ch != '\r') {
+        if (chan->line_len < sim.linebuf && chan->line_len < sizeof(chan->line)-1)
+            chan->line[chan->line_len++] = ch;
+        else
+            chan->line_overflow = true;
+        return;
+    }
+
+    /* Command line complete. */
+    chan->line[chan->line_len] = '\0';
+    size_t len = chan->line_len;
+    chan->line_len = 0;
+
+    if (chan->line_overflow) {
+        chan->line_overflow = false;
+        urc("ERROR");
+        return;
+    }
+    if (len == 0)
+        return;
+    if (len < 2 || strncasecmp(chan->line, "AT", 2)) {
+        /* Garbage; real modems ignore it. */
+        return;
+    }
+
+    execute(chan->line + 2);
+}
+
+/*
+ * CMUX.
+ */
+
+static void mux_message(uint8_t type, bool command, const uint8_t *values, size_t len)
+{
+    uint8_t msg[8];
+    msg[0] = type | (command ? CMUX_MSG_CR : 0) | 0x01;
+    msg[1] = (len << 1) | 0x01;
+    if (len)
+        memcpy(msg + 2, values, len);
+    emit_frame(0, false, CMUX_UIH, msg, 2 + len);
+}
+
+static void mux_exit(void)
+{
+    sim.mux = false;
+    sim.chan = &sim.channels[0];
+    sim.chan->open = true;
+}
+
+static void mux_control(const uint8_t *data, size_t len)
+{
+    if (len < 2 || !(data[0] & CMUX_MSG_CR))
+        return;
+    uint8_t type = data[0] & ~(CMUX_MSG_CR | 0x01);
+    size_t vlen = data[1] >> 1;
+    if (vlen > len - 2 || vlen > 6)
+        return;
+
+    if (type == CMUX_MSG_MSC && vlen >= 2) {
+        int dlci = data[2] >> 2;
+        if (dlci >= 1 && dlci <= SIM_MAX_DLCI)
+            sim.channels[dlci].paused = data[3] & CMUX_V24_FC;
+        mux_message(type, false, data + 2, vlen);
+    } else if (type == CMUX_MSG_CLD) {
+        mux_message(type, false, NULL, 0);
+        mux_exit();
+    } else if (type == CMUX_MSG_TEST) {
+        mux_message(type, false, data + 2, vlen);
+    } else {
+        mux_message(CMUX_MSG_NSC, false, data, 1);
+    }
+}
+
+static void mux_frame(const struct cmux_frame *frame)
+{
+    int dlci = frame->dlci;
+    if (dlci > SIM_MAX_DLCI) {
+        emit_frame(dlci, true, CMUX_DM | CMUX_PF, NULL, 0);
+        return;
+    }
+    struct sim_channel *chan = &sim.channels[dlci];
+
+    switch (frame->control & ~CMUX_PF) {
+        case CMUX_SABM:
+            memset(chan, 0, sizeof(*chan));
+            chan->open = true;
+            chan->echo = sim.echo;
+            emit_frame(dlci, true, CMUX_UA | CMUX_PF, NULL, 0);
+            break;
+        case CMUX_DISC:
+            emit_frame(dlci, true, chan->open ? CMUX_UA | CMUX_PF : CMUX_DM | CMUX_PF, NULL, 0);
+            chan->open = false;
+            if (dlci == 0)
+                mux_exit();
+            break;
+        case CMUX_UIH:
+        case CMUX_UI:
+            if (!chan->open)
+                break;
+            if (dlci == 0) {
+                mux_control(frame->data, frame->len);
+            } else {
+                sim.chan = chan;
+                for (size_t i=0; i<frame->len && sim.mux; i++)
+                    input_byte(frame->data[i]);
+            }
+            break;
+    }
+}
+
+static void mux_input(const uint8_t *data, size_t len)
+{
+    for (size_t i=0; i<len; i++) {
+        struct cmux_frame frame;
+        if (!sim.mux) {
+            /* Left CMUX mode mid-buffer. */
+            sim.chan = &sim.channels[0];
+            input_byte(data[i]);
+        } else if (cmux_decoder_feed(&sim.decoder, data[i], &frame)) {
+            mux_frame(&frame);
+        }
+    }
+}
+
+/*
+ * Script parsing.
+ */
+
+static void schedule(int delay, int period, const char *line)
+{
+    if (sim.nevents == SIM_MAX_EVENTS)
+        return;
+    struct sim_event *event = &sim.events[sim.nevents++];
+    event->due = now_ms() + delay;
+    event->period = period;
+    event->line = strdup(line);
+}
+
+static void run_line(char *line)
+{
+    /* Trim. */
+    while (isspace((unsigned char) *line))
+        line++;
+    size_t len = strlen(line);
+    while (len && isspace((unsigned char) line[len-1]))
+        line[--len] = '\0';
+    if (!*line || *line == '#')
+        return;
+
+    char *word = line;
+    char *rest = line + strcspn(line, " \t");
+    if (*rest)
+        *rest++ = '\0';
+    while (isspace((unsigned char) *rest))
+        rest++;
+
+    if (!strcmp(word, "model")) {
+        sim.model = !strcmp(rest, "telit") ? MODEL_TELIT : MODEL_SIM800;
+    } else if (!strcmp(word, "echo")) {
+        sim.echo = !strcmp(rest, "on");
+        for (int i=0; i<=SIM_AUX; i++)
+            sim.channels[i].echo = sim.echo;
+    } else if (!strcmp(word, "baud")) {
+        sim.baud = atoi(rest);
+    } else if (!strcmp(word, "linebuf")) {
+        sim.linebuf = atoi(rest);
+    } else if (!strcmp(word, "sockbuf")) {
+        sim.sockbuf = atoi(rest);
+    } else if (!strcmp(word, "seed")) {
+        sim.seed = atoi(rest);
+    } else if (!strcmp(word, "ftproot")) {
+        sim.ftproot = strdup(rest);
+    } else if (!strcmp(word, "latency") || !strcmp(word, "fault") || !strcmp(word, "reply")) {
+        char *prefix = rest;
+        char *arg = rest + strcspn(rest, " \t");
+        if (*arg)
+            *arg++ = '\0';
+        while (isspace((unsigned char) *arg))
+            arg++;
+        struct sim_rule *rule = rule_get(prefix);
+        if (!rule)
+            return;
+        if (!strcmp(word, "latency")) {
+            rule->latency = atoi(arg);
+        } else if (!strcmp(word, "reply")) {
+            free(rule->reply);
+            rule->reply = strdup(arg);
+        } else {
+            char kind[16];
+            rule->fault_ms = 0;
+            if (sscanf(arg, "%15s %lf %d", kind, &rule->probability, &rule->fault_ms) < 2)
+                return;
+            rule->fault = !strcmp(kind, "drop") ? FAULT_DROP :
+                          !strcmp(kind, "error") ? FAULT_ERROR :
+                          !strcmp(kind, "garble") ? FAULT_GARBLE :
+                          !strcmp(kind, "late") ? FAULT_LATE :
+                          !strcmp(kind, "noise") ? FAULT_NOISE : FAULT_NONE;
+        }
+    } else if (!strcmp(word, "route")) {
+        char host[64], addr[64];
+        int port;
+        if (sscanf(rest, "%63s %63[^:]:%d", host, addr, &port) != 3 || sim.nroutes == SIM_MAX_ROUTES)
+            return;
+        struct sim_route *route = &sim.routes[sim.nroutes++];
+        snprintf(route->host, sizeof(route->host), "%s", host);
+        route->addr.sin_family = AF_INET;
+        route->addr.sin_port = htons(port);
+        inet_pton(AF_INET, addr, &route->addr.sin_addr);
+    } else if (!strcmp(word, "set")) {
+        char key[16], value[32];
+        if (sscanf(rest, "%15s %31s", key, value) != 2)
+            return;
+        if (!strcmp(key, "creg"))
+            sim.creg = atoi(value);
+        else if (!strcmp(key, "rssi"))
+            sim.rssi = atoi(value);
+        else if (!strcmp(key, "imei"))
+            snprintf(sim.imei, sizeof(sim.imei), "%s", value);
+        else if (!strcmp(key, "iccid"))
+            snprintf(sim.iccid, sizeof(sim.iccid), "%s", value);
+    } else if (!strcmp(word, "urc")) {
+        sim.chan = &sim.channels[sim.mux ? sim.urc_dlci : sim.aux != -1 ? SIM_AUX : 0];
+        urc("%s", rest);
+    } else if (!strcmp(word, "mux")) {
+        char what[8], flag[8] = "";
+        int dlci;
+        if (sscanf(rest, "%7s %d %7s", what, &dlci, flag) < 2 || dlci < 1 || dlci > SIM_MAX_DLCI)
+            return;
+        if (!strcmp(what, "urc")) {
+            sim.urc_dlci = dlci;
+        } else if (!strcmp(what, "fc") && sim.mux) {
+            uint8_t values[2] = { (dlci << 2) | 0x03,
+                CMUX_V24_RTC | CMUX_V24_RTR | CMUX_V24_DV | 0x01 |
+                (!strcmp(flag, "on") ? CMUX_V24_FC : 0) };
+            mux_message(CMUX_MSG_MSC, true, values, sizeof(values));
+        }
+    } else if (!strcmp(word, "after") || !strcmp(word, "every")) {
+        int ms = atoi(rest);
+        char *cmd = rest + strcspn(rest, " \t");
+        while (isspace((unsigned char) *cmd))
+            cmd++;
+        schedule(ms, !strcmp(word, "every") ? ms : 0, cmd);
+    } else if (!strcmp(word, "quit")) {
+        sim.quit = true;
+    } else {
+        fprintf(stderr, "modem-sim: unknown directive '%s'\n", word);
+    }
+}
+
+static void run_events(void)
+{
+    int64_t now = now_ms();
+    for (int i=0; i<sim.nevents; i++) {
+        struct sim_event *event = &sim.events[i];
+        if (event->due > now)
+            continue;
+
+        char line[SIM_LINE_MAX];
+        snprintf(line, sizeof(line), "%s", event->line);
+        if (event->period) {
+            event->due += event->period;
+        } else {
+            free(event->line);
+            sim.events[i--] = sim.events[--sim.nevents];
+        }
+        run_line(line);
+    }
+}
+
+static void run_escapes(void)
+{
+    int64_t now = now_ms();
+    for (int i=0; i<=SIM_AUX; i++) {
+        struct sim_channel *chan = &sim.channels[i];
+        if (chan->input != INPUT_TRANSPARENT || !chan->escape_due || chan->escape_due > now)
+            continue;
+        chan->input = INPUT_LINE;
+        chan->escape_plus = 0;
+        chan->escape_due = 0;
+        sim.chan = chan;
+        urc("OK");
+    }
+}
+
+static int next_timeout(void)
+{
+    int64_t now = now_ms();
+    int64_t due = now + 100;
+
+    if (sim.out_len || sim.aux_len)
+        due = now + 1;
+    for (struct sim_chunk *chunk=sim.queue; chunk; chunk=chunk->next) {
+        if (chunk->dlci > 0 && sim.channels[chunk->dlci].paused)
+            continue;
+        if (chunk->due < due)
+            due = chunk->due;
+        break;
+    }
+    for (int i=0; i<sim.nevents; i++)
+        if (sim.events[i].due < due)
+            due = sim.events[i].due;
+    for (int i=0; i<=SIM_AUX; i++)
+        if (sim.channels[i].escape_due && sim.channels[i].escape_due < due)
+            due = sim.channels[i].escape_due;
+
+    return due > now ? (int) (due - now) : 0;
+}
+
+static int open_master(const char *label, const char *link)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1)
+        return -1;
+
+    struct termios attr;
+    tcgetattr(fd, &attr);
+    cfmakeraw(&attr);
+    tcsetattr(fd, TCSANOW, &attr);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    const char *path = ptsname(fd);
+    if (link) {
+        unlink(link);
+        if (symlink(path, link) == -1)
+            return -1;
+    }
+    printf("%s: %s\n", label, path);
+    fflush(stdout);
+
+    return fd;
+}
+
+static int open_echo_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    sim.echo_addr.sin_family = AF_INET;
+    sim.echo_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sim.echo_addr);
+    if (bind(fd, (struct sockaddr *) &sim.echo_addr, len) == -1 ||
+        listen(fd, SIM_MAX_ECHO) == -1 ||
+        getsockname(fd, (struct sockaddr *) &sim.echo_addr, &len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int open_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *) &addr, len) == -1 || listen(fd, 1) == -1 ||
+        getsockname(fd, (struct sockaddr *) &addr, &len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    printf("tcp: %d\n", ntohs(addr.sin_port));
+    fflush(stdout);
+
+    return fd;
+}
+
+static void server_accept(void)
+{
+    int fd = accept4(sim.server, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd == -1)
+        return;
+    if (sim.master != -1)
+        close(sim.master);
+    sim.master = fd;
+    sim.telnet_state = 0;
+    sim.out_len = 0;
+}
+
+/* Protocol bytes go straight into the output, past the escaping. */
+static void telnet_reply(uint8_t verb, uint8_t option)
+{
+    if (sim.out_len + 3 <= sizeof(sim.out)) {
+        sim.out[sim.out_len++] = 0xff;
+        sim.out[sim.out_len++] = verb;
+        sim.out[sim.out_len++] = option;
+    }
+}
+
+/*
+ * Strip Telnet commands from client input, in place. Agree to binary mode,
+ * SGA and COM-PORT-OPTION, refuse the rest, and act on SET-BAUDRATE.
+ */
+static size_t telnet_input(uint8_t *buf, size_t len)
+{
+    enum { DATA, COMMAND, OPTION, SUB, SUB_IAC };
+    size_t out = 0;
+    for (size_t i=0; i<len; i++) {
+        uint8_t ch = buf[i];
+        switch (sim.telnet_state) {
+            case DATA:
+                if (ch == 0xff)
+                    sim.telnet_state = COMMAND;
+                else
+                    buf[out++] = ch;
+                break;
+            case COMMAND:
+                sim.telnet_state = DATA;
+                if (ch == 0xff) {
+                    buf[out++] = ch;
+                } else if (ch == 250) {
+                    sim.telnet_sub_len = 0;
+                    sim.telnet_state = SUB;
+                } else if (ch >= 251) {
+                    sim.telnet_verb = ch;
+                    sim.telnet_state = OPTION;
+                }
+                break;
+            case OPTION: {
+                sim.telnet_state = DATA;
+                bool known = ch == 0 || ch == 3 || ch == 44;
+                if (sim.telnet_verb == 251)
+                    telnet_reply(known ? 253 : 254, ch);
+                else if (sim.telnet_verb == 253)
+                    telnet_reply(known && ch != 44 ? 251 : 252, ch);
+                break;
+            }
+            case SUB:
+                if (ch == 0xff)
+                    sim.telnet_state = SUB_IAC;
+                else if (sim.telnet_sub_len < sizeof(sim.telnet_sub))
+                    sim.telnet_sub[sim.telnet_sub_len++] = ch;
+                break;
+            case SUB_IAC:
+                if (ch == 0xff) {
+                    sim.telnet_state = SUB;
+                    if (sim.telnet_sub_len < sizeof(sim.telnet_sub))
+                        sim.telnet_sub[sim.telnet_sub_len++] = ch;
+                    break;
+                }
+                sim.telnet_state = DATA;
+                /* COM-PORT-OPTION SET-BAUDRATE <4 bytes, big endian>. */
+                if (ch == 240 && sim.telnet_sub_len == 6 &&
+                    sim.telnet_sub[0] == 44 && sim.telnet_sub[1] == 1)
+                    sim.ipr = (long) sim.telnet_sub[2] << 24 | sim.telnet_sub[3] << 16 |
+                              sim.telnet_sub[4] << 8 | sim.telnet_sub[5];
+                break;
+        }
+    }
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *script = NULL;
+    const char *link = NULL;
+    const char *transport = NULL;
+    bool aux = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:l:b:t:a")) != -1) {
+        switch (opt) {
+            case 'm': sim.model = !strcmp(optarg, "telit") ? MODEL_TELIT : MODEL_SIM800; break;
+            case 's': script = optarg; break;
+            case 'l': link = optarg; break;
+            case 'b': sim.baud = atoi(optarg); break;
+            case 't': transport = optarg; break;
+            case 'a': aux = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-m sim800|telit] [-s script] [-l link] [-b baud] "
+                                "[-t raw|rfc2217] [-a]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    sim.echo_listen = open_echo_server();
+    if (sim.echo_listen == -1) {
+        perror("modem-sim: echo server");
+        return 1;
+    }
+
+    if (script) {
+        FILE *f = fopen(script, "r");
+        if (!f) {
+            perror("modem-sim: script");
+            return 1;
+        }
+        char line[SIM_LINE_MAX];
+        while (fgets(line, sizeof(line), f))
+            run_line(line);
+        fclose(f);
+    }
+
+    if (transport) {
+        sim.telnet = !strcmp(transport, "rfc2217");
+        /* A client may hang up with output still queued. */
+        signal(SIGPIPE, SIG_IGN);
+        sim.server = open_server();
+        if (sim.server == -1) {
+            perror("modem-sim: server");
+            return 1;
+        }
+    } else {
+        sim.master = open_master("pty", link);
+        if (sim.master == -1) {
+            perror("modem-sim: pty");
+            return 1;
+        }
+    }
+    if (aux) {
+        sim.aux = open_master("aux", NULL);
+        if (sim.aux == -1) {
+            perror("modem-sim: aux pty");
+            return 1;
+        }
+        sim.channels[SIM_AUX] = (struct sim_channel) { .open = true, .echo = sim.echo };
+    }
+    sim.out_credit_time = now_ms();
+
+    bool stdin_open = true;
+    char control[SIM_LINE_MAX];
+    size_t control_len = 0;
+
+    while (!sim.quit) {
+        struct pollfd pfds[5 + SIM_NSOCKETS + SIM_MAX_ECHO];
+        int sockmap[SIM_NSOCKETS + SIM_MAX_ECHO];
+        int n = 0;
+
+        pfds[n++] = (struct pollfd) { .fd = sim.master, .events = POLLIN };
+        pfds[n++] = (struct pollfd) { .fd = stdin_open ? STDIN_FILENO : -1, .events = POLLIN };
+        pfds[n++] = (struct pollfd) { .fd = sim.echo_listen, .events = POLLIN };
+        pfds[n++] = (struct pollfd) { .fd = sim.server, .events = POLLIN };
+        pfds[n++] = (struct pollfd) { .fd = sim.aux, .events = POLLIN };
+        for (int i=0; i<SIM_NSOCKETS; i++) {
+            struct sim_socket *s = &sim.sockets[i];
+            if (s->connected && s->used < sim.sockbuf) {
+                sockmap[n-5] = i;
+                pfds[n++] = (struct pollfd) { .fd = s->fd, .events = POLLIN };
+            }
+        }
+        for (int i=0; i<SIM_MAX_ECHO; i++) {
+            if (sim.echo_clients[i] > 0) {
+                sockmap[n-5] = -1-i;
+                pfds[n++] = (struct pollfd) { .fd = sim.echo_clients[i], .events = POLLIN };
+            }
+        }
+
+        if (poll(pfds, n, next_timeout()) == -1 && errno != EINTR) {
+            perror("modem-sim: poll");
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            uint8_t buf[512];
+            ssize_t amount = read(sim.master, buf, sizeof(buf));
+            if (amount == 0 && sim.server != -1) {
+                /* Client gone; wait for the next one. */
+                close(sim.master);
+                sim.master = -1;
+            }
+            if (amount > 0 && sim.telnet)
+                amount = telnet_input(buf, amount);
+            if (amount > 0 && sim.mux) {
+                mux_input(buf, amount);
+            } else {
+                sim.chan = &sim.channels[0];
+                for (ssize_t i=0; i<amount; i++)
+                    input_byte(buf[i]);
+            }
+        }
+        if (pfds[1].revents & (POLLIN | POLLHUP)) {
+            ssize_t amount = read(STDIN_FILENO, control + control_len, sizeof(control) - control_len - 1);
+            if (amount <= 0) {
+                stdin_open = false;
+            } else {
+                control_len += amount;
+                char *eol;
+                while ((eol = memchr(control, '\n', control_len))) {
+                    *eol = '\0';
+                    run_line(control);
+                    control_len -= eol + 1 - control;
+                    memmove(control, eol + 1, control_len);
+                }
+                if (control_len == sizeof(control) - 1)
+                    control_len = 0;
+            }
+        }
+        if (pfds[2].revents & POLLIN)
+            echo_accept();
+        if (pfds[3].revents & POLLIN)
+            server_accept();
+        if (pfds[4].revents & POLLIN) {
+            uint8_t buf[512];
+            ssize_t amount = read(sim.aux, buf, sizeof(buf));
+            sim.chan = &sim.channels[SIM_AUX];
+            for (ssize_t i=0; i<amount; i++)
+                input_byte(buf[i]);
+        }
+        for (int i=5; i<n; i++) {
+            if (!(pfds[i].revents & (POLLIN | POLLHUP)))
+                continue;
+            if (sockmap[i-5] >= 0)
+                socket_readable(sockmap[i-5]);
+            else
+                echo_readable(-1-sockmap[i-5]);
+        }
+
+        run_events();
+        run_escapes();
+        output_pump();
+    }
+
+    if (link)
+        unlink(link);
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
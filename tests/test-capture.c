@@ -0,0 +1,172 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include <attentive/at-capture.h>
+#include <attentive/at-unix.h>
+
+
+#define STR_LEN(s) s, strlen(s)
+
+
+static void make_session(const char *path)
+{
+    struct at_capture *cap = at_capture_open(path);
+    ck_assert(cap != NULL);
+
+    at_capture_write(cap, AT_CAPTURE_TX, STR_LEN("AT\r"));
+    at_capture_write(cap, AT_CAPTURE_RX, STR_LEN("\r\nOK\r\n"));
+    at_capture_write(cap, AT_CAPTURE_TX, STR_LEN("AT+CGSN\r"));
+    /* Byte-by-byte, the way the reader thread records it. */
+    const char *reply = "\r\n490154203237518\r\n\r\nOK\r\n";
+    for (const char *p=reply; *p; p++)
+        at_capture_write(cap, AT_CAPTURE_RX, p, 1);
+
+    ck_assert_int_eq(at_capture_close(cap), 0);
+}
+
+static void run_session(struct at_replay *replay, struct at_capture *record)
+{
+    struct at *at = at_alloc_unix(at_replay_devpath(replay), 0);
+    ck_assert(at != NULL);
+    ck_assert_int_eq(at_open(at), 0);
+    at_unix_set_capture(at, record);
+    ck_assert_int_eq(at_replay_start(replay), 0);
+
+    at_set_timeout(at, 5);
+    const char *response = at_command(at, "AT");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "");
+    response = at_command(at, "AT+CGSN");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "490154203237518");
+
+    at_unix_set_capture(at, NULL);
+    at_free(at);
+}
+
+START_TEST(test_capture_replay)
+{
+    printf(":: test_capture_replay\n");
+
+    char original[] = "/tmp/test-capture-XXXXXX";
+    char recorded[] = "/tmp/test-capture-XXXXXX";
+    close(mkstemp(original));
+    close(mkstemp(recorded));
+
+    make_session(original);
+
+    /* Replay the synthetic session and record it through the channel. */
+    struct at_replay *replay = at_replay_open(original, AT_REPLAY_FAST);
+    ck_assert(replay != NULL);
+    struct at_capture *record = at_capture_open(recorded);
+    ck_assert(record != NULL);
+    run_session(replay, record);
+    ck_assert_int_eq(at_capture_close(record), 0);
+
+    struct at_replay_stats stats;
+    ck_assert_int_eq(at_replay_wait(replay, &stats), 0);
+    ck_assert_int_eq(stats.records, 4);
+    ck_assert_int_eq(stats.tx_bytes, strlen("AT\rAT+CGSN\r"));
+    ck_assert_int_eq(stats.divergences, 0);
+    at_replay_close(replay);
+
+    /* The channel's own recording must replay just as well, in real time. */
+    replay = at_replay_open(recorded, AT_REPLAY_REALTIME);
+    ck_assert(replay != NULL);
+    run_session(replay, NULL);
+    ck_assert_int_eq(at_replay_wait(replay, &stats), 0);
+    ck_assert_int_eq(stats.divergences, 0);
+    at_replay_close(replay);
+
+    unlink(original);
+    unlink(recorded);
+}
+END_TEST
+
+START_TEST(test_capture_divergence)
+{
+    printf(":: test_capture_divergence\n");
+
+    char path[] = "/tmp/test-capture-XXXXXX";
+    close(mkstemp(path));
+
+    struct at_capture *cap = at_capture_open(path);
+    ck_assert(cap != NULL);
+    at_capture_write(cap, AT_CAPTURE_TX, STR_LEN("ATE0\r"));
+    at_capture_write(cap, AT_CAPTURE_RX, STR_LEN("\r\nOK\r\n"));
+    ck_assert_int_eq(at_capture_close(cap), 0);
+
+    struct at_replay *replay = at_replay_open(path, AT_REPLAY_FAST);
+    ck_assert(replay != NULL);
+    struct at *at = at_alloc_unix(at_replay_devpath(replay), 0);
+    ck_assert_int_eq(at_open(at), 0);
+    ck_assert_int_eq(at_replay_start(replay), 0);
+
+    at_set_timeout(at, 5);
+    ck_assert(at_command(at, "ATE1") != NULL);
+
+    struct at_replay_stats stats;
+    ck_assert_int_eq(at_replay_wait(replay, &stats), -1);
+    ck_assert_int_eq(stats.divergences, 1);
+    ck_assert_int_eq(stats.first_divergence, 16);
+
+    at_free(at);
+    at_replay_close(replay);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_capture_invalid)
+{
+    printf(":: test_capture_invalid\n");
+
+    char path[] = "/tmp/test-capture-XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert(write(fd, STR_LEN("NOT A CAPTURE FILE")) > 0);
+    close(fd);
+
+    ck_assert(at_replay_open(path, AT_REPLAY_FAST) == NULL);
+    unlink(path);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("capture");
+    tcase_add_test(tc, test_capture_replay);
+    tcase_add_test(tc, test_capture_divergence);
+    tcase_add_test(tc, test_capture_invalid);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,114 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <attentive/cmux.h>
+
+
+static int decode(struct cmux_decoder *dec, const uint8_t *buf, size_t len,
+                  struct cmux_frame *frame)
+{
+    int frames = 0;
+    for (size_t i=0; i<len; i++)
+        if (cmux_decoder_feed(dec, buf[i], frame))
+            frames++;
+    return frames;
+}
+
+START_TEST(test_cmux_encode)
+{
+    printf(":: test_cmux_encode\n");
+
+    /* Reference frames from TS 27.010 implementations. */
+    static const uint8_t sabm0[] = { 0xf9, 0x03, 0x3f, 0x01, 0x1c, 0xf9 };
+    static const uint8_t ua0[] = { 0xf9, 0x03, 0x73, 0x01, 0xd7, 0xf9 };
+    uint8_t buf[64];
+
+    ck_assert_int_eq(cmux_frame_encode(buf, sizeof(buf), 0, true, CMUX_SABM | CMUX_PF, NULL, 0), sizeof(sabm0));
+    ck_assert(!memcmp(buf, sabm0, sizeof(sabm0)));
+    ck_assert_int_eq(cmux_frame_encode(buf, sizeof(buf), 0, true, CMUX_UA | CMUX_PF, NULL, 0), sizeof(ua0));
+    ck_assert(!memcmp(buf, ua0, sizeof(ua0)));
+
+    /* Too small a buffer. */
+    ck_assert_int_eq(cmux_frame_encode(buf, 5, 0, true, CMUX_SABM, NULL, 0), 0);
+}
+END_TEST
+
+START_TEST(test_cmux_decode)
+{
+    printf(":: test_cmux_decode\n");
+
+    struct cmux_decoder dec;
+    struct cmux_frame frame;
+    cmux_decoder_init(&dec);
+
+    /* Two-byte length field, flag bytes inside the payload. */
+    uint8_t payload[300];
+    for (size_t i=0; i<sizeof(payload); i++)
+        payload[i] = (i % 7) ? i : 0xf9;
+    uint8_t buf[400];
+    size_t len = cmux_frame_encode(buf, sizeof(buf), 2, false, CMUX_UIH, payload, sizeof(payload));
+    ck_assert_int_eq(len, sizeof(payload) + 7);
+
+    ck_assert_int_eq(decode(&dec, buf, len, &frame), 1);
+    ck_assert_int_eq(frame.dlci, 2);
+    ck_assert(!frame.cr);
+    ck_assert_int_eq(frame.control, CMUX_UIH);
+    ck_assert_int_eq(frame.len, sizeof(payload));
+    ck_assert(!memcmp(frame.data, payload, sizeof(payload)));
+
+    /* Back-to-back frames sharing a flag, after some line noise. */
+    uint8_t stream[64] = { 0x00, 0x41, 0xf9 };
+    size_t used = 2;
+    used += cmux_frame_encode(stream + used, sizeof(stream) - used, 1, true, CMUX_UIH, "AT\r", 3) - 1;
+    used += cmux_frame_encode(stream + used, sizeof(stream) - used, 1, true, CMUX_UIH, "AT\r", 3);
+    ck_assert_int_eq(decode(&dec, stream, used, &frame), 2);
+    ck_assert_int_eq(frame.len, 3);
+    ck_assert(!memcmp(frame.data, "AT\r", 3));
+
+    /* A corrupted header is rejected; the next frame still decodes. */
+    size_t errors = dec.errors;
+    len = cmux_frame_encode(buf, sizeof(buf), 1, true, CMUX_UIH, "OK", 2);
+    buf[2] ^= 0x01;
+    ck_assert_int_eq(decode(&dec, buf, len, &frame), 0);
+    ck_assert_int_eq(dec.errors, errors + 1);
+    buf[2] ^= 0x01;
+    ck_assert_int_eq(decode(&dec, buf, len, &frame), 1);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("cmux");
+    tcase_add_test(tc, test_cmux_encode);
+    tcase_add_test(tc, test_cmux_decode);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
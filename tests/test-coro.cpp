@@ -0,0 +1,299 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include <attentive/at-coro.hpp>
+
+extern "C" {
+#include <attentive/at-unix.h>
+}
+
+using namespace attentive;
+
+#define SIM_PATH "tests/modem-sim"
+
+struct sim {
+    pid_t pid;
+    FILE *control;
+    char devpath[64];
+};
+
+static void sim_start(struct sim *sim, const char *model)
+{
+    int in[2], out[2];
+    ck_assert_int_eq(pipe(in), 0);
+    ck_assert_int_eq(pipe(out), 0);
+
+    sim->pid = fork();
+    ck_assert_int_ne(sim->pid, -1);
+    if (sim->pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[1]);
+        close(out[0]);
+        const char *argv[] = { SIM_PATH, "-m", model, NULL };
+        execv(SIM_PATH, (char **) argv);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    FILE *f = fdopen(out[0], "r");
+    ck_assert(f != NULL);
+    char line[128];
+    ck_assert(fgets(line, sizeof(line), f) != NULL);
+    ck_assert_int_eq(sscanf(line, "pty: %63s", sim->devpath), 1);
+    fclose(f);
+
+    sim->control = fdopen(in[1], "w");
+    ck_assert(sim->control != NULL);
+    setvbuf(sim->control, NULL, _IOLBF, 0);
+}
+
+static void sim_send(struct sim *sim, const char *line)
+{
+    fprintf(sim->control, "%s\n", line);
+}
+
+static void sim_stop(struct sim *sim)
+{
+    sim_send(sim, "quit");
+    fclose(sim->control);
+    waitpid(sim->pid, NULL, 0);
+}
+
+static struct at *channel_open(struct sim *sim)
+{
+    struct at *at = at_alloc_unix(sim->devpath, 0);
+    ck_assert(at != NULL);
+    ck_assert_int_eq(at_open(at), 0);
+    at_set_timeout(at, 2);
+
+    /* Disable echo; the first response may carry it. */
+    at_command(at, "ATE0");
+    const char *response = at_command(at, "ATE0");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "");
+    return at;
+}
+
+static task<std::string> query(channel &ch, std::string line)
+{
+    response r = co_await ch.command(std::move(line));
+    co_return std::string(r ? r.text() : "(failed)");
+}
+
+static task<void> count_query(channel &ch, std::atomic<int> &matches, std::atomic<int> &done)
+{
+    response r = co_await ch.command("AT+CGSN");
+    if (r && r.text() == "490154203237518")
+        matches++;
+    done++;
+}
+
+struct cancelled {
+    bool failed;
+    int error;
+    double waited;
+    std::string after;
+};
+
+static task<cancelled> cancel_query(channel &ch, std::stop_token stop)
+{
+    auto start = std::chrono::steady_clock::now();
+    response r = co_await ch.command("AT+CGMI", {}, stop);
+    std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+    cancelled result = { !r, errno, waited.count(), "" };
+    result.after = co_await query(ch, "AT+CSQ");
+    co_return result;
+}
+
+START_TEST(test_coro_commands)
+{
+    printf(":: test_coro_commands\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    at_executor *executor = at_executor_alloc(2);
+    ck_assert(executor != NULL);
+
+    {
+        channel ch(executor, at);
+        std::string csq = sync_wait(query(ch, "AT+CSQ"));
+        ck_assert_str_eq(csq.c_str(), "+CSQ: 20,0");
+
+        /* Many coroutines on one port, a couple of threads. */
+        const int count = 1000;
+        std::atomic<int> matches(0), done(0);
+        auto start = std::chrono::steady_clock::now();
+        for (int i=0; i<count; i++)
+            spawn(count_query(ch, matches, done));
+        for (int i=0; i<1000 && done < count; i++)
+            usleep(10000);
+        ck_assert_int_eq(done, count);
+        ck_assert_int_eq(matches, count);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("coroutines: %.0f commands/s\n", count / elapsed.count());
+
+        /* Stop tokens cancel commands in flight. */
+        sim_send(&sim, "latency +CGMI 2000");
+        usleep(50000);
+        std::stop_source source;
+        std::thread stopper([&source] {
+            usleep(100000);
+            source.request_stop();
+        });
+        cancelled result = sync_wait(cancel_query(ch, source.get_token()));
+        stopper.join();
+        ck_assert(result.failed);
+        ck_assert_int_eq(result.error, ECANCELED);
+        ck_assert(result.waited < 1.0);
+        ck_assert_str_eq(result.after.c_str(), "+CSQ: 20,0");
+
+        /* And before they start. */
+        std::string early = sync_wait([](channel &ch) -> task<std::string> {
+            std::stop_source source;
+            source.request_stop();
+            response r = co_await ch.command("AT+CSQ", {}, source.get_token());
+            co_return r ? "(answered)" : strerror(errno);
+        }(ch));
+        ck_assert_str_eq(early.c_str(), strerror(ECANCELED));
+    }
+
+    at_executor_free(executor);
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+struct echoed {
+    int imei;
+    bool connected;
+    ssize_t sent;
+    size_t received;
+    bool match;
+};
+
+static task<echoed> echo(channel &ch, modem &m)
+{
+    echoed result = {};
+    char imei[CELLULAR_IMEI_LENGTH+1];
+    result.imei = co_await m.imei(imei);
+    if (result.imei == 0 && strcmp(imei, "490154203237518"))
+        result.imei = -2;
+
+    socket sock = co_await m.connect(0, "example.com", 7);
+    result.connected = bool(sock);
+    if (!sock)
+        co_return result;
+
+    std::byte payload[500];
+    for (size_t i=0; i<sizeof(payload); i++)
+        payload[i] = std::byte('a' + i % 26);
+    result.sent = co_await sock.send(payload);
+
+    std::byte data[sizeof(payload)];
+    for (int tries=0; result.received < sizeof(data) && tries < 200; tries++) {
+        /* Reads must fit the parser buffer. */
+        size_t chunk = std::min<size_t>(sizeof(data) - result.received, 200);
+        ssize_t got = co_await sock.recv(std::span(data + result.received, chunk));
+        if (got < 0)
+            break;
+        result.received += got;
+        if (got == 0)
+            co_await ch.delay(5);
+    }
+    result.match = !memcmp(payload, data, sizeof(payload));
+
+    /* The socket closes on its way out. */
+    co_return result;
+}
+
+START_TEST(test_coro_socket)
+{
+    printf(":: test_coro_socket\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    sim_send(&sim, "reply +BT OK");
+    usleep(50000);
+    struct cellular *dev = cellular_sim800_alloc();
+    ck_assert(dev != NULL);
+    ck_assert_int_eq(cellular_attach(dev, at, "internet"), 0);
+    at_executor *executor = at_executor_alloc(2);
+    ck_assert(executor != NULL);
+
+    {
+        channel ch(executor, at);
+        modem m(ch, dev);
+        echoed result = sync_wait(echo(ch, m));
+        ck_assert_int_eq(result.imei, 0);
+        ck_assert(result.connected);
+        ck_assert_int_eq(result.sent, 500);
+        ck_assert_int_eq(result.received, 500);
+        ck_assert(result.match);
+
+        /* The handle's close went first; the id is free again. */
+        ck_assert(sync_wait([](modem &m) -> task<bool> {
+            socket sock = co_await m.connect(0, "example.com", 7);
+            if (!sock)
+                co_return false;
+            int result = co_await sock.close();
+            co_return result == 0;
+        }(m)));
+    }
+
+    at_executor_free(executor);
+    cellular_detach(dev);
+    cellular_sim800_free(dev);
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("coro");
+    tcase_set_timeout(tc, 30);
+    tcase_add_test(tc, test_coro_commands);
+    tcase_add_test(tc, test_coro_socket);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    signal(SIGPIPE, SIG_IGN);
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,218 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include <attentive/at-executor.h>
+
+
+#define STRANDS 8
+#define ITEMS 2000
+
+struct channel {
+    struct at_strand *strand;
+    int next;               /* Next item expected; only touched by work. */
+    int misordered;
+    int running;            /* Work items of this strand running. Atomic. */
+    int overlapped;
+};
+
+static void check_order(void *arg, struct at_buf *buf)
+{
+    struct channel *channel = arg;
+
+    if (__atomic_add_fetch(&channel->running, 1, __ATOMIC_SEQ_CST) > 1)
+        channel->overlapped++;
+    int item = atoi(buf->data);
+    if (item != channel->next)
+        channel->misordered++;
+    channel->next = item + 1;
+    __atomic_sub_fetch(&channel->running, 1, __ATOMIC_SEQ_CST);
+}
+
+START_TEST(test_executor_order)
+{
+    printf(":: test_executor_order\n");
+
+    struct at_executor *executor = at_executor_alloc(4);
+    ck_assert(executor != NULL);
+    struct at_buf_pool *pool = at_buf_pool_alloc(16, 0);
+    ck_assert(pool != NULL);
+
+    struct channel channels[STRANDS];
+    memset(channels, 0, sizeof(channels));
+    for (int i=0; i<STRANDS; i++) {
+        channels[i].strand = at_strand_alloc(executor);
+        ck_assert(channels[i].strand != NULL);
+    }
+
+    /* Work runs in posting order, one item at a time per strand. */
+    for (int n=0; n<ITEMS; n++) {
+        for (int i=0; i<STRANDS; i++) {
+            struct at_buf *buf = at_buf_acquire(pool);
+            ck_assert(buf != NULL);
+            buf->len = snprintf(buf->data, 16, "%d", n);
+            ck_assert_int_eq(at_strand_post(channels[i].strand, check_order, &channels[i], buf), 0);
+        }
+    }
+
+    for (int i=0; i<STRANDS; i++) {
+        at_strand_free(channels[i].strand);
+        ck_assert_int_eq(channels[i].next, ITEMS);
+        ck_assert_int_eq(channels[i].misordered, 0);
+        ck_assert_int_eq(channels[i].overlapped, 0);
+    }
+
+    struct at_executor_stats stats;
+    at_executor_get_stats(executor, &stats);
+    ck_assert_int_eq(stats.posted, STRANDS * ITEMS);
+    ck_assert_int_eq(stats.executed, STRANDS * ITEMS);
+
+    at_executor_free(executor);
+    at_buf_pool_free(pool);
+}
+END_TEST
+
+static volatile int fast_done;
+
+static void slow_work(void *arg, struct at_buf *buf)
+{
+    (void) arg;
+    (void) buf;
+    usleep(200000);
+}
+
+static void fast_work(void *arg, struct at_buf *buf)
+{
+    (void) arg;
+    (void) buf;
+    __atomic_add_fetch(&fast_done, 1, __ATOMIC_SEQ_CST);
+}
+
+START_TEST(test_executor_parallel)
+{
+    printf(":: test_executor_parallel\n");
+
+    struct at_executor *executor = at_executor_alloc(2);
+    ck_assert(executor != NULL);
+    struct at_strand *slow = at_strand_alloc(executor);
+    struct at_strand *fast = at_strand_alloc(executor);
+    fast_done = 0;
+
+    /* A strand stuck in slow work doesn't hold up the other one. */
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<5; i++)
+        ck_assert_int_eq(at_strand_post(slow, slow_work, NULL, NULL), 0);
+    for (int i=0; i<100; i++)
+        ck_assert_int_eq(at_strand_post(fast, fast_work, NULL, NULL), 0);
+    at_strand_free(fast);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    ck_assert_int_eq(fast_done, 100);
+    ck_assert(seconds < 0.5);
+
+    /* Freeing a strand waits for its queued work. */
+    at_strand_free(slow);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    ck_assert(seconds >= 1.0);
+
+    at_executor_free(executor);
+}
+END_TEST
+
+struct fanout {
+    struct at_strand *strands[STRANDS];
+    int counts[STRANDS];
+};
+
+static void count_work(void *arg, struct at_buf *buf)
+{
+    (void) buf;
+    int *count = arg;
+    (*count)++;
+}
+
+static void fanout_work(void *arg, struct at_buf *buf)
+{
+    (void) buf;
+    struct fanout *fanout = arg;
+
+    /* Work posted from a worker lands in its own deque; while this one is
+     * busy, idle workers have to steal it. */
+    for (int n=0; n<100; n++)
+        for (int i=0; i<STRANDS; i++)
+            at_strand_post(fanout->strands[i], count_work, &fanout->counts[i], NULL);
+    usleep(100000);
+}
+
+START_TEST(test_executor_steal)
+{
+    printf(":: test_executor_steal\n");
+
+    struct at_executor *executor = at_executor_alloc(4);
+    ck_assert(executor != NULL);
+    struct fanout fanout;
+    memset(&fanout, 0, sizeof(fanout));
+    for (int i=0; i<STRANDS; i++)
+        fanout.strands[i] = at_strand_alloc(executor);
+    struct at_strand *origin = at_strand_alloc(executor);
+
+    ck_assert_int_eq(at_strand_post(origin, fanout_work, &fanout, NULL), 0);
+    at_strand_free(origin);
+    for (int i=0; i<STRANDS; i++) {
+        at_strand_free(fanout.strands[i]);
+        ck_assert_int_eq(fanout.counts[i], 100);
+    }
+
+    struct at_executor_stats stats;
+    at_executor_get_stats(executor, &stats);
+    ck_assert_int_ge(stats.steals, 1);
+    ck_assert_int_eq(stats.executed, 1 + STRANDS * 100);
+
+    at_executor_free(executor);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("executor");
+    tcase_set_timeout(tc, 30);
+    tcase_add_test(tc, test_executor_order);
+    tcase_add_test(tc, test_executor_parallel);
+    tcase_add_test(tc, test_executor_steal);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
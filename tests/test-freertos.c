@@ -0,0 +1,367 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * The FreeRTOS port, built against the pthread shim in tests/freertos and
+ * run against the modem simulator.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include <attentive/at-freertos.h>
+
+#include "FreeRTOS.h"
+#include "FreeRTOS_IO.h"
+
+
+#define SIM_PATH "tests/modem-sim"
+
+struct sim {
+    pid_t pid;
+    FILE *control;
+    char devpath[64];
+};
+
+/**
+ * Spawn the simulator and point the board UART at its pty.
+ */
+static void sim_start(struct sim *sim, const char *model)
+{
+    int in[2], out[2];
+    ck_assert_int_eq(pipe(in), 0);
+    ck_assert_int_eq(pipe(out), 0);
+
+    sim->pid = fork();
+    ck_assert_int_ne(sim->pid, -1);
+    if (sim->pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[1]);
+        close(out[0]);
+        execl(SIM_PATH, SIM_PATH, "-m", model, NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    FILE *f = fdopen(out[0], "r");
+    ck_assert(f != NULL);
+    char line[128];
+    ck_assert(fgets(line, sizeof(line), f) != NULL);
+    ck_assert_int_eq(sscanf(line, "pty: %63s", sim->devpath), 1);
+    fclose(f);
+
+    sim->control = fdopen(in[1], "w");
+    ck_assert(sim->control != NULL);
+    setvbuf(sim->control, NULL, _IOLBF, 0);
+
+    freertos_shim_uart_path = sim->devpath;
+}
+
+static void sim_send(struct sim *sim, const char *line)
+{
+    fprintf(sim->control, "%s\n", line);
+}
+
+static void sim_stop(struct sim *sim)
+{
+    sim_send(sim, "quit");
+    fclose(sim->control);
+    waitpid(sim->pid, NULL, 0);
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static char urc_seen[128];
+
+static void handle_urc(const char *line, size_t len, void *arg)
+{
+    /* In the reader task, which holds the channel lock already. */
+    if (arg && !strcmp(line, "+CIEV: 1,9"))
+        at_send(arg, "AT");
+    snprintf(urc_seen, sizeof(urc_seen), "%.*s", (int) len, line);
+}
+
+static enum at_response_type scan_line(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    if (!strncmp(line, "+CIEV: ", 7))
+        return AT_RESPONSE_URC;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static const struct at_callbacks callbacks = {
+    .scan_line = scan_line,
+    .handle_urc = handle_urc,
+};
+
+static struct at *channel_open(void)
+{
+    struct at *at = at_alloc_freertos();
+    ck_assert(at != NULL);
+    ck_assert_int_eq(at_open(at), 0);
+    at_set_callbacks(at, &callbacks, NULL);
+    at_set_timeout(at, 2);
+
+    /* Disable echo; the first response may carry it. */
+    at_command(at, "ATE0");
+    const char *response = at_command(at, "ATE0");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "");
+    return at;
+}
+
+START_TEST(test_freertos_basic)
+{
+    printf(":: test_freertos_basic\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open();
+
+    const char *response = at_command(at, "AT+CGSN");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "490154203237518");
+
+    response = at_command(at, "AT+CREG?;+CSQ");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "+CREG: 0,1\n+CSQ: 20,0");
+
+    /* Injected URCs reach the URC handler. */
+    urc_seen[0] = '\0';
+    sim_send(&sim, "urc +CIEV: 1,3");
+    for (int i=0; i<100 && strcmp(urc_seen, "+CIEV: 1,3"); i++)
+        usleep(10000);
+    ck_assert_str_eq(urc_seen, "+CIEV: 1,3");
+
+    /* Reads come in chunks, not bytes. */
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    ck_assert_int_gt(stats.rx_bytes, 0);
+    ck_assert_int_eq(stats.commands, 4);
+    ck_assert_int_eq(stats.urcs, 1);
+
+    /* Sends go out from callbacks and from other tasks alike. */
+    at_set_callbacks(at, &callbacks, at);
+    unsigned long tx_bytes = stats.tx_bytes;
+    sim_send(&sim, "urc +CIEV: 1,9");
+    for (int i=0; i<100 && stats.tx_bytes == tx_bytes; i++) {
+        usleep(10000);
+        at_get_stats(at, &stats);
+    }
+    ck_assert_int_eq(stats.tx_bytes, tx_bytes + strlen("AT\r"));
+    ck_assert(at_send(at, "AT"));
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.tx_bytes, tx_bytes + 2 * strlen("AT\r"));
+    /* Let the answers go by before the next command. */
+    usleep(100000);
+    response = at_command(at, "AT+CSQ");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "+CSQ: 20,0");
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_freertos_timeout)
+{
+    printf(":: test_freertos_timeout\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open();
+
+    /* The deadline is kept to the tick, not rounded to whole-second waits. */
+    sim_send(&sim, "fault +CGMI drop 1.0");
+    at_command(at, "AT");
+    at_set_timeout(at, 1);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(at_command(at, "AT+CGMI") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    double seconds = elapsed(&start);
+    ck_assert(seconds >= 0.99);
+    ck_assert(seconds < 1.3);
+
+    /* The channel recovers. */
+    sim_send(&sim, "fault +CGMI drop 0");
+    ck_assert(at_command(at, "AT") != NULL);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+static void *pending_command(void *arg)
+{
+    struct at *at = arg;
+    const char *response = at_command(at, "AT+CGMI");
+    return (void *) (intptr_t) (response ? 0 : errno);
+}
+
+START_TEST(test_freertos_close)
+{
+    printf(":: test_freertos_close\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open();
+
+    /* Closing fails a pending command without waiting for its timeout. */
+    sim_send(&sim, "fault +CGMI drop 1.0");
+    at_command(at, "AT");
+    at_set_timeout(at, 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, pending_command, at);
+    usleep(100000);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_int_eq(at_close(at), 0);
+    void *result;
+    pthread_join(thread, &result);
+    ck_assert_int_eq((intptr_t) result, ENODEV);
+    ck_assert(elapsed(&start) < 0.5);
+
+    ck_assert(at_command(at, "AT") == NULL);
+    ck_assert_int_eq(errno, ENODEV);
+
+    /* Reopening brings the reader back. */
+    sim_send(&sim, "fault +CGMI drop 0");
+    at_set_timeout(at, 2);
+    ck_assert_int_eq(at_open(at), 0);
+    ck_assert(at_command(at, "AT") != NULL);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+static void *cancel_later(void *arg)
+{
+    usleep(200000);
+    at_cancel(arg);
+    return NULL;
+}
+
+START_TEST(test_freertos_budget)
+{
+    printf(":: test_freertos_budget\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open();
+    at_set_timeout(at, 10);
+
+    /* The deadline wins over a longer timeout. */
+    sim_send(&sim, "latency +CSQ 2000");
+    at_command(at, "AT");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    at_set_deadline(at, at_now(at) + 300000000);
+    ck_assert(at_command(at, "AT+CSQ") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert(elapsed(&start) < 1.0);
+    at_set_deadline(at, 0);
+
+    /* Cancellation wakes up a sleeping task. */
+    struct at_cancel token = {0};
+    at_set_cancel(at, &token);
+    pthread_t thread;
+    pthread_create(&thread, NULL, cancel_later, &token);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_int_eq(at_delay(at, 5000), -1);
+    ck_assert_int_eq(errno, ECANCELED);
+    ck_assert(elapsed(&start) < 1.0);
+    pthread_join(thread, NULL);
+    ck_assert(at_command(at, "AT") == NULL);
+    ck_assert_int_eq(errno, ECANCELED);
+
+    /* Back in business, past the late answer. */
+    at_set_cancel(at, NULL);
+    const char *response = at_command(at, "AT+CGMI");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "SIMCOM_Ltd");
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_freertos_throughput)
+{
+    printf(":: test_freertos_throughput\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open();
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rounds = 200;
+    for (int i=0; i<rounds; i++) {
+        const char *response = at_command(at, "AT+CSQ");
+        ck_assert(response != NULL);
+        ck_assert_str_eq(response, "+CSQ: 20,0");
+    }
+    printf("freertos: %.0f commands/s\n", rounds / elapsed(&start));
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("freertos");
+    tcase_set_timeout(tc, 30);
+    tcase_add_test(tc, test_freertos_basic);
+    tcase_add_test(tc, test_freertos_timeout);
+    tcase_add_test(tc, test_freertos_close);
+    tcase_add_test(tc, test_freertos_budget);
+    tcase_add_test(tc, test_freertos_throughput);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    signal(SIGPIPE, SIG_IGN);
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
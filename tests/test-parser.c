@@ -6,6 +6,7 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,6 +16,7 @@
 #include <glib.h>
 
 #include <attentive/parser.h>
+#include <attentive/at-stats.h>
 
 
 #define STR_LEN(s) s, strlen(s)
@@ -304,6 +306,291 @@ START_TEST(test_parser_dataprompt)
 }
 END_TEST
 
+static enum at_response_type creg_scanner(const char *line, size_t len, void *priv)
+{
+    (void) len;
+    (void) priv;
+
+    if (!strncmp(line, "+CREG:", 6))
+        return AT_RESPONSE_URC;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+START_TEST(test_parser_sentinel)
+{
+    printf(":: test_parser_sentinel\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = creg_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* A late answer, final response included, goes nowhere... */
+    at_parser_await_response(parser);
+    at_parser_expect_sentinel(parser, "042");
+    at_parser_feed(parser, STR_LEN("\r\nSIMCOM_Ltd\r\n\r\nOK\r\n"));
+    expect_nothing();
+
+    /* ...URCs still get through, and the sentinel's OK ends the command. */
+    expect_urc("+CREG: 1");
+    expect_response("");
+    at_parser_feed(parser, STR_LEN("\r\n+CREG: 1\r\n\r\n042\r\n\r\nOK\r\n"));
+    expect_nothing();
+
+    /* Next command is back to normal. */
+    at_parser_await_response(parser);
+    expect_response("042");
+    at_parser_feed(parser, STR_LEN("\r\n042\r\n\r\nOK\r\n"));
+    expect_nothing();
+
+    /* An error in place of the sentinel ends the command. */
+    at_parser_await_response(parser);
+    at_parser_expect_sentinel(parser, "043");
+    expect_response("+CME ERROR: 3");
+    at_parser_feed(parser, STR_LEN("\r\n+CME ERROR: 3\r\n"));
+    expect_nothing();
+
+    at_parser_free(parser);
+}
+END_TEST
+
+static struct at_parser *stream_parser;
+static char stream_data[64];
+static size_t stream_len;
+
+static size_t stream_handler(const void *data, size_t len, void *priv)
+{
+    (void) priv;
+
+    /* '#' ends the stream in this test. */
+    for (size_t i=0; i<len; i++) {
+        stream_data[stream_len++] = ((const char *) data)[i];
+        if (((const char *) data)[i] == '#') {
+            at_parser_set_stream_handler(stream_parser, NULL);
+            return i+1;
+        }
+    }
+    return len;
+}
+
+static void stream_urc(const char *line, size_t len, void *priv)
+{
+    handle_urc(line, len, priv);
+    if (!strcmp(line, "CONNECT"))
+        at_parser_set_stream_handler(stream_parser, stream_handler);
+}
+
+static enum at_response_type stream_scanner(const char *line, size_t len, void *priv)
+{
+    (void) len;
+    (void) priv;
+
+    if (!strcmp(line, "CONNECT"))
+        return AT_RESPONSE_URC;
+
+    return AT_RESPONSE_UNKNOWN;
+}
+
+START_TEST(test_parser_stream)
+{
+    printf(":: test_parser_stream\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = stream_urc,
+        .scan_line = stream_scanner,
+    };
+    stream_parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(stream_parser != NULL);
+    stream_len = 0;
+
+    expect_prepare();
+
+    /* Switch in and out of stream mode in the middle of a buffer. */
+    expect_response("");
+    expect_urc("CONNECT");
+    expect_urc("RING");
+    at_parser_await_response(stream_parser);
+    at_parser_feed(stream_parser, STR_LEN("\r\nOK\r\n\r\nCONNECT\r\nOK\r\nab"));
+    at_parser_feed(stream_parser, STR_LEN("\r\ncd#\r\nRING\r\n"));
+    expect_nothing();
+    ck_assert_int_eq(stream_len, 11);
+    ck_assert(!memcmp(stream_data, "OK\r\nab\r\ncd#", 11));
+
+    at_parser_free(stream_parser);
+}
+END_TEST
+
+static struct at_parser *take_parser;
+static struct at_buf *taken[8];
+static int taken_count;
+
+static void take_response(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+
+    taken[taken_count++] = at_parser_take_response(take_parser);
+}
+
+START_TEST(test_parser_take)
+{
+    printf(":: test_parser_take\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = take_response,
+        .handle_urc = handle_urc,
+    };
+    take_parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(take_parser != NULL);
+    taken_count = 0;
+
+    expect_prepare();
+
+    /* Taken responses survive whatever the parser does next. */
+    expect_urc("RING");
+    at_parser_await_response(take_parser);
+    at_parser_feed(take_parser, STR_LEN("first\r\nOK\r\nRING\r\n"));
+    at_parser_await_response(take_parser);
+    at_parser_feed(take_parser, STR_LEN("second\r\nERROR\r\n"));
+    at_parser_await_response(take_parser);
+    at_parser_feed(take_parser, STR_LEN("OK\r\n"));
+    expect_nothing();
+
+    ck_assert_int_eq(taken_count, 3);
+    ck_assert_str_eq(taken[0]->data, "first");
+    ck_assert_int_eq(taken[0]->len, 5);
+    ck_assert_str_eq(taken[1]->data, "second\nERROR");
+    ck_assert_int_eq(taken[1]->len, 12);
+    ck_assert_str_eq(taken[2]->data, "");
+    ck_assert_int_eq(taken[2]->len, 0);
+
+    /* Extra references keep a buffer out of the pool. */
+    struct at_buf *held = at_buf_ref(taken[1]);
+    for (int i=0; i<3; i++)
+        at_buf_release(taken[i]);
+    ck_assert_str_eq(held->data, "second\nERROR");
+
+    /* Released buffers are reused. */
+    for (int i=0; i<100; i++) {
+        taken_count = 0;
+        at_parser_await_response(take_parser);
+        at_parser_feed(take_parser, STR_LEN("again\r\nOK\r\n"));
+        ck_assert_int_eq(taken_count, 1);
+        ck_assert(taken[0] != held);
+        ck_assert_str_eq(taken[0]->data, "again");
+        at_buf_release(taken[0]);
+    }
+    ck_assert_str_eq(held->data, "second\nERROR");
+
+    /* Buffers may outlive the parser. */
+    at_parser_free(take_parser);
+    ck_assert_str_eq(held->data, "second\nERROR");
+    at_buf_release(held);
+}
+END_TEST
+
+START_TEST(test_buf_pool)
+{
+    printf(":: test_buf_pool\n");
+
+    struct at_buf_pool *pool = at_buf_pool_alloc(32, 2);
+    ck_assert(pool != NULL);
+    ck_assert_int_eq(at_buf_pool_size(pool), 32);
+    ck_assert_int_eq(at_buf_pool_count(pool), 2);
+
+    /* The pool grows instead of running dry. */
+    struct at_buf *bufs[4];
+    for (int i=0; i<4; i++) {
+        bufs[i] = at_buf_acquire(pool);
+        ck_assert(bufs[i] != NULL);
+        ck_assert_int_eq(bufs[i]->len, 0);
+        ck_assert_str_eq(bufs[i]->data, "");
+    }
+    ck_assert_int_eq(at_buf_pool_count(pool), 4);
+
+    /* ...and reuses what comes back. */
+    at_buf_release(bufs[2]);
+    ck_assert(at_buf_acquire(pool) == bufs[2]);
+    ck_assert_int_eq(at_buf_pool_count(pool), 4);
+
+    at_buf_pool_free(pool);
+    for (int i=0; i<4; i++)
+        at_buf_release(bufs[i]);
+}
+END_TEST
+
+START_TEST(test_parser_urc_policy)
+{
+    printf(":: test_parser_urc_policy\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+    struct at_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    at_parser_set_stats(parser, &stats);
+
+    const uint64_t window = 3600000000000ULL;
+    ck_assert_int_eq(at_parser_set_urc_policy(parser, "+CIEV:", AT_URC_COALESCE, window), 0);
+    ck_assert_int_eq(at_parser_set_urc_policy(parser, "+CSQN:", AT_URC_RATE_LIMIT, window), 0);
+    ck_assert_int_eq(at_parser_set_urc_policy(parser, "+CTZV:", AT_URC_DROP, 0), 0);
+    ck_assert_int_eq(at_parser_set_urc_policy(parser, "", AT_URC_DROP, 0), -1);
+    ck_assert_int_eq(errno, EINVAL);
+
+    expect_prepare();
+
+    /* The first of a burst goes through, the last is held. */
+    expect_urc("+CIEV: 2,1");
+    expect_urc("+CSQN: 10");
+    expect_urc("RING");
+    at_parser_feed(parser, STR_LEN("+CIEV: 2,1\r\n+CSQN: 10\r\n+CTZV: 8\r\n"));
+    at_parser_feed(parser, STR_LEN("+CIEV: 2,2\r\n+CSQN: 11\r\n+CIEV: 2,3\r\nRING\r\n"));
+    expect_nothing();
+
+    /* Nothing is due until the window is over. */
+    uint64_t now = at_stats_clock_ns();
+    uint64_t due = at_parser_flush_urcs(parser, now);
+    ck_assert(due > now && due != UINT64_MAX);
+    expect_urc("+CIEV: 2,3");
+    ck_assert_int_eq(at_parser_flush_urcs(parser, due), UINT64_MAX);
+    expect_nothing();
+
+    ck_assert_int_eq(stats.urcs + stats.unexpected, 7);
+    ck_assert_int_eq(stats.urcs_coalesced, 1);
+    ck_assert_int_eq(stats.urcs_limited, 1);
+    ck_assert_int_eq(stats.urcs_dropped, 1);
+
+    /* Lifting a policy passes everything on again. */
+    ck_assert_int_eq(at_parser_set_urc_policy(parser, "+CSQN:", AT_URC_DELIVER, 0), 0);
+    expect_urc("+CSQN: 12");
+    expect_urc("+CSQN: 13");
+    at_parser_feed(parser, STR_LEN("+CSQN: 12\r\n+CSQN: 13\r\n"));
+    expect_nothing();
+
+    /* Slots run out. */
+    char prefix[16];
+    int result = 0;
+    for (int i=0; i<AT_PARSER_URC_POLICIES && result == 0; i++) {
+        sprintf(prefix, "+X%d:", i);
+        result = at_parser_set_urc_policy(parser, prefix, AT_URC_DROP, 0);
+    }
+    ck_assert_int_eq(result, -1);
+    ck_assert_int_eq(errno, ENOSPC);
+
+    at_parser_free(parser);
+}
+END_TEST
+
 Suite *attentive_suite(void)
 {
     Suite *s = suite_create("attentive");
@@ -318,6 +605,11 @@ Suite *attentive_suite(void)
     tcase_add_test(tc, test_parser_rawdata);
     tcase_add_test(tc, test_parser_hexdata);
     tcase_add_test(tc, test_parser_dataprompt);
+    tcase_add_test(tc, test_parser_sentinel);
+    tcase_add_test(tc, test_parser_stream);
+    tcase_add_test(tc, test_parser_take);
+    tcase_add_test(tc, test_parser_urc_policy);
+    tcase_add_test(tc, test_buf_pool);
     suite_add_tcase(s, tc);
 
     return s;
@@ -0,0 +1,138 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <attentive/ring.h>
+
+
+START_TEST(test_ring_basic)
+{
+    printf(":: test_ring_basic\n");
+
+    uint8_t storage[8];
+    struct at_ring ring;
+    at_ring_init(&ring, storage, sizeof(storage));
+
+    char buf[16];
+    ck_assert_int_eq(at_ring_read(&ring, buf, sizeof(buf)), 0);
+
+    /* Wrap around the end of the storage. */
+    ck_assert_int_eq(at_ring_write(&ring, "abcdef", 6), 6);
+    ck_assert_int_eq(at_ring_read(&ring, buf, 4), 4);
+    ck_assert(!memcmp(buf, "abcd", 4));
+    ck_assert_int_eq(at_ring_write(&ring, "ghijkl", 6), 6);
+    ck_assert_int_eq(at_ring_used(&ring), 8);
+    ck_assert_int_eq(at_ring_read(&ring, buf, sizeof(buf)), 8);
+    ck_assert(!memcmp(buf, "efghijkl", 8));
+
+    /* Overflow is dropped and counted. */
+    ck_assert_int_eq(at_ring_write(&ring, "0123456789", 10), 8);
+    ck_assert_int_eq(at_ring_write(&ring, "x", 1), 0);
+
+    struct at_ring_stats stats;
+    at_ring_get_stats(&ring, &stats);
+    ck_assert_int_eq(stats.size, 8);
+    ck_assert_int_eq(stats.used, 8);
+    ck_assert_int_eq(stats.high_water, 8);
+    ck_assert_int_eq(stats.overruns, 3);
+    ck_assert_int_eq(stats.total, 20);
+
+    at_ring_flush(&ring);
+    ck_assert_int_eq(at_ring_used(&ring), 0);
+}
+END_TEST
+
+#define STRESS_BYTES (1024 * 1024)
+
+static void *stress_producer(void *arg)
+{
+    struct at_ring *ring = arg;
+    uint8_t chunk[97];
+    size_t sent = 0;
+
+    while (sent < STRESS_BYTES) {
+        size_t len = sizeof(chunk) < STRESS_BYTES - sent ? sizeof(chunk) : STRESS_BYTES - sent;
+        for (size_t i=0; i<len; i++)
+            chunk[i] = (uint8_t) ((sent + i) * 7);
+        /* Only push what fits, so nothing is dropped. */
+        size_t space = ring->size - at_ring_used(ring);
+        if (len > space)
+            len = space;
+        if (!len)
+            sched_yield();
+        sent += at_ring_write(ring, chunk, len);
+    }
+
+    return NULL;
+}
+
+START_TEST(test_ring_threads)
+{
+    printf(":: test_ring_threads\n");
+
+    static uint8_t storage[1024];
+    struct at_ring ring;
+    at_ring_init(&ring, storage, sizeof(storage));
+
+    pthread_t producer;
+    pthread_create(&producer, NULL, stress_producer, &ring);
+
+    size_t received = 0;
+    while (received < STRESS_BYTES) {
+        uint8_t buf[61];
+        size_t len = at_ring_read(&ring, buf, sizeof(buf));
+        if (!len)
+            sched_yield();
+        for (size_t i=0; i<len; i++)
+            ck_assert_int_eq(buf[i], (uint8_t) ((received + i) * 7));
+        received += len;
+    }
+    pthread_join(producer, NULL);
+
+    struct at_ring_stats stats;
+    at_ring_get_stats(&ring, &stats);
+    ck_assert_int_eq(stats.overruns, 0);
+    ck_assert_int_eq(stats.total, STRESS_BYTES);
+    ck_assert_int_le(stats.high_water, sizeof(storage));
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("ring");
+    tcase_add_test(tc, test_ring_basic);
+    tcase_add_test(tc, test_ring_threads);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
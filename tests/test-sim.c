@@ -0,0 +1,2092 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include <attentive/at-batch.h>
+#include <attentive/at-broker.h>
+#include <attentive/at-clock.h>
+#include <attentive/at-executor.h>
+#include <attentive/at-unix.h>
+#include <attentive/cellular.h>
+#include <attentive/cmux.h>
+#include <attentive/ring.h>
+
+
+#define SIM_PATH "tests/modem-sim"
+
+struct sim {
+    pid_t pid;
+    FILE *control;
+    char devpath[64];       /**< pty path, or TCP port with a transport. */
+    char auxpath[64];       /**< Second pty, with sim_spawn_aux(). */
+};
+
+/**
+ * Spawn the simulator and learn its pty path, or its TCP port if it serves
+ * the given transport ("raw" or "rfc2217"), and the path of its aux pty.
+ */
+static void sim_spawn_aux(struct sim *sim, const char *model, const char *transport, bool aux)
+{
+    int in[2], out[2];
+    ck_assert_int_eq(pipe(in), 0);
+    ck_assert_int_eq(pipe(out), 0);
+
+    sim->pid = fork();
+    ck_assert_int_ne(sim->pid, -1);
+    if (sim->pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[1]);
+        close(out[0]);
+        const char *argv[8] = { SIM_PATH, "-m", model };
+        int argc = 3;
+        if (transport) {
+            argv[argc++] = "-t";
+            argv[argc++] = transport;
+        }
+        if (aux)
+            argv[argc++] = "-a";
+        execv(SIM_PATH, (char **) argv);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    FILE *f = fdopen(out[0], "r");
+    ck_assert(f != NULL);
+    char line[128];
+    ck_assert(fgets(line, sizeof(line), f) != NULL);
+    ck_assert_int_eq(sscanf(line, transport ? "tcp: %63s" : "pty: %63s", sim->devpath), 1);
+    if (aux) {
+        ck_assert(fgets(line, sizeof(line), f) != NULL);
+        ck_assert_int_eq(sscanf(line, "aux: %63s", sim->auxpath), 1);
+    }
+    fclose(f);
+
+    sim->control = fdopen(in[1], "w");
+    ck_assert(sim->control != NULL);
+    setvbuf(sim->control, NULL, _IOLBF, 0);
+}
+
+static void sim_spawn(struct sim *sim, const char *model, const char *transport)
+{
+    sim_spawn_aux(sim, model, transport, false);
+}
+
+static void sim_start(struct sim *sim, const char *model)
+{
+    sim_spawn(sim, model, NULL);
+}
+
+static void sim_send(struct sim *sim, const char *line)
+{
+    fprintf(sim->control, "%s\n", line);
+}
+
+static void sim_stop(struct sim *sim)
+{
+    sim_send(sim, "quit");
+    fclose(sim->control);
+    waitpid(sim->pid, NULL, 0);
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static char urc_seen[128];
+
+static void handle_urc(const char *line, size_t len, void *arg)
+{
+    (void) arg;
+    snprintf(urc_seen, sizeof(urc_seen), "%.*s", (int) len, line);
+}
+
+static enum at_response_type scan_line(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    if (!strncmp(line, "+CIPRXGET: 1,", 13) || !strncmp(line, "SRING: ", 7) ||
+        !strncmp(line, "+CIEV: ", 7) || strstr(line, ", CONNECT OK"))
+        return AT_RESPONSE_URC;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static const struct at_callbacks callbacks = {
+    .scan_line = scan_line,
+    .handle_urc = handle_urc,
+};
+
+static enum at_response_type scanner_ciprxget(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    int confirmed;
+    if (sscanf(line, "+CIPRXGET: 2,%*d,%*d,%d", &confirmed) == 1 && confirmed > 0)
+        return AT_RESPONSE_RAWDATA_FOLLOWS(confirmed);
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static enum at_response_type scanner_cipsend(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    if (strstr(line, ", SEND OK"))
+        return AT_RESPONSE_FINAL_OK;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static enum at_response_type scanner_cipclose(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    if (strstr(line, ", CLOSE OK"))
+        return AT_RESPONSE_FINAL;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static enum at_response_type scanner_cifsr(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    int ip[4];
+    if (sscanf(line, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]) == 4)
+        return AT_RESPONSE_FINAL_OK;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static struct at *channel_open_path(const char *devpath)
+{
+    struct at *at = at_alloc_unix(devpath, 0);
+    ck_assert(at != NULL);
+    ck_assert_int_eq(at_open(at), 0);
+    at_set_callbacks(at, &callbacks, NULL);
+    at_set_timeout(at, 2);
+
+    /* Disable echo; the first response may carry it. */
+    at_command(at, "ATE0");
+    const char *response = at_command(at, "ATE0");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "");
+    return at;
+}
+
+static struct at *channel_open(struct sim *sim)
+{
+    return channel_open_path(sim->devpath);
+}
+
+START_TEST(test_sim_basic)
+{
+    printf(":: test_sim_basic\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+
+    struct at_trace *trace = at_trace_alloc("sim800", 64);
+    at_set_trace(at, trace);
+
+    const char *response = at_command(at, "AT+CGSN");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "490154203237518");
+
+    /* The command is traced from TX to response. */
+    struct at_trace_event events[64];
+    size_t count = at_trace_snapshot(trace, events, 64);
+    ck_assert_int_eq(count, 5);
+    ck_assert_int_eq(events[0].type, AT_TRACE_COMMAND);
+    ck_assert(!memcmp(events[0].text, "AT+CGSN", 7));
+    ck_assert_int_eq(events[1].type, AT_TRACE_RX);
+    ck_assert_int_eq(events[2].type, AT_TRACE_LINE);
+    ck_assert_int_eq(events[2].arg, AT_RESPONSE_INTERMEDIATE);
+    ck_assert_int_eq(events[3].type, AT_TRACE_LINE);
+    ck_assert_int_eq(events[3].arg, AT_RESPONSE_FINAL_OK);
+    ck_assert_int_eq(events[4].type, AT_TRACE_RESPONSE);
+    ck_assert(events[4].timestamp >= events[0].timestamp);
+    at_set_trace(at, NULL);
+    at_trace_free(trace);
+
+    response = at_command(at, "AT+CREG?;+CSQ");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "+CREG: 0,1\n+CSQ: 20,0");
+
+    response = at_command(at, "AT+NOSUCHTHING");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "ERROR");
+
+    /* Injected URCs reach the URC handler. */
+    sim_send(&sim, "urc +CIEV: 1,3");
+    for (int i=0; i<100 && strcmp(urc_seen, "+CIEV: 1,3"); i++)
+        usleep(10000);
+    ck_assert_str_eq(urc_seen, "+CIEV: 1,3");
+
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.urcs, 1);
+    ck_assert_int_eq(stats.urcs_used, 1);
+    ck_assert_str_eq(stats.urc_classes[0].name, "+CIEV");
+    ck_assert_int_eq(stats.urc_classes[0].count, 1);
+    ck_assert_int_eq(stats.handle_urc_calls, 1);
+    ck_assert_int_ge(stats.scan_line_calls, stats.lines);
+
+    /* A burst is coalesced; its last line still arrives, a bit later. */
+    ck_assert_int_eq(at_set_urc_policy(at, "+CIEV:", AT_URC_COALESCE, 200), 0);
+    for (int i=1; i<=5; i++) {
+        char line[32];
+        sprintf(line, "urc +CIEV: 2,%d", i);
+        sim_send(&sim, line);
+    }
+    for (int i=0; i<100 && strcmp(urc_seen, "+CIEV: 2,5"); i++)
+        usleep(10000);
+    ck_assert_str_eq(urc_seen, "+CIEV: 2,5");
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.urcs, 6);
+    ck_assert_int_ge(stats.urcs_coalesced, 1);
+    ck_assert_int_eq(stats.handle_urc_calls + stats.urcs_coalesced, 6);
+    ck_assert_int_eq(stats.urc_classes[0].suppressed, stats.urcs_coalesced);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_latency_and_faults)
+{
+    printf(":: test_sim_latency_and_faults\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+
+    sim_send(&sim, "latency +CSQ 200");
+    at_command(at, "AT");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(at_command(at, "AT+CSQ") != NULL);
+    ck_assert(elapsed(&start) >= 0.15);
+
+    /* A dropped command times out. */
+    sim_send(&sim, "fault +CGMI drop 1.0");
+    at_command(at, "AT");
+    at_set_timeout(at, 1);
+    ck_assert(at_command(at, "AT+CGMI") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+
+    /* Both show up in the counters. */
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, 6);
+    ck_assert_int_eq(stats.timeouts, 1);
+    /* The resync waits for the next command. */
+    ck_assert_int_eq(stats.resyncs, 0);
+    ck_assert_int_gt(stats.tx_bytes, 0);
+    ck_assert_int_gt(stats.rx_bytes, 0);
+    ck_assert_int_eq(stats.parser_size, 256);
+    ck_assert_int_gt(stats.parser_high_water, 0);
+    ck_assert_int_eq(stats.verbs_used, 4);
+    ck_assert_str_eq(stats.verbs[2].name, "AT+CSQ");
+    ck_assert_int_eq(stats.verbs[2].responses, 1);
+    ck_assert_int_ge(stats.verbs[2].max_us, 150000);
+    ck_assert_int_eq(stats.verbs[2].buckets[at_stats_bucket(stats.verbs[2].max_us)], 1);
+    ck_assert_str_eq(stats.verbs[3].name, "AT+CGMI");
+    ck_assert_int_eq(stats.verbs[3].timeouts, 1);
+    ck_assert_int_eq(stats.verbs[3].responses, 0);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_resync)
+{
+    printf(":: test_sim_resync\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    at_set_timeout(at, 1);
+
+    /* A late answer is discarded, not taken for the next command's. */
+    sim_send(&sim, "fault +CGMI late 1.0 1500");
+    at_command(at, "AT");
+    ck_assert(at_command(at, "AT+CGMI") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    const char *response = at_command(at, "AT+CSQ");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "+CSQ: 20,0");
+
+    /* The register holds the nonce. */
+    response = at_command(at, "ATS8?");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "001");
+
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.timeouts, 1);
+    ck_assert_int_eq(stats.resyncs, 1);
+    ck_assert_int_eq(stats.resync_failures, 0);
+    ck_assert_int_ge(stats.stale_lines, 1);
+    ck_assert_int_eq(stats.unexpected, 0);
+
+    /* Until a resync gets through, commands aren't sent at all. */
+    sim_send(&sim, "fault +CSQ drop 1.0");
+    sim_send(&sim, "fault S8 drop 1.0");
+    at_command(at, "AT");
+    ck_assert(at_command(at, "AT+CSQ") == NULL);
+    ck_assert(at_command(at, "AT+CGMM") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    sim_send(&sim, "fault S8 drop 0");
+    usleep(50000);
+    response = at_command(at, "AT+CGMM");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "SIMCOM_SIM800");
+
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.timeouts, 2);
+    ck_assert_int_eq(stats.resyncs, 3);
+    ck_assert_int_eq(stats.resync_failures, 1);
+
+    /* A timed-out command returns on time; the next one pays for the
+     * resync out of its own timeout. */
+    sim_send(&sim, "fault +CSQ drop 1.0");
+    sim_send(&sim, "fault S8 drop 1.0");
+    usleep(50000);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(at_command(at, "AT+CSQ") == NULL);
+    ck_assert(elapsed(&start) < 1.5);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(at_command(at, "AT+CGMM") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert(elapsed(&start) < 1.5);
+    sim_send(&sim, "fault +CSQ drop 0");
+    sim_send(&sim, "fault S8 drop 0");
+    usleep(50000);
+    response = at_command(at, "AT+CSQ");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "+CSQ: 20,0");
+
+    /* A modem that turns the sentinel down gets a plain AT instead, right
+     * away rather than after the timeout. */
+    sim_send(&sim, "reply S8 ERROR");
+    sim_send(&sim, "fault +CGMI late 1.0 1500");
+    usleep(50000);
+    ck_assert(at_command(at, "AT+CGMI") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    usleep(700000);
+    at_set_timeout(at, 3);
+    at_get_stats(at, &stats);
+    unsigned long failures = stats.resync_failures;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    response = at_command(at, "AT+CGMM");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "SIMCOM_SIM800");
+    ck_assert(elapsed(&start) < 1.0);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.resync_failures, failures + 1);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+static void *cancel_thread(void *arg)
+{
+    usleep(200000);
+    at_cancel(arg);
+    return NULL;
+}
+
+START_TEST(test_sim_budget)
+{
+    printf(":: test_sim_budget\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    at_set_timeout(at, 10);
+    sim_send(&sim, "latency +CSQ 2000");
+    at_command(at, "AT");
+
+    /* The deadline cuts a command's own timeout short... */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    at_set_deadline(at, at_now(at) + 300000000);
+    ck_assert(at_command(at, "AT+CSQ") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert(elapsed(&start) < 1.0);
+
+    /* ...and once it has passed, nothing goes out. */
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    unsigned long commands = stats.commands;
+    ck_assert(at_command(at, "AT") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert_int_eq(at_delay(at, 1000), -1);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands);
+
+    /* Without it, the channel resyncs past the late answer. */
+    at_set_deadline(at, 0);
+    const char *response = at_command(at, "AT+CGMI");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "SIMCOM_Ltd");
+
+    /* Cancelling wakes up a waiting command at once. */
+    struct at_cancel token = {0};
+    at_set_cancel(at, &token);
+    pthread_t thread;
+    pthread_create(&thread, NULL, cancel_thread, &token);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(at_command(at, "AT+CSQ") == NULL);
+    ck_assert_int_eq(errno, ECANCELED);
+    ck_assert(elapsed(&start) < 1.0);
+    pthread_join(thread, NULL);
+
+    /* It sticks until the token is replaced. */
+    ck_assert(at_command(at, "AT") == NULL);
+    ck_assert_int_eq(errno, ECANCELED);
+    ck_assert_int_eq(at_delay(at, 1000), -1);
+    ck_assert_int_eq(errno, ECANCELED);
+
+    /* So does a sleep. */
+    struct at_cancel sleep_token = {0};
+    at_set_cancel(at, &sleep_token);
+    pthread_create(&thread, NULL, cancel_thread, &sleep_token);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_int_eq(at_delay(at, 5000), -1);
+    ck_assert_int_eq(errno, ECANCELED);
+    ck_assert(elapsed(&start) < 1.0);
+    pthread_join(thread, NULL);
+
+    at_set_cancel(at, NULL);
+    ck_assert_int_eq(at_delay(at, 10), 0);
+    response = at_command(at, "AT+CGMI");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "SIMCOM_Ltd");
+
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.cancelled, 1);
+    ck_assert_int_eq(stats.resync_failures, 0);
+    ck_assert_int_ge(stats.stale_lines, 2);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+struct token_query {
+    struct at *at;
+    const char *command;
+    struct at_cancel *token;
+    int error;              /* errno if it failed, else zero. */
+    char response[64];
+};
+
+static void *token_query_thread(void *arg)
+{
+    struct token_query *query = arg;
+    struct at_command_options opts = { .cancel = query->token };
+    struct at_buf *response = at_command_opts(query->at, &opts, "%s", query->command);
+    query->error = response ? 0 : errno;
+    snprintf(query->response, sizeof(query->response), "%s", response ? response->data : "(null)");
+    at_buf_release(response);
+    return NULL;
+}
+
+START_TEST(test_sim_cancel_tokens)
+{
+    printf(":: test_sim_cancel_tokens\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    at_set_timeout(at, 10);
+    sim_send(&sim, "latency +CSQ 1000");
+    at_command(at, "AT");
+
+    /* Each command answers to its own token: cancelling the one waiting
+     * for its turn leaves the one in flight alone... */
+    struct at_cancel first = {0}, second = {0};
+    struct token_query slow = { at, "AT+CSQ", &first, 0, "" };
+    pthread_t thread, canceller;
+    pthread_create(&thread, NULL, token_query_thread, &slow);
+    usleep(100000);
+    pthread_create(&canceller, NULL, cancel_thread, &second);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct at_command_options opts = { .cancel = &second };
+    ck_assert(at_command_opts(at, &opts, "AT+CGMI") == NULL);
+    ck_assert_int_eq(errno, ECANCELED);
+    ck_assert(elapsed(&start) < 0.5);
+    pthread_join(canceller, NULL);
+    pthread_join(thread, NULL);
+    ck_assert_int_eq(slow.error, 0);
+    ck_assert_str_eq(slow.response, "+CSQ: 20,0");
+
+    /* ...and cancelling the one in flight lets the queued one go. */
+    struct at_cancel third = {0}, fourth = {0};
+    slow = (struct token_query) { at, "AT+CSQ", &third, 0, "" };
+    pthread_create(&thread, NULL, token_query_thread, &slow);
+    usleep(100000);
+    pthread_create(&canceller, NULL, cancel_thread, &third);
+    opts.cancel = &fourth;
+    struct at_buf *response = at_command_opts(at, &opts, "AT+CGMI");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response->data, "SIMCOM_Ltd");
+    at_buf_release(response);
+    pthread_join(canceller, NULL);
+    pthread_join(thread, NULL);
+    ck_assert_int_eq(slow.error, ECANCELED);
+
+    /* Neither token stuck to the channel. */
+    const char *line = at_command(at, "AT+CGMR");
+    ck_assert(line != NULL);
+    ck_assert_str_eq(line, "Revision:1418B04SIM800L24");
+
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.cancelled, 1);
+    ck_assert_int_eq(stats.resync_failures, 0);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+struct queued_query {
+    struct at *at;
+    const char *command;
+    int priority;
+    int *order;             /* Shared completion counter. */
+    int finished;           /* This query's place in it. */
+    char response[64];
+};
+
+static pthread_mutex_t queued_query_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *queued_query_thread(void *arg)
+{
+    struct queued_query *query = arg;
+    struct at_command_options opts = { .priority = query->priority };
+    struct at_buf *response = at_command_opts(query->at, &opts, "%s", query->command);
+    snprintf(query->response, sizeof(query->response), "%s", response ? response->data : "(null)");
+    at_buf_release(response);
+    pthread_mutex_lock(&queued_query_lock);
+    query->finished = ++*query->order;
+    pthread_mutex_unlock(&queued_query_lock);
+    return NULL;
+}
+
+START_TEST(test_sim_virtual_clock)
+{
+    printf(":: test_sim_virtual_clock\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at_clock *clock = at_clock_alloc_virtual(20);
+    ck_assert(clock != NULL);
+    struct at *at = at_alloc_unix(sim.devpath, 0);
+    ck_assert(at != NULL);
+    at_unix_set_clock(at, clock);
+    ck_assert_int_eq(at_open(at), 0);
+    at_set_timeout(at, 2);
+    at_command(at, "ATE0");
+    ck_assert_str_eq(at_command(at, "ATE0"), "");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Sleeps and timeouts pass in virtual time. */
+    uint64_t before = at_now(at);
+    ck_assert_int_eq(at_delay(at, 60000), 0);
+    ck_assert(at_now(at) - before >= 60000000000ULL);
+
+    sim_send(&sim, "fault +CGMI drop 1.0");
+    usleep(50000);
+    before = at_now(at);
+    at_set_timeout(at, 150);
+    ck_assert(at_command(at, "AT+CGMI") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert(at_now(at) - before >= 150000000000ULL);
+    at_set_timeout(at, 2);
+    ck_assert_str_eq(at_command(at, "AT+CSQ"), "+CSQ: 20,0");
+
+    /* So do deadlines. */
+    at_set_deadline(at, at_now(at) + 5000000000ULL);
+    int slept = 0;
+    while (at_delay(at, 1000) == 0)
+        slept++;
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert_int_eq(slept, 5);
+    at_set_deadline(at, 0);
+
+    /* And URC policy windows: a held line waits for modem time. */
+    at_set_callbacks(at, &callbacks, NULL);
+    ck_assert_int_eq(at_set_urc_policy(at, "+CIEV:", AT_URC_COALESCE, 60000), 0);
+    urc_seen[0] = '\0';
+    sim_send(&sim, "urc +CIEV: 2,1");
+    for (int i=0; i<100 && strcmp(urc_seen, "+CIEV: 2,1"); i++)
+        usleep(10000);
+    ck_assert_str_eq(urc_seen, "+CIEV: 2,1");
+    sim_send(&sim, "urc +CIEV: 2,2");
+    usleep(100000);
+    ck_assert_str_eq(urc_seen, "+CIEV: 2,1");
+    ck_assert_int_eq(at_delay(at, 60000), 0);
+    for (int i=0; i<100 && strcmp(urc_seen, "+CIEV: 2,2"); i++)
+        usleep(10000);
+    ck_assert_str_eq(urc_seen, "+CIEV: 2,2");
+
+    /* A driver's worst case: the connection never comes up. */
+    sim_send(&sim, "reply +BT OK");
+    sim_send(&sim, "reply +CIPSTART OK");
+    usleep(50000);
+    struct cellular *modem = cellular_sim800_alloc();
+    ck_assert(modem != NULL);
+    ck_assert_int_eq(cellular_attach(modem, at, "internet"), 0);
+    before = at_now(at);
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 0, "example.com", 7), -1);
+    ck_assert(at_now(at) - before >= 20000000000ULL);
+    cellular_detach(modem);
+    cellular_sim800_free(modem);
+
+    /* Minutes of modem time, in well under a second of ours. */
+    printf("virtual clock: %.0f s in %.3f s\n", at_now(at) / 1e9, elapsed(&start));
+    ck_assert(elapsed(&start) < 2.0);
+
+    at_free(at);
+    at_clock_free(clock);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_command_options)
+{
+    printf(":: test_sim_command_options\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    at_set_timeout(at, 10);
+    sim_send(&sim, "latency +CSQ 1500");
+    at_command(at, "AT");
+
+    /* A per-command timeout overrides the channel's for that command only
+     * (the next one's resync then waits out the late answer)... */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct at_command_options opts = { .timeout = 1 };
+    ck_assert(at_command_opts(at, &opts, "AT+CSQ") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert(elapsed(&start) < 1.5);
+    /* ...and doesn't stick. */
+    const char *line = at_command(at, "AT+CSQ");
+    ck_assert(line != NULL);
+    ck_assert_str_eq(line, "+CSQ: 20,0");
+
+    /* Commands from other threads queue up behind the one in flight and go
+     * out by priority, then in order of arrival. */
+    int order = 0;
+    struct queued_query queries[] = {
+        { at, "AT+CSQ", 0, &order, 0, "" },
+        { at, "AT+CGMI", 0, &order, 0, "" },
+        { at, "AT+CGMR", 0, &order, 0, "" },
+        { at, "AT+CGMM", 5, &order, 0, "" },
+    };
+    pthread_t threads[4];
+    for (int i=0; i<4; i++) {
+        pthread_create(&threads[i], NULL, queued_query_thread, &queries[i]);
+        usleep(100000);
+    }
+    for (int i=0; i<4; i++)
+        pthread_join(threads[i], NULL);
+    ck_assert_str_eq(queries[0].response, "+CSQ: 20,0");
+    ck_assert_str_eq(queries[1].response, "SIMCOM_Ltd");
+    ck_assert_str_eq(queries[3].response, "SIMCOM_SIM800");
+    ck_assert_int_eq(queries[0].finished, 1);
+    ck_assert_int_eq(queries[3].finished, 2);
+    ck_assert_int_eq(queries[1].finished, 3);
+    ck_assert_int_eq(queries[2].finished, 4);
+
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.queued, 3);
+
+    /* Cancelling also reaches commands waiting for their turn. */
+    struct at_cancel token = {0};
+    queries[0].finished = 0;
+    pthread_create(&threads[0], NULL, queued_query_thread, &queries[0]);
+    usleep(100000);
+    at_set_cancel(at, &token);
+    pthread_t canceller;
+    pthread_create(&canceller, NULL, cancel_thread, &token);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(at_command(at, "AT+CGMI") == NULL);
+    ck_assert_int_eq(errno, ECANCELED);
+    ck_assert(elapsed(&start) < 1.0);
+    pthread_join(canceller, NULL);
+    pthread_join(threads[0], NULL);
+    at_set_cancel(at, NULL);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+static void *shared_query_thread(void *arg)
+{
+    struct queued_query *query = arg;
+    struct at_command_options opts = { .shared = true };
+    struct at_buf *response = at_command_opts(query->at, &opts, "%s", query->command);
+    snprintf(query->response, sizeof(query->response), "%p %s",
+             (void *) response, response ? response->data : "(null)");
+    at_buf_release(response);
+    return NULL;
+}
+
+START_TEST(test_sim_shared_queries)
+{
+    printf(":: test_sim_shared_queries\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    sim_send(&sim, "latency +CSQ 500");
+    at_command(at, "AT");
+
+    /* Identical queries issued while one is in flight get its answer. */
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    unsigned long commands = stats.commands;
+    struct queued_query queries[3];
+    pthread_t threads[3];
+    for (int i=0; i<3; i++) {
+        queries[i] = (struct queued_query) { .at = at, .command = "AT+CSQ" };
+        pthread_create(&threads[i], NULL, shared_query_thread, &queries[i]);
+        usleep(50000);
+    }
+    for (int i=0; i<3; i++)
+        pthread_join(threads[i], NULL);
+    ck_assert(strstr(queries[0].response, " +CSQ: 20,0"));
+    ck_assert_str_eq(queries[1].response, queries[0].response);
+    ck_assert_str_eq(queries[2].response, queries[0].response);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 1);
+    ck_assert_int_eq(stats.shared, 2);
+
+    /* Without a window, later ones go out again... */
+    struct at_command_options opts = { .shared = true };
+    struct at_buf *response = at_command_opts(at, &opts, "AT+CSQ");
+    ck_assert(response != NULL);
+    at_buf_release(response);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 2);
+
+    /* ...with one, they reuse fresh answers... */
+    at_set_share_window(at, 5000);
+    response = at_command_opts(at, &opts, "AT+CSQ");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response->data, "+CSQ: 20,0");
+    at_buf_release(response);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 2);
+    ck_assert_int_eq(stats.shared, 3);
+
+    /* ...until another command may have changed things. */
+    ck_assert(at_command(at, "AT") != NULL);
+    response = at_command_opts(at, &opts, "AT+CSQ");
+    ck_assert(response != NULL);
+    at_buf_release(response);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 4);
+    ck_assert_int_eq(stats.shared, 3);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_sim800_socket)
+{
+    printf(":: test_sim_sim800_socket\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+
+    /* Walk the GPRS state machine. */
+    ck_assert_str_eq(at_command(at, "AT+CSTT=\"internet\""), "");
+    ck_assert_str_eq(at_command(at, "AT+CIICR"), "");
+    at_set_command_scanner(at, scanner_cifsr);
+    ck_assert(at_command(at, "AT+CIFSR") != NULL);
+    /* CONNECT OK follows the OK right away and may overwrite it. */
+    ck_assert(at_command(at, "AT+CIPSTART=0,TCP,\"example.com\",7") != NULL);
+
+    /* Echo server round trip, timed. */
+    char payload[1024];
+    for (size_t i=0; i<sizeof(payload); i++)
+        payload[i] = 'a' + i % 26;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rounds = 20;
+    for (int round=0; round<rounds; round++) {
+        urc_seen[0] = '\0';
+        at_expect_dataprompt(at);
+        ck_assert_str_eq(at_command(at, "AT+CIPSEND=0,%zu", sizeof(payload)), "");
+        at_set_command_scanner(at, scanner_cipsend);
+        /* The response buffer may already hold the data URC; don't look. */
+        ck_assert(at_command_raw(at, payload, sizeof(payload)) != NULL);
+
+        /* Wait for the data notification; chunks must fit the parser buffer. */
+        for (int i=0; i<1000 && strcmp(urc_seen, "+CIPRXGET: 1,0"); i++)
+            usleep(1000);
+        ck_assert_str_eq(urc_seen, "+CIPRXGET: 1,0");
+
+        size_t received = 0;
+        for (int tries=0; received < sizeof(payload) && tries < 100; tries++) {
+            at_set_command_scanner(at, scanner_ciprxget);
+            const char *response = at_command(at, "AT+CIPRXGET=2,0,200");
+            ck_assert(response != NULL);
+            int confirmed;
+            ck_assert_int_eq(sscanf(response, "+CIPRXGET: 2,0,200,%d", &confirmed), 1);
+            if (confirmed == 0) {
+                usleep(1000);
+                continue;
+            }
+            ck_assert(!memcmp(strchr(response, '\n') + 1, payload + received, confirmed));
+            received += confirmed;
+        }
+        ck_assert_int_eq(received, sizeof(payload));
+    }
+    printf("sim800 socket: %.0f bytes/s round trip\n",
+            rounds * sizeof(payload) / elapsed(&start));
+
+    at_set_command_scanner(at, scanner_cipclose);
+    ck_assert_str_eq(at_command(at, "AT+CIPCLOSE=0"), "0, CLOSE OK");
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_tcp)
+{
+    printf(":: test_sim_tcp\n");
+
+    static const char *transports[] = { "raw", "rfc2217" };
+    unsigned long rx_bytes[2];
+    for (int t=0; t<2; t++) {
+        struct sim sim;
+        sim_spawn(&sim, "sim800", transports[t]);
+        struct at *at = at_alloc_tcp("127.0.0.1", sim.devpath, B115200, t ? AT_TCP_RFC2217 : 0);
+        ck_assert(at != NULL);
+        ck_assert_int_eq(at_open(at), 0);
+        at_set_callbacks(at, &callbacks, NULL);
+        at_set_timeout(at, 2);
+        at_command(at, "ATE0");
+        ck_assert_str_eq(at_command(at, "ATE0"), "");
+        ck_assert_str_eq(at_command(at, "AT+CGSN"), "490154203237518");
+
+        /* Only RFC 2217 can set the remote baudrate. */
+        ck_assert_str_eq(at_command(at, "AT+IPR?"), t ? "+IPR: 115200" : "+IPR: 0");
+
+        /* Telnet commands and escapes in the data make it through intact. */
+        ck_assert_str_eq(at_command(at, "AT+CSTT=\"internet\""), "");
+        ck_assert_str_eq(at_command(at, "AT+CIICR"), "");
+        at_set_command_scanner(at, scanner_cifsr);
+        ck_assert(at_command(at, "AT+CIFSR") != NULL);
+        ck_assert(at_command(at, "AT+CIPSTART=0,TCP,\"example.com\",7") != NULL);
+        static const char payload[] = "\xff\xfa\x2c\x01\xff\xf0 \xff\xff\xfb\x00 \xff";
+        urc_seen[0] = '\0';
+        at_expect_dataprompt(at);
+        ck_assert_str_eq(at_command(at, "AT+CIPSEND=0,%zu", sizeof(payload)), "");
+        at_set_command_scanner(at, scanner_cipsend);
+        ck_assert(at_command_raw(at, payload, sizeof(payload)) != NULL);
+        for (int i=0; i<1000 && strcmp(urc_seen, "+CIPRXGET: 1,0"); i++)
+            usleep(1000);
+        at_set_command_scanner(at, scanner_ciprxget);
+        const char *response = at_command(at, "AT+CIPRXGET=2,0,200");
+        ck_assert(response != NULL);
+        int confirmed;
+        ck_assert_int_eq(sscanf(response, "+CIPRXGET: 2,0,200,%d", &confirmed), 1);
+        ck_assert_int_eq(confirmed, sizeof(payload));
+        ck_assert(!memcmp(strchr(response, '\n') + 1, payload, sizeof(payload)));
+
+        struct at_stats stats;
+        at_get_stats(at, &stats);
+        rx_bytes[t] = stats.rx_bytes;
+
+        at_free(at);
+        sim_stop(&sim);
+    }
+
+    /* Telnet framing isn't counted; only the longer +IPR answer is. */
+    ck_assert_int_eq(rx_bytes[1], rx_bytes[0] + strlen("115200") - strlen("0"));
+}
+END_TEST
+
+/* Transparent mode: the stream handler collects socket data. */
+static struct {
+    struct at *at;
+    volatile bool online;
+    volatile bool escaping;
+    char data[4096];
+    volatile size_t len;
+} stream;
+
+static size_t stream_handler(const void *data, size_t len, void *arg)
+{
+    (void) arg;
+    for (size_t i=0; i<len; i++) {
+        if (stream.len < sizeof(stream.data))
+            stream.data[stream.len++] = ((const char *) data)[i];
+        if (stream.escaping && stream.len >= 6 &&
+            !memcmp(stream.data + stream.len - 6, "\r\nOK\r\n", 6)) {
+            stream.len -= 6;
+            stream.online = false;
+            at_set_stream_handler(stream.at, NULL);
+            return i+1;
+        }
+    }
+    return len;
+}
+
+static enum at_response_type stream_scan_line(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    if (!strcmp(line, "CONNECT"))
+        return AT_RESPONSE_URC;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static void stream_urc(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    if (!strcmp(line, "CONNECT")) {
+        stream.online = true;
+        at_set_stream_handler(stream.at, stream_handler);
+    }
+}
+
+static const struct at_callbacks stream_callbacks = {
+    .scan_line = stream_scan_line,
+    .handle_urc = stream_urc,
+};
+
+static enum at_response_type scanner_close_ok(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    if (!strcmp(line, "CLOSE OK"))
+        return AT_RESPONSE_FINAL;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static void stream_wait(bool online, size_t len)
+{
+    for (int i=0; i<2000 && (stream.online != online || stream.len < len); i++)
+        usleep(1000);
+    ck_assert_int_eq(stream.online, online);
+    ck_assert_int_eq(stream.len, len);
+}
+
+START_TEST(test_sim_sim800_transparent)
+{
+    printf(":: test_sim_sim800_transparent\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    memset(&stream, 0, sizeof(stream));
+    stream.at = at;
+    at_set_callbacks(at, &stream_callbacks, NULL);
+
+    ck_assert_str_eq(at_command(at, "AT+CIPMUX=0"), "");
+    ck_assert_str_eq(at_command(at, "AT+CIPMODE=1"), "");
+    ck_assert_str_eq(at_command(at, "AT+CSTT=\"internet\""), "");
+    ck_assert_str_eq(at_command(at, "AT+CIICR"), "");
+    at_set_command_scanner(at, scanner_cifsr);
+    ck_assert(at_command(at, "AT+CIFSR") != NULL);
+    ck_assert(at_command(at, "AT+CIPSTART=\"TCP\",\"example.com\",7") != NULL);
+    stream_wait(true, 0);
+
+    /* No prompts and no 1460-byte limit; data bypasses the parser. */
+    char payload[3000];
+    for (size_t i=0; i<sizeof(payload); i++)
+        payload[i] = (i % 64) ? 'a' + i % 26 : '\n';
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(at_send_raw(at, payload, sizeof(payload)));
+    stream_wait(true, sizeof(payload));
+    ck_assert(!memcmp(stream.data, payload, sizeof(payload)));
+    printf("sim800 transparent: %.0f bytes/s round trip\n", sizeof(payload) / elapsed(&start));
+
+    /* Escape to command mode with the connection up. */
+    usleep(600000);
+    stream.escaping = true;
+    ck_assert(at_send_raw(at, "+++", 3));
+    stream_wait(false, sizeof(payload));
+    stream.escaping = false;
+    ck_assert_str_eq(at_command(at, "AT+CSQ"), "+CSQ: 20,0");
+
+    /* Back online; data sent meanwhile wasn't lost. */
+    ck_assert(at_send(at, "ATO"));
+    stream_wait(true, sizeof(payload));
+    ck_assert(at_send_raw(at, "+x+", 3));
+    stream_wait(true, sizeof(payload) + 3);
+    ck_assert(!memcmp(stream.data + sizeof(payload), "+x+", 3));
+
+    usleep(600000);
+    stream.escaping = true;
+    ck_assert(at_send_raw(at, "+++", 3));
+    stream_wait(false, sizeof(payload) + 3);
+    at_set_command_scanner(at, scanner_close_ok);
+    ck_assert_str_eq(at_command(at, "AT+CIPCLOSE"), "CLOSE OK");
+
+    /* Nothing left to resume. */
+    ck_assert_str_eq(at_command(at, "ATO"), "NO CARRIER");
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_sim800_stream_overflow)
+{
+    printf(":: test_sim_sim800_stream_overflow\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    sim_send(&sim, "reply +BT OK");
+    usleep(50000);
+    struct cellular *modem = cellular_sim800_alloc();
+    ck_assert(modem != NULL);
+    ck_assert_int_eq(cellular_attach(modem, at, "internet"), 0);
+    ck_assert_int_eq(cellular_sim800_set_transparent(modem, true), 0);
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 0, "example.com", 7), 0);
+
+    /* A small echo fits the stream buffer. */
+    char buf[4096];
+    ck_assert_int_eq(modem->ops->socket_send(modem, 0, "hello", 5, 0), 5);
+    ssize_t got = 0;
+    for (int i=0; i<200 && got < 5; i++) {
+        ssize_t n = modem->ops->socket_recv(modem, 0, buf + got, sizeof(buf) - got, 0);
+        ck_assert_int_ge(n, 0);
+        got += n;
+        usleep(10000);
+    }
+    ck_assert(got == 5 && !memcmp(buf, "hello", 5));
+
+    /* Left unread, more than fits is lost, and that isn't passed off as data. */
+    memset(buf, 'x', sizeof(buf));
+    ck_assert_int_eq(modem->ops->socket_send(modem, 0, buf, sizeof(buf), 0), (int) sizeof(buf));
+    usleep(500000);
+    int result = modem->ops->socket_recv(modem, 0, buf, sizeof(buf), 0);
+    ck_assert_int_eq(result, -1);
+    ck_assert_int_eq(errno, ENOBUFS);
+
+    ck_assert_int_eq(cellular_sim800_escape(modem), 0);
+    ck_assert_int_eq(modem->ops->socket_close(modem, 0), 0);
+    cellular_detach(modem);
+    cellular_sim800_free(modem);
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_telit_socket)
+{
+    printf(":: test_sim_telit_socket\n");
+
+    struct sim sim;
+    sim_start(&sim, "telit");
+    struct at *at = channel_open(&sim);
+
+    ck_assert(!strncmp(at_command(at, "AT#SGACT=1,1"), "#SGACT: ", 8));
+    ck_assert_str_eq(at_command(at, "AT#SD=1,0,7,example.com,0,0,1"), "");
+
+    at_expect_dataprompt(at);
+    ck_assert_str_eq(at_command(at, "AT#SSENDEXT=1,5"), "");
+    /* The echo may come back before we look at the response; see above. */
+    ck_assert(at_command_raw(at, "hello", 5) != NULL);
+
+    /* Wait for the SRING notification. */
+    for (int i=0; i<100 && strcmp(urc_seen, "SRING: 1"); i++)
+        usleep(10000);
+    ck_assert_str_eq(urc_seen, "SRING: 1");
+
+    ck_assert_str_eq(at_command(at, "AT#SS=1"), "#SS: 1,3");
+    ck_assert_str_eq(at_command(at, "AT#SH=1"), "");
+    ck_assert_str_eq(at_command(at, "AT#SS=1"), "#SS: 1,0");
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+static volatile int rings_seen;
+
+static bool urcs_held;      /* "+CIEV: 1,2" blocks while set. */
+
+static void slow_urc(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+    if (!strcmp(line, "+CIEV: 1,2")) {
+        while (__atomic_load_n(&urcs_held, __ATOMIC_SEQ_CST))
+            usleep(10000);
+    } else if (!strncmp(line, "+CIEV: ", 7)) {
+        usleep(300000);
+    } else if (!strcmp(line, "RING")) {
+        rings_seen++;
+    }
+}
+
+static const struct at_callbacks slow_callbacks = {
+    .scan_line = scan_line,
+    .handle_urc = slow_urc,
+};
+
+START_TEST(test_sim_slow_callback)
+{
+    printf(":: test_sim_slow_callback\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    at_set_callbacks(at, &slow_callbacks, NULL);
+    rings_seen = 0;
+
+    /* The tty keeps being drained into the ring while the callback sleeps. */
+    sim_send(&sim, "urc +CIEV: 1,1");
+    for (int i=0; i<50; i++)
+        sim_send(&sim, "urc RING");
+    for (int i=0; i<200 && rings_seen < 50; i++)
+        usleep(10000);
+    ck_assert_int_eq(rings_seen, 50);
+
+    struct at_ring_stats stats;
+    at_unix_get_rx_stats(at, &stats);
+    printf("rx ring: high water %zu of %zu bytes\n", stats.high_water, stats.size);
+    ck_assert_int_ge(stats.high_water, 50 * 8 / 2);
+    ck_assert_int_eq(stats.overruns, 0);
+    ck_assert_int_eq(stats.used, 0);
+
+    /* While a callback holds the parser, the ring fills up; the rest of a
+     * burst bigger than it waits in the tty instead of being lost. */
+    __atomic_store_n(&urcs_held, true, __ATOMIC_SEQ_CST);
+    sim_send(&sim, "urc +CIEV: 1,2");
+    for (int i=0; i<3000; i++)
+        sim_send(&sim, "urc RING");
+    for (int i=0; i<500 && stats.high_water < stats.size; i++) {
+        usleep(10000);
+        at_unix_get_rx_stats(at, &stats);
+    }
+    ck_assert_int_eq(stats.high_water, stats.size);
+    __atomic_store_n(&urcs_held, false, __ATOMIC_SEQ_CST);
+    for (int i=0; i<500 && rings_seen < 3050; i++)
+        usleep(10000);
+    ck_assert_int_eq(rings_seen, 3050);
+    at_unix_get_rx_stats(at, &stats);
+    ck_assert_int_eq(stats.overruns, 0);
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+static char deferred_response[64];
+
+static void deferred_urc(const char *line, size_t len, void *arg)
+{
+    struct at *at = arg;
+
+    slow_urc(line, len, NULL);
+
+    /* Off the parser thread, handlers may issue commands. */
+    if (!strcmp(line, "+CIEV: 2,1")) {
+        const char *response = at_command(at, "AT+CGSN");
+        snprintf(deferred_response, sizeof(deferred_response), "%s", response ? response : "(null)");
+    }
+}
+
+static const struct at_callbacks deferred_callbacks = {
+    .scan_line = scan_line,
+    .handle_urc = deferred_urc,
+};
+
+START_TEST(test_sim_executor)
+{
+    printf(":: test_sim_executor\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    struct at_executor *executor = at_executor_alloc(2);
+    ck_assert(executor != NULL);
+    ck_assert_int_eq(at_unix_set_executor(at, executor), 0);
+    at_set_callbacks(at, &deferred_callbacks, at);
+    rings_seen = 0;
+    deferred_response[0] = '\0';
+
+    /* A slow handler no longer holds up commands. */
+    sim_send(&sim, "urc +CIEV: 1,1");
+    usleep(50000);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const char *response = at_command(at, "AT+CSQ");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "+CSQ: 20,0");
+    ck_assert(elapsed(&start) < 0.2);
+
+    /* URCs queue up behind it in order, and handlers can talk back. */
+    for (int i=0; i<20; i++)
+        sim_send(&sim, "urc RING");
+    sim_send(&sim, "urc +CIEV: 2,1");
+    for (int i=0; i<200 && !deferred_response[0]; i++)
+        usleep(10000);
+    ck_assert_int_eq(rings_seen, 20);
+    ck_assert_str_eq(deferred_response, "490154203237518");
+
+    /* Detaching waits for the queue to drain. */
+    ck_assert_int_eq(at_unix_set_executor(at, NULL), 0);
+    struct at_executor_stats stats;
+    at_executor_get_stats(executor, &stats);
+    ck_assert_int_eq(stats.executed, 22);
+
+    at_free(at);
+    at_executor_free(executor);
+    sim_stop(&sim);
+}
+END_TEST
+
+static int usr1_seen;
+
+static void handle_usr1(int signum)
+{
+    (void) signum;
+    usr1_seen++;
+}
+
+START_TEST(test_sim_teardown)
+{
+    printf(":: test_sim_teardown\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+
+    /* Applications keep SIGUSR1 to themselves. */
+    struct sigaction sa = { .sa_handler = handle_usr1 };
+    sigaction(SIGUSR1, &sa, NULL);
+    usr1_seen = 0;
+
+    /* Closing wakes the reader right away, even mid-poll(). */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int cycles = 50;
+    for (int i=0; i<cycles; i++) {
+        struct at *at = at_alloc_unix(sim.devpath, 0);
+        ck_assert(at != NULL);
+        ck_assert_int_eq(at_open(at), 0);
+        at_set_timeout(at, 2);
+        ck_assert(at_command(at, "AT") != NULL);
+        ck_assert_int_eq(at_close(at), 0);
+        ck_assert_int_eq(at_open(at), 0);
+        at_free(at);
+    }
+    double seconds = elapsed(&start);
+    printf("teardown: %.0f us per channel cycle\n", seconds / cycles * 1e6);
+    ck_assert(seconds < 5.0);
+
+    struct sigaction current;
+    sigaction(SIGUSR1, NULL, &current);
+    ck_assert(current.sa_handler == handle_usr1);
+    ck_assert_int_eq(usr1_seen, 0);
+    signal(SIGUSR1, SIG_DFL);
+
+    sim_stop(&sim);
+}
+END_TEST
+
+struct held_query {
+    struct at *at;
+    const char *command;
+    const char *expected;
+    int mismatches;
+};
+
+static void *held_query_thread(void *arg)
+{
+    struct held_query *query = arg;
+
+    /* Keep the last few responses while other threads issue commands. */
+    struct at_buf *held[8] = { NULL };
+    for (int i=0; i<200; i++) {
+        at_buf_release(held[i % 8]);
+        held[i % 8] = at_command_buf(query->at, "%s", query->command);
+        for (int j=0; j<8 && j<=i; j++)
+            if (!held[j] || strcmp(held[j]->data, query->expected))
+                query->mismatches++;
+    }
+    for (int j=0; j<8; j++)
+        at_buf_release(held[j]);
+    return NULL;
+}
+
+START_TEST(test_sim_response_buffers)
+{
+    printf(":: test_sim_response_buffers\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+
+    /* Responses outlive later commands. */
+    struct at_buf *cgsn = at_command_buf(at, "AT+CGSN");
+    ck_assert(cgsn != NULL);
+    const char *response = at_command(at, "AT+CSQ");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "+CSQ: 20,0");
+    ck_assert_str_eq(cgsn->data, "490154203237518");
+    ck_assert_int_eq(cgsn->len, 15);
+    at_buf_release(cgsn);
+
+    /* Concurrent callers each keep their own. */
+    struct held_query queries[] = {
+        { at, "AT+CGSN", "490154203237518", 0 },
+        { at, "AT+CSQ", "+CSQ: 20,0", 0 },
+        { at, "AT+CREG?", "+CREG: 0,1", 0 },
+    };
+    pthread_t threads[3];
+    for (int i=0; i<3; i++)
+        pthread_create(&threads[i], NULL, held_query_thread, &queries[i]);
+    for (int i=0; i<3; i++) {
+        pthread_join(threads[i], NULL);
+        ck_assert_int_eq(queries[i].mismatches, 0);
+    }
+
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+struct slow_query {
+    struct at *at;
+    char response[64];
+};
+
+static void *slow_query_thread(void *arg)
+{
+    struct slow_query *query = arg;
+    const char *response = at_command(query->at, "AT+CGMR");
+    snprintf(query->response, sizeof(query->response), "%s", response ? response : "(null)");
+    return NULL;
+}
+
+START_TEST(test_sim_cmux)
+{
+    printf(":: test_sim_cmux\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    ck_assert_str_eq(at_command(at, "AT+CMUX=0"), "");
+    at_free(at);
+
+    struct cmux *mux = cmux_open(sim.devpath, 0, 2);
+    ck_assert(mux != NULL);
+    struct at *control = cmux_at_alloc(mux, 1);
+    struct at *data = cmux_at_alloc(mux, 2);
+    ck_assert_int_eq(at_open(control), 0);
+    ck_assert_int_eq(at_open(data), 0);
+    at_set_callbacks(control, &callbacks, NULL);
+    at_set_timeout(control, 2);
+    at_set_timeout(data, 2);
+    at_command(control, "ATE0");
+    at_command(data, "ATE0");
+
+    /* A slow command on one DLC doesn't hold up the other. */
+    sim_send(&sim, "latency +CGMR 500");
+    at_command(control, "AT");
+    struct slow_query query = { .at = data };
+    pthread_t thread;
+    pthread_create(&thread, NULL, slow_query_thread, &query);
+    usleep(50000);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_str_eq(at_command(control, "AT+CSQ"), "+CSQ: 20,0");
+    ck_assert(elapsed(&start) < 0.3);
+    pthread_join(thread, NULL);
+    ck_assert_str_eq(query.response, "Revision:1418B04SIM800L24");
+
+    /* URCs arrive on DLC 1 by default. */
+    sim_send(&sim, "urc +CIEV: 2,1");
+    for (int i=0; i<100 && strcmp(urc_seen, "+CIEV: 2,1"); i++)
+        usleep(10000);
+    ck_assert_str_eq(urc_seen, "+CIEV: 2,1");
+
+    /* The modem may stop us sending on a DLC. */
+    sim_send(&sim, "mux fc 2 on");
+    sim_send(&sim, "after 300 mux fc 2 off");
+    usleep(50000);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_str_eq(at_command(data, "AT+CGSN"), "490154203237518");
+    ck_assert(elapsed(&start) >= 0.2);
+    ck_assert_str_eq(at_command(control, "AT+CGSN"), "490154203237518");
+
+    at_free(control);
+    at_free(data);
+    cmux_close(mux);
+
+    /* Back in plain AT mode. */
+    at = channel_open(&sim);
+    ck_assert_str_eq(at_command(at, "AT+CSQ"), "+CSQ: 20,0");
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+struct imei_query {
+    struct cellular *modem;
+    char imei[CELLULAR_IMEI_LENGTH+1];
+    int result;
+};
+
+static void *imei_thread(void *arg)
+{
+    struct imei_query *query = arg;
+    query->result = query->modem->ops->imei(query->modem, query->imei, sizeof(query->imei));
+    return NULL;
+}
+
+START_TEST(test_sim_dual_port)
+{
+    printf(":: test_sim_dual_port\n");
+
+    struct sim sim;
+    sim_spawn_aux(&sim, "sim800", NULL, true);
+    struct at *data = channel_open_path(sim.devpath);
+    struct at *control = channel_open_path(sim.auxpath);
+
+    struct cellular *modem = cellular_generic_alloc();
+    ck_assert(modem != NULL);
+    ck_assert_int_eq(cellular_attach_dual(modem, data, control, "internet"), 0);
+    ck_assert(cellular_port(modem, CELLULAR_PORT_DATA) == data);
+    ck_assert(cellular_port(modem, CELLULAR_PORT_CONTROL) == control);
+
+    /* Status polls don't queue behind a slow command on the data port. */
+    sim_send(&sim, "latency +CGMR 500");
+    usleep(50000);
+    struct slow_query query = { .at = data };
+    pthread_t thread;
+    pthread_create(&thread, NULL, slow_query_thread, &query);
+    usleep(50000);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_int_eq(modem->ops->rssi(modem), 20);
+    ck_assert_int_ge(modem->ops->creg(modem), 0);
+    ck_assert(elapsed(&start) < 0.3);
+    pthread_join(thread, NULL);
+    ck_assert_str_eq(query.response, "Revision:1418B04SIM800L24");
+
+    struct cellular_stats stats;
+    cellular_get_stats(modem, &stats);
+    ck_assert_int_eq(stats.control.commands, 4);
+    ck_assert_int_eq(stats.at.commands, 3);
+
+    /* URCs come in on the control port. */
+    urc_seen[0] = '\0';
+    sim_send(&sim, "urc +CIEV: 2,1");
+    for (int i=0; i<100 && strcmp(urc_seen, "+CIEV: 2,1"); i++)
+        usleep(10000);
+    ck_assert_str_eq(urc_seen, "+CIEV: 2,1");
+    at_get_stats(data, &stats.at);
+    ck_assert_int_eq(stats.at.urcs, 0);
+
+    /* A budget covers the ops of the thread that set it, and only those. */
+    sim_send(&sim, "latency +CGSN 800");
+    sim_send(&sim, "latency +CCID 1500");
+    usleep(50000);
+    struct imei_query other = { .modem = modem };
+    pthread_create(&thread, NULL, imei_thread, &other);
+    usleep(50000);
+    struct at_cancel token = {0};
+    struct cellular_budget budget = { .cancel = &token };
+    cellular_budget_begin(&budget);
+    pthread_t canceller;
+    pthread_create(&canceller, NULL, cancel_thread, &token);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char iccid[CELLULAR_ICCID_LENGTH+2];
+    ck_assert_int_eq(modem->ops->iccid(modem, iccid, sizeof(iccid)), -1);
+    ck_assert_int_eq(errno, ECANCELED);
+    ck_assert(elapsed(&start) < 1.0);
+    cellular_budget_end();
+    pthread_join(canceller, NULL);
+    pthread_join(thread, NULL);
+    ck_assert_int_eq(other.result, 0);
+    ck_assert_str_eq(other.imei, "490154203237518");
+    ck_assert_int_eq(modem->ops->iccid(modem, iccid, sizeof(iccid)), 0);
+
+    /* Single-port modems use the one channel for both. */
+    ck_assert_int_eq(cellular_detach(modem), 0);
+    ck_assert_int_eq(cellular_attach(modem, data, "internet"), 0);
+    ck_assert(cellular_port(modem, CELLULAR_PORT_CONTROL) == data);
+    ck_assert_int_eq(cellular_detach(modem), 0);
+
+    cellular_generic_free(modem);
+    at_free(control);
+    at_free(data);
+    sim_stop(&sim);
+}
+END_TEST
+
+static void *broker_thread(void *arg)
+{
+    struct at_broker *broker = arg;
+    return (void *) (intptr_t) at_broker_run(broker);
+}
+
+START_TEST(test_sim_broker)
+{
+    printf(":: test_sim_broker\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    sim_send(&sim, "reply +BT OK");
+    usleep(50000);
+    struct cellular *modem = cellular_sim800_alloc();
+    ck_assert(modem != NULL);
+    ck_assert_int_eq(cellular_attach(modem, at, "internet"), 0);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/attentive-broker-%d.sock", (int) getpid());
+    struct at_broker *broker = at_broker_alloc(path, modem);
+    ck_assert(broker != NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, broker_thread, broker);
+
+    struct cellular *a = cellular_broker_alloc(path);
+    struct cellular *b = cellular_broker_alloc(path);
+    ck_assert(a != NULL && b != NULL);
+
+    /* Both clients see the one modem. */
+    char imei[CELLULAR_IMEI_LENGTH+1];
+    ck_assert_int_eq(a->ops->imei(a, imei, sizeof(imei)), 0);
+    ck_assert_str_eq(imei, "490154203237518");
+
+    /* Answers are cut to the room given, NUL included; no room is no good. */
+    ck_assert_int_eq(a->ops->imei(a, imei, 4), 0);
+    ck_assert_str_eq(imei, "490");
+    ck_assert_int_eq(a->ops->imei(a, imei, 0), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    ck_assert_int_eq(b->ops->rssi(b), 20);
+    ck_assert_int_eq(b->ops->attach(b), 0);
+
+    /* Connections belong to whoever opened them. */
+    ck_assert_int_eq(a->ops->socket_connect(a, 0, "example.com", 7), 0);
+    ck_assert_int_eq(b->ops->socket_connect(b, 0, "example.com", 7), -1);
+    ck_assert_int_eq(errno, EBUSY);
+    ck_assert_int_eq(b->ops->socket_send(b, 0, "x", 1, 0), -1);
+    ck_assert_int_eq(errno, EBUSY);
+    ck_assert_int_eq(b->ops->pdp_close(b), -1);
+    ck_assert_int_eq(errno, EBUSY);
+
+    /* Echo round trip, the second time built in the shared ring. */
+    for (int round=0; round<2; round++) {
+        char payload[1000];
+        for (size_t i=0; i<sizeof(payload); i++)
+            payload[i] = 'a' + (i + round) % 26;
+        const void *data = payload;
+        if (round == 1) {
+            size_t size;
+            char *ring = cellular_broker_buffer(a, &size);
+            ck_assert(size >= sizeof(payload));
+            memcpy(ring, payload, sizeof(payload));
+            data = ring;
+        }
+        ck_assert_int_eq(a->ops->socket_send(a, 0, data, sizeof(payload), 0), sizeof(payload));
+
+        char echo[sizeof(payload)];
+        size_t received = 0;
+        for (int tries=0; received < sizeof(echo) && tries < 200; tries++) {
+            /* Reads must fit the parser buffer. */
+            size_t chunk = sizeof(echo) - received < 200 ? sizeof(echo) - received : 200;
+            ssize_t result = a->ops->socket_recv(a, 0, echo + received, chunk, 0);
+            ck_assert(result >= 0);
+            received += result;
+            if (result == 0)
+                usleep(5000);
+        }
+        ck_assert_int_eq(received, sizeof(payload));
+        ck_assert(!memcmp(echo, payload, sizeof(payload)));
+    }
+
+    /* A client that goes away leaves its connections behind closed. */
+    cellular_broker_free(a);
+    for (int i=0; i<100 && b->ops->socket_connect(b, 0, "example.com", 7) != 0; i++) {
+        ck_assert_int_eq(errno, EBUSY);
+        usleep(10000);
+    }
+    ck_assert_int_eq(b->ops->socket_close(b, 0), 0);
+    cellular_broker_free(b);
+
+    at_broker_stop(broker);
+    void *result;
+    pthread_join(thread, &result);
+    ck_assert(result == NULL);
+    at_broker_free(broker);
+    ck_assert_int_eq(access(path, F_OK), -1);
+
+    cellular_detach(modem);
+    cellular_sim800_free(modem);
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+struct broker_connect {
+    struct cellular *client;
+    int result;
+};
+
+static void *broker_connect_thread(void *arg)
+{
+    struct broker_connect *connect = arg;
+    connect->result = connect->client->ops->socket_connect(connect->client, 0, "example.com", 7);
+    return NULL;
+}
+
+START_TEST(test_sim_broker_dual)
+{
+    printf(":: test_sim_broker_dual\n");
+
+    struct sim sim;
+    sim_spawn_aux(&sim, "sim800", NULL, true);
+    struct at *data = channel_open_path(sim.devpath);
+    struct at *control = channel_open_path(sim.auxpath);
+    sim_send(&sim, "reply +BT OK");
+    usleep(50000);
+    struct cellular *modem = cellular_sim800_alloc();
+    ck_assert(modem != NULL);
+    ck_assert_int_eq(cellular_attach_dual(modem, data, control, "internet"), 0);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/attentive-broker-%d.sock", (int) getpid());
+    struct at_broker *broker = at_broker_alloc(path, modem);
+    ck_assert(broker != NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, broker_thread, broker);
+    struct cellular *a = cellular_broker_alloc(path);
+    struct cellular *b = cellular_broker_alloc(path);
+    ck_assert(a != NULL && b != NULL);
+
+    /* A slow connect holds up neither status queries nor new clients. */
+    sim_send(&sim, "latency +CIPSTART 1000");
+    usleep(50000);
+    struct broker_connect connect = { .client = a };
+    pthread_t connecting;
+    pthread_create(&connecting, NULL, broker_connect_thread, &connect);
+    usleep(100000);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_int_eq(b->ops->rssi(b), 20);
+    struct cellular *c = cellular_broker_alloc(path);
+    ck_assert(c != NULL);
+    ck_assert_int_ge(c->ops->creg(c), 0);
+    ck_assert(elapsed(&start) < 0.5);
+    pthread_join(connecting, NULL);
+    ck_assert_int_eq(connect.result, 0);
+    ck_assert_int_eq(a->ops->socket_close(a, 0), 0);
+
+    cellular_broker_free(a);
+    cellular_broker_free(b);
+    cellular_broker_free(c);
+    at_broker_stop(broker);
+    pthread_join(thread, NULL);
+    at_broker_free(broker);
+
+    cellular_detach(modem);
+    cellular_sim800_free(modem);
+    at_free(control);
+    at_free(data);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_status_cache)
+{
+    printf(":: test_sim_status_cache\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    sim_send(&sim, "reply +BT OK");
+    sim_send(&sim, "reply +CIND=? +CIND: (\"battchg\",(0-5)),(\"signal\",(0-5)),(\"service\",(0-1))\\nOK");
+    usleep(50000);
+    struct cellular *modem = cellular_sim800_alloc();
+    ck_assert(modem != NULL);
+    ck_assert_int_eq(cellular_attach(modem, at, "internet"), 0);
+    at_set_timeout(at, 1);
+    ck_assert_int_eq(cellular_status_reports(modem), 0);
+    ck_assert_int_eq(modem->signal_indicator, 2);
+    ck_assert_int_eq(modem->service_indicator, 3);
+
+    /* Its longer timeouts were its own. */
+    sim_send(&sim, "fault +CGMM drop 1.0");
+    usleep(50000);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(at_command(at, "AT+CGMM") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert(elapsed(&start) < 2.0);
+
+    /* The IMEI is read once. */
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    unsigned long commands = stats.commands;
+    for (int i=0; i<3; i++) {
+        char imei[CELLULAR_IMEI_LENGTH+1];
+        ck_assert_int_eq(modem->ops->imei(modem, imei, sizeof(imei)), 0);
+        ck_assert_str_eq(imei, "490154203237518");
+    }
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 1);
+
+    /* Fresh values come from memory... */
+    cellular_set_status_ttl(modem, CELLULAR_STATUS_RSSI, 60000);
+    cellular_set_status_ttl(modem, CELLULAR_STATUS_CREG, 60000);
+    ck_assert_int_eq(modem->ops->rssi(modem), 20);
+    ck_assert_int_eq(modem->ops->creg(modem), 1);
+    sim_send(&sim, "set rssi 25");
+    usleep(50000);
+    ck_assert_int_eq(modem->ops->rssi(modem), 20);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 3);
+
+    /* ...until an indicator event makes them stale... */
+    sim_send(&sim, "urc +CIEV: 2,4");
+    int rssi = 0;
+    for (int i=0; i<100 && (rssi = modem->ops->rssi(modem)) != 25; i++)
+        usleep(10000);
+    ck_assert_int_eq(rssi, 25);
+
+    /* ...or a registration report brings a new one. */
+    at_get_stats(at, &stats);
+    commands = stats.commands;
+    sim_send(&sim, "urc +CREG: 5,\"00C3\",\"0FA1\"");
+    int creg = 0;
+    for (int i=0; i<100 && (creg = modem->ops->creg(modem)) != 5; i++)
+        usleep(10000);
+    ck_assert_int_eq(creg, 5);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands);
+
+    /* Refreshes only go out while the channel is idle. */
+    cellular_set_status_ttl(modem, CELLULAR_STATUS_RSSI, 1);
+    usleep(2000);
+    sim_send(&sim, "latency +CGMR 300");
+    usleep(50000);
+    struct slow_query query = { .at = at };
+    pthread_t thread;
+    pthread_create(&thread, NULL, slow_query_thread, &query);
+    usleep(50000);
+    errno = 0;
+    ck_assert_int_eq(cellular_refresh_status(modem), -1);
+    ck_assert_int_eq(errno, EBUSY);
+    pthread_join(thread, NULL);
+    ck_assert_str_eq(query.response, "Revision:1418B04SIM800L24");
+    /* Signal strength, and the ICCID that was never read. */
+    ck_assert_int_eq(cellular_refresh_status(modem), 2);
+    usleep(2000);
+    ck_assert_int_eq(cellular_refresh_status(modem), 1);
+
+    /* Detaching forgets everything. */
+    ck_assert_int_eq(cellular_detach(modem), 0);
+    ck_assert(!modem->status[CELLULAR_STATUS_IMEI].valid);
+    ck_assert(!modem->status[CELLULAR_STATUS_CREG].valid);
+
+    cellular_sim800_free(modem);
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_batch)
+{
+    printf(":: test_sim_batch\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    struct at_stats stats;
+    at_get_stats(at, &stats);
+    unsigned long commands = stats.commands;
+
+    /* One line, answers shared out. */
+    struct at_batch_command queries[] = {
+        { .command = "AT+CGSN", .repeat = true },
+        { .command = "AT+CMEE=2", .repeat = true },
+        { .command = "AT+CREG?" },
+        { .command = "AT+CSQ", .repeat = true },
+    };
+    ck_assert_int_eq(at_batch(at, NULL, queries, 4, 556), 0);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 1);
+    ck_assert_str_eq(queries[0].text, "490154203237518");
+    ck_assert_str_eq(queries[1].text, "");
+    ck_assert_str_eq(queries[2].text, "+CREG: 0,1");
+    ck_assert_str_eq(queries[3].text, "+CSQ: 20,0");
+    for (int i=0; i<4; i++)
+        ck_assert_int_eq(queries[i].result, 0);
+    at_batch_release(queries, 4);
+
+    /* Short lines and loners split it up. */
+    ck_assert_int_eq(at_batch(at, NULL, queries, 4, 20), 0);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 3);
+    ck_assert_str_eq(queries[3].text, "+CSQ: 20,0");
+    at_batch_release(queries, 4);
+    queries[2].alone = true;
+    ck_assert_int_eq(at_batch(at, NULL, queries, 4, 556), 0);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 6);
+    ck_assert_str_eq(queries[2].text, "+CREG: 0,1");
+    at_batch_release(queries, 4);
+
+    /* A failure is tracked down, and ends the batch. */
+    struct at_batch_command failing[] = {
+        { .command = "AT+CMEE=2", .repeat = true },
+        { .command = "AT+NOSUCHTHING", .repeat = true },
+        { .command = "AT+CSQ", .repeat = true },
+    };
+    errno = 0;
+    ck_assert_int_eq(at_batch(at, NULL, failing, 3, 556), -1);
+    ck_assert_int_eq(errno, EIO);
+    ck_assert_int_eq(failing[0].result, 0);
+    ck_assert_int_eq(failing[1].result, -1);
+    ck_assert_str_eq(failing[1].text, "ERROR");
+    ck_assert_int_eq(failing[2].result, -1);
+    ck_assert(failing[2].text == NULL);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 9);
+    at_batch_release(failing, 3);
+
+    /* What may not run twice isn't retried with the rest. */
+    failing[0].repeat = false;
+    ck_assert_int_eq(at_batch(at, NULL, failing, 3, 556), -1);
+    ck_assert_int_eq(errno, EIO);
+    ck_assert_int_eq(failing[0].result, 0);
+    ck_assert_int_eq(failing[1].result, -1);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 12);
+    at_batch_release(failing, 3);
+
+    /* Driver setup goes out in one line. */
+    sim_send(&sim, "reply +BT OK");
+    usleep(50000);
+    struct cellular *modem = cellular_sim800_alloc();
+    ck_assert(modem != NULL);
+    ck_assert_int_eq(cellular_attach(modem, at, "internet"), 0);
+    at_get_stats(at, &stats);
+    commands = stats.commands;
+    ck_assert_int_eq(modem->ops->ftp_open(modem, "ftp.example.com", 21, "user", "secret", true), 0);
+    at_get_stats(at, &stats);
+    ck_assert_int_eq(stats.commands, commands + 1);
+
+    /* On the driver's timeout, not the channel's; and never truncated. */
+    at_set_timeout(at, 1);
+    sim_send(&sim, "latency +FTPCID 1500");
+    usleep(50000);
+    ck_assert_int_eq(modem->ops->ftp_open(modem, "ftp.example.com", 21, "user", "secret", false), 0);
+    char host[96];
+    memset(host, 'a', sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    ck_assert_int_eq(modem->ops->ftp_open(modem, host, 21, "user", "secret", true), -1);
+    ck_assert_int_eq(errno, ENOMEM);
+    ck_assert_int_eq(cellular_detach(modem), 0);
+
+    cellular_sim800_free(modem);
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+START_TEST(test_sim_pdp_state)
+{
+    printf(":: test_sim_pdp_state\n");
+
+    struct sim sim;
+    sim_start(&sim, "sim800");
+    struct at *at = channel_open(&sim);
+    sim_send(&sim, "reply +BT OK");
+    usleep(50000);
+    struct cellular *modem = cellular_sim800_alloc();
+    ck_assert(modem != NULL);
+
+    /* Prewarming opens the context on attach; that's the one change seen. */
+    struct at_trace *trace = at_trace_alloc("sim800", 64);
+    at_set_trace(at, trace);
+    cellular_set_pdp_prewarm(modem, true);
+    ck_assert_int_eq(cellular_attach(modem, at, "internet"), 0);
+    at_set_trace(at, NULL);
+    struct at_trace_event events[64];
+    size_t count = at_trace_snapshot(trace, events, 64);
+    int changes = 0;
+    for (size_t i=0; i<count; i++) {
+        if (events[i].type == AT_TRACE_STATE && !memcmp(events[i].text, "pdp_active", 10)) {
+            ck_assert_int_eq(events[i].arg, 1);
+            changes++;
+        }
+    }
+    ck_assert_int_eq(changes, 1);
+    at_trace_free(trace);
+    struct cellular_stats stats;
+    cellular_get_stats(modem, &stats);
+    ck_assert_int_eq(stats.pdp_requests, 1);
+    ck_assert_int_eq(stats.pdp_reused, 0);
+    ck_assert(stats.pdp_active);
+
+    /* A live context costs nothing more than the command itself. */
+    unsigned long commands = stats.at.commands;
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 0, "example.com", 7), 0);
+    cellular_get_stats(modem, &stats);
+    ck_assert_int_eq(stats.at.commands, commands + 1);
+    ck_assert_int_eq(stats.pdp_requests, 2);
+    ck_assert_int_eq(stats.pdp_reused, 1);
+
+    /* Deactivation reports bring the full open back. */
+    sim_send(&sim, "urc +PDP: DEACT");
+    for (int i=0; i<100 && stats.pdp_active; i++) {
+        usleep(10000);
+        cellular_get_stats(modem, &stats);
+    }
+    ck_assert(!stats.pdp_active);
+    commands = stats.at.commands;
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 1, "example.com", 7), 0);
+    cellular_get_stats(modem, &stats);
+    ck_assert_int_gt(stats.at.commands, commands + 1);
+    ck_assert_int_eq(stats.pdp_reused, 1);
+    ck_assert(stats.pdp_active);
+
+    /* So does a lost carrier, to be on the safe side. */
+    sim_send(&sim, "urc NO CARRIER");
+    for (int i=0; i<100 && stats.pdp_active; i++) {
+        usleep(10000);
+        cellular_get_stats(modem, &stats);
+    }
+    ck_assert(!stats.pdp_active);
+
+    /* The driver's timeouts are its own; the channel's stays as set. */
+    at_set_timeout(at, 1);
+    sim_send(&sim, "latency +CIPSTART 1500");
+    usleep(50000);
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 2, "example.com", 7), 0);
+    sim_send(&sim, "latency +CGMI 1500");
+    usleep(50000);
+    ck_assert(at_command(at, "AT+CGMI") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+
+    /* A budget cuts them short all the same. */
+    struct cellular_budget budget = { .deadline = at_now(at) + 300000000 };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cellular_budget_begin(&budget);
+    ck_assert_int_eq(modem->ops->socket_connect(modem, 3, "example.com", 7), -1);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    cellular_budget_end();
+    ck_assert(elapsed(&start) < 1.0);
+
+    ck_assert_int_eq(modem->ops->socket_close(modem, 0), 0);
+    ck_assert_int_eq(modem->ops->socket_close(modem, 1), 0);
+    ck_assert_int_eq(modem->ops->socket_close(modem, 2), 0);
+    ck_assert_int_eq(cellular_detach(modem), 0);
+    cellular_get_stats(modem, &stats);
+    ck_assert(!stats.pdp_active);
+
+    cellular_sim800_free(modem);
+    at_free(at);
+    sim_stop(&sim);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("sim");
+    tcase_set_timeout(tc, 30);
+    tcase_add_test(tc, test_sim_basic);
+    tcase_add_test(tc, test_sim_latency_and_faults);
+    tcase_add_test(tc, test_sim_resync);
+    tcase_add_test(tc, test_sim_budget);
+    tcase_add_test(tc, test_sim_cancel_tokens);
+    tcase_add_test(tc, test_sim_virtual_clock);
+    tcase_add_test(tc, test_sim_command_options);
+    tcase_add_test(tc, test_sim_shared_queries);
+    tcase_add_test(tc, test_sim_sim800_socket);
+    tcase_add_test(tc, test_sim_tcp);
+    tcase_add_test(tc, test_sim_sim800_transparent);
+    tcase_add_test(tc, test_sim_sim800_stream_overflow);
+    tcase_add_test(tc, test_sim_telit_socket);
+    tcase_add_test(tc, test_sim_cmux);
+    tcase_add_test(tc, test_sim_dual_port);
+    tcase_add_test(tc, test_sim_broker);
+    tcase_add_test(tc, test_sim_broker_dual);
+    tcase_add_test(tc, test_sim_status_cache);
+    tcase_add_test(tc, test_sim_batch);
+    tcase_add_test(tc, test_sim_pdp_state);
+    tcase_add_test(tc, test_sim_slow_callback);
+    tcase_add_test(tc, test_sim_executor);
+    tcase_add_test(tc, test_sim_teardown);
+    tcase_add_test(tc, test_sim_response_buffers);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    signal(SIGPIPE, SIG_IGN);
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,123 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <attentive/at-stats.h>
+
+
+#define STR_LEN(s) s, strlen(s)
+
+START_TEST(test_stats_verbs)
+{
+    printf(":: test_stats_verbs\n");
+
+    static struct at_stats stats;
+
+    /* Verbs end at the arguments; raw data has a slot of its own. */
+    ck_assert_int_eq(at_stats_verb(&stats, STR_LEN("AT+CIPSEND=0,10\r")), 0);
+    ck_assert_int_eq(at_stats_verb(&stats, STR_LEN("AT+CREG?;+CSQ\r")), 1);
+    ck_assert_int_eq(at_stats_verb(&stats, STR_LEN("AT+CIPSEND=1,99\r")), 0);
+    ck_assert_int_eq(at_stats_verb(&stats, NULL, 10), 2);
+    ck_assert_int_eq(at_stats_verb(&stats, STR_LEN("AT")), 3);
+    ck_assert_int_eq(at_stats_verb(&stats, STR_LEN("AT+VERYVERYLONGCOMMAND")), 4);
+
+    /* Once the table is full, the rest share the last slot. */
+    for (int i=0; i<20; i++) {
+        char command[16];
+        int len = snprintf(command, sizeof(command), "AT+X%d", i);
+        ck_assert_int_eq(at_stats_verb(&stats, command, len),
+                         i < AT_STATS_VERBS-6 ? i + 5 : AT_STATS_VERBS-1);
+    }
+
+    at_stats_response(&stats, 0, 1500000);
+    at_stats_response(&stats, 0, 500);
+    at_stats_timeout(&stats, 1);
+
+    struct at_stats copy;
+    at_stats_snapshot(&stats, &copy);
+    ck_assert_int_eq(copy.verbs_used, AT_STATS_VERBS);
+    ck_assert_str_eq(copy.verbs[0].name, "AT+CIPSEND");
+    ck_assert_str_eq(copy.verbs[1].name, "AT+CREG");
+    ck_assert_str_eq(copy.verbs[2].name, AT_STATS_VERB_RAW);
+    ck_assert_str_eq(copy.verbs[4].name, "AT+VERYVERYLONG");
+    ck_assert_str_eq(copy.verbs[AT_STATS_VERBS-1].name, "*");
+    ck_assert_int_eq(copy.verbs[0].responses, 2);
+    ck_assert_int_eq(copy.verbs[0].total_us, 1500);
+    ck_assert_int_eq(copy.verbs[0].max_us, 1500);
+    ck_assert_int_eq(copy.verbs[0].buckets[0], 1);
+    ck_assert_int_eq(copy.verbs[0].buckets[11], 1);
+    ck_assert_int_eq(copy.verbs[1].timeouts, 1);
+    ck_assert_int_eq(copy.timeouts, 1);
+}
+END_TEST
+
+START_TEST(test_stats_buckets)
+{
+    printf(":: test_stats_buckets\n");
+
+    ck_assert_int_eq(at_stats_bucket(0), 0);
+    ck_assert_int_eq(at_stats_bucket(1), 1);
+    ck_assert_int_eq(at_stats_bucket(2), 2);
+    ck_assert_int_eq(at_stats_bucket(3), 2);
+    ck_assert_int_eq(at_stats_bucket(1024), 11);
+    ck_assert_int_eq(at_stats_bucket(1ULL << 40), AT_STATS_BUCKETS-1);
+}
+END_TEST
+
+START_TEST(test_stats_urcs)
+{
+    printf(":: test_stats_urcs\n");
+
+    static struct at_stats stats;
+    at_stats_urc(&stats, STR_LEN("+CIPRXGET: 1,0"));
+    at_stats_urc(&stats, STR_LEN("RING"));
+    at_stats_urc(&stats, STR_LEN("+CIPRXGET: 1,3"));
+
+    struct at_stats copy;
+    at_stats_snapshot(&stats, &copy);
+    ck_assert_int_eq(copy.urcs_used, 2);
+    ck_assert_str_eq(copy.urc_classes[0].name, "+CIPRXGET");
+    ck_assert_int_eq(copy.urc_classes[0].count, 2);
+    ck_assert_str_eq(copy.urc_classes[1].name, "RING");
+    ck_assert_int_eq(copy.urc_classes[1].count, 1);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("stats");
+    tcase_add_test(tc, test_stats_verbs);
+    tcase_add_test(tc, test_stats_buckets);
+    tcase_add_test(tc, test_stats_urcs);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
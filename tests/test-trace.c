@@ -0,0 +1,187 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include <attentive/at-trace.h>
+#include <attentive/parser.h>
+
+
+#define STR_LEN(s) s, strlen(s)
+
+START_TEST(test_trace_ring)
+{
+    printf(":: test_trace_ring\n");
+
+    struct at_trace *trace = at_trace_alloc("ring", 5);
+    ck_assert(trace != NULL);
+
+    struct at_trace_event events[16];
+    ck_assert_int_eq(at_trace_snapshot(trace, events, 16), 0);
+
+    /* Capacity rounds up to 8; the oldest events get overwritten. */
+    for (int i=0; i<10; i++)
+        at_trace_event(trace, AT_TRACE_STATE, i, STR_LEN("counter"));
+    size_t count = at_trace_snapshot(trace, events, 16);
+    ck_assert_int_eq(count, 8);
+    for (size_t i=0; i<count; i++) {
+        ck_assert_int_eq(events[i].arg, (int) i + 2);
+        ck_assert_int_eq(events[i].type, AT_TRACE_STATE);
+        ck_assert(!memcmp(events[i].text, "counter", events[i].len));
+        if (i)
+            ck_assert(events[i].timestamp >= events[i-1].timestamp);
+    }
+
+    /* Snapshots can be limited to the newest events. */
+    ck_assert_int_eq(at_trace_snapshot(trace, events, 3), 3);
+    ck_assert_int_eq(events[0].arg, 7);
+
+    /* Long text is truncated. */
+    char line[100];
+    memset(line, 'x', sizeof(line));
+    at_trace_event(trace, AT_TRACE_LINE, 0, line, sizeof(line));
+    count = at_trace_snapshot(trace, events, 16);
+    ck_assert_int_eq(events[count-1].len, AT_TRACE_TEXT);
+
+    at_trace_free(trace);
+}
+END_TEST
+
+static void *trace_writer(void *arg)
+{
+    struct at_trace *trace = arg;
+    for (int i=0; i<100000; i++)
+        at_trace_event(trace, AT_TRACE_RX, i, "abcdefgh", 8);
+    return NULL;
+}
+
+START_TEST(test_trace_threads)
+{
+    printf(":: test_trace_threads\n");
+
+    struct at_trace *trace = at_trace_alloc("threads", 1024);
+    pthread_t threads[4];
+    for (int i=0; i<4; i++)
+        pthread_create(&threads[i], NULL, trace_writer, trace);
+
+    /* Snapshots taken during writes only return complete events. */
+    static struct at_trace_event events[1024];
+    for (int round=0; round<50; round++) {
+        size_t count = at_trace_snapshot(trace, events, 1024);
+        for (size_t i=0; i<count; i++) {
+            ck_assert_int_eq(events[i].type, AT_TRACE_RX);
+            ck_assert_int_eq(events[i].len, 8);
+        }
+    }
+    for (int i=0; i<4; i++)
+        pthread_join(threads[i], NULL);
+
+    ck_assert_int_eq(at_trace_snapshot(trace, events, 1024), 1024);
+
+    /* The cost of an event, for the record. */
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i<1000000; i++)
+        at_trace_event(trace, AT_TRACE_LINE, i, "+CSQ: 20,0", 10);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("trace: %.1f ns per event\n",
+            ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e6);
+
+    at_trace_free(trace);
+}
+END_TEST
+
+START_TEST(test_trace_export)
+{
+    printf(":: test_trace_export\n");
+
+    struct at_trace *trace = at_trace_alloc("modem \"0\"", 64);
+    at_trace_event(trace, AT_TRACE_BEGIN, 0, STR_LEN("socket_send"));
+    at_trace_event(trace, AT_TRACE_COMMAND, 6, STR_LEN("AT+CSQ"));
+    at_trace_event(trace, AT_TRACE_RX, 2, STR_LEN("\r\n"));
+    at_trace_event(trace, AT_TRACE_LINE, AT_RESPONSE_INTERMEDIATE, STR_LEN("+CSQ: 20,0"));
+    at_trace_event(trace, AT_TRACE_RESPONSE, 10, STR_LEN("+CSQ: 20,0"));
+    at_trace_event(trace, AT_TRACE_COMMAND, 7, STR_LEN("AT+CGMI"));
+    at_trace_event(trace, AT_TRACE_TIMEOUT, 1, NULL, 0);
+    at_trace_event(trace, AT_TRACE_END, 10, STR_LEN("socket_send"));
+
+    /* Dump and load back. */
+    char path[] = "/tmp/test-trace-XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert_int_ne(fd, -1);
+    close(fd);
+    ck_assert_int_eq(at_trace_dump(trace, path), 0);
+
+    char name[AT_TRACE_NAME];
+    size_t count;
+    struct at_trace_event *events = at_trace_load(path, name, &count);
+    ck_assert(events != NULL);
+    ck_assert_int_eq(count, 8);
+    ck_assert_str_eq(name, "modem \"0\"");
+    ck_assert_int_eq(events[1].type, AT_TRACE_COMMAND);
+    unlink(path);
+
+    /* Convert; commands become slices ending at their response. */
+    char *json;
+    size_t size;
+    FILE *out = open_memstream(&json, &size);
+    ck_assert_int_eq(at_trace_export_chrome(out, events, count, 3, name), 0);
+    fclose(out);
+
+    ck_assert(strstr(json, "\"args\":{\"name\":\"modem \\\"0\\\"\"}") != NULL);
+    ck_assert(strstr(json, "{\"name\":\"AT+CSQ\",\"cat\":\"command\",\"ph\":\"X\"") != NULL);
+    ck_assert(strstr(json, "\"response\":\"+CSQ: 20,0\"") != NULL);
+    ck_assert(strstr(json, "{\"name\":\"AT+CGMI\",\"cat\":\"command\",\"ph\":\"X\"") != NULL);
+    ck_assert(strstr(json, "\"timeout\":true") != NULL);
+    ck_assert(strstr(json, "{\"name\":\"intermediate\",\"cat\":\"line\",\"ph\":\"i\"") != NULL);
+    ck_assert(strstr(json, "\"ph\":\"B\"") != NULL);
+    ck_assert(strstr(json, "\"ph\":\"E\"") != NULL);
+    ck_assert(strstr(json, "\\u000d\\u000a") != NULL);
+    ck_assert(strstr(json, "\"tid\":3") != NULL);
+
+    free(json);
+    free(events);
+    at_trace_free(trace);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("trace");
+    tcase_add_test(tc, test_trace_ring);
+    tcase_add_test(tc, test_trace_threads);
+    tcase_add_test(tc, test_trace_export);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */